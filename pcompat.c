@@ -49,6 +49,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <sys/statvfs.h>
 #include <sys/utsname.h>
@@ -2296,6 +2297,49 @@ int64_t psync_file_size(psync_file_t fd){
 #endif
 }
 
+void *psync_mmap_file(psync_file_t fd, uint64_t size){
+#if defined(P_OS_POSIX)
+  void *ret;
+  ret=mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (unlikely_log(ret==MAP_FAILED))
+    return NULL;
+  else
+    return ret;
+#elif defined(P_OS_WINDOWS)
+  HANDLE mapping;
+  void *ret;
+  mapping=CreateFileMapping(fd, NULL, PAGE_READWRITE, (DWORD)(size>>32), (DWORD)size, NULL);
+  if (unlikely_log(!mapping))
+    return NULL;
+  ret=MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+  /* the view keeps a reference to the mapping */
+  CloseHandle(mapping);
+  return ret;
+#else
+#error "Function not implemented for your operating system"
+#endif
+}
+
+int psync_munmap_file(void *ptr, uint64_t size){
+#if defined(P_OS_POSIX)
+  return munmap(ptr, size);
+#elif defined(P_OS_WINDOWS)
+  return psync_bool_to_zero(UnmapViewOfFile(ptr));
+#else
+#error "Function not implemented for your operating system"
+#endif
+}
+
+int psync_mmap_file_sync(void *ptr, uint64_t size){
+#if defined(P_OS_POSIX)
+  return msync(ptr, size, MS_SYNC);
+#elif defined(P_OS_WINDOWS)
+  return psync_bool_to_zero(FlushViewOfFile(ptr, size));
+#else
+#error "Function not implemented for your operating system"
+#endif
+}
+
 char *psync_deviceid(){
   char *device;
 #if defined(P_OS_WINDOWS)
@@ -447,6 +447,9 @@ ssize_t psync_file_pwrite(psync_file_t fd, const void *buf, size_t count, uint64
 int64_t psync_file_seek(psync_file_t fd, uint64_t offset, int whence);
 int psync_file_truncate(psync_file_t fd);
 int64_t psync_file_size(psync_file_t fd) PSYNC_PURE;
+void *psync_mmap_file(psync_file_t fd, uint64_t size);
+int psync_munmap_file(void *ptr, uint64_t size);
+int psync_mmap_file_sync(void *ptr, uint64_t size);
 char *psync_deviceid();
 
 #if defined(P_OS_WINDOWS)
@@ -49,7 +49,6 @@
 "\
 PRAGMA journal_mode=WAL;\
 PRAGMA synchronous=1;\
-PRAGMA locking_mode=EXCLUSIVE;\
 BEGIN;\
 PRAGMA page_size=4096;\
 PRAGMA cache_size=8000;\
@@ -81,8 +80,10 @@ CREATE TABLE IF NOT EXISTS localfile (id INTEGER PRIMARY KEY, localparentfolderi
 CREATE INDEX IF NOT EXISTS klocalfilelpfid ON localfile(localparentfolderid);\
 CREATE INDEX IF NOT EXISTS klocalfilefileid ON localfile(fileid);\
 CREATE INDEX IF NOT EXISTS klocalfilechecksum ON localfile(checksum);\
+CREATE INDEX IF NOT EXISTS klocalfilehash ON localfile(hash);\
 CREATE UNIQUE INDEX IF NOT EXISTS klocalfilerpsn ON localfile(syncid, localparentfolderid, name);\
 CREATE TABLE IF NOT EXISTS localfileupload (localfileid INTEGER REFERENCES localfile(id), uploadid INTEGER, PRIMARY KEY (localfileid, uploadid)) " P_SQL_WOWROWID ";\
+CREATE TABLE IF NOT EXISTS localfileuploadpart (uploadid INTEGER, off INTEGER, len INTEGER, PRIMARY KEY (uploadid, off)) " P_SQL_WOWROWID ";\
 CREATE TABLE IF NOT EXISTS syncedfolder (syncid INTEGER REFERENCES syncfolder(id) ON DELETE CASCADE, folderid INTEGER, localfolderid INTEGER, synctype INTEGER,\
   PRIMARY KEY (syncid, folderid));\
 CREATE INDEX IF NOT EXISTS ksyncedfolderdownfolderid ON syncedfolder(folderid);\
@@ -111,6 +112,18 @@ CREATE TABLE IF NOT EXISTS fstaskdepend (fstaskid INTEGER, dependfstaskid INTEGE
 CREATE INDEX IF NOT EXISTS kfstaskdependdependfstaskid ON fstaskdepend(dependfstaskid);\
 CREATE TABLE IF NOT EXISTS pagecachetask(id INTEGER PRIMARY KEY, type INTEGER, taskid INTEGER, hash INTEGER);\
 CREATE TABLE IF NOT EXISTS fstaskupload (fstaskid INTEGER REFERENCES fstask(id), uploadid INTEGER, PRIMARY KEY (fstaskid, uploadid)) " P_SQL_WOWROWID ";\
+CREATE TABLE IF NOT EXISTS blockchecksum (sha1 BLOB, blocksize INTEGER, hash INTEGER, off INTEGER, PRIMARY KEY (sha1, blocksize, hash)) " P_SQL_WOWROWID ";\
+CREATE TABLE IF NOT EXISTS filechunk (checksum TEXT, off INTEGER, len INTEGER, sha1 BLOB, PRIMARY KEY (checksum, off)) " P_SQL_WOWROWID ";\
+CREATE TABLE IF NOT EXISTS localhashcache (device INTEGER, inode INTEGER, size INTEGER, mtimenative INTEGER, checksum TEXT,\
+  partsize INTEGER, partchecksum TEXT, lastuse INTEGER, PRIMARY KEY (device, inode)) " P_SQL_WOWROWID ";\
+CREATE INDEX IF NOT EXISTS klocalhashcachelastuse ON localhashcache(lastuse);\
+CREATE INDEX IF NOT EXISTS kblockchecksumhash ON blockchecksum(hash);\
+CREATE TRIGGER IF NOT EXISTS tlocalfiledelblockchecksum AFTER DELETE ON localfile \
+  WHEN NOT EXISTS (SELECT 1 FROM localfile WHERE hash=OLD.hash) BEGIN DELETE FROM blockchecksum WHERE hash=OLD.hash; END;\
+CREATE TRIGGER IF NOT EXISTS tlocalfileupdblockchecksum AFTER UPDATE OF hash ON localfile \
+  WHEN OLD.hash IS NOT NEW.hash AND NOT EXISTS (SELECT 1 FROM localfile WHERE hash=OLD.hash) BEGIN DELETE FROM blockchecksum WHERE hash=OLD.hash; END;\
+CREATE TRIGGER IF NOT EXISTS tlocalfiledelfilechunk AFTER DELETE ON localfile \
+  WHEN NOT EXISTS (SELECT 1 FROM localfile WHERE checksum=OLD.checksum) BEGIN DELETE FROM filechunk WHERE checksum=OLD.checksum; END;\
 CREATE TABLE IF NOT EXISTS resolver (hostname TEXT, port TEXT, prio INTEGER, created INTEGER, family INTEGER, socktype INTEGER, protocol INTEGER,\
   data TEXT, PRIMARY KEY (hostname, port, prio)) " P_SQL_WOWROWID ";\
 INSERT OR IGNORE INTO folder (id, name) VALUES (0, '');\
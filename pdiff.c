@@ -43,6 +43,16 @@
 
 #define PSYNC_SQL_DOWNLOAD "synctype&"NTO_STR(PSYNC_DOWNLOAD_ONLY)"="NTO_STR(PSYNC_DOWNLOAD_ONLY)
 
+/* Indexes of file that nothing looks up while the initial download runs are dropped for it and created once it is done.
+ * The parentfolderid ones stay, as the fs and the syncer list folders all along. They have to match the ones in
+ * PSYNC_DATABASE_STRUCTURE, which also brings them back on start if the download was interrupted.
+ */
+#define PSYNC_SQL_DROP_DIFF_INDEXES "DROP INDEX IF EXISTS kfilecategory;\
+DROP INDEX IF EXISTS kfileartist;"
+
+#define PSYNC_SQL_CREATE_DIFF_INDEXES "CREATE INDEX IF NOT EXISTS kfilecategory ON file(category);\
+CREATE INDEX IF NOT EXISTS kfileartist ON file(artist, album);"
+
 static uint64_t used_quota=0, current_quota=0;
 static psync_uint_t needdownload;
 static psync_socket_t exceptionsockwrite=INVALID_SOCKET;
@@ -251,8 +261,27 @@ static psync_socket *get_connected_socket(){
   }
 }
 
+/* Consecutive folders created in the same parent update it once, with their count and the mtime of the last of them. */
+
+static psync_sql_res *parent_st=NULL;
+static psync_folderid_t pending_parentid;
+static uint64_t pending_parent_mtime;
+static uint32_t pending_parent_cnt=0;
+
+static void flush_folder_parent(){
+  if (!pending_parent_cnt)
+    return;
+  if (!parent_st)
+    parent_st=psync_sql_prep_statement("UPDATE folder SET subdircnt=subdircnt+?, mtime=? WHERE id=?");
+  psync_sql_bind_uint(parent_st, 1, pending_parent_cnt);
+  psync_sql_bind_uint(parent_st, 2, pending_parent_mtime);
+  psync_sql_bind_uint(parent_st, 3, pending_parentid);
+  psync_sql_run(parent_st);
+  pending_parent_cnt=0;
+}
+
 static void process_createfolder(const binresult *entry){
-  static psync_sql_res *st=NULL, *st2=NULL;
+  static psync_sql_res *st=NULL;
   psync_sql_res *res, *stmt, *stmt2;
   const binresult *meta, *name;
   uint64_t userid, perms, mtime;
@@ -261,13 +290,14 @@ static void process_createfolder(const binresult *entry){
 //  char *localname;
   psync_syncid_t syncid;
   if (!entry){
+    flush_folder_parent();
     if (st){
       psync_sql_free_result(st);
       st=NULL;
     }
-    if (st2){
-      psync_sql_free_result(st2);
-      st2=NULL;
+    if (parent_st){
+      psync_sql_free_result(parent_st);
+      parent_st=NULL;
     }
     return;
   }
@@ -275,9 +305,6 @@ static void process_createfolder(const binresult *entry){
     st=psync_sql_prep_statement("REPLACE INTO folder (id, parentfolderid, userid, permissions, name, ctime, mtime, subdircnt) VALUES (?, ?, ?, ?, ?, ?, ?, 0)");
     if (!st)
       return;
-    st2=psync_sql_prep_statement("UPDATE folder SET subdircnt=subdircnt+1, mtime=? WHERE id=?");
-    if (!st2)
-      return;
   }
   meta=psync_find_result(entry, "metadata", PARAM_HASH);
   if (psync_find_result(meta, "ismine", PARAM_BOOL)->num){
@@ -292,6 +319,8 @@ static void process_createfolder(const binresult *entry){
   folderid=psync_find_result(meta, "folderid", PARAM_NUM)->num;
   parentfolderid=psync_find_result(meta, "parentfolderid", PARAM_NUM)->num;
   mtime=psync_find_result(meta, "modified", PARAM_NUM)->num;
+  if (pending_parent_cnt && (pending_parentid!=parentfolderid || pending_parentid==folderid))
+    flush_folder_parent();
   psync_sql_bind_uint(st, 1, folderid);
   psync_sql_bind_uint(st, 2, parentfolderid);
   psync_sql_bind_uint(st, 3, userid);
@@ -300,9 +329,9 @@ static void process_createfolder(const binresult *entry){
   psync_sql_bind_uint(st, 6, psync_find_result(meta, "created", PARAM_NUM)->num);
   psync_sql_bind_uint(st, 7, mtime);
   psync_sql_run(st);
-  psync_sql_bind_uint(st2, 1, mtime);
-  psync_sql_bind_uint(st2, 2, parentfolderid);
-  psync_sql_run(st2);
+  pending_parentid=parentfolderid;
+  pending_parent_mtime=mtime;
+  pending_parent_cnt++;
   if (psync_is_folder_in_downloadlist(parentfolderid) && !psync_is_name_to_ignore(name->str)){
     psync_add_folder_to_downloadlist(folderid);
     res=psync_sql_query("SELECT syncid, localfolderid, synctype FROM syncedfolder WHERE folderid=? AND "PSYNC_SQL_DOWNLOAD);
@@ -717,50 +746,193 @@ void psync_diff_update_file(const binresult *meta){
   insert_revision(0, 0, 0, 0);
 }
 
-static void process_createfile(const binresult *entry){
-  static psync_sql_res *st=NULL;
-  const binresult *meta, *name;
+/* Files of a diff are parsed in a single pass over their metadata hash into an array of columns and inserted
+ * DIFF_FILE_BATCH at a time with one multi-row statement. Keys of the metadata hashes in one response share the same
+ * string, so the column of a key is looked up by the key's address in file_meta_keys and only compared as a string
+ * the first time it is seen. The cache is to be cleared whenever the response the keys belong to is freed.
+ */
+
+#define DIFF_FILE_BATCH 16
+#define DIFF_META_KEY_CACHE 64
+
+#define DIFF_COL_REQUIRED 1
+#define DIFF_COL_DOUBLE   2
+
+#define FILE_ROW_SQL "(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)"
+#define FILE_ROWS2_SQL FILE_ROW_SQL ", " FILE_ROW_SQL
+#define FILE_ROWS4_SQL FILE_ROWS2_SQL ", " FILE_ROWS2_SQL
+#define FILE_ROWS8_SQL FILE_ROWS4_SQL ", " FILE_ROWS4_SQL
+#define FILE_ROWS16_SQL FILE_ROWS8_SQL ", " FILE_ROWS8_SQL
+#define REV_ROW_SQL "(?, ?, ?, ?)"
+#define REV_ROWS2_SQL REV_ROW_SQL ", " REV_ROW_SQL
+#define REV_ROWS4_SQL REV_ROWS2_SQL ", " REV_ROWS2_SQL
+#define REV_ROWS8_SQL REV_ROWS4_SQL ", " REV_ROWS4_SQL
+#define REV_ROWS16_SQL REV_ROWS8_SQL ", " REV_ROWS8_SQL
+
+#define FILE_INSERT_SQL "REPLACE INTO file (id, parentfolderid, userid, size, hash, name, ctime, mtime, category, thumb, icon, "\
+                        "artist, album, title, genre, trackno, width, height, duration, fps, videocodec, audiocodec, videobitrate, "\
+                        "audiobitrate, audiosamplerate, rotate) VALUES "
+
+#if DIFF_FILE_BATCH!=16
+#error "FILE_ROWS16_SQL and REV_ROWS16_SQL have to match DIFF_FILE_BATCH"
+#endif
+
+typedef struct {
+  const char *name;
+  uint32_t type;
+  uint32_t flags;
+} diff_meta_col_t;
+
+typedef struct {
+  const char *key;
+  int32_t col;
+} diff_meta_key_t;
+
+typedef enum {
+  FCOL_FILEID=0,
+  FCOL_PARENTFOLDERID,
+  FCOL_ISMINE,
+  FCOL_USERID,
+  FCOL_SIZE,
+  FCOL_HASH,
+  FCOL_NAME,
+  FCOL_DELETEDFILEID,
+  FCOL_CREATED, /* columns from here on are bound in order, the same way bind_meta() does */
+  FCOL_MODIFIED,
+  FCOL_CATEGORY,
+  FCOL_THUMB,
+  FCOL_ICON,
+  FCOL_ARTIST,
+  FCOL_ALBUM,
+  FCOL_TITLE,
+  FCOL_GENRE,
+  FCOL_TRACKNO,
+  FCOL_WIDTH,
+  FCOL_HEIGHT,
+  FCOL_DURATION,
+  FCOL_FPS,
+  FCOL_VIDEOCODEC,
+  FCOL_AUDIOCODEC,
+  FCOL_VIDEOBITRATE,
+  FCOL_AUDIOBITRATE,
+  FCOL_AUDIOSAMPLERATE,
+  FCOL_ROTATE,
+  FCOL_CNT
+} diff_file_col_t;
+
+typedef struct {
+  const binresult *cols[FCOL_CNT];
+} diff_file_row_t;
+
+static const diff_meta_col_t file_meta_cols[FCOL_CNT]={
+  {"fileid", PARAM_NUM, DIFF_COL_REQUIRED},
+  {"parentfolderid", PARAM_NUM, DIFF_COL_REQUIRED},
+  {"ismine", PARAM_BOOL, DIFF_COL_REQUIRED},
+  {"userid", PARAM_NUM, 0},
+  {"size", PARAM_NUM, DIFF_COL_REQUIRED},
+  {"hash", PARAM_NUM, DIFF_COL_REQUIRED},
+  {"name", PARAM_STR, DIFF_COL_REQUIRED},
+  {"deletedfileid", PARAM_NUM, 0},
+  {"created", PARAM_NUM, DIFF_COL_REQUIRED},
+  {"modified", PARAM_NUM, DIFF_COL_REQUIRED},
+  {"category", PARAM_NUM, DIFF_COL_REQUIRED},
+  {"thumb", PARAM_BOOL, DIFF_COL_REQUIRED},
+  {"icon", PARAM_STR, DIFF_COL_REQUIRED},
+  {"artist", PARAM_STR, 0},
+  {"album", PARAM_STR, 0},
+  {"title", PARAM_STR, 0},
+  {"genre", PARAM_STR, 0},
+  {"trackno", PARAM_NUM, 0},
+  {"width", PARAM_NUM, 0},
+  {"height", PARAM_NUM, 0},
+  {"duration", PARAM_STR, DIFF_COL_DOUBLE},
+  {"fps", PARAM_STR, DIFF_COL_DOUBLE},
+  {"videocodec", PARAM_STR, 0},
+  {"audiocodec", PARAM_STR, 0},
+  {"videobitrate", PARAM_NUM, 0},
+  {"audiobitrate", PARAM_NUM, 0},
+  {"audiosamplerate", PARAM_NUM, 0},
+  {"rotate", PARAM_NUM, 0}
+};
+
+static diff_meta_key_t file_meta_keys[DIFF_META_KEY_CACHE];
+static diff_file_row_t file_batch[DIFF_FILE_BATCH];
+static uint32_t file_batch_cnt=0;
+static psync_sql_res *file_st=NULL, *file_batch_st=NULL, *rev_batch_st=NULL;
+
+static int32_t file_meta_col_by_name(const char *key){
+  int32_t i;
+  for (i=0; i<FCOL_CNT; i++)
+    if (!strcmp(file_meta_cols[i].name, key))
+      return i;
+  return -1;
+}
+
+static int32_t file_meta_col(const char *key){
+  diff_meta_key_t *k;
+  uintptr_t h, i;
+  h=(uintptr_t)key>>3;
+  for (i=0; i<DIFF_META_KEY_CACHE; i++){
+    k=&file_meta_keys[(h+i)%DIFF_META_KEY_CACHE];
+    if (k->key==key)
+      return k->col;
+    if (!k->key){
+      k->key=key;
+      k->col=file_meta_col_by_name(key);
+      return k->col;
+    }
+  }
+  return file_meta_col_by_name(key);
+}
+
+static int parse_file_meta(const binresult *meta, diff_file_row_t *row){
+  const binresult *val;
+  uint32_t i;
+  int32_t col;
+  memset(row, 0, sizeof(diff_file_row_t));
+  for (i=0; i<meta->length; i++){
+    col=file_meta_col(meta->hash[i].key);
+    if (col<0)
+      continue;
+    val=meta->hash[i].value;
+    if (val->type==file_meta_cols[col].type)
+      row->cols[col]=val;
+  }
+  for (i=0; i<FCOL_CNT; i++)
+    if ((file_meta_cols[i].flags&DIFF_COL_REQUIRED) && !row->cols[i])
+      return -1;
+  if (!row->cols[FCOL_ISMINE]->num && !row->cols[FCOL_USERID])
+    return -1;
+  return 0;
+}
+
+static void bind_file_row(psync_sql_res *res, const diff_file_row_t *row, int off){
+  const binresult *br;
+  uint32_t i;
+  psync_sql_bind_uint(res, off++, row->cols[FCOL_FILEID]->num);
+  psync_sql_bind_uint(res, off++, row->cols[FCOL_PARENTFOLDERID]->num);
+  psync_sql_bind_uint(res, off++, row->cols[FCOL_ISMINE]->num?psync_my_userid:row->cols[FCOL_USERID]->num);
+  psync_sql_bind_uint(res, off++, row->cols[FCOL_SIZE]->num);
+  psync_sql_bind_uint(res, off++, row->cols[FCOL_HASH]->num);
+  psync_sql_bind_lstring(res, off++, row->cols[FCOL_NAME]->str, row->cols[FCOL_NAME]->length);
+  for (i=FCOL_CREATED; i<FCOL_CNT; i++){
+    br=row->cols[i];
+    if (!br)
+      psync_sql_bind_null(res, off++);
+    else if (file_meta_cols[i].flags&DIFF_COL_DOUBLE)
+      psync_sql_bind_double(res, off++, atof(br->str));
+    else if (br->type==PARAM_STR)
+      psync_sql_bind_lstring(res, off++, br->str, br->length);
+    else
+      psync_sql_bind_uint(res, off++, br->num);
+  }
+}
+
+static void download_created_file(psync_fileid_t fileid, psync_folderid_t parentfolderid, uint64_t hash, const binresult *name){
   psync_sql_res *res, *res2;
-  psync_folderid_t parentfolderid;
-  psync_fileid_t fileid;
-  uint64_t size, userid, hash;
   psync_uint_row row;
   psync_str_row row2;
   int hasit;
-  if (!entry){
-    if (st){
-      psync_sql_free_result(st);
-      st=NULL;
-    }
-    insert_revision(0, 0, 0, 0);
-    return;
-  }
-  if (!st)
-    st=psync_sql_prep_statement("REPLACE INTO file (id, parentfolderid, userid, size, hash, name, ctime, mtime, category, thumb, icon, "
-                                "artist, album, title, genre, trackno, width, height, duration, fps, videocodec, audiocodec, videobitrate, "
-                                "audiobitrate, audiosamplerate, rotate) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)");
-  meta=psync_find_result(entry, "metadata", PARAM_HASH);
-  size=psync_find_result(meta, "size", PARAM_NUM)->num;
-  fileid=psync_find_result(meta, "fileid", PARAM_NUM)->num;
-  parentfolderid=psync_find_result(meta, "parentfolderid", PARAM_NUM)->num;
-  if (psync_find_result(meta, "ismine", PARAM_BOOL)->num){
-    userid=psync_my_userid;
-    used_quota+=size;
-  }
-  else
-    userid=psync_find_result(meta, "userid", PARAM_NUM)->num;
-  hash=psync_find_result(meta, "hash", PARAM_NUM)->num;
-  name=psync_find_result(meta, "name", PARAM_STR);
-  check_for_deletedfileid(meta);
-  psync_sql_bind_uint(st, 1, fileid);
-  psync_sql_bind_uint(st, 2, parentfolderid);
-  psync_sql_bind_uint(st, 3, userid);
-  psync_sql_bind_uint(st, 4, size);
-  psync_sql_bind_uint(st, 5, hash);
-  psync_sql_bind_lstring(st, 6, name->str, name->length);
-  bind_meta(st, meta, 7);
-  psync_sql_run(st);
-  insert_revision(fileid, hash, psync_find_result(meta, "modified", PARAM_NUM)->num, size);
   if (psync_is_folder_in_downloadlist(parentfolderid) && !psync_is_name_to_ignore(name->str)){
     res=psync_sql_query("SELECT syncid, localfolderid FROM syncedfolder WHERE folderid=? AND "PSYNC_SQL_DOWNLOAD);
     psync_sql_bind_uint(res, 1, parentfolderid);
@@ -787,6 +959,121 @@ static void process_createfile(const binresult *entry){
   }
 }
 
+static void flush_file_batch(){
+  diff_file_row_t *row;
+  uint32_t i;
+  if (!file_batch_cnt)
+    return;
+  if (file_batch_cnt==DIFF_FILE_BATCH){
+    if (!file_batch_st){
+      file_batch_st=psync_sql_prep_statement(FILE_INSERT_SQL FILE_ROWS16_SQL);
+      rev_batch_st=psync_sql_prep_statement("REPLACE INTO filerevision (fileid, hash, ctime, size) VALUES " REV_ROWS16_SQL);
+    }
+    for (i=0; i<DIFF_FILE_BATCH; i++){
+      row=&file_batch[i];
+      bind_file_row(file_batch_st, row, i*(FCOL_CNT-FCOL_CREATED+6)+1);
+      psync_sql_bind_uint(rev_batch_st, i*4+1, row->cols[FCOL_FILEID]->num);
+      psync_sql_bind_uint(rev_batch_st, i*4+2, row->cols[FCOL_HASH]->num);
+      psync_sql_bind_uint(rev_batch_st, i*4+3, row->cols[FCOL_MODIFIED]->num);
+      psync_sql_bind_uint(rev_batch_st, i*4+4, row->cols[FCOL_SIZE]->num);
+    }
+    psync_sql_run(file_batch_st);
+    psync_sql_run(rev_batch_st);
+  }
+  else{
+    if (!file_st)
+      file_st=psync_sql_prep_statement(FILE_INSERT_SQL FILE_ROW_SQL);
+    for (i=0; i<file_batch_cnt; i++){
+      row=&file_batch[i];
+      bind_file_row(file_st, row, 1);
+      psync_sql_run(file_st);
+      insert_revision(row->cols[FCOL_FILEID]->num, row->cols[FCOL_HASH]->num, row->cols[FCOL_MODIFIED]->num, row->cols[FCOL_SIZE]->num);
+    }
+  }
+  for (i=0; i<file_batch_cnt; i++){
+    row=&file_batch[i];
+    download_created_file(row->cols[FCOL_FILEID]->num, row->cols[FCOL_PARENTFOLDERID]->num, row->cols[FCOL_HASH]->num, row->cols[FCOL_NAME]);
+  }
+  file_batch_cnt=0;
+}
+
+static void create_file_from_meta(const binresult *meta){
+  const binresult *name;
+  psync_folderid_t parentfolderid;
+  psync_fileid_t fileid;
+  uint64_t size, userid, hash;
+  if (!file_st)
+    file_st=psync_sql_prep_statement(FILE_INSERT_SQL FILE_ROW_SQL);
+  size=psync_find_result(meta, "size", PARAM_NUM)->num;
+  fileid=psync_find_result(meta, "fileid", PARAM_NUM)->num;
+  parentfolderid=psync_find_result(meta, "parentfolderid", PARAM_NUM)->num;
+  if (psync_find_result(meta, "ismine", PARAM_BOOL)->num){
+    userid=psync_my_userid;
+    used_quota+=size;
+  }
+  else
+    userid=psync_find_result(meta, "userid", PARAM_NUM)->num;
+  hash=psync_find_result(meta, "hash", PARAM_NUM)->num;
+  name=psync_find_result(meta, "name", PARAM_STR);
+  check_for_deletedfileid(meta);
+  psync_sql_bind_uint(file_st, 1, fileid);
+  psync_sql_bind_uint(file_st, 2, parentfolderid);
+  psync_sql_bind_uint(file_st, 3, userid);
+  psync_sql_bind_uint(file_st, 4, size);
+  psync_sql_bind_uint(file_st, 5, hash);
+  psync_sql_bind_lstring(file_st, 6, name->str, name->length);
+  bind_meta(file_st, meta, 7);
+  psync_sql_run(file_st);
+  insert_revision(fileid, hash, psync_find_result(meta, "modified", PARAM_NUM)->num, size);
+  download_created_file(fileid, parentfolderid, hash, name);
+}
+
+static void process_createfile(const binresult *entry){
+  const binresult *meta;
+  diff_file_row_t *row;
+  psync_sql_res *res;
+  if (!entry){
+    flush_file_batch();
+    if (file_st){
+      psync_sql_free_result(file_st);
+      file_st=NULL;
+    }
+    if (file_batch_st){
+      psync_sql_free_result(file_batch_st);
+      file_batch_st=NULL;
+    }
+    if (rev_batch_st){
+      psync_sql_free_result(rev_batch_st);
+      rev_batch_st=NULL;
+    }
+    insert_revision(0, 0, 0, 0);
+    memset(file_meta_keys, 0, sizeof(file_meta_keys));
+    return;
+  }
+  meta=psync_find_result(entry, "metadata", PARAM_HASH);
+  row=&file_batch[file_batch_cnt];
+  if (unlikely(parse_file_meta(meta, row))){
+    flush_file_batch();
+    create_file_from_meta(meta);
+    return;
+  }
+  if (row->cols[FCOL_ISMINE]->num)
+    used_quota+=row->cols[FCOL_SIZE]->num;
+  if (unlikely(row->cols[FCOL_DELETEDFILEID])){
+    /* the deleted file may as well be in the batch, so it goes in order */
+    flush_file_batch();
+    if (row!=file_batch){
+      file_batch[0]=*row;
+      row=file_batch;
+    }
+    res=psync_sql_prep_statement("DELETE FROM file WHERE id=?");
+    psync_sql_bind_uint(res, 1, row->cols[FCOL_DELETEDFILEID]->num);
+    psync_sql_run_free(res);
+  }
+  if (++file_batch_cnt==DIFF_FILE_BATCH)
+    flush_file_batch();
+}
+
 static void process_modifyfile(const binresult *entry){
   static psync_sql_res *sq=NULL, *st=NULL;
   psync_sql_res *res;
@@ -1323,6 +1610,13 @@ void psync_diff_unlock(){
   pthread_mutex_unlock(&diff_mutex);
 }
 
+static void flush_batched_entries(void (*next)(const binresult *)){
+  if (next!=process_createfolder)
+    flush_folder_parent();
+  if (next!=process_createfile)
+    flush_file_batch();
+}
+
 static uint64_t process_entries(const binresult *entries, uint64_t newdiffid){
   const binresult *entry, *etype;
   uint64_t oused_quota;
@@ -1336,10 +1630,12 @@ static uint64_t process_entries(const binresult *entries, uint64_t newdiffid){
     etype=psync_find_result(entry, "event", PARAM_STR);
     for (j=0; j<event_list_size; j++)
       if (etype->length==event_list[j].len && !memcmp(etype->str, event_list[j].name, etype->length)){
+        flush_batched_entries(event_list[j].process);
         event_list[j].process(entry);
         event_list[j].used=1;
       }
   }
+  flush_batched_entries(NULL);
   for (j=0; j<event_list_size; j++)
     if (event_list[j].used)
       event_list[j].process(NULL);
@@ -1420,6 +1716,101 @@ static void handle_exception(psync_socket **sock, uint64_t *diffid, char ex){
   }
 }
 
+/* While catching up, diffs are requested by a fetcher thread that keeps the next request in flight and queues up to
+ * PSYNC_DIFF_FETCH_AHEAD parsed responses, so the network and the database are busy at the same time. The fetcher exits
+ * after queueing a response that ends the catch up (failure, error or no entries) or when asked to stop.
+ */
+
+static pthread_mutex_t fetch_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fetch_cond=PTHREAD_COND_INITIALIZER;
+static binresult *fetch_results[PSYNC_DIFF_FETCH_AHEAD];
+static psync_socket *fetch_sock;
+static uint64_t fetch_diffid;
+static uint32_t fetch_first, fetch_cnt;
+static int fetch_running=0, fetch_stop=0;
+
+static int diff_ends_fetch(const binresult *res){
+  return !res || psync_find_result(res, "result", PARAM_NUM)->num || !psync_find_result(res, "entries", PARAM_ARRAY)->length;
+}
+
+static void diff_fetch_thread(){
+  binresult *res;
+  uint64_t diffid;
+  int last;
+  diffid=fetch_diffid;
+  do{
+    binparam diffparams[]={P_STR("timeformat", "timestamp"), P_NUM("limit", PSYNC_DIFF_LIMIT), P_NUM("diffid", diffid)};
+    if (!psync_do_run)
+      break;
+    res=send_command(fetch_sock, "diff", diffparams);
+    last=diff_ends_fetch(res);
+    if (!last)
+      diffid=psync_find_result(res, "diffid", PARAM_NUM)->num;
+    pthread_mutex_lock(&fetch_mutex);
+    while (fetch_cnt==PSYNC_DIFF_FETCH_AHEAD && !fetch_stop)
+      pthread_cond_wait(&fetch_cond, &fetch_mutex);
+    if (fetch_stop){
+      pthread_mutex_unlock(&fetch_mutex);
+      if (res)
+        psync_free(res);
+      break;
+    }
+    fetch_results[(fetch_first+fetch_cnt)%PSYNC_DIFF_FETCH_AHEAD]=res;
+    fetch_cnt++;
+    pthread_cond_broadcast(&fetch_cond);
+    pthread_mutex_unlock(&fetch_mutex);
+  } while (!last);
+  pthread_mutex_lock(&fetch_mutex);
+  fetch_running=0;
+  pthread_cond_broadcast(&fetch_cond);
+  pthread_mutex_unlock(&fetch_mutex);
+}
+
+static void diff_fetch_start(psync_socket *sock, uint64_t diffid){
+  fetch_sock=sock;
+  fetch_diffid=diffid;
+  fetch_first=0;
+  fetch_cnt=0;
+  fetch_stop=0;
+  fetch_running=1;
+  psync_run_thread("diff fetch", diff_fetch_thread);
+}
+
+/* returns 0 if the fetcher exited without queueing anything more, the response itself can be NULL on failure */
+static int diff_fetch_next(binresult **res){
+  int ret;
+  pthread_mutex_lock(&fetch_mutex);
+  while (!fetch_cnt && fetch_running)
+    pthread_cond_wait(&fetch_cond, &fetch_mutex);
+  if (fetch_cnt){
+    *res=fetch_results[fetch_first];
+    fetch_first=(fetch_first+1)%PSYNC_DIFF_FETCH_AHEAD;
+    fetch_cnt--;
+    pthread_cond_broadcast(&fetch_cond);
+    ret=1;
+  }
+  else
+    ret=0;
+  pthread_mutex_unlock(&fetch_mutex);
+  return ret;
+}
+
+/* the socket is free to use once this returns */
+static void diff_fetch_finish(){
+  pthread_mutex_lock(&fetch_mutex);
+  fetch_stop=1;
+  pthread_cond_broadcast(&fetch_cond);
+  while (fetch_running)
+    pthread_cond_wait(&fetch_cond, &fetch_mutex);
+  while (fetch_cnt){
+    if (fetch_results[fetch_first])
+      psync_free(fetch_results[fetch_first]);
+    fetch_first=(fetch_first+1)%PSYNC_DIFF_FETCH_AHEAD;
+    fetch_cnt--;
+  }
+  pthread_mutex_unlock(&fetch_mutex);
+}
+
 static void psync_diff_thread(){
   psync_socket *sock;
   binresult *res;
@@ -1435,15 +1826,17 @@ restart:
   sock=get_connected_socket();
   psync_set_status(PSTATUS_TYPE_ONLINE, PSTATUS_ONLINE_SCANNING);
   diffid=psync_sql_cellint("SELECT value FROM setting WHERE id='diffid'", 0);
-  if (diffid==0)
+  if (diffid==0){
     initialdownload=1;
+    psync_sql_statement(PSYNC_SQL_DROP_DIFF_INDEXES);
+  }
   used_quota=psync_sql_cellint("SELECT value FROM setting WHERE id='usedquota'", 0);
+  diff_fetch_start(sock, diffid);
   do{
-    binparam diffparams[]={P_STR("timeformat", "timestamp"), P_NUM("limit", PSYNC_DIFF_LIMIT), P_NUM("diffid", diffid)};
-    if (!psync_do_run)
+    if (!psync_do_run || !diff_fetch_next(&res))
       break;
-    res=send_command(sock, "diff", diffparams);
     if (!res){
+      diff_fetch_finish();
       psync_socket_close(sock);
       goto restart;
     }
@@ -1451,6 +1844,7 @@ restart:
     if (unlikely(result)){
       debug(D_ERROR, "diff returned error %u: %s", (unsigned int)result, psync_find_result(res, "error", PARAM_STR)->str);
       psync_free(res);
+      diff_fetch_finish();
       psync_socket_close(sock);
       psync_milisleep(PSYNC_SLEEP_BEFORE_RECONNECT);
       goto restart;
@@ -1463,8 +1857,11 @@ restart:
     result=entries->length;
     psync_free(res);
   } while (result);
+  diff_fetch_finish();
   check_overquota();
   psync_set_status(PSTATUS_TYPE_ONLINE, PSTATUS_ONLINE_ONLINE);
+  if (initialdownload)
+    psync_sql_statement(PSYNC_SQL_CREATE_DIFF_INDEXES);
   psync_sql_statement("ANALYZE");
   initialdownload=0;
   psync_syncer_check_delayed_syncs();
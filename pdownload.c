@@ -42,12 +42,14 @@
 #include "plist.h"
 #include "plocalscan.h"
 #include "pupload.h"
+#include "ptransfer.h"
 
 typedef struct {
   psync_list list;
   psync_fileid_t fileid;
   psync_syncid_t syncid;
   int stop;
+  psync_transfer_t transfer;
   unsigned char hash[PSYNC_HASH_DIGEST_HEXLEN];
 } download_list_t;
 
@@ -75,6 +77,11 @@ static pthread_cond_t current_downloads_cond=PTHREAD_COND_INITIALIZER;
 
 static psync_list downloads=PSYNC_LIST_STATIC_INIT(downloads);
 
+static psync_task_queue_t download_queue=PSYNC_TASK_QUEUE_STATIC_INIT(
+  "SELECT t.id, t.type, t.syncid, t.itemid, t.localitemid, t.newitemid, t.name, t.newsyncid, IFNULL(f.size, 0) FROM task t LEFT JOIN file f ON "
+  "t.type="NTO_STR(PSYNC_DOWNLOAD_FILE)" AND f.id=t.itemid WHERE t.inprogress=0 AND t.type&"NTO_STR(PSYNC_TASK_DWLUPL_MASK)"="
+  NTO_STR(PSYNC_TASK_DOWNLOAD)" ORDER BY t.id LIMIT "NTO_STR(PSYNC_TASK_QUEUE_SIZE), PSYNC_DOWNLOAD_FILE);
+
 static void task_wait_no_downloads(){
   pthread_mutex_lock(&current_downloads_mutex);
   while (starting_downloads || started_downloads){
@@ -494,12 +501,6 @@ static int task_download_file(psync_syncid_t syncid, psync_fileid_t fileid, psyn
   }
   memcpy(dwl->hash, serverhashhex, PSYNC_HASH_DIGEST_HEXLEN);
   pthread_mutex_lock(&current_downloads_mutex);
-  while (starting_downloads || started_downloads>=PSYNC_MAX_PARALLEL_DOWNLOADS || 
-         psync_status.bytestodownloadcurrent-psync_status.bytesdownloaded>PSYNC_START_NEW_DOWNLOADS_TRESHOLD){
-    current_downloads_waiters++;
-    pthread_cond_wait(&current_downloads_cond, &current_downloads_mutex);
-    current_downloads_waiters--;
-  }
   starting_downloads++;
   psync_status.filesdownloading++;
   pthread_mutex_unlock(&current_downloads_mutex);
@@ -587,8 +588,6 @@ static int task_download_file(psync_syncid_t syncid, psync_fileid_t fileid, psyn
   psync_status.bytestodownloadcurrent+=serversize;
   starting_downloads--;
   started_downloads++;
-  if (current_downloads_waiters)
-    pthread_cond_signal(&current_downloads_cond);
   pthread_mutex_unlock(&current_downloads_mutex);
   addedsize=serversize;
   current_counter=&started_downloads;
@@ -684,9 +683,8 @@ static int task_download_file(psync_syncid_t syncid, psync_fileid_t fileid, psyn
         psync_hash_update(&hashctx, buff, rd);
         pthread_mutex_lock(&current_downloads_mutex);
         psync_status.bytesdownloaded+=rd;
-        if (current_downloads_waiters && psync_status.bytestodownloadcurrent-psync_status.bytesdownloaded<=PSYNC_START_NEW_DOWNLOADS_TRESHOLD)
-          pthread_cond_signal(&current_downloads_cond);
         pthread_mutex_unlock(&current_downloads_mutex);
+        psync_transfer_progress(&dwl->transfer, rd);
         psync_send_status_update();
         downloadedsize+=rd;
         if (unlikely(!psync_statuses_ok_array(requiredstatuses, ARRAY_SIZE(requiredstatuses))))
@@ -720,9 +718,8 @@ static int task_download_file(psync_syncid_t syncid, psync_fileid_t fileid, psyn
         psync_hash_update(&hashctx, buff, rd);
         pthread_mutex_lock(&current_downloads_mutex);
         psync_status.bytesdownloaded+=rd;
-        if (current_downloads_waiters && psync_status.bytestodownloadcurrent-psync_status.bytesdownloaded<=PSYNC_START_NEW_DOWNLOADS_TRESHOLD)
-          pthread_cond_signal(&current_downloads_cond);
         pthread_mutex_unlock(&current_downloads_mutex);
+        psync_transfer_progress(&dwl->transfer, rd);
         psync_send_status_update();
         downloadedsize+=rd;
       }
@@ -935,19 +932,18 @@ static void task_run_download_file_thread(void *ptr){
     psync_status_recalc_to_download();
     psync_send_status_update();
   }
+  psync_transfer_end(&dt->dwllist.transfer);
   pthread_mutex_lock(&current_downloads_mutex);
   psync_list_del(&dt->dwllist.list);
   pthread_mutex_unlock(&current_downloads_mutex);
   psync_free(dt);
 }
 
-static int task_run_download_file(uint64_t taskid, psync_syncid_t syncid, psync_fileid_t fileid, psync_folderid_t localfolderid, const char *filename){
+static int task_run_download_file(uint64_t taskid, psync_syncid_t syncid, psync_fileid_t fileid, psync_folderid_t localfolderid, const char *filename,
+                                  uint64_t size){
   psync_sql_res *res;
   download_task_t *dt;
   size_t len;
-  res=psync_sql_prep_statement("UPDATE task SET inprogress=1 WHERE id=?");
-  psync_sql_bind_uint(res, 1, taskid);
-  psync_sql_run_free(res);
   len=strlen(filename);
   dt=(download_task_t *)psync_malloc(offsetof(download_task_t, filename)+len+1);
   dt->taskid=taskid;
@@ -959,16 +955,11 @@ static int task_run_download_file(uint64_t taskid, psync_syncid_t syncid, psync_
   memcpy(dt->filename, filename, len+1);
   pthread_mutex_lock(&current_downloads_mutex);
   psync_list_add_tail(&downloads, &dt->dwllist.list);
-  while (!dt->dwllist.stop && (starting_downloads || started_downloads>=PSYNC_MAX_PARALLEL_DOWNLOADS || 
-         psync_status.bytestodownloadcurrent-psync_status.bytesdownloaded>PSYNC_START_NEW_DOWNLOADS_TRESHOLD)){
-    current_downloads_waiters++;
-    pthread_cond_wait(&current_downloads_cond, &current_downloads_mutex);
-    current_downloads_waiters--;
-  }
-  if (unlikely(dt->dwllist.stop))
-    psync_list_del(&dt->dwllist.list);
   pthread_mutex_unlock(&current_downloads_mutex);
-  if (unlikely(dt->dwllist.stop)){
+  if (unlikely(psync_transfer_start(&dt->dwllist.transfer, PSYNC_TRANSFER_DOWNLOAD, size, &dt->dwllist.stop))){
+    pthread_mutex_lock(&current_downloads_mutex);
+    psync_list_del(&dt->dwllist.list);
+    pthread_mutex_unlock(&current_downloads_mutex);
     psync_free(dt);
     res=psync_sql_prep_statement("UPDATE task SET inprogress=0 WHERE id=?");
     psync_sql_bind_uint(res, 1, taskid);
@@ -1041,7 +1032,7 @@ static int task_del_folder_rec(psync_folderid_t localfolderid, psync_folderid_t
 }
   
 static int download_task(uint64_t taskid, uint32_t type, psync_syncid_t syncid, uint64_t itemid, uint64_t localitemid, uint64_t newitemid, const char *name,
-                                        psync_syncid_t newsyncid){
+                                        psync_syncid_t newsyncid, uint64_t size){
   int res;
   switch (type) {
     case PSYNC_CREATE_LOCAL_FOLDER:
@@ -1062,7 +1053,7 @@ static int download_task(uint64_t taskid, uint32_t type, psync_syncid_t syncid,
       res=task_renamefolder(syncid, itemid, localitemid, newitemid, name);
       break;
     case PSYNC_DOWNLOAD_FILE:
-      res=task_run_download_file(taskid, syncid, itemid, localitemid, name);
+      res=task_run_download_file(taskid, syncid, itemid, localitemid, name, size);
       break;
     case PSYNC_DELETE_LOCAL_FILE:
       res=task_delete_file(syncid, itemid, name);
@@ -1080,32 +1071,20 @@ static int download_task(uint64_t taskid, uint32_t type, psync_syncid_t syncid,
 }
 
 static void download_thread(){
-  psync_sql_res *res;
-  psync_variant *row;
-  uint64_t taskid;
-  uint32_t type;
+  psync_task_t *task;
   while (psync_do_run){
     psync_wait_statuses_array(requiredstatuses, ARRAY_SIZE(requiredstatuses));
     
-    row=psync_sql_row("SELECT id, type, syncid, itemid, localitemid, newitemid, name, newsyncid FROM task WHERE "
-                      "inprogress=0 AND type&"NTO_STR(PSYNC_TASK_DWLUPL_MASK)"="NTO_STR(PSYNC_TASK_DOWNLOAD)" ORDER BY id LIMIT 1");
-    if (row){
-      taskid=psync_get_number(row[0]);
-      type=psync_get_number(row[1]);
-      if (!download_task(taskid, type, 
-                         psync_get_number(row[2]), 
-                         psync_get_number(row[3]), 
-                         psync_get_number(row[4]), 
-                         psync_get_number_or_null(row[5]),                          
-                         psync_get_string_or_null(row[6]),
-                         psync_get_number_or_null(row[7]))){
-        res=psync_sql_prep_statement("DELETE FROM task WHERE id=?");
-        psync_sql_bind_uint(res, 1, taskid);
-        psync_sql_run_free(res);
-      }
-      else if (type!=PSYNC_DOWNLOAD_FILE)
+    /* large files go first if there is room for one more of them to fill the bandwidth, small ones otherwise */
+    task=psync_task_queue_get(&download_queue, psync_transfer_large_can_start(PSYNC_TRANSFER_DOWNLOAD));
+    if (task){
+      if (!download_task(task->id, task->type, task->syncid, task->itemid, task->localitemid, task->newitemid, task->name, 
+                         task->newsyncid, task->size))
+        psync_task_queue_done(&download_queue, task);
+      else if (task->type!=PSYNC_DOWNLOAD_FILE){
         psync_milisleep(PSYNC_SLEEP_ON_FAILED_DOWNLOAD);
-      psync_free(row);
+        psync_task_queue_retry(&download_queue, task);
+      }
       continue;
     }
 
@@ -1137,6 +1116,7 @@ void psync_delete_download_tasks_for_file(psync_fileid_t fileid){
   psync_sql_bind_uint(res, 2, fileid);
   psync_sql_run(res);
   if (psync_sql_affected_rows()){
+    psync_task_queue_changed(&download_queue);
     psync_status_recalc_to_download();
     psync_send_status_update();
   }
@@ -1146,6 +1126,7 @@ void psync_delete_download_tasks_for_file(psync_fileid_t fileid){
     if (dwl->fileid==fileid)
       dwl->stop=1;
   pthread_mutex_unlock(&current_downloads_mutex);
+  psync_transfer_wake();
 }
 
 void psync_stop_file_download(psync_fileid_t fileid, psync_syncid_t syncid){
@@ -1155,6 +1136,7 @@ void psync_stop_file_download(psync_fileid_t fileid, psync_syncid_t syncid){
     if (dwl->fileid==fileid && dwl->syncid==syncid)
       dwl->stop=1;
   pthread_mutex_unlock(&current_downloads_mutex);
+  psync_transfer_wake();
 }
 
 void psync_stop_sync_download(psync_syncid_t syncid){
@@ -1163,6 +1145,7 @@ void psync_stop_sync_download(psync_syncid_t syncid){
   res=psync_sql_prep_statement("DELETE FROM task WHERE syncid=? AND type&"NTO_STR(PSYNC_TASK_DWLUPL_MASK)"="NTO_STR(PSYNC_TASK_DOWNLOAD));
   psync_sql_bind_uint(res, 1, syncid);
   psync_sql_run_free(res);
+  psync_task_queue_changed(&download_queue);
   psync_status_recalc_to_download();
   psync_send_status_update();
   pthread_mutex_lock(&current_downloads_mutex);
@@ -1170,6 +1153,7 @@ void psync_stop_sync_download(psync_syncid_t syncid){
     if (dwl->syncid==syncid)
       dwl->stop=1;
   pthread_mutex_unlock(&current_downloads_mutex);
+  psync_transfer_wake();
 }
 
 void psync_stop_all_download(){
@@ -1178,6 +1162,7 @@ void psync_stop_all_download(){
   psync_list_for_each_element(dwl, &downloads, download_list_t, list)
     dwl->stop=1;
   pthread_mutex_unlock(&current_downloads_mutex);
+  psync_transfer_wake();
 }
 
 downloading_files_hashes *psync_get_downloading_hashes(){
@@ -33,6 +33,8 @@
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include "pfs.h"
 #include "pfsfolder.h"
 #include "pcompat.h"
@@ -55,15 +57,42 @@
 #define FS_BLOCK_SIZE 4096
 #define FS_MAX_WRITE  256*1024
 
+/* An index file starts with a header followed by records of the ranges of the file that are written locally. The first
+ * extentcnt records are sorted and do not overlap, the rest are appended as writes come and are merged into the
+ * extents when the index gets compacted. Index files of older versions have only copyfromoriginal in the header.
+ */
 typedef struct {
-  uint64_t offset;
-  uint64_t length;
-} index_record;
+  uint64_t copyfromoriginal;
+} index_header_v1;
 
 typedef struct {
   uint64_t copyfromoriginal;
+  uint32_t magic;
+  uint32_t version;
+  uint64_t extentcnt;
+  uint64_t reserved;
 } index_header;
 
+#define FS_INDEX_MAGIC   0x58444950
+#define FS_INDEX_VERSION 1
+
+#define FS_INDEX_COMPACT_MIN_RECORDS 1024
+
+#define FS_WRITE_BUFFER_SIZE (1024*1024)
+#define FS_INDEX_RECORDS_BATCH 128
+
+/* Writes are collected in a per open file buffer as long as they are adjacent and written to the data file as one
+ * extent. Index records for the extents are merged when possible and appended to the index file in batches.
+ * The interval tree of written ranges is only updated once the data is in the data file, so readers can rely on it.
+ */
+typedef struct _psync_fs_write_buffer_t {
+  uint64_t offset;
+  uint32_t length;
+  uint32_t reccnt;
+  psync_fs_index_record_t records[FS_INDEX_RECORDS_BATCH];
+  char data[FS_WRITE_BUFFER_SIZE];
+} psync_fs_write_buffer_t;
+
 static struct fuse_chan *psync_fuse_channel=0;
 static struct fuse *psync_fuse=0;
 static char *psync_current_mountpoint=0;
@@ -77,6 +106,209 @@ static gid_t mygid=0;
 
 static psync_tree *openfiles=PSYNC_TREE_EMPTY;
 
+static char *psync_fs_get_write_file_name(psync_fsfileid_t fileid, char type){
+  char fileidhex[sizeof(psync_fsfileid_t)*2+2];
+  fileid=-fileid;
+  psync_binhex(fileidhex, &fileid, sizeof(psync_fsfileid_t));
+  fileidhex[sizeof(psync_fsfileid_t)]=type;
+  fileidhex[sizeof(psync_fsfileid_t)+1]=0;
+  return psync_strcat(psync_setting_get_string(_PS(fscachepath)), PSYNC_DIRECTORY_SEPARATOR, fileidhex, NULL);
+}
+
+static uint64_t psync_fs_interval_tree_to_extents(psync_interval_tree_t *tree, psync_fs_index_record_t **extents){
+  psync_interval_tree_t *it;
+  uint64_t cnt;
+  cnt=0;
+  if (tree)
+    for (it=psync_interval_tree_get_first(tree); it; it=psync_interval_tree_get_next(it))
+      cnt++;
+  *extents=psync_new_cnt(psync_fs_index_record_t, cnt?cnt:1);
+  cnt=0;
+  if (tree)
+    for (it=psync_interval_tree_get_first(tree); it; it=psync_interval_tree_get_next(it)){
+      (*extents)[cnt].offset=it->from;
+      (*extents)[cnt].length=it->to-it->from;
+      cnt++;
+    }
+  return cnt;
+}
+
+/* Replaces the index file with one that has only the merged extents of the interval tree. The new index is written to
+ * a temporary file that is renamed over the old one, so a crash at any point leaves a valid index behind. Pending
+ * records should be written before calling this.
+ */
+static int psync_fs_compact_index_locked(psync_openfile_t *of){
+  psync_fs_index_record_t *extents;
+  char *indexname, *tmpname;
+  index_header hdr;
+  psync_file_t fd;
+  uint64_t cnt;
+  ssize_t len;
+  int ret;
+  if (unlikely_log(psync_file_pread(of->indexfile, &hdr.copyfromoriginal, sizeof(hdr.copyfromoriginal), offsetof(index_header, copyfromoriginal))!=
+                   sizeof(hdr.copyfromoriginal)))
+    return -1;
+  cnt=psync_fs_interval_tree_to_extents(of->writeintervals, &extents);
+  hdr.magic=FS_INDEX_MAGIC;
+  hdr.version=FS_INDEX_VERSION;
+  hdr.extentcnt=cnt;
+  hdr.reserved=0;
+  indexname=psync_fs_get_write_file_name(of->fileid, 'i');
+  tmpname=psync_strcat(indexname, ".tmp", NULL);
+  ret=-1;
+  fd=psync_file_open(tmpname, P_O_WRONLY, P_O_CREAT|P_O_TRUNC);
+  if (unlikely_log(fd==INVALID_HANDLE_VALUE))
+    goto err0;
+  len=sizeof(psync_fs_index_record_t)*cnt;
+  if (unlikely_log(psync_file_pwrite(fd, &hdr, sizeof(index_header), 0)!=sizeof(index_header)) ||
+      unlikely_log(len && psync_file_pwrite(fd, extents, len, sizeof(index_header))!=len) || unlikely_log(psync_file_sync(fd))){
+    psync_file_close(fd);
+    goto err1;
+  }
+  psync_file_close(fd);
+  psync_file_close(of->indexfile);
+  ret=psync_file_rename_overwrite(tmpname, indexname);
+  of->indexfile=psync_file_open(indexname, P_O_RDWR, 0);
+  if (unlikely_log(of->indexfile==INVALID_HANDLE_VALUE))
+    ret=-1;
+  else if (likely_log(!ret)){
+    debug(D_NOTICE, "compacted index of %s from %lu records to %lu extents", of->currentname, (unsigned long)of->indexoff, (unsigned long)cnt);
+    of->indexoff=cnt;
+    of->indexextents=cnt;
+    goto err0;
+  }
+err1:
+  psync_file_delete(tmpname);
+err0:
+  psync_free(tmpname);
+  psync_free(indexname);
+  psync_free(extents);
+  return ret;
+}
+
+static int psync_fs_index_needs_compaction(psync_openfile_t *of){
+  uint64_t appended;
+  appended=of->indexoff-of->indexextents;
+  return appended>=FS_INDEX_COMPACT_MIN_RECORDS && appended>=of->indexextents;
+}
+
+static int psync_fs_write_index_records_locked(psync_openfile_t *of){
+  psync_fs_write_buffer_t *wb;
+  ssize_t len;
+  wb=of->writebuf;
+  if (!wb->reccnt)
+    return 0;
+  len=sizeof(psync_fs_index_record_t)*wb->reccnt;
+  if (unlikely_log(psync_file_pwrite(of->indexfile, wb->records, len, sizeof(psync_fs_index_record_t)*of->indexoff+sizeof(index_header))!=len))
+    return -EIO;
+  of->indexoff+=wb->reccnt;
+  wb->reccnt=0;
+  if (psync_fs_index_needs_compaction(of) && psync_fs_compact_index_locked(of) && of->indexfile==INVALID_HANDLE_VALUE)
+    return -EIO;
+  return 0;
+}
+
+static int psync_fs_add_index_record_locked(psync_openfile_t *of, uint64_t offset, uint64_t length){
+  psync_fs_write_buffer_t *wb;
+  psync_fs_index_record_t *rec;
+  wb=of->writebuf;
+  if (wb->reccnt){
+    rec=&wb->records[wb->reccnt-1];
+    if (offset>=rec->offset && offset<=rec->offset+rec->length){
+      if (offset+length>rec->offset+rec->length)
+        rec->length=offset+length-rec->offset;
+      return 0;
+    }
+  }
+  if (wb->reccnt==FS_INDEX_RECORDS_BATCH && psync_fs_write_index_records_locked(of))
+    return -EIO;
+  rec=&wb->records[wb->reccnt++];
+  rec->offset=offset;
+  rec->length=length;
+  return 0;
+}
+
+static ssize_t psync_fs_write_extent_locked(psync_openfile_t *of, const char *buf, uint64_t size, uint64_t offset){
+  ssize_t bw;
+  bw=psync_file_pwrite(of->datafile, buf, size, offset);
+  if (unlikely_log(bw==-1))
+    return -EIO;
+  if (!of->newfile){
+    if (psync_fs_add_index_record_locked(of, offset, bw))
+      return -EIO;
+    psync_interval_tree_add(&of->writeintervals, offset, offset+bw);
+  }
+  return bw;
+}
+
+static int psync_fs_write_buffered_data_locked(psync_openfile_t *of){
+  psync_fs_write_buffer_t *wb;
+  ssize_t bw;
+  wb=of->writebuf;
+  if (!wb || !wb->length)
+    return 0;
+  bw=psync_fs_write_extent_locked(of, wb->data, wb->length, wb->offset);
+  if (unlikely(bw!=wb->length)){
+    debug(D_ERROR, "failed to write %u buffered bytes at offset %lu of file %s", (unsigned)wb->length, (unsigned long)wb->offset, of->currentname);
+    wb->length=0;
+    return -EIO;
+  }
+  wb->length=0;
+  return 0;
+}
+
+static int psync_fs_flush_write_buffer_locked(psync_openfile_t *of){
+  if (!of->writebuf)
+    return 0;
+  if (psync_fs_write_buffered_data_locked(of))
+    return -EIO;
+  if (!of->newfile)
+    return psync_fs_write_index_records_locked(of);
+  else
+    return 0;
+}
+
+static ssize_t psync_fs_buffered_write_locked(psync_openfile_t *of, const char *buf, uint64_t size, uint64_t offset){
+  psync_fs_write_buffer_t *wb;
+  wb=of->writebuf;
+  if (!wb){
+    wb=psync_new(psync_fs_write_buffer_t);
+    wb->length=0;
+    wb->reccnt=0;
+    of->writebuf=wb;
+  }
+  else if (wb->length && (wb->offset+wb->length!=offset || wb->length+size>FS_WRITE_BUFFER_SIZE) && psync_fs_write_buffered_data_locked(of))
+    return -EIO;
+  if (size>=FS_WRITE_BUFFER_SIZE)
+    return psync_fs_write_extent_locked(of, buf, size, offset);
+  if (!wb->length)
+    wb->offset=offset;
+  memcpy(wb->data+wb->length, buf, size);
+  wb->length+=size;
+  return size;
+}
+
+static void psync_fs_write_buffered_data_by_fileid_locked(psync_fsfileid_t fileid){
+  psync_openfile_t *fl;
+  psync_tree *tr;
+  int64_t d;
+  tr=openfiles;
+  while (tr){
+    d=fileid-psync_tree_element(tr, psync_openfile_t, tree)->fileid;
+    if (d<0)
+      tr=tr->left;
+    else if (d>0)
+      tr=tr->right;
+    else{
+      fl=psync_tree_element(tr, psync_openfile_t, tree);
+      pthread_mutex_lock(&fl->mutex);
+      psync_fs_write_buffered_data_locked(fl);
+      pthread_mutex_unlock(&fl->mutex);
+      break;
+    }
+  }
+}
+
 int psync_fs_update_openfile(uint64_t taskid, uint64_t writeid, psync_fileid_t newfileid, uint64_t hash, uint64_t size){
   psync_openfile_t *fl;
   psync_tree *tr;
@@ -308,6 +540,7 @@ static int psync_creat_local_to_file_stat(psync_fstask_creat_t *cr, struct stat
   char fileidhex[sizeof(psync_fsfileid_t)*2+2];
   int stret;
   fileid=cr->taskid;
+  psync_fs_write_buffered_data_by_fileid_locked(-fileid);
   psync_binhex(fileidhex, &fileid, sizeof(psync_fsfileid_t));
   fileidhex[sizeof(psync_fsfileid_t)]='d';
   fileidhex[sizeof(psync_fsfileid_t)+1]=0;
@@ -556,25 +789,92 @@ static psync_openfile_t *psync_fs_create_file(psync_fsfileid_t fileid, psync_fsf
   return fl;
 }
 
-int64_t psync_fs_load_interval_tree(psync_file_t fd, uint64_t size, psync_interval_tree_t **tree){
-  index_record records[512];
-  uint64_t cnt;
+static int64_t psync_fs_read_index_header(psync_file_t fd, uint64_t size, index_header *hdr){
+  if (size>=sizeof(index_header) && psync_file_pread(fd, hdr, sizeof(index_header), 0)==sizeof(index_header) &&
+      hdr->magic==FS_INDEX_MAGIC && hdr->version==FS_INDEX_VERSION){
+    assertw((size-sizeof(index_header))%sizeof(psync_fs_index_record_t)==0);
+    if (unlikely_log(hdr->extentcnt>(size-sizeof(index_header))/sizeof(psync_fs_index_record_t)))
+      return -1;
+    return sizeof(index_header);
+  }
+  if (unlikely_log(size<sizeof(index_header_v1) || psync_file_pread(fd, hdr, sizeof(index_header_v1), 0)!=sizeof(index_header_v1)))
+    return -1;
+  assertw((size-sizeof(index_header_v1))%sizeof(psync_fs_index_record_t)==0);
+  hdr->magic=0;
+  hdr->version=0;
+  hdr->extentcnt=0;
+  hdr->reserved=0;
+  return sizeof(index_header_v1);
+}
+
+static int psync_fs_read_index_records(psync_file_t fd, uint64_t hdrsize, uint64_t cnt, psync_interval_tree_t **tree){
+  psync_fs_index_record_t records[512];
   uint64_t i;
   ssize_t rrd, rd, j;
-  if (size<sizeof(index_header))
-    return 0;
-  size-=sizeof(index_header);
-  assertw(size%sizeof(index_record)==0);
-  cnt=size/sizeof(index_record);
-  debug(D_NOTICE, "loading %lu intervals", (unsigned long)cnt);
   for (i=0; i<cnt; i+=ARRAY_SIZE(records)){
     rd=ARRAY_SIZE(records)>cnt-i?cnt-i:ARRAY_SIZE(records);
-    rrd=psync_file_pread(fd, records, rd*sizeof(index_record), i*sizeof(index_record)+sizeof(index_header));
-    if (unlikely_log(rrd!=rd*sizeof(index_record)))
+    rrd=psync_file_pread(fd, records, rd*sizeof(psync_fs_index_record_t), i*sizeof(psync_fs_index_record_t)+hdrsize);
+    if (unlikely_log(rrd!=rd*sizeof(psync_fs_index_record_t)))
       return -1;
     for (j=0; j<rd; j++)
       psync_interval_tree_add(tree, records[j].offset, records[j].offset+records[j].length);
   }
+  return 0;
+}
+
+static int64_t psync_fs_load_index(psync_file_t fd, uint64_t size, psync_interval_tree_t **tree, index_header *hdr){
+  int64_t hdrsize;
+  uint64_t cnt;
+  hdrsize=psync_fs_read_index_header(fd, size, hdr);
+  if (hdrsize==-1)
+    return -1;
+  cnt=(size-hdrsize)/sizeof(psync_fs_index_record_t);
+  debug(D_NOTICE, "loading %lu intervals, %lu of them compacted", (unsigned long)cnt, (unsigned long)hdr->extentcnt);
+  if (psync_fs_read_index_records(fd, hdrsize, cnt, tree))
+    return -1;
+  return cnt;
+}
+
+int64_t psync_fs_load_interval_tree(psync_file_t fd, uint64_t size, psync_interval_tree_t **tree){
+  index_header hdr;
+  if (!size)
+    return 0;
+  return psync_fs_load_index(fd, size, tree, &hdr);
+}
+
+/* Returns the sorted, non-overlapping ranges of a modified file that are stored locally. A compacted index is read
+ * as it is, otherwise the records are merged through an interval tree.
+ */
+int64_t psync_fs_load_index_extents(psync_file_t fd, uint64_t size, psync_fs_index_record_t **extents){
+  psync_interval_tree_t *tree;
+  index_header hdr;
+  int64_t hdrsize;
+  uint64_t cnt;
+  ssize_t len;
+  if (!size){
+    *extents=psync_new_cnt(psync_fs_index_record_t, 1);
+    return 0;
+  }
+  hdrsize=psync_fs_read_index_header(fd, size, &hdr);
+  if (hdrsize==-1)
+    return -1;
+  cnt=(size-hdrsize)/sizeof(psync_fs_index_record_t);
+  if (cnt==hdr.extentcnt){
+    *extents=psync_new_cnt(psync_fs_index_record_t, cnt?cnt:1);
+    len=sizeof(psync_fs_index_record_t)*cnt;
+    if (unlikely_log(len && psync_file_pread(fd, *extents, len, hdrsize)!=len)){
+      psync_free(*extents);
+      return -1;
+    }
+    return cnt;
+  }
+  tree=NULL;
+  if (psync_fs_read_index_records(fd, hdrsize, cnt, &tree)){
+    psync_interval_tree_free(tree);
+    return -1;
+  }
+  cnt=psync_fs_interval_tree_to_extents(tree, extents);
+  psync_interval_tree_free(tree);
   return cnt;
 }
 
@@ -584,21 +884,30 @@ static int load_interval_tree(psync_openfile_t *of){
   ifs=psync_file_size(of->indexfile);
   if (unlikely_log(ifs==-1))
     return -1;
-  if (ifs<sizeof(index_header)){
-    assertw(ifs==0);
+  if (ifs==0){
     hdr.copyfromoriginal=of->initialsize;
+    hdr.magic=FS_INDEX_MAGIC;
+    hdr.version=FS_INDEX_VERSION;
+    hdr.extentcnt=0;
+    hdr.reserved=0;
+    of->indexoff=0;
+    of->indexextents=0;
     if (psync_file_pwrite(of->indexfile, &hdr, sizeof(index_header), 0)!=sizeof(index_header))
       return -1;
     else
       return 0;
   }
-  ifs=psync_fs_load_interval_tree(of->indexfile, ifs, &of->writeintervals);
+  ifs=psync_fs_load_index(of->indexfile, ifs, &of->writeintervals, &hdr);
   if (ifs==-1)
     return -1;
-  else{
-    of->indexoff=ifs;
-    return 0;
-  }
+  of->indexoff=ifs;
+  of->indexextents=hdr.extentcnt;
+  // records are appended after the current header, so indexes of older versions are converted before any write
+  if (hdr.magic!=FS_INDEX_MAGIC)
+    return psync_fs_compact_index_locked(of);
+  if (psync_fs_index_needs_compaction(of))
+    psync_fs_compact_index_locked(of);
+  return of->indexfile==INVALID_HANDLE_VALUE?-1:0;
 }
 
 static int open_write_files(psync_openfile_t *of, int trunc){
@@ -837,7 +1146,11 @@ void psync_fs_inc_of_refcnt(psync_openfile_t *of){
 
 static void psync_fs_free_openfile(psync_openfile_t *of){
   debug(D_NOTICE, "releasing file %s", of->currentname);
-  pthread_mutex_destroy(&of->mutex);
+  if (of->writebuf){
+    if (unlikely(psync_fs_flush_write_buffer_locked(of)))
+      debug(D_ERROR, "failed to write buffered data of file %s on release, data is lost", of->currentname);
+    psync_free(of->writebuf);
+  }
   if (of->datafile!=INVALID_HANDLE_VALUE)
     psync_file_close(of->datafile);
   if (of->indexfile!=INVALID_HANDLE_VALUE)
@@ -846,6 +1159,7 @@ static void psync_fs_free_openfile(psync_openfile_t *of){
     psync_interval_tree_free(of->writeintervals);
   psync_fstask_release_folder_tasks(of->currentfolder);
   psync_free(of->currentname);
+  pthread_mutex_destroy(&of->mutex);
   psync_free(of);
 }
 
@@ -894,6 +1208,14 @@ static int psync_fs_flush(const char *path, struct fuse_file_info *fi){
   debug(D_NOTICE, "flush %s", path);
   of=fh_to_openfile(fi->fh);
   pthread_mutex_lock(&of->mutex);
+  if (of->writebuf){
+    if (unlikely(psync_fs_flush_write_buffer_locked(of))){
+      pthread_mutex_unlock(&of->mutex);
+      return -EIO;
+    }
+    psync_free(of->writebuf);
+    of->writebuf=NULL;
+  }
   if (of->modified && !of->uploading){
     psync_sql_res *res;
     uint64_t writeid;
@@ -931,7 +1253,7 @@ static int psync_fs_fsync(const char *path, int datasync, struct fuse_file_info
     pthread_mutex_unlock(&of->mutex);
     return 0;
   }
-  if (unlikely_log(psync_file_sync(of->datafile)) || unlikely_log(!of->newfile && psync_file_sync(of->indexfile))){
+  if (unlikely(psync_fs_flush_write_buffer_locked(of)) || unlikely_log(psync_file_sync(of->datafile)) || unlikely_log(!of->newfile && psync_file_sync(of->indexfile))){
     pthread_mutex_unlock(&of->mutex);
     return -EIO;
   }
@@ -957,12 +1279,9 @@ static int psync_read_newfile(psync_openfile_t *of, char *buf, uint64_t size, ui
     return br;
 }
 
-static int psync_fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
-  psync_openfile_t *of;
+static void psync_fs_account_read_locked(psync_openfile_t *of, size_t size){
   time_t currenttime;
-  of=fh_to_openfile(fi->fh);
   currenttime=psync_timer_time();
-  pthread_mutex_lock(&of->mutex);
   if (of->currentsec==currenttime){
     of->bytesthissec+=size;
     if (of->currentspeed<of->bytesthissec)
@@ -978,6 +1297,17 @@ static int psync_fs_read(const char *path, char *buf, size_t size, off_t offset,
     of->currentsec=currenttime;
     of->bytesthissec=size;
   }
+}
+
+static int psync_fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
+  psync_openfile_t *of;
+  of=fh_to_openfile(fi->fh);
+  pthread_mutex_lock(&of->mutex);
+  if (unlikely(psync_fs_write_buffered_data_locked(of))){
+    pthread_mutex_unlock(&of->mutex);
+    return -EIO;
+  }
+  psync_fs_account_read_locked(of, size);
   if (of->newfile){
     int ret=psync_read_newfile(of, buf, size, offset);
     pthread_mutex_unlock(&of->mutex);
@@ -989,11 +1319,93 @@ static int psync_fs_read(const char *path, char *buf, size_t size, off_t offset,
     return psync_pagecache_read_unmodified_locked(of, buf, size, offset);
 }
 
+#if defined(FUSE_CAP_SPLICE_READ)
+
+/* fuse frees both the vector and the memory buffers in it with free() */
+static struct fuse_bufvec *psync_fs_new_bufvec(size_t cnt){
+  struct fuse_bufvec *bufv;
+  bufv=(struct fuse_bufvec *)malloc(offsetof(struct fuse_bufvec, buf)+sizeof(struct fuse_buf)*cnt);
+  if (unlikely_log(!bufv))
+    return NULL;
+  memset(bufv, 0, offsetof(struct fuse_bufvec, buf)+sizeof(struct fuse_buf)*cnt);
+  bufv->count=cnt;
+  return bufv;
+}
+
+static void psync_fs_set_fd_buf(struct fuse_buf *buf, psync_file_t fd, uint64_t size, uint64_t offset){
+  buf->size=size;
+  buf->flags=(enum fuse_buf_flags)(FUSE_BUF_IS_FD|FUSE_BUF_FD_SEEK);
+  buf->fd=fd;
+  buf->pos=offset;
+}
+
+/* Data of new files and pages already in the disk cache are returned as ranges of the respective files so that
+ * fuse can splice them to the kernel. Everything else is read in memory by the normal read path.
+ */
+static int psync_fs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi){
+  psync_openfile_t *of;
+  psync_pagecache_range_t *ranges;
+  struct fuse_bufvec *bufv;
+  psync_file_t fd;
+  char *buf;
+  int ret, i;
+  /* the previous read of this thread was already sent to the kernel */
+  psync_pagecache_unpin_ranges();
+  of=fh_to_openfile(fi->fh);
+  pthread_mutex_lock(&of->mutex);
+  if (unlikely(psync_fs_write_buffered_data_locked(of))){
+    pthread_mutex_unlock(&of->mutex);
+    return -EIO;
+  }
+  psync_fs_account_read_locked(of, size);
+  if (of->newfile){
+    bufv=psync_fs_new_bufvec(1);
+    if (likely(bufv))
+      psync_fs_set_fd_buf(&bufv->buf[0], of->datafile, size, offset);
+    pthread_mutex_unlock(&of->mutex);
+    if (unlikely(!bufv))
+      return -ENOMEM;
+    *bufp=bufv;
+    return 0;
+  }
+  if (!of->modified){
+    ret=psync_pagecache_read_unmodified_ranges_locked(of, size, offset, &ranges, &fd);
+    if (ret>=0){
+      bufv=psync_fs_new_bufvec(ret?ret:1);
+      if (likely(bufv))
+        for (i=0; i<ret; i++)
+          psync_fs_set_fd_buf(&bufv->buf[i], fd, ranges[i].size, ranges[i].offset);
+      psync_free(ranges);
+      if (unlikely(!bufv))
+        return -ENOMEM;
+      *bufp=bufv;
+      return 0;
+    }
+  }
+  buf=(char *)malloc(size);
+  if (unlikely_log(!buf)){
+    pthread_mutex_unlock(&of->mutex);
+    return -ENOMEM;
+  }
+  if (of->modified)
+    ret=psync_pagecache_read_modified_locked(of, buf, size, offset);
+  else
+    ret=psync_pagecache_read_unmodified_locked(of, buf, size, offset);
+  if (ret<0 || !(bufv=psync_fs_new_bufvec(1))){
+    free(buf);
+    return ret<0?ret:-ENOMEM;
+  }
+  bufv->buf[0].size=ret;
+  bufv->buf[0].mem=buf;
+  *bufp=bufv;
+  return 0;
+}
+
+#endif
+
 static int psync_fs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
   psync_openfile_t *of;
   ssize_t bw;
-  uint64_t ioff;
-  index_record rec;
   int ret;
   of=fh_to_openfile(fi->fh);
   pthread_mutex_lock(&of->mutex);
@@ -1006,12 +1418,9 @@ static int psync_fs_write(const char *path, const char *buf, size_t size, off_t
   of->writeid++;
 retry:
   if (of->newfile){
-    bw=psync_file_pwrite(of->datafile, buf, size, offset);
+    bw=psync_fs_buffered_write_locked(of, buf, size, offset);
     pthread_mutex_unlock(&of->mutex);
-    if (unlikely_log(bw==-1))
-      return -EIO;
-    else
-      return bw;
+    return bw;
   }
   else{
     if (unlikely(!of->modified)){
@@ -1040,21 +1449,8 @@ retry:
         return ret;
       }
       of->modified=1;
-      of->indexoff=0;
-    }
-    ioff=of->indexoff++;
-    bw=psync_file_pwrite(of->datafile, buf, size, offset);
-    if (unlikely_log(bw==-1)){
-      pthread_mutex_unlock(&of->mutex);
-      return -EIO;
-    }
-    rec.offset=offset;
-    rec.length=bw;
-    if (unlikely_log(psync_file_pwrite(of->indexfile, &rec, sizeof(rec), sizeof(rec)*ioff+sizeof(index_header))!=sizeof(rec))){
-      pthread_mutex_unlock(&of->mutex);
-      return -EIO;
     }
-    psync_interval_tree_add(&of->writeintervals, offset, offset+bw);
+    bw=psync_fs_buffered_write_locked(of, buf, size, offset);
     pthread_mutex_unlock(&of->mutex);
     return bw;
   }
@@ -1315,6 +1711,9 @@ void *psync_fs_init(struct fuse_conn_info *conn){
 #endif
 #if defined(FUSE_CAP_BIG_WRITES)
   conn->want|=FUSE_CAP_BIG_WRITES;
+#endif
+#if defined(FUSE_CAP_SPLICE_READ)
+  conn->want|=FUSE_CAP_SPLICE_READ;
 #endif
   conn->max_readahead=0;
   conn->max_write=FS_MAX_WRITE;
@@ -1470,6 +1869,9 @@ int psync_fs_start(){
   psync_oper.fsync    = psync_fs_fsync;
   psync_oper.fsyncdir = psync_fs_fsyncdir;
   psync_oper.read     = psync_fs_read;
+#if defined(FUSE_CAP_SPLICE_READ)
+  psync_oper.read_buf = psync_fs_read_buf;
+#endif
   psync_oper.write    = psync_fs_write;
   psync_oper.mkdir    = psync_fs_mkdir;
   psync_oper.rmdir    = psync_fs_rmdir;
@@ -1516,6 +1918,10 @@ int psync_fs_isstarted(){
   return s;
 }
 
+void psync_fs_get_readahead_stats(psync_fs_readahead_stats_t *stats){
+  psync_pagecache_get_readahead_stats(stats);
+}
+
 int psync_fs_remount(){
   int s;
   pthread_mutex_lock(&start_mutex);
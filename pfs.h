@@ -43,14 +43,27 @@ typedef struct {
   uint64_t length;
   uint64_t requestedto;
   uint64_t id;
+  /* id of the stream when it was started, changes when the slot is reused for another stream */
+  uint64_t startid;
+  /* distance in pages between the last two reads, only used when it is not sequential */
+  int64_t stride;
   time_t lastuse;
+  unsigned char type;
 } psync_file_stream_t;
 
+typedef struct {
+  uint64_t offset;
+  uint64_t length;
+} psync_fs_index_record_t;
+
+struct _psync_fs_write_buffer_t;
+
 typedef struct {
   psync_tree tree;
   psync_file_stream_t streams[PSYNC_FS_FILESTREAMS_CNT];
   pthread_mutex_t mutex;
   psync_interval_tree_t *writeintervals;
+  struct _psync_fs_write_buffer_t *writebuf;
   psync_fstask_folder_t *currentfolder;
   char *currentname;
   psync_fsfileid_t fileid;
@@ -60,6 +73,7 @@ typedef struct {
   uint64_t currentsize;
   uint64_t laststreamid;
   uint64_t indexoff;
+  uint64_t indexextents;
   uint64_t writeid;
   time_t currentsec;
   psync_file_t datafile;
@@ -68,6 +82,8 @@ typedef struct {
   uint32_t condwaiters;
   uint32_t runningreads;
   uint32_t currentspeed;
+  uint32_t connspeed;
+  uint32_t connlatency;
   uint32_t bytesthissec;
   unsigned char modified;
   unsigned char newfile;
@@ -79,6 +95,7 @@ void psync_fs_uploading_openfile(uint64_t taskid);
 int psync_fs_rename_openfile_locked(psync_fsfileid_t fileid, psync_fsfolderid_t folderid, const char *name);
 int64_t psync_fs_get_file_writeid(uint64_t taskid);
 int64_t psync_fs_load_interval_tree(psync_file_t fd, uint64_t size, psync_interval_tree_t **tree);
+int64_t psync_fs_load_index_extents(psync_file_t fd, uint64_t size, psync_fs_index_record_t **extents);
 int psync_fs_remount();
 void psync_fs_inc_of_refcnt_locked(psync_openfile_t *of);
 void psync_fs_inc_of_refcnt(psync_openfile_t *of);
@@ -25,6 +25,9 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "psynclib.h"
+#include <string.h>
+
 int psync_fs_remount(){
   return 0;
 }
@@ -38,4 +41,8 @@ int psync_fs_start(){
 }
 
 void psync_fs_stop(){
-}
\ No newline at end of file
+}
+
+void psync_fs_get_readahead_stats(psync_fs_readahead_stats_t *stats){
+  memset(stats, 0, sizeof(psync_fs_readahead_stats_t));
+}
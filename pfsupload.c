@@ -529,11 +529,11 @@ static int upload_modify_read_req(psync_socket *api){
 int upload_modify(uint64_t taskid, psync_folderid_t folderid, const char *name, const char *filename, const char *indexname, psync_fileid_t fileid, 
               uint64_t hash, uint64_t writeid){
   binparam aparams[]={P_STR("auth", psync_my_auth)};
-  psync_interval_tree_t *tree, *cinterval;
+  psync_fs_index_record_t *extents;
   psync_socket *api;
   binresult *res;
   psync_sql_res *sql;
-  int64_t fsize, coff, len;
+  int64_t fsize, coff, len, extcnt, ext;
   uint64_t result;
   psync_uploadid_t uploadid;
   psync_uint_t reqs;
@@ -550,9 +550,7 @@ int upload_modify(uint64_t taskid, psync_folderid_t folderid, const char *name,
     else
       return -1;
   }
-  tree=NULL;
-  if (unlikely_log((fsize=psync_file_size(fd))==-1 || psync_fs_load_interval_tree(fd, fsize, &tree)==-1)){
-    psync_interval_tree_free(tree);
+  if (unlikely_log((fsize=psync_file_size(fd))==-1 || (extcnt=psync_fs_load_index_extents(fd, fsize, &extents))==-1)){
     psync_file_close(fd);
     return -1;
   }
@@ -569,7 +567,7 @@ int upload_modify(uint64_t taskid, psync_folderid_t folderid, const char *name,
   if (unlikely(result)){
     psync_free(res);
     psync_apipool_release(api);
-    psync_interval_tree_free(tree);
+    psync_free(extents);
     debug(D_WARNING, "upload_create returned %lu", (unsigned long)result);
     if (psync_handle_api_result(result)==PSYNC_NET_TEMPFAIL)
       return -1;
@@ -587,7 +585,7 @@ int upload_modify(uint64_t taskid, psync_folderid_t folderid, const char *name,
     err=psync_fs_err();
     debug(D_WARNING, "can not open %s", filename);
     psync_apipool_release(api);
-    psync_interval_tree_free(tree);
+    psync_free(extents);
     if (err==P_NOENT)
       return 0;
     else
@@ -598,7 +596,7 @@ int upload_modify(uint64_t taskid, psync_folderid_t folderid, const char *name,
     goto err3;
   coff=0;
   reqs=0;
-  cinterval=psync_interval_tree_get_first(tree);
+  ext=0;
   while (coff<fsize){
     if (reqs && (psync_socket_pendingdata(api) || psync_select_in(&api->sock, 1, 0)!=SOCKET_ERROR)){
       if ((ret=upload_modify_read_req(api))){
@@ -609,21 +607,21 @@ int upload_modify(uint64_t taskid, psync_folderid_t folderid, const char *name,
       else
         reqs--;
     }
-    if (cinterval){
-      if (cinterval->from>coff){
-        len=i64min(cinterval->from, fsize)-coff;
+    if (ext<extcnt){
+      if (extents[ext].offset>coff){
+        len=i64min(extents[ext].offset, fsize)-coff;
         ret=upload_modify_send_copy_from(api, uploadid, coff, len, fileid, hash);
         reqs++;
         coff+=len;
       }
-      else if (cinterval->from<=coff && cinterval->to>coff){
-        ret=upload_modify_send_local(api, uploadid, coff, i64min(cinterval->to, fsize)-coff, fd);
+      else if (extents[ext].offset+extents[ext].length>coff){
+        ret=upload_modify_send_local(api, uploadid, coff, i64min(extents[ext].offset+extents[ext].length, fsize)-coff, fd);
         reqs++;
-        coff=cinterval->to;
-        cinterval=psync_interval_tree_get_next(cinterval);
+        coff=extents[ext].offset+extents[ext].length;
+        ext++;
       }
       else{
-        debug(D_BUG, "broken interval tree");
+        debug(D_BUG, "broken index extents");
         break;
       }
     }
@@ -645,7 +643,7 @@ int upload_modify(uint64_t taskid, psync_folderid_t folderid, const char *name,
         perm_fail_upload_task(taskid);
       goto err2;
     }
-  psync_interval_tree_free(tree);
+  psync_free(extents);
   if (psync_fs_get_file_writeid(taskid)!=writeid){
     debug(D_NOTICE, "%s changed while uploading as %lu/%s", filename, (unsigned long)folderid, name);
     psync_apipool_release(api);
@@ -657,7 +655,7 @@ err3:
 err2:
   psync_apipool_release_bad(api);
 err1:
-  psync_interval_tree_free(tree);
+  psync_free(extents);
   return -1;
 }
 
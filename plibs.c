@@ -28,7 +28,6 @@
 #include "psettings.h"
 #include "plibs.h"
 #include "ptimer.h"
-#include "pcache.h"
 #include "ptree.h"
 #include <string.h>
 #include <stdarg.h>
@@ -77,6 +76,101 @@ PSYNC_THREAD uint32_t psync_error=0;
 
 static pthread_mutex_t psync_db_checkpoint_mutex=PTHREAD_MUTEX_INITIALIZER;
 
+/* Prepared statements are cached by the address of their sql in a small set associative table, without hashing the text. A
+ * statement is taken out of the table while in use. The writer's cache is only used under the database lock and each reader's
+ * by the thread holding the reader.
+ */
+typedef struct {
+  psync_sql_res *stmts[PSYNC_SQL_STMT_CACHE_SIZE];
+  uint64_t prepared;
+  uint64_t reused;
+} psync_sql_stmt_cache_t;
+
+static psync_sql_stmt_cache_t psync_db_stmts;
+
+/* Queries of threads that do not hold the database lock run on a pool of read-only connections, so that reads are not blocked
+ * by the writer and by each other. A thread keeps the same reader for nested queries. Once it takes the database lock while
+ * holding a reader, its queries go to the writer until the reader is released, as the reader may not see its own changes.
+ */
+struct psync_sql_reader_t_ {
+  sqlite3 *db;
+  uint32_t refcnt;
+  uint32_t gen;
+  uint32_t profile;
+  psync_sql_stmt_cache_t stmts;
+};
+
+typedef struct psync_sql_reader_t_ psync_sql_reader_t;
+
+static pthread_mutex_t psync_db_readers_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t psync_db_readers_cond=PTHREAD_COND_INITIALIZER;
+static psync_sql_reader_t *psync_db_readers[PSYNC_DB_READERS];
+static uint32_t psync_db_readers_free=0;
+static uint32_t psync_db_readers_open=0;
+static uint32_t psync_db_readers_gen=0;
+static uint32_t psync_db_readers_created=0;
+static uint64_t psync_db_readers_prepared=0;
+static uint64_t psync_db_readers_reused=0;
+static char *psync_db_path=NULL;
+
+static PSYNC_THREAD psync_sql_reader_t *psync_my_reader=NULL;
+static PSYNC_THREAD uint32_t psync_my_sql_locks=0;
+static PSYNC_THREAD int psync_my_reader_stale=0;
+
+/* The sql profiler keeps latency histograms of statements, by their sql text, and of waiting for and holding the database
+ * lock, by the place in the code that took it. Hold time is accounted to the outermost lock of a thread. Entries keep a copy
+ * of the sql, statements from the statement cache are looked up by the address of their sql and generated ones by a hash of
+ * the text.
+ *
+ * Statements are accounted in a table of the reader they run on, or in the writer's table, so that parallel readers do not
+ * share a mutex, and the tables are merged by psync_sql_get_profile(). Lock sites are only updated with the database lock
+ * held, those of statements that take the lock themselves are kept apart from the ones in the code. Entries that do not find
+ * a slot in a few probes are counted as dropped.
+ */
+typedef struct {
+  /* address of the sql of a cached statement, NULL for generated sql */
+  const char *sql;
+  char *text;
+  uint64_t texthash;
+  uint64_t executions;
+  uint64_t rows;
+  uint64_t usec;
+  uint32_t hist[PSYNC_SQL_PROFILE_BUCKETS];
+} psync_sql_profile_stmt_t;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  uint32_t stmtcnt;
+  uint64_t dropped;
+  psync_sql_profile_stmt_t stmts[PSYNC_SQL_PROFILE_STATEMENTS];
+} psync_sql_profile_table_t;
+
+typedef struct {
+  /* copy of the sql of statements that take the lock themselves */
+  const char *file;
+  const char *function;
+  uint64_t texthash;
+  unsigned line;
+  uint64_t waits;
+  uint64_t waitusec;
+  uint64_t holds;
+  uint64_t holdusec;
+  uint32_t waithist[PSYNC_SQL_PROFILE_BUCKETS];
+  uint32_t holdhist[PSYNC_SQL_PROFILE_BUCKETS];
+} psync_sql_profile_site_t;
+
+/* table 0 is the writer's, readers use the rest in turn */
+static psync_sql_profile_table_t psync_sql_profile_tables[PSYNC_DB_READERS+1];
+static int psync_sql_profile_inited=0;
+/* protected by psync_db_mutex */
+static psync_sql_profile_site_t psync_sql_profile_sites[PSYNC_SQL_PROFILE_SITES];
+static psync_sql_profile_site_t psync_sql_profile_stmt_sites[PSYNC_SQL_PROFILE_STATEMENTS];
+static uint32_t psync_sql_profile_sitecnt=0;
+static uint64_t psync_sql_profile_sites_dropped=0;
+
+static PSYNC_THREAD uint64_t psync_my_sql_lock_start;
+static PSYNC_THREAD psync_sql_profile_site_t *psync_my_sql_lock_site;
+
 
 char *psync_strdup(const char *str){
   size_t len;
@@ -163,6 +257,7 @@ static int psync_sql_wal_hook(void *ptr, sqlite3 *db, const char *name, int nump
 
 int psync_sql_connect(const char *db){
   pthread_mutexattr_t mattr;
+  uint32_t i;
   int code;
   if (!sqlite3_threadsafe()){
     debug(D_CRITICAL, "sqlite is compiled without thread support");
@@ -174,9 +269,17 @@ int psync_sql_connect(const char *db){
     pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE);
     pthread_mutex_init(&psync_db_mutex, &mattr);
     pthread_mutexattr_destroy(&mattr);
+    if (!psync_sql_profile_inited){
+      for (i=0; i<PSYNC_DB_READERS+1; i++)
+        pthread_mutex_init(&psync_sql_profile_tables[i].mutex, NULL);
+      psync_sql_profile_inited=1;
+    }
     if (IS_DEBUG)
       sqlite3_config(SQLITE_CONFIG_LOG, psync_sql_err_callback, NULL);
     sqlite3_wal_hook(psync_db, psync_sql_wal_hook, NULL);
+    pthread_mutex_lock(&psync_db_readers_mutex);
+    psync_db_path=psync_strdup(db);
+    pthread_mutex_unlock(&psync_db_readers_mutex);
     return 0;
   }
   else{
@@ -185,13 +288,318 @@ int psync_sql_connect(const char *db){
   }
 }
 
+static uint64_t psync_sql_profile_time(){
+  struct timespec ts;
+  psync_nanotime(&ts);
+  return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+static uint64_t psync_sql_profile_usec(uint64_t start, uint64_t end){
+  return end>start?(end-start)/1000:0;
+}
+
+static void psync_sql_profile_hist_add(uint32_t *hist, uint64_t usec){
+  uint32_t b;
+  b=0;
+  while (usec>=2 && b<PSYNC_SQL_PROFILE_BUCKETS-1){
+    usec>>=1;
+    b++;
+  }
+  hist[b]++;
+}
+
+static uint64_t psync_sql_profile_hist_p99(const uint32_t *hist, uint64_t cnt){
+  uint64_t sum, lim;
+  uint32_t b;
+  lim=cnt-cnt/100;
+  sum=0;
+  for (b=0; b<PSYNC_SQL_PROFILE_BUCKETS-1; b++){
+    sum+=hist[b];
+    if (sum>=lim)
+      break;
+  }
+  return ((uint64_t)2<<b)-1;
+}
+
+static uint64_t psync_sql_profile_text_hash(const char *sql){
+  uint64_t h;
+  h=14695981039346656037ULL;
+  while (*sql)
+    h=(h^(unsigned char)*sql++)*1099511628211ULL;
+  return h;
+}
+
+/* cached is to be set only for sql that stays at the same address, the text of the others is copied before the call returns */
+static void psync_sql_profile_stmt(const char *sql, int cached, uint64_t nsec, uint32_t rows){
+  psync_sql_profile_table_t *pt;
+  psync_sql_profile_stmt_t *ps;
+  uint64_t th;
+  uintptr_t h, i;
+  if (cached){
+    th=0;
+    h=(uintptr_t)sql>>3;
+  }
+  else
+    h=th=psync_sql_profile_text_hash(sql);
+  pt=&psync_sql_profile_tables[psync_my_reader?psync_my_reader->profile:0];
+  pthread_mutex_lock(&pt->mutex);
+  for (i=0; i<PSYNC_SQL_PROFILE_PROBES; i++){
+    ps=&pt->stmts[(h+i)%PSYNC_SQL_PROFILE_STATEMENTS];
+    if (!ps->text){
+      ps->sql=cached?sql:NULL;
+      ps->text=psync_strdup(sql);
+      ps->texthash=th;
+      pt->stmtcnt++;
+      break;
+    }
+    if (cached?ps->sql==sql:!ps->sql && ps->texthash==th && !strcmp(ps->text, sql))
+      break;
+  }
+  if (likely(i<PSYNC_SQL_PROFILE_PROBES)){
+    ps->executions++;
+    ps->rows+=rows;
+    ps->usec+=nsec/1000;
+    psync_sql_profile_hist_add(ps->hist, nsec/1000);
+  }
+  else
+    pt->dropped++;
+  pthread_mutex_unlock(&pt->mutex);
+}
+
+/* to be called with psync_db_mutex held, statements that take the lock themselves pass their sql as file and 0 as line */
+static psync_sql_profile_site_t *psync_sql_profile_site(const char *file, const char *function, unsigned line){
+  psync_sql_profile_site_t *sites, *ps;
+  uint64_t th;
+  uintptr_t h, i, sz;
+  if (line){
+    sites=psync_sql_profile_sites;
+    sz=PSYNC_SQL_PROFILE_SITES;
+    th=0;
+    h=((uintptr_t)file>>3)+line;
+  }
+  else{
+    sites=psync_sql_profile_stmt_sites;
+    sz=PSYNC_SQL_PROFILE_STATEMENTS;
+    h=th=psync_sql_profile_text_hash(file);
+  }
+  for (i=0; i<PSYNC_SQL_PROFILE_PROBES; i++){
+    ps=&sites[(h+i)%sz];
+    if (!ps->file){
+      ps->file=line?file:psync_strdup(file);
+      ps->function=function;
+      ps->texthash=th;
+      ps->line=line;
+      psync_sql_profile_sitecnt++;
+      return ps;
+    }
+    if (line?ps->file==file && ps->line==line:ps->texthash==th && !strcmp(ps->file, file))
+      return ps;
+  }
+  psync_sql_profile_sites_dropped++;
+  return NULL;
+}
+
+static void psync_sql_profile_wait(psync_sql_profile_site_t *ps, uint64_t usec){
+  if (likely(ps)){
+    ps->waits++;
+    ps->waitusec+=usec;
+    psync_sql_profile_hist_add(ps->waithist, usec);
+  }
+}
+
+static void psync_sql_profile_hold(psync_sql_profile_site_t *ps, uint64_t usec){
+  if (likely(ps)){
+    ps->holds++;
+    ps->holdusec+=usec;
+    psync_sql_profile_hist_add(ps->holdhist, usec);
+  }
+}
+
+/* to be called when an execution of the statement is completed or abandoned */
+static void psync_sql_profile_res(psync_sql_res *res){
+  if (res->steps){
+    psync_sql_profile_stmt(res->cached?res->sql:sqlite3_sql(res->stmt), res->cached, res->steptime, res->rows);
+    res->steptime=0;
+    res->steps=0;
+    res->rows=0;
+  }
+}
+
+static int psync_sql_step(psync_sql_res *res){
+  uint64_t start;
+  int code;
+  start=psync_sql_profile_time();
+  code=sqlite3_step(res->stmt);
+  res->steptime+=psync_sql_profile_time()-start;
+  res->steps++;
+  if (code==SQLITE_ROW)
+    res->rows++;
+  else
+    psync_sql_profile_res(res);
+  return code;
+}
+
+static int psync_sql_step_once(sqlite3_stmt *stmt, const char *sql){
+  uint64_t start;
+  int code;
+  start=psync_sql_profile_time();
+  code=sqlite3_step(stmt);
+  psync_sql_profile_stmt(sql, 0, psync_sql_profile_time()-start, code==SQLITE_ROW);
+  return code;
+}
+
+static void psync_sql_free_cache(psync_sql_res *res){
+  sqlite3_finalize(res->stmt);
+  psync_free(res);
+}
+
+static psync_sql_res *psync_sql_stmt_cache_get(psync_sql_stmt_cache_t *cache, const char *sql){
+  psync_sql_res *res;
+  uintptr_t h, i;
+  h=(uintptr_t)sql>>3;
+  for (i=0; i<PSYNC_SQL_STMT_CACHE_WAYS; i++){
+    res=cache->stmts[(h+i)%PSYNC_SQL_STMT_CACHE_SIZE];
+    if (res && res->sql==sql){
+      cache->stmts[(h+i)%PSYNC_SQL_STMT_CACHE_SIZE]=NULL;
+      cache->reused++;
+      return res;
+    }
+  }
+  cache->prepared++;
+  return NULL;
+}
+
+static void psync_sql_stmt_cache_add(psync_sql_stmt_cache_t *cache, psync_sql_res *res){
+  uintptr_t h, i;
+  h=(uintptr_t)res->sql>>3;
+  for (i=0; i<PSYNC_SQL_STMT_CACHE_WAYS; i++)
+    if (!cache->stmts[(h+i)%PSYNC_SQL_STMT_CACHE_SIZE]){
+      cache->stmts[(h+i)%PSYNC_SQL_STMT_CACHE_SIZE]=res;
+      return;
+    }
+  h%=PSYNC_SQL_STMT_CACHE_SIZE;
+  psync_sql_free_cache(cache->stmts[h]);
+  cache->stmts[h]=res;
+}
+
+static void psync_sql_stmt_cache_clean(psync_sql_stmt_cache_t *cache){
+  uint32_t i;
+  for (i=0; i<PSYNC_SQL_STMT_CACHE_SIZE; i++)
+    if (cache->stmts[i]){
+      psync_sql_free_cache(cache->stmts[i]);
+      cache->stmts[i]=NULL;
+    }
+}
+
+static psync_sql_reader_t *psync_sql_reader_open(){
+  psync_sql_reader_t *rd;
+  sqlite3 *db;
+  int code;
+  code=sqlite3_open_v2(psync_db_path, &db, SQLITE_OPEN_READONLY, NULL);
+  if (unlikely(code!=SQLITE_OK)){
+    debug(D_ERROR, "could not open read-only connection to database %s: %d", psync_db_path, code);
+    sqlite3_close(db);
+    return NULL;
+  }
+  sqlite3_busy_timeout(db, PSYNC_DB_READER_BUSY_TIMEOUT);
+  rd=psync_new(psync_sql_reader_t);
+  memset(rd, 0, sizeof(psync_sql_reader_t));
+  rd->db=db;
+  rd->gen=psync_db_readers_gen;
+  rd->profile=1+psync_db_readers_created++%PSYNC_DB_READERS;
+  return rd;
+}
+
+static void psync_sql_reader_close(psync_sql_reader_t *rd){
+  int code;
+  psync_sql_stmt_cache_clean(&rd->stmts);
+  code=sqlite3_close(rd->db);
+  if (unlikely(code!=SQLITE_OK))
+    debug(D_ERROR, "error when closing read-only database connection: %d", code);
+  psync_free(rd);
+}
+
+/* returns NULL if the query is to run on the writer */
+static psync_sql_reader_t *psync_sql_reader_acquire(){
+  psync_sql_reader_t *rd;
+  if (psync_my_sql_locks || psync_my_reader_stale)
+    return NULL;
+  if (psync_my_reader){
+    psync_my_reader->refcnt++;
+    return psync_my_reader;
+  }
+  rd=NULL;
+  pthread_mutex_lock(&psync_db_readers_mutex);
+  while (psync_db_path){
+    if (psync_db_readers_free){
+      rd=psync_db_readers[--psync_db_readers_free];
+      break;
+    }
+    if (psync_db_readers_open<PSYNC_DB_READERS){
+      rd=psync_sql_reader_open();
+      if (rd)
+        psync_db_readers_open++;
+      break;
+    }
+    pthread_cond_wait(&psync_db_readers_cond, &psync_db_readers_mutex);
+  }
+  pthread_mutex_unlock(&psync_db_readers_mutex);
+  if (rd){
+    rd->refcnt=1;
+    psync_my_reader=rd;
+  }
+  return rd;
+}
+
+static void psync_sql_reader_release(psync_sql_reader_t *rd){
+  if (--rd->refcnt)
+    return;
+  psync_my_reader=NULL;
+  psync_my_reader_stale=0;
+  pthread_mutex_lock(&psync_db_readers_mutex);
+  psync_db_readers_prepared+=rd->stmts.prepared;
+  psync_db_readers_reused+=rd->stmts.reused;
+  rd->stmts.prepared=0;
+  rd->stmts.reused=0;
+  if (rd->gen==psync_db_readers_gen){
+    psync_db_readers[psync_db_readers_free++]=rd;
+    pthread_cond_signal(&psync_db_readers_cond);
+    rd=NULL;
+  }
+  pthread_mutex_unlock(&psync_db_readers_mutex);
+  if (rd)
+    psync_sql_reader_close(rd);
+}
+
+/* readers that are in use are closed when released */
+static void psync_sql_readers_close(){
+  pthread_mutex_lock(&psync_db_readers_mutex);
+  while (psync_db_readers_free)
+    psync_sql_reader_close(psync_db_readers[--psync_db_readers_free]);
+  psync_db_readers_open=0;
+  psync_db_readers_gen++;
+  psync_free(psync_db_path);
+  psync_db_path=NULL;
+  pthread_cond_broadcast(&psync_db_readers_cond);
+  pthread_mutex_unlock(&psync_db_readers_mutex);
+}
+
 void psync_sql_close(){
+  uint64_t prepared, reused;
   int code, tries;
+  psync_sql_readers_close();
+  psync_sql_statement_stats(&prepared, &reused);
+  debug(D_NOTICE, "prepared %lu sql statements, reused %lu", (unsigned long)prepared, (unsigned long)reused);
+  psync_sql_lock();
+  psync_sql_stmt_cache_clean(&psync_db_stmts);
+  psync_sql_unlock();
   tries=0;
   while (1){
     code=sqlite3_close(psync_db);
     if (code==SQLITE_BUSY){
-      psync_cache_clean_all();
+      psync_sql_lock();
+      psync_sql_stmt_cache_clean(&psync_db_stmts);
+      psync_sql_unlock();
       tries++;
       if (tries>100){
         psync_milisleep(tries-90);
@@ -234,60 +642,50 @@ int psync_sql_reopen(const char *path){
   }
 }
 
-#if IS_DEBUG
-unsigned long sqllockcnt=0;
-struct timespec sqllockstart;
-#endif
+/* the site is looked up when the lock is taken, as the sql of statements that lock may be freed before the lock is released */
+static void psync_sql_mark_locked(const char *file, const char *function, unsigned line, uint64_t now){
+  if (!psync_my_sql_locks++){
+    psync_my_sql_lock_start=now?now:psync_sql_profile_time();
+    psync_my_sql_lock_site=psync_sql_profile_site(file, function, line);
+    if (psync_my_reader)
+      psync_my_reader_stale=1;
+  }
+}
 
-int psync_sql_trylock(){
-#if IS_DEBUG
+int psync_sql_do_trylock(const char *file, const char *function, unsigned line){
   if (pthread_mutex_trylock(&psync_db_mutex))
     return -1;
-  if (++sqllockcnt==1)
-    psync_nanotime(&sqllockstart);
+  psync_sql_mark_locked(file, function, line, 0);
   return 0;
-#else
-  return pthread_mutex_trylock(&psync_db_mutex);
-#endif
 }
 
-void psync_sql_lock(){
-#if IS_DEBUG
+void psync_sql_do_lock(const char *file, const char *function, unsigned line){
+  uint64_t start, now;
   if (pthread_mutex_trylock(&psync_db_mutex)){
-    struct timespec start, end;
-    unsigned long msec;
-    psync_nanotime(&start);
+    start=psync_sql_profile_time();
     pthread_mutex_lock(&psync_db_mutex);
-    psync_nanotime(&end);
-    msec=(end.tv_sec-start.tv_sec)*1000+end.tv_nsec/1000000-start.tv_nsec/1000000;
-    if (msec>=5)
-      debug(D_WARNING, "waited %lu milliseconds for database mutex", msec);
-    sqllockcnt++;
-    memcpy(&sqllockstart, &end, sizeof(struct timespec));
-  }
-  else if (++sqllockcnt==1)
-    psync_nanotime(&sqllockstart);
-#else
-  pthread_mutex_lock(&psync_db_mutex);
-#endif
+    now=psync_sql_profile_time();
+    /* a thread never waits for a lock it already holds, so this is its outermost lock */
+    psync_sql_mark_locked(file, function, line, now);
+    psync_sql_profile_wait(psync_my_sql_lock_site, psync_sql_profile_usec(start, now));
+    if (IS_DEBUG && psync_sql_profile_usec(start, now)>=5000)
+      debug(D_WARNING, "waited %lu milliseconds for database mutex", (unsigned long)psync_sql_profile_usec(start, now)/1000);
+  }
+  else
+    psync_sql_mark_locked(file, function, line, 0);
 }
 
 void psync_sql_unlock(){
-#if IS_DEBUG
-  if (--sqllockcnt==0){
-    struct timespec end;
-    unsigned long msec;
+  uint64_t usec;
+  if (--psync_my_sql_locks==0){
+    usec=psync_sql_profile_usec(psync_my_sql_lock_start, psync_sql_profile_time());
+    psync_sql_profile_hold(psync_my_sql_lock_site, usec);
     pthread_mutex_unlock(&psync_db_mutex);
-    psync_nanotime(&end);
-    msec=(end.tv_sec-sqllockstart.tv_sec)*1000+end.tv_nsec/1000000-sqllockstart.tv_nsec/1000000;
-    if (msec>=10)
-      debug(D_WARNING, "held database mutex for %lu milliseconds", msec);
+    if (IS_DEBUG && usec>=10000)
+      debug(D_WARNING, "held database mutex for %lu milliseconds", (unsigned long)usec/1000);
   }
   else
     pthread_mutex_unlock(&psync_db_mutex);
-#else
-  pthread_mutex_unlock(&psync_db_mutex);
-#endif
 }
 
 int psync_sql_sync(){
@@ -310,9 +708,12 @@ int psync_sql_sync(){
 
 int psync_sql_statement(const char *sql){
   char *errmsg;
+  uint64_t start;
   int code;
-  psync_sql_lock();
+  psync_sql_do_lock(sql, NULL, 0);
+  start=psync_sql_profile_time();
   code=sqlite3_exec(psync_db, sql, NULL, NULL, &errmsg);
+  psync_sql_profile_stmt(sql, 0, psync_sql_profile_time()-start, 0);
   psync_sql_unlock();
   if (likely(code==SQLITE_OK))
     return 0;
@@ -323,8 +724,8 @@ int psync_sql_statement(const char *sql){
   }
 }
 
-int psync_sql_start_transaction(){
-  psync_sql_lock();
+int psync_sql_do_start_transaction(const char *file, const char *function, unsigned line){
+  psync_sql_do_lock(file, function, line);
   if (unlikely(psync_sql_statement("BEGIN"))){
     psync_sql_unlock();
     return -1;
@@ -425,69 +826,90 @@ static void psync_sql_check_query_plan(const char *sql){
 
 #endif
 
+static sqlite3 *psync_sql_read_lock(psync_sql_reader_t **rd, const char *sql){
+  *rd=psync_sql_reader_acquire();
+  if (*rd)
+    return (*rd)->db;
+  psync_sql_do_lock(sql, NULL, 0);
+  return psync_db;
+}
+
+static void psync_sql_read_unlock(psync_sql_reader_t *rd){
+  if (rd)
+    psync_sql_reader_release(rd);
+  else
+    psync_sql_unlock();
+}
+
 char *psync_sql_cellstr(const char *sql){
+  psync_sql_reader_t *rd;
   sqlite3_stmt *stmt;
+  sqlite3 *db;
   int code;
   psync_sql_check_query_plan(sql);
-  psync_sql_lock();
-  code=sqlite3_prepare_v2(psync_db, sql, -1, &stmt, NULL);
+  db=psync_sql_read_lock(&rd, sql);
+  code=sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
   if (unlikely(code!=SQLITE_OK)){
-    psync_sql_unlock();
-    debug(D_ERROR, "error running sql statement: %s: %s", sql, sqlite3_errmsg(psync_db));
+    debug(D_ERROR, "error running sql statement: %s: %s", sql, sqlite3_errmsg(db));
+    psync_sql_read_unlock(rd);
     return NULL;
   }
-  code=sqlite3_step(stmt);
+  code=psync_sql_step_once(stmt, sql);
   if (code==SQLITE_ROW){
     char *ret;
     ret=(char *)sqlite3_column_text(stmt, 0);
     if (ret)
       ret=psync_strdup(ret);
     sqlite3_finalize(stmt);
-    psync_sql_unlock();
+    psync_sql_read_unlock(rd);
     return ret;
   }
   else {
     sqlite3_finalize(stmt);
-    psync_sql_unlock();
     if (unlikely(code!=SQLITE_DONE))
-      debug(D_ERROR, "sqlite3_step returned error: %s: %s", sql, sqlite3_errmsg(psync_db));
+      debug(D_ERROR, "sqlite3_step returned error: %s: %s", sql, sqlite3_errmsg(db));
+    psync_sql_read_unlock(rd);
     return NULL;
   }
 }
 
 int64_t psync_sql_cellint(const char *sql, int64_t dflt){
+  psync_sql_reader_t *rd;
   sqlite3_stmt *stmt;
+  sqlite3 *db;
   int code;
   psync_sql_check_query_plan(sql);
-  psync_sql_lock();
-  code=sqlite3_prepare_v2(psync_db, sql, -1, &stmt, NULL);
+  db=psync_sql_read_lock(&rd, sql);
+  code=sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
   if (unlikely(code!=SQLITE_OK))
-    debug(D_ERROR, "error running sql statement: %s: %s", sql, sqlite3_errmsg(psync_db));
+    debug(D_ERROR, "error running sql statement: %s: %s", sql, sqlite3_errmsg(db));
   else{
-    code=sqlite3_step(stmt);
+    code=psync_sql_step_once(stmt, sql);
     if (code==SQLITE_ROW)
       dflt=sqlite3_column_int64(stmt, 0);
     else if (unlikely(code!=SQLITE_DONE))
-      debug(D_ERROR, "sqlite3_step returned error: %s: %s", sql, sqlite3_errmsg(psync_db));
+      debug(D_ERROR, "sqlite3_step returned error: %s: %s", sql, sqlite3_errmsg(db));
     sqlite3_finalize(stmt);
   }
-  psync_sql_unlock();
+  psync_sql_read_unlock(rd);
   return dflt;
 }
 
 char **psync_sql_rowstr(const char *sql){
+  psync_sql_reader_t *rd;
   sqlite3_stmt *stmt;
+  sqlite3 *db;
   int code, cnt;
   psync_sql_check_query_plan(sql);
-  psync_sql_lock();
-  code=sqlite3_prepare_v2(psync_db, sql, -1, &stmt, NULL);
+  db=psync_sql_read_lock(&rd, sql);
+  code=sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
   if (unlikely(code!=SQLITE_OK)){
-    psync_sql_unlock();
-    debug(D_ERROR, "error running sql statement: %s: %s", sql, sqlite3_errmsg(psync_db));
+    debug(D_ERROR, "error running sql statement: %s: %s", sql, sqlite3_errmsg(db));
+    psync_sql_read_unlock(rd);
     return NULL;
   }
   cnt=sqlite3_column_count(stmt);
-  code=sqlite3_step(stmt);
+  code=psync_sql_step_once(stmt, sql);
   if (code==SQLITE_ROW){
     char **arr, *nstr, *str;
     size_t l, ln;
@@ -515,31 +937,33 @@ char **psync_sql_rowstr(const char *sql){
         arr[i]=NULL;
     }
     sqlite3_finalize(stmt);
-    psync_sql_unlock();
+    psync_sql_read_unlock(rd);
     return arr;
   }
   else {
     sqlite3_finalize(stmt);
-    psync_sql_unlock();
     if (unlikely(code!=SQLITE_DONE))
-      debug(D_ERROR, "sqlite3_step returned error: %s: %s", sql, sqlite3_errmsg(psync_db));
+      debug(D_ERROR, "sqlite3_step returned error: %s: %s", sql, sqlite3_errmsg(db));
+    psync_sql_read_unlock(rd);
     return NULL;
   }
 }
 
 psync_variant *psync_sql_row(const char *sql){
+  psync_sql_reader_t *rd;
   sqlite3_stmt *stmt;
+  sqlite3 *db;
   int code, cnt;
   psync_sql_check_query_plan(sql);
-  psync_sql_lock();
-  code=sqlite3_prepare_v2(psync_db, sql, -1, &stmt, NULL);
+  db=psync_sql_read_lock(&rd, sql);
+  code=sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
   if (unlikely(code!=SQLITE_OK)){
-    psync_sql_unlock();
-    debug(D_ERROR, "error running sql statement: %s: %s", sql, sqlite3_errmsg(psync_db));
+    debug(D_ERROR, "error running sql statement: %s: %s", sql, sqlite3_errmsg(db));
+    psync_sql_read_unlock(rd);
     return NULL;
   }
   cnt=sqlite3_column_count(stmt);
-  code=sqlite3_step(stmt);
+  code=psync_sql_step_once(stmt, sql);
   if (code==SQLITE_ROW){
     psync_variant *arr;
     char *nstr, *str;
@@ -583,77 +1007,85 @@ psync_variant *psync_sql_row(const char *sql){
       }
     }
     sqlite3_finalize(stmt);
-    psync_sql_unlock();
+    psync_sql_read_unlock(rd);
     return arr;
   }
   else {
     sqlite3_finalize(stmt);
-    psync_sql_unlock();
     if (unlikely(code!=SQLITE_DONE))
-      debug(D_ERROR, "sqlite3_step returned error: %s: %s", sql, sqlite3_errmsg(psync_db));
+      debug(D_ERROR, "sqlite3_step returned error: %s: %s", sql, sqlite3_errmsg(db));
+    psync_sql_read_unlock(rd);
     return NULL;
   }
 }
 
-psync_sql_res *psync_sql_query_nocache(const char *sql){
+static psync_sql_res *psync_sql_prepare_query(const char *sql, psync_sql_reader_t *rd, sqlite3 *db, uint32_t cached){
   sqlite3_stmt *stmt;
   psync_sql_res *res;
   int code, cnt;
-  psync_sql_check_query_plan(sql);
-  psync_sql_lock();
-  code=sqlite3_prepare_v2(psync_db, sql, -1, &stmt, NULL);
+  code=sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
   if (unlikely(code!=SQLITE_OK)){
-    psync_sql_unlock();
-    debug(D_ERROR, "error running sql statement: %s: %s", sql, sqlite3_errmsg(psync_db));
+    debug(D_ERROR, "error running sql statement: %s: %s", sql, sqlite3_errmsg(db));
+    psync_sql_read_unlock(rd);
     return NULL;
   }
   cnt=sqlite3_column_count(stmt);
   res=(psync_sql_res *)psync_malloc(sizeof(psync_sql_res)+cnt*sizeof(psync_variant));
   res->stmt=stmt;
   res->sql=sql;
+  res->reader=rd;
+  res->steptime=0;
+  res->steps=0;
+  res->rows=0;
+  res->cached=cached;
   res->column_count=cnt;
   return res;
 }
 
+psync_sql_res *psync_sql_query_nocache(const char *sql){
+  psync_sql_reader_t *rd;
+  sqlite3 *db;
+  psync_sql_check_query_plan(sql);
+  db=psync_sql_read_lock(&rd, sql);
+  return psync_sql_prepare_query(sql, rd, db, 0);
+}
+
 psync_sql_res *psync_sql_query(const char *sql){
+  psync_sql_reader_t *rd;
   psync_sql_res *ret;
-  ret=psync_cache_get(sql);
-  if (ret){
-//    debug(D_NOTICE, "got query %s from cache", sql);
-    psync_sql_lock();
+  sqlite3 *db;
+  db=psync_sql_read_lock(&rd, sql);
+  ret=psync_sql_stmt_cache_get(rd?&rd->stmts:&psync_db_stmts, sql);
+  if (ret)
     return ret;
-  }
-  else
-    return psync_sql_query_nocache(sql);
-}
-
-static void psync_sql_free_cache(void *ptr){
-  psync_sql_res *res=(psync_sql_res *)ptr;
-  sqlite3_finalize(res->stmt);
-  psync_free(res);
+  psync_sql_check_query_plan(sql);
+  return psync_sql_prepare_query(sql, rd, db, 1);
 }
 
 void psync_sql_free_result(psync_sql_res *res){
-  int code=sqlite3_reset(res->stmt);
-  psync_sql_unlock();
+  psync_sql_reader_t *rd;
+  int code;
+  psync_sql_profile_res(res);
+  code=sqlite3_reset(res->stmt);
+  rd=res->reader;
   if (code==SQLITE_OK)
-    psync_cache_add(res->sql, res, PSYNC_QUERY_CACHE_SEC, psync_sql_free_cache, PSYNC_QUERY_MAX_CNT);
+    psync_sql_stmt_cache_add(rd?&rd->stmts:&psync_db_stmts, res);
   else
     psync_sql_free_cache(res);
+  psync_sql_read_unlock(rd);
 }
 
 void psync_sql_free_result_nocache(psync_sql_res *res){
+  psync_sql_profile_res(res);
   sqlite3_finalize(res->stmt);
-  psync_sql_unlock();
+  psync_sql_read_unlock(res->reader);
   psync_free(res);
 }
 
-psync_sql_res *psync_sql_prep_statement_nocache(const char *sql){
+static psync_sql_res *psync_sql_prepare_statement(const char *sql, uint32_t cached){
   sqlite3_stmt *stmt;
   psync_sql_res *res;
   int code;
-  psync_sql_check_query_plan(sql);
-  psync_sql_lock();
   code=sqlite3_prepare_v2(psync_db, sql, -1, &stmt, NULL);
   if (unlikely(code!=SQLITE_OK)){
     psync_sql_unlock();
@@ -663,103 +1095,114 @@ psync_sql_res *psync_sql_prep_statement_nocache(const char *sql){
   res=psync_new(psync_sql_res);
   res->stmt=stmt;
   res->sql=sql;
+  res->reader=NULL;
+  res->steptime=0;
+  res->steps=0;
+  res->rows=0;
+  res->cached=cached;
   return res;
 }
 
+psync_sql_res *psync_sql_prep_statement_nocache(const char *sql){
+  psync_sql_check_query_plan(sql);
+  psync_sql_do_lock(sql, NULL, 0);
+  return psync_sql_prepare_statement(sql, 0);
+}
+
 psync_sql_res *psync_sql_prep_statement(const char *sql){
   psync_sql_res *ret;
-  ret=psync_cache_get(sql);
-  if (ret){
-//    debug(D_NOTICE, "got statement %s from cache", sql);
-    psync_sql_lock();
+  psync_sql_do_lock(sql, NULL, 0);
+  ret=psync_sql_stmt_cache_get(&psync_db_stmts, sql);
+  if (ret)
     return ret;
-  }
-  else
-    return psync_sql_prep_statement_nocache(sql);
+  psync_sql_check_query_plan(sql);
+  return psync_sql_prepare_statement(sql, 1);
 }
 
 void psync_sql_reset(psync_sql_res *res){
-  int code=sqlite3_reset(res->stmt);
+  int code;
+  psync_sql_profile_res(res);
+  code=sqlite3_reset(res->stmt);
   if (unlikely(code!=SQLITE_OK))
-    debug(D_ERROR, "sqlite3_reset returned error: %s", sqlite3_errmsg(psync_db));
+    debug(D_ERROR, "sqlite3_reset returned error: %s", sqlite3_errmsg(sqlite3_db_handle(res->stmt)));
 }
 
 void psync_sql_run(psync_sql_res *res){
-  int code=sqlite3_step(res->stmt);
+  int code=psync_sql_step(res);
   if (unlikely(code!=SQLITE_DONE))
-    debug(D_ERROR, "sqlite3_step returned error: %s: %s", sqlite3_errmsg(psync_db), res->sql);
+    debug(D_ERROR, "sqlite3_step returned error: %s: %s", sqlite3_errmsg(sqlite3_db_handle(res->stmt)), res->sql);
   code=sqlite3_reset(res->stmt);
   if (unlikely(code!=SQLITE_OK))
-    debug(D_ERROR, "sqlite3_reset returned error: %s", sqlite3_errmsg(psync_db));
+    debug(D_ERROR, "sqlite3_reset returned error: %s", sqlite3_errmsg(sqlite3_db_handle(res->stmt)));
 }
 
 void psync_sql_run_free_nocache(psync_sql_res *res){
-  int code=sqlite3_step(res->stmt);
+  int code=psync_sql_step(res);
   if (unlikely(code!=SQLITE_DONE))
-    debug(D_ERROR, "sqlite3_step returned error: %s: %s", sqlite3_errmsg(psync_db), res->sql);
+    debug(D_ERROR, "sqlite3_step returned error: %s: %s", sqlite3_errmsg(sqlite3_db_handle(res->stmt)), res->sql);
   sqlite3_finalize(res->stmt);
   psync_sql_unlock();
   psync_free(res);
 }
 
 void psync_sql_run_free(psync_sql_res *res){
-  int code=sqlite3_step(res->stmt);
+  int code=psync_sql_step(res);
   if (unlikely(code!=SQLITE_DONE || (code=sqlite3_reset(res->stmt))!=SQLITE_OK)){
-    debug(D_ERROR, "sqlite3_step returned error: %s: %s", sqlite3_errmsg(psync_db), res->sql);
+    debug(D_ERROR, "sqlite3_step returned error: %s: %s", sqlite3_errmsg(sqlite3_db_handle(res->stmt)), res->sql);
     sqlite3_finalize(res->stmt);
     psync_sql_unlock();
     psync_free(res);
   }
   else{
+    psync_sql_stmt_cache_add(&psync_db_stmts, res);
     psync_sql_unlock();
-    psync_cache_add(res->sql, res, PSYNC_QUERY_CACHE_SEC, psync_sql_free_cache, PSYNC_QUERY_MAX_CNT);
   }
 }
 
 void psync_sql_bind_int(psync_sql_res *res, int n, int64_t val){
   int code=sqlite3_bind_int64(res->stmt, n, val);
   if (unlikely(code!=SQLITE_OK))
-    debug(D_ERROR, "error binding value: %s", sqlite3_errmsg(psync_db));
+    debug(D_ERROR, "error binding value: %s", sqlite3_errmsg(sqlite3_db_handle(res->stmt)));
 }
 
 void psync_sql_bind_uint(psync_sql_res *res, int n, uint64_t val){
   int code=sqlite3_bind_int64(res->stmt, n, val);
   if (unlikely(code!=SQLITE_OK))
-    debug(D_ERROR, "error binding value: %s", sqlite3_errmsg(psync_db));
+    debug(D_ERROR, "error binding value: %s", sqlite3_errmsg(sqlite3_db_handle(res->stmt)));
 }
 
 void psync_sql_bind_double(psync_sql_res *res, int n, double val){
   int code=sqlite3_bind_double(res->stmt, n, val);
   if (unlikely(code!=SQLITE_OK))
-    debug(D_ERROR, "error binding value: %s", sqlite3_errmsg(psync_db));
+    debug(D_ERROR, "error binding value: %s", sqlite3_errmsg(sqlite3_db_handle(res->stmt)));
 }
 
 void psync_sql_bind_string(psync_sql_res *res, int n, const char *str){
   int code=sqlite3_bind_text(res->stmt, n, str, -1, SQLITE_STATIC);
   if (unlikely(code!=SQLITE_OK))
-    debug(D_ERROR, "error binding value: %s", sqlite3_errmsg(psync_db));}
+    debug(D_ERROR, "error binding value: %s", sqlite3_errmsg(sqlite3_db_handle(res->stmt)));}
 
 void psync_sql_bind_lstring(psync_sql_res *res, int n, const char *str, size_t len){
   int code=sqlite3_bind_text(res->stmt, n, str, len, SQLITE_STATIC);
   if (unlikely(code!=SQLITE_OK))
-    debug(D_ERROR, "error binding value: %s", sqlite3_errmsg(psync_db));
+    debug(D_ERROR, "error binding value: %s", sqlite3_errmsg(sqlite3_db_handle(res->stmt)));
 }
 
 void psync_sql_bind_blob(psync_sql_res *res, int n, const char *str, size_t len){
   int code=sqlite3_bind_blob(res->stmt, n, str, len, SQLITE_STATIC);
   if (unlikely(code!=SQLITE_OK))
-    debug(D_ERROR, "error binding value: %s", sqlite3_errmsg(psync_db));
+    debug(D_ERROR, "error binding value: %s", sqlite3_errmsg(sqlite3_db_handle(res->stmt)));
 }
 
 void psync_sql_bind_null(psync_sql_res *res, int n){
   int code=sqlite3_bind_null(res->stmt, n);
   if (unlikely(code!=SQLITE_OK))
-    debug(D_ERROR, "error binding value: %s", sqlite3_errmsg(psync_db));
+    debug(D_ERROR, "error binding value: %s", sqlite3_errmsg(sqlite3_db_handle(res->stmt)));
 }
 
 psync_variant_row psync_sql_fetch_row(psync_sql_res *res){
   int code, i;
-  code=sqlite3_step(res->stmt);
+  code=psync_sql_step(res);
   if (code==SQLITE_ROW){
     for (i=0; i<res->column_count; i++){
       code=sqlite3_column_type(res->stmt, i);
@@ -783,7 +1226,7 @@ psync_variant_row psync_sql_fetch_row(psync_sql_res *res){
   }
   else {
     if (unlikely(code!=SQLITE_DONE))
-      debug(D_ERROR, "sqlite3_step returned error: %s", sqlite3_errmsg(psync_db));
+      debug(D_ERROR, "sqlite3_step returned error: %s", sqlite3_errmsg(sqlite3_db_handle(res->stmt)));
     return NULL;
   }
 }
@@ -791,7 +1234,7 @@ psync_variant_row psync_sql_fetch_row(psync_sql_res *res){
 psync_str_row psync_sql_fetch_rowstr(psync_sql_res *res){
   int code, i;
   const char **strs;
-  code=sqlite3_step(res->stmt);
+  code=psync_sql_step(res);
   if (code==SQLITE_ROW){
     strs=(const char **)res->row;
     for (i=0; i<res->column_count; i++)
@@ -800,7 +1243,7 @@ psync_str_row psync_sql_fetch_rowstr(psync_sql_res *res){
   }
   else {
     if (unlikely(code!=SQLITE_DONE))
-      debug(D_ERROR, "sqlite3_step returned error: %s", sqlite3_errmsg(psync_db));
+      debug(D_ERROR, "sqlite3_step returned error: %s", sqlite3_errmsg(sqlite3_db_handle(res->stmt)));
     return NULL;
   }
 }
@@ -808,7 +1251,7 @@ psync_str_row psync_sql_fetch_rowstr(psync_sql_res *res){
 const uint64_t *psync_sql_fetch_rowint(psync_sql_res *res){
   int code, i;
   uint64_t *ret;
-  code=sqlite3_step(res->stmt);
+  code=psync_sql_step(res);
   if (code==SQLITE_ROW){
     ret=(uint64_t *)res->row;
     for (i=0; i<res->column_count; i++)
@@ -817,7 +1260,7 @@ const uint64_t *psync_sql_fetch_rowint(psync_sql_res *res){
   }
   else {
     if (unlikely(code!=SQLITE_DONE))
-      debug(D_ERROR, "sqlite3_step returned error: %s", sqlite3_errmsg(psync_db));
+      debug(D_ERROR, "sqlite3_step returned error: %s", sqlite3_errmsg(sqlite3_db_handle(res->stmt)));
     return NULL;
   }
 }
@@ -832,7 +1275,7 @@ psync_full_result_int *psync_sql_fetchall_int(psync_sql_res *res){
   off=0;
   all=0;
   data=NULL;
-  while ((code=sqlite3_step(res->stmt))==SQLITE_ROW){
+  while ((code=psync_sql_step(res))==SQLITE_ROW){
     if (rows>=all){
       all=10+all*2;
       data=(uint64_t *)psync_realloc(data, sizeof(uint64_t)*cols*all);
@@ -843,7 +1286,7 @@ psync_full_result_int *psync_sql_fetchall_int(psync_sql_res *res){
     rows++;
   }
   if (unlikely(code!=SQLITE_DONE))
-    debug(D_ERROR, "sqlite3_step returned error: %s", sqlite3_errmsg(psync_db));
+    debug(D_ERROR, "sqlite3_step returned error: %s", sqlite3_errmsg(sqlite3_db_handle(res->stmt)));
   psync_sql_free_result(res);
   ret=(psync_full_result_int *)psync_malloc(offsetof(psync_full_result_int, data)+sizeof(uint64_t)*off);
   ret->rows=rows;
@@ -861,6 +1304,210 @@ uint64_t psync_sql_insertid(){
   return sqlite3_last_insert_rowid(psync_db);
 }
 
+/* statements of readers in use are not counted until they are released */
+void psync_sql_statement_stats(uint64_t *prepared, uint64_t *reused){
+  pthread_mutex_lock(&psync_db_readers_mutex);
+  *prepared=psync_db_readers_prepared;
+  *reused=psync_db_readers_reused;
+  pthread_mutex_unlock(&psync_db_readers_mutex);
+  psync_sql_lock();
+  *prepared+=psync_db_stmts.prepared;
+  *reused+=psync_db_stmts.reused;
+  psync_sql_unlock();
+}
+
+static int psync_sql_stmt_profile_cmp(const void *p1, const void *p2){
+  const psync_sql_stmt_profile_t *s1=(const psync_sql_stmt_profile_t *)p1, *s2=(const psync_sql_stmt_profile_t *)p2;
+  if (s1->totalusec>s2->totalusec)
+    return -1;
+  else if (s1->totalusec<s2->totalusec)
+    return 1;
+  else
+    return 0;
+}
+
+static int psync_sql_lock_profile_cmp(const void *p1, const void *p2){
+  const psync_sql_lock_profile_t *l1=(const psync_sql_lock_profile_t *)p1, *l2=(const psync_sql_lock_profile_t *)p2;
+  if (l1->holdusec>l2->holdusec)
+    return -1;
+  else if (l1->holdusec<l2->holdusec)
+    return 1;
+  else
+    return 0;
+}
+
+static int psync_sql_profile_stmt_sql_cmp(const void *p1, const void *p2){
+  const psync_sql_profile_stmt_t *s1=(const psync_sql_profile_stmt_t *)p1, *s2=(const psync_sql_profile_stmt_t *)p2;
+  return strcmp(s1->text, s2->text);
+}
+
+/* copies the statements of all tables to a single array, with the counts of the same sql text summed, whether it was run on more
+ * than one connection or both from the statement cache and as generated sql */
+static psync_sql_profile_stmt_t *psync_sql_profile_merge_stmts(uint32_t *cnt, uint64_t *dropped){
+  psync_sql_profile_table_t *pt;
+  psync_sql_profile_stmt_t *stmts;
+  uint32_t i, j, n, b;
+  stmts=psync_new_cnt(psync_sql_profile_stmt_t, PSYNC_SQL_PROFILE_STATEMENTS*(PSYNC_DB_READERS+1));
+  n=0;
+  for (i=0; i<PSYNC_DB_READERS+1; i++){
+    pt=&psync_sql_profile_tables[i];
+    pthread_mutex_lock(&pt->mutex);
+    for (j=0; j<PSYNC_SQL_PROFILE_STATEMENTS; j++)
+      if (pt->stmts[j].text)
+        stmts[n++]=pt->stmts[j];
+    *dropped+=pt->dropped;
+    pthread_mutex_unlock(&pt->mutex);
+  }
+  qsort(stmts, n, sizeof(psync_sql_profile_stmt_t), psync_sql_profile_stmt_sql_cmp);
+  j=0;
+  for (i=0; i<n; i++)
+    if (j && !strcmp(stmts[j-1].text, stmts[i].text)){
+      stmts[j-1].executions+=stmts[i].executions;
+      stmts[j-1].rows+=stmts[i].rows;
+      stmts[j-1].usec+=stmts[i].usec;
+      for (b=0; b<PSYNC_SQL_PROFILE_BUCKETS; b++)
+        stmts[j-1].hist[b]+=stmts[i].hist[b];
+    }
+    else
+      stmts[j++]=stmts[i];
+  *cnt=j;
+  return stmts;
+}
+
+psync_sql_profile_t *psync_sql_get_profile(){
+  psync_sql_profile_t *ret;
+  psync_sql_profile_stmt_t *stmts, *ps;
+  psync_sql_profile_site_t *sites, *pl;
+  psync_sql_stmt_profile_t *st;
+  psync_sql_lock_profile_t *lk;
+  char *str;
+  size_t len;
+  uint64_t dropped;
+  uint32_t i, stmtcnt, sitecnt;
+  dropped=0;
+  stmts=psync_sql_profile_merge_stmts(&stmtcnt, &dropped);
+  sites=psync_new_cnt(psync_sql_profile_site_t, PSYNC_SQL_PROFILE_SITES+PSYNC_SQL_PROFILE_STATEMENTS);
+  sitecnt=0;
+  psync_sql_lock();
+  for (i=0; i<PSYNC_SQL_PROFILE_SITES; i++)
+    if (psync_sql_profile_sites[i].file)
+      sites[sitecnt++]=psync_sql_profile_sites[i];
+  for (i=0; i<PSYNC_SQL_PROFILE_STATEMENTS; i++)
+    if (psync_sql_profile_stmt_sites[i].file)
+      sites[sitecnt++]=psync_sql_profile_stmt_sites[i];
+  dropped+=psync_sql_profile_sites_dropped;
+  psync_sql_unlock();
+  len=0;
+  for (i=0; i<stmtcnt; i++)
+    len+=strlen(stmts[i].text)+1;
+  for (i=0; i<sitecnt; i++){
+    len+=strlen(sites[i].file)+1;
+    if (sites[i].line)
+      len+=strlen(sites[i].function)+16;
+  }
+  ret=(psync_sql_profile_t *)psync_malloc(sizeof(psync_sql_profile_t)+sizeof(psync_sql_stmt_profile_t)*stmtcnt+
+                                          sizeof(psync_sql_lock_profile_t)*sitecnt+len);
+  ret->dropped=dropped;
+  ret->stmtcnt=stmtcnt;
+  ret->lockcnt=sitecnt;
+  ret->stmts=(psync_sql_stmt_profile_t *)(ret+1);
+  ret->locks=(psync_sql_lock_profile_t *)(ret->stmts+ret->stmtcnt);
+  str=(char *)(ret->locks+ret->lockcnt);
+  st=ret->stmts;
+  for (i=0; i<stmtcnt; i++){
+    ps=&stmts[i];
+    len=strlen(ps->text)+1;
+    memcpy(str, ps->text, len);
+    st->sql=str;
+    str+=len;
+    st->executions=ps->executions;
+    st->rows=ps->rows;
+    st->totalusec=ps->usec;
+    st->p99usec=psync_sql_profile_hist_p99(ps->hist, ps->executions);
+    st++;
+  }
+  lk=ret->locks;
+  for (i=0; i<sitecnt; i++){
+    pl=&sites[i];
+    if (pl->line)
+      len=sprintf(str, "%s:%u (%s)", pl->file, pl->line, pl->function)+1;
+    else{
+      len=strlen(pl->file)+1;
+      memcpy(str, pl->file, len);
+    }
+    lk->site=str;
+    str+=len;
+    lk->waits=pl->waits;
+    lk->waitusec=pl->waitusec;
+    lk->holds=pl->holds;
+    lk->holdusec=pl->holdusec;
+    lk->p99waitusec=pl->waits?psync_sql_profile_hist_p99(pl->waithist, pl->waits):0;
+    lk->p99holdusec=pl->holds?psync_sql_profile_hist_p99(pl->holdhist, pl->holds):0;
+    memcpy(lk->waithist, pl->waithist, sizeof(lk->waithist));
+    memcpy(lk->holdhist, pl->holdhist, sizeof(lk->holdhist));
+    lk++;
+  }
+  psync_free(stmts);
+  psync_free(sites);
+  qsort(ret->stmts, ret->stmtcnt, sizeof(psync_sql_stmt_profile_t), psync_sql_stmt_profile_cmp);
+  qsort(ret->locks, ret->lockcnt, sizeof(psync_sql_lock_profile_t), psync_sql_lock_profile_cmp);
+  psync_sql_statement_stats(&ret->prepared, &ret->reused);
+  return ret;
+}
+
+static int psync_sql_profile_write(psync_file_t fd, const char *str, size_t len){
+  return psync_file_write(fd, str, len)!=(ssize_t)len;
+}
+
+int psync_sql_dump_profile(const char *path){
+  psync_sql_profile_t *pr;
+  psync_file_t fd;
+  char buff[512];
+  size_t i, len;
+  uint32_t b;
+  int err;
+  fd=psync_file_open(path, P_O_WRONLY, P_O_CREAT|P_O_TRUNC);
+  if (unlikely(fd==INVALID_HANDLE_VALUE)){
+    debug(D_WARNING, "could not open %s for writing", path);
+    return -1;
+  }
+  pr=psync_sql_get_profile();
+  len=sprintf(buff, "statements: %lu prepared, %lu reused, %lu samples dropped\nexecutions rows total_usec p99_usec sql\n",
+              (unsigned long)pr->prepared, (unsigned long)pr->reused, (unsigned long)pr->dropped);
+  err=psync_sql_profile_write(fd, buff, len);
+  for (i=0; i<pr->stmtcnt && !err; i++){
+    len=sprintf(buff, "%lu %lu %lu %lu ", (unsigned long)pr->stmts[i].executions, (unsigned long)pr->stmts[i].rows,
+                (unsigned long)pr->stmts[i].totalusec, (unsigned long)pr->stmts[i].p99usec);
+    err=psync_sql_profile_write(fd, buff, len) || psync_sql_profile_write(fd, pr->stmts[i].sql, strlen(pr->stmts[i].sql)) ||
+        psync_sql_profile_write(fd, "\n", 1);
+  }
+  if (!err){
+    len=sprintf(buff, "\nlock sites\nwaits wait_usec p99_wait_usec holds hold_usec p99_hold_usec site\n");
+    err=psync_sql_profile_write(fd, buff, len);
+  }
+  for (i=0; i<pr->lockcnt && !err; i++){
+    len=sprintf(buff, "%lu %lu %lu %lu %lu %lu ", (unsigned long)pr->locks[i].waits, (unsigned long)pr->locks[i].waitusec,
+                (unsigned long)pr->locks[i].p99waitusec, (unsigned long)pr->locks[i].holds, (unsigned long)pr->locks[i].holdusec,
+                (unsigned long)pr->locks[i].p99holdusec);
+    err=psync_sql_profile_write(fd, buff, len) || psync_sql_profile_write(fd, pr->locks[i].site, strlen(pr->locks[i].site)) ||
+        psync_sql_profile_write(fd, "\n", 1);
+    len=sprintf(buff, "  wait histogram:");
+    for (b=0; b<PSYNC_SQL_PROFILE_BUCKETS; b++)
+      len+=sprintf(buff+len, " %u", (unsigned)pr->locks[i].waithist[b]);
+    len+=sprintf(buff+len, "\n  hold histogram:");
+    for (b=0; b<PSYNC_SQL_PROFILE_BUCKETS; b++)
+      len+=sprintf(buff+len, " %u", (unsigned)pr->locks[i].holdhist[b]);
+    buff[len++]='\n';
+    err=err || psync_sql_profile_write(fd, buff, len);
+  }
+  psync_free(pr);
+  if (unlikely(psync_file_close(fd)) || unlikely(err)){
+    debug(D_WARNING, "error writing sql profile to %s", path);
+    return -1;
+  }
+  return 0;
+}
+
 int psync_rename_conflicted_file(const char *path){
   char *npath;
   size_t plen, dotidx;
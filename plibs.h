@@ -118,9 +118,17 @@ typedef struct {
   };
 } psync_variant;
 
+struct psync_sql_reader_t_;
+
 typedef struct {
   sqlite3_stmt *stmt;
   const char *sql;
+  struct psync_sql_reader_t_ *reader;
+  uint64_t steptime;
+  uint32_t steps;
+  uint32_t rows;
+  /* sql is a constant kept in the statement cache, otherwise the profiler takes the text from stmt */
+  uint32_t cached;
   int column_count;
   psync_variant row[];
 } psync_sql_res;
@@ -164,11 +172,16 @@ char *psync_strcat(const char *str, ...) PSYNC_MALLOC PSYNC_SENTINEL;
 int psync_sql_connect(const char *db) PSYNC_NONNULL(1);
 void psync_sql_close();
 int psync_sql_reopen(const char *path);
-int psync_sql_trylock();
-void psync_sql_lock();
+/* the place in the code that takes the database lock is recorded by the sql profiler */
+#define psync_sql_trylock() psync_sql_do_trylock(__FILE__, __FUNCTION__, __LINE__)
+#define psync_sql_lock() psync_sql_do_lock(__FILE__, __FUNCTION__, __LINE__)
+#define psync_sql_start_transaction() psync_sql_do_start_transaction(__FILE__, __FUNCTION__, __LINE__)
+
+int psync_sql_do_trylock(const char *file, const char *function, unsigned line);
+void psync_sql_do_lock(const char *file, const char *function, unsigned line);
 void psync_sql_unlock();
 int psync_sql_sync();
-int psync_sql_start_transaction();
+int psync_sql_do_start_transaction(const char *file, const char *function, unsigned line);
 int psync_sql_commit_transaction();
 int psync_sql_rollback_transaction();
 
@@ -177,6 +190,8 @@ char *psync_sql_cellstr(const char *sql) PSYNC_NONNULL(1);
 int64_t psync_sql_cellint(const char *sql, int64_t dflt) PSYNC_NONNULL(1);
 char **psync_sql_rowstr(const char *sql) PSYNC_NONNULL(1);
 psync_variant *psync_sql_row(const char *sql) PSYNC_NONNULL(1);
+/* psync_sql_query() and psync_sql_prep_statement() cache the statement by the address of sql, so it is to be a string constant,
+ * generated sql should go to the _nocache versions and their results freed with the _nocache functions */
 psync_sql_res *psync_sql_query(const char *sql) PSYNC_NONNULL(1);
 psync_sql_res *psync_sql_query_nocache(const char *sql) PSYNC_NONNULL(1);
 psync_sql_res *psync_sql_prep_statement(const char *sql) PSYNC_NONNULL(1);
@@ -200,6 +215,9 @@ psync_uint_row psync_sql_fetch_rowint(psync_sql_res *res) PSYNC_NONNULL(1);
 psync_full_result_int *psync_sql_fetchall_int(psync_sql_res *res) PSYNC_NONNULL(1);
 uint32_t psync_sql_affected_rows() PSYNC_PURE;
 uint64_t psync_sql_insertid() PSYNC_PURE;
+void psync_sql_statement_stats(uint64_t *prepared, uint64_t *reused);
+psync_sql_profile_t *psync_sql_get_profile();
+int psync_sql_dump_profile(const char *path);
 
 int psync_rename_conflicted_file(const char *path);
 
@@ -38,6 +38,8 @@
 #include "papi.h"
 #include "pcache.h"
 #include "ptree.h"
+#include "pfolder.h"
+#include "ptasks.h"
 
 #define API_CACHE_KEY "ApiConn"
 
@@ -61,6 +63,8 @@ typedef struct {
 
 typedef struct {
   psync_uint_t elementcnt;
+  uint32_t *filter;
+  uint32_t filtershift;
   uint32_t elements[];
 } psync_file_checksum_hash;
 
@@ -222,14 +226,10 @@ int psync_handle_api_result(uint64_t result){
     return PSYNC_NET_TEMPFAIL;
 }
 
-int psync_get_remote_file_checksum(psync_fileid_t fileid, unsigned char *hexsum, uint64_t *fsize, uint64_t *hash){
-  psync_socket *api;
-  binresult *res;
-  const binresult *meta, *checksum;
+/* returns 1 and fills the arguments if the checksum of the current version of fileid is known locally */
+int psync_get_cached_remote_file_checksum(psync_fileid_t fileid, unsigned char *hexsum, uint64_t *fsize, uint64_t *hash){
   psync_sql_res *sres;
   psync_variant_row row;
-  uint64_t result, h;
-  binparam params[]={P_STR("auth", psync_my_auth), P_NUM("fileid", fileid)};
   sres=psync_sql_query("SELECT h.checksum, f.size, f.hash FROM hashchecksum h, file f WHERE f.id=? AND f.hash=h.hash AND f.size=h.size");
   psync_sql_bind_uint(sres, 1, fileid);
   row=psync_sql_fetch_row(sres);
@@ -241,25 +241,20 @@ int psync_get_remote_file_checksum(psync_fileid_t fileid, unsigned char *hexsum,
     if (hash)
       *hash=psync_get_number(row[2]);
     psync_sql_free_result(sres);
-    return PSYNC_NET_OK;
+    return 1;
   }
   psync_sql_free_result(sres);
-  api=psync_apipool_get();
-  if (unlikely(!api))
-    return PSYNC_NET_TEMPFAIL;
-  res=send_command(api, "checksumfile", params);
-  if (res)
-    psync_apipool_release(api);
-  else
-    psync_apipool_release_bad(api);
-  if (unlikely_log(!res)){
-    psync_timer_notify_exception();
-    return PSYNC_NET_TEMPFAIL;
-  }
+  return 0;
+}
+
+/* processes the result of a checksumfile command, for callers that send it themselves */
+int psync_remote_file_checksum_result(const binresult *res, unsigned char *hexsum, uint64_t *fsize, uint64_t *hash){
+  const binresult *meta, *checksum;
+  psync_sql_res *sres;
+  uint64_t result, h;
   result=psync_find_result(res, "result", PARAM_NUM)->num;
   if (result){
     debug(D_ERROR, "checksumfile returned error %lu", (unsigned long)result);
-    psync_free(res);
     return psync_handle_api_result(result);
   }
   meta=psync_find_result(res, "metadata", PARAM_HASH);
@@ -276,108 +271,324 @@ int psync_get_remote_file_checksum(psync_fileid_t fileid, unsigned char *hexsum,
   psync_sql_bind_lstring(sres, 3, checksum->str, checksum->length);
   psync_sql_run_free(sres);
   memcpy(hexsum, checksum->str, checksum->length);
-  psync_free(res);
   return PSYNC_NET_OK;
 }
 
-int psync_get_local_file_checksum(const char *restrict filename, unsigned char *restrict hexsum, uint64_t *restrict fsize){
-  psync_stat_t st;
+int psync_get_remote_file_checksum(psync_fileid_t fileid, unsigned char *hexsum, uint64_t *fsize, uint64_t *hash){
+  psync_socket *api;
+  binresult *res;
+  int ret;
+  binparam params[]={P_STR("auth", psync_my_auth), P_NUM("fileid", fileid)};
+  if (psync_get_cached_remote_file_checksum(fileid, hexsum, fsize, hash))
+    return PSYNC_NET_OK;
+  api=psync_apipool_get();
+  if (unlikely(!api))
+    return PSYNC_NET_TEMPFAIL;
+  res=send_command(api, "checksumfile", params);
+  if (res)
+    psync_apipool_release(api);
+  else
+    psync_apipool_release_bad(api);
+  if (unlikely_log(!res)){
+    psync_timer_notify_exception();
+    return PSYNC_NET_TEMPFAIL;
+  }
+  ret=psync_remote_file_checksum_result(res, hexsum, fsize, hash);
+  psync_free(res);
+  return ret;
+}
+
+/* Files of at least PSYNC_HASH_PIPELINE_MIN_SIZE are hashed with a reader thread that fills one of two buffers while the
+ * calling thread hashes the other, so that disk reads and hashing overlap. The number of such pipelines is limited to
+ * PSYNC_HASH_MAX_PIPELINES, above that (and for smaller files) files are hashed inline.
+ */
+
+#define HASH_PIPELINE_BUFFERS 2
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  uint64_t offset;
+  uint64_t remaining;
+  psync_file_t fd;
+  uint32_t readidx;
+  uint32_t hashidx;
+  uint32_t refcnt;
+  int error;
+  size_t len[HASH_PIPELINE_BUFFERS];
+  unsigned char *buff[HASH_PIPELINE_BUFFERS];
+} psync_hash_pipeline_t;
+
+typedef struct {
   psync_hash_ctx hctx;
-  uint64_t rsz;
-  void *buff;
+  psync_hash_ctx hctxp;
+  uint64_t pfsize;
+  int part;
+} psync_file_hasher_t;
+
+static pthread_mutex_t hash_pipelines_mutex=PTHREAD_MUTEX_INITIALIZER;
+static uint32_t hash_pipelines=0;
+
+static void psync_file_hasher_update(psync_file_hasher_t *h, const unsigned char *buff, size_t len){
+  psync_hash_update(&h->hctx, buff, len);
+  if (h->part && h->pfsize){
+    if (h->pfsize<len){
+      psync_hash_update(&h->hctxp, buff, h->pfsize);
+      h->pfsize=0;
+    }
+    else{
+      psync_hash_update(&h->hctxp, buff, len);
+      h->pfsize-=len;
+    }
+  }
+}
+
+static void psync_hash_pipeline_release(psync_hash_pipeline_t *pl){
+  uint32_t i, refcnt;
+  pthread_mutex_lock(&pl->mutex);
+  refcnt=--pl->refcnt;
+  pthread_mutex_unlock(&pl->mutex);
+  if (refcnt)
+    return;
+  for (i=0; i<HASH_PIPELINE_BUFFERS; i++)
+    psync_free(pl->buff[i]);
+  pthread_cond_destroy(&pl->cond);
+  pthread_mutex_destroy(&pl->mutex);
+  psync_free(pl);
+  pthread_mutex_lock(&hash_pipelines_mutex);
+  hash_pipelines--;
+  pthread_mutex_unlock(&hash_pipelines_mutex);
+}
+
+static void psync_hash_pipeline_reader(void *ptr){
+  psync_hash_pipeline_t *pl;
   size_t rs;
   ssize_t rrs;
-  psync_file_t fd;
-  unsigned char hashbin[PSYNC_HASH_DIGEST_LEN];
-  fd=psync_file_open(filename, P_O_RDONLY, 0);
-  if (fd==INVALID_HANDLE_VALUE)
-    return PSYNC_NET_PERMFAIL;
-  if (unlikely_log(psync_fstat(fd, &st)))
-    goto err1;
-  buff=psync_malloc(PSYNC_COPY_BUFFER_SIZE);
-  psync_hash_init(&hctx);
-  rsz=psync_stat_size(&st);
-  while (rsz){
-    if (rsz>PSYNC_COPY_BUFFER_SIZE)
-      rs=PSYNC_COPY_BUFFER_SIZE;
+  uint32_t b;
+  pl=(psync_hash_pipeline_t *)ptr;
+  pthread_mutex_lock(&pl->mutex);
+  while (pl->remaining){
+    while (pl->readidx-pl->hashidx>=HASH_PIPELINE_BUFFERS)
+      pthread_cond_wait(&pl->cond, &pl->mutex);
+    b=pl->readidx%HASH_PIPELINE_BUFFERS;
+    if (pl->remaining>PSYNC_HASH_BUFFER_SIZE)
+      rs=PSYNC_HASH_BUFFER_SIZE;
     else
-      rs=rsz;
+      rs=pl->remaining;
+    pthread_mutex_unlock(&pl->mutex);
+    if (pl->remaining>rs)
+      psync_file_readahead(pl->fd, pl->offset+rs, PSYNC_HASH_BUFFER_SIZE);
+    rrs=psync_file_read(pl->fd, pl->buff[b], rs);
+    pthread_mutex_lock(&pl->mutex);
+    if (unlikely(rrs<=0)){
+      pl->error=1;
+      break;
+    }
+    pl->len[b]=rrs;
+    pl->offset+=rrs;
+    pl->remaining-=rrs;
+    pl->readidx++;
+    pthread_cond_signal(&pl->cond);
+  }
+  pthread_cond_signal(&pl->cond);
+  pthread_mutex_unlock(&pl->mutex);
+  psync_hash_pipeline_release(pl);
+}
+
+static int psync_hash_pipeline_start(psync_file_t fd, uint64_t size, psync_file_hasher_t *h){
+  psync_hash_pipeline_t *pl;
+  uint32_t b, i;
+  int ret;
+  pthread_mutex_lock(&hash_pipelines_mutex);
+  if (hash_pipelines>=PSYNC_HASH_MAX_PIPELINES){
+    pthread_mutex_unlock(&hash_pipelines_mutex);
+    return 1;
+  }
+  hash_pipelines++;
+  pthread_mutex_unlock(&hash_pipelines_mutex);
+  pl=psync_new(psync_hash_pipeline_t);
+  pthread_mutex_init(&pl->mutex, NULL);
+  pthread_cond_init(&pl->cond, NULL);
+  pl->offset=0;
+  pl->remaining=size;
+  pl->fd=fd;
+  pl->readidx=0;
+  pl->hashidx=0;
+  pl->refcnt=2;
+  pl->error=0;
+  for (i=0; i<HASH_PIPELINE_BUFFERS; i++)
+    pl->buff[i]=(unsigned char *)psync_malloc(PSYNC_HASH_BUFFER_SIZE);
+  psync_run_thread1("hash reader", psync_hash_pipeline_reader, pl);
+  pthread_mutex_lock(&pl->mutex);
+  while (1){
+    while (pl->readidx==pl->hashidx && pl->remaining && !pl->error)
+      pthread_cond_wait(&pl->cond, &pl->mutex);
+    if (pl->readidx==pl->hashidx)
+      break;
+    b=pl->hashidx%HASH_PIPELINE_BUFFERS;
+    pthread_mutex_unlock(&pl->mutex);
+    psync_file_hasher_update(h, pl->buff[b], pl->len[b]);
+    pthread_mutex_lock(&pl->mutex);
+    pl->hashidx++;
+    pthread_cond_signal(&pl->cond);
+  }
+  ret=pl->error?-1:0;
+  pthread_mutex_unlock(&pl->mutex);
+  psync_hash_pipeline_release(pl);
+  return ret;
+}
+
+static int psync_hash_file_inline(psync_file_t fd, uint64_t size, psync_file_hasher_t *h){
+  unsigned char *buff;
+  uint64_t off;
+  size_t rs;
+  ssize_t rrs;
+  if (size>PSYNC_HASH_BUFFER_SIZE)
+    rs=PSYNC_HASH_BUFFER_SIZE;
+  else
+    rs=PSYNC_COPY_BUFFER_SIZE;
+  buff=(unsigned char *)psync_malloc(rs);
+  off=0;
+  while (size){
+    if (size<rs)
+      rs=size;
+    else if (size>rs)
+      psync_file_readahead(fd, off+rs, rs);
     rrs=psync_file_read(fd, buff, rs);
-    if (rrs<=0)
-      goto err2;
-    psync_hash_update(&hctx, buff, rrs);
-    rsz-=rrs;
+    if (rrs<=0){
+      psync_free(buff);
+      return -1;
+    }
+    psync_file_hasher_update(h, buff, rrs);
+    off+=rrs;
+    size-=rrs;
     psync_yield_cpu();
   }
   psync_free(buff);
-  psync_file_close(fd);
-  psync_hash_final(hashbin, &hctx);
-  psync_binhex(hexsum, hashbin, PSYNC_HASH_DIGEST_LEN);
-  if (fsize)
-    *fsize=psync_stat_size(&st);
-  return PSYNC_NET_OK;
-err2:
-  psync_free(buff);
-err1:
-  psync_file_close(fd);
-  return PSYNC_NET_PERMFAIL;
+  return 0;
 }
 
-int psync_get_local_file_checksum_part(const char *restrict filename, unsigned char *restrict hexsum, uint64_t *restrict fsize,
-                                       unsigned char *restrict phexsum, uint64_t pfsize){
-  psync_stat_t st;
-  psync_hash_ctx hctx, hctxp;
-  uint64_t rsz;
-  void *buff;
-  size_t rs;
-  ssize_t rrs;
+/* Checksums of local files are cached in localhashcache keyed by device and inode and validated by size and native mtime.
+ * Files modified less than PSYNC_HASH_CACHE_MIN_AGE_SEC ago are not cached, as a write in the same mtime tick would go
+ * unnoticed. Rows not used for PSYNC_HASH_CACHE_MAX_UNUSED_SEC are pruned, lastuse is refreshed at most once every
+ * PSYNC_CHECKSUMS_PRUNE_INTERVAL to keep hits read-only.
+ */
+
+static void psync_hash_cache_touch(const psync_stat_t *st){
+  psync_sql_res *res;
+  res=psync_sql_prep_statement("UPDATE localhashcache SET lastuse=? WHERE device=? AND inode=?");
+  psync_sql_bind_uint(res, 1, psync_timer_time());
+  psync_sql_bind_uint(res, 2, psync_stat_device(st));
+  psync_sql_bind_uint(res, 3, psync_stat_inode(st));
+  psync_sql_run_free(res);
+}
+
+static int psync_hash_cache_get(const psync_stat_t *st, unsigned char *restrict hexsum, unsigned char *restrict phexsum, uint64_t pfsize){
+  psync_sql_res *res;
+  psync_variant_row row;
+  int ret;
+  res=psync_sql_query("SELECT checksum, partsize, partchecksum, lastuse FROM localhashcache WHERE device=? AND inode=? AND size=? AND mtimenative=?");
+  psync_sql_bind_uint(res, 1, psync_stat_device(st));
+  psync_sql_bind_uint(res, 2, psync_stat_inode(st));
+  psync_sql_bind_uint(res, 3, psync_stat_size(st));
+  psync_sql_bind_uint(res, 4, psync_stat_mtime_native(st));
+  ret=0;
+  if ((row=psync_sql_fetch_row(res)) && row[0].length==PSYNC_HASH_DIGEST_HEXLEN){
+    if (!phexsum){
+      memcpy(hexsum, psync_get_string(row[0]), PSYNC_HASH_DIGEST_HEXLEN);
+      ret=1;
+    }
+    else if (row[1].type==PSYNC_TNUMBER && row[1].num==pfsize && row[2].length==PSYNC_HASH_DIGEST_HEXLEN){
+      memcpy(hexsum, psync_get_string(row[0]), PSYNC_HASH_DIGEST_HEXLEN);
+      memcpy(phexsum, psync_get_string(row[2]), PSYNC_HASH_DIGEST_HEXLEN);
+      ret=1;
+    }
+    if (ret && (row[3].type!=PSYNC_TNUMBER || row[3].num+PSYNC_CHECKSUMS_PRUNE_INTERVAL<(uint64_t)psync_timer_time()))
+      ret=2;
+  }
+  psync_sql_free_result(res);
+  if (ret==2){
+    psync_hash_cache_touch(st);
+    ret=1;
+  }
+  return ret;
+}
+
+static void psync_hash_cache_put(const psync_stat_t *st, const unsigned char *hexsum, const unsigned char *phexsum, uint64_t pfsize){
+  psync_sql_res *res;
+  if (psync_stat_mtime(st)+PSYNC_HASH_CACHE_MIN_AGE_SEC>psync_timer_time())
+    return;
+  res=psync_sql_prep_statement("REPLACE INTO localhashcache (device, inode, size, mtimenative, checksum, partsize, partchecksum, lastuse) "
+                               "VALUES (?, ?, ?, ?, ?, ?, ?, ?)");
+  psync_sql_bind_uint(res, 1, psync_stat_device(st));
+  psync_sql_bind_uint(res, 2, psync_stat_inode(st));
+  psync_sql_bind_uint(res, 3, psync_stat_size(st));
+  psync_sql_bind_uint(res, 4, psync_stat_mtime_native(st));
+  psync_sql_bind_lstring(res, 5, (const char *)hexsum, PSYNC_HASH_DIGEST_HEXLEN);
+  if (phexsum){
+    psync_sql_bind_uint(res, 6, pfsize);
+    psync_sql_bind_lstring(res, 7, (const char *)phexsum, PSYNC_HASH_DIGEST_HEXLEN);
+  }
+  else{
+    psync_sql_bind_null(res, 6);
+    psync_sql_bind_null(res, 7);
+  }
+  psync_sql_bind_uint(res, 8, psync_timer_time());
+  psync_sql_run_free(res);
+}
+
+static int psync_get_local_file_checksum_int(const char *restrict filename, unsigned char *restrict hexsum, uint64_t *restrict fsize,
+                                             unsigned char *restrict phexsum, uint64_t pfsize){
+  psync_stat_t st, st2;
+  psync_file_hasher_t h;
+  uint64_t size;
   psync_file_t fd;
+  int ret;
   unsigned char hashbin[PSYNC_HASH_DIGEST_LEN];
   fd=psync_file_open(filename, P_O_RDONLY, 0);
   if (fd==INVALID_HANDLE_VALUE)
     return PSYNC_NET_PERMFAIL;
-  if (unlikely_log(psync_fstat(fd, &st)))
-    goto err1;
-  buff=psync_malloc(PSYNC_COPY_BUFFER_SIZE);
-  psync_hash_init(&hctx);
-  psync_hash_init(&hctxp);
-  rsz=psync_stat_size(&st);
-  while (rsz){
-    if (rsz>PSYNC_COPY_BUFFER_SIZE)
-      rs=PSYNC_COPY_BUFFER_SIZE;
-    else
-      rs=rsz;
-    rrs=psync_file_read(fd, buff, rs);
-    if (rrs<=0)
-      goto err2;
-    psync_hash_update(&hctx, buff, rrs);
-    if (pfsize){
-      if (pfsize<rrs){
-        psync_hash_update(&hctxp, buff, pfsize);
-        pfsize=0;
-      }
-      else{
-        psync_hash_update(&hctxp, buff, rrs);
-        pfsize-=rrs;
-      }
-    }
-    rsz-=rrs;
-    psync_yield_cpu();
+  if (unlikely_log(psync_fstat(fd, &st))){
+    psync_file_close(fd);
+    return PSYNC_NET_PERMFAIL;
+  }
+  size=psync_stat_size(&st);
+  if (fsize)
+    *fsize=size;
+  if (psync_hash_cache_get(&st, hexsum, phexsum, pfsize)){
+    psync_file_close(fd);
+    return PSYNC_NET_OK;
+  }
+  h.part=phexsum!=NULL;
+  h.pfsize=pfsize;
+  psync_hash_init(&h.hctx);
+  if (h.part)
+    psync_hash_init(&h.hctxp);
+  if (size<PSYNC_HASH_PIPELINE_MIN_SIZE || (ret=psync_hash_pipeline_start(fd, size, &h))==1)
+    ret=psync_hash_file_inline(fd, size, &h);
+  if (ret || unlikely_log(psync_fstat(fd, &st2))){
+    psync_file_close(fd);
+    return PSYNC_NET_PERMFAIL;
   }
-  psync_free(buff);
   psync_file_close(fd);
-  psync_hash_final(hashbin, &hctx);
+  psync_hash_final(hashbin, &h.hctx);
   psync_binhex(hexsum, hashbin, PSYNC_HASH_DIGEST_LEN);
-  psync_hash_final(hashbin, &hctxp);
-  psync_binhex(phexsum, hashbin, PSYNC_HASH_DIGEST_LEN);
-  if (fsize)
-    *fsize=psync_stat_size(&st);
+  if (h.part){
+    psync_hash_final(hashbin, &h.hctxp);
+    psync_binhex(phexsum, hashbin, PSYNC_HASH_DIGEST_LEN);
+  }
+  if (psync_stat_size(&st2)==size && psync_stat_mtime_native(&st2)==psync_stat_mtime_native(&st))
+    psync_hash_cache_put(&st, hexsum, phexsum, pfsize);
   return PSYNC_NET_OK;
-err2:
-  psync_free(buff);
-err1:
-  psync_file_close(fd);
-  return PSYNC_NET_PERMFAIL;
+}
+
+int psync_get_local_file_checksum(const char *restrict filename, unsigned char *restrict hexsum, uint64_t *restrict fsize){
+  return psync_get_local_file_checksum_int(filename, hexsum, fsize, NULL, 0);
+}
+
+int psync_get_local_file_checksum_part(const char *restrict filename, unsigned char *restrict hexsum, uint64_t *restrict fsize,
+                                       unsigned char *restrict phexsum, uint64_t pfsize){
+  return psync_get_local_file_checksum_int(filename, hexsum, fsize, phexsum, pfsize);
 }
 
 int psync_file_writeall_checkoverquota(psync_file_t fd, const void *buf, size_t count){
@@ -789,6 +1000,7 @@ ex:
   hsock->contentlength=clen;
   hsock->readbytes=0;
   hsock->keepalive=keepalive;
+  hsock->pendingrequests=0;
   hsock->readbuffoff=rl;
   hsock->readbuffsize=rb;
   memcpy(hsock->cachekey, cachekey, cl);
@@ -801,7 +1013,7 @@ err0:
 }
 
 void psync_http_close(psync_http_socket *http){
-  if (http->keepalive>5 && http->readbytes==http->contentlength){
+  if (http->keepalive>5 && http->readbytes==http->contentlength && !http->pendingrequests && http->readbuffoff==http->readbuffsize){
 //    debug(D_NOTICE, "caching socket %s keepalive=%u, readbytes=%lu, contentlength=%lu", http->cachekey, (unsigned)http->keepalive,
 //                    (unsigned long)http->readbytes, (unsigned long)http->contentlength);
     psync_cache_add(http->cachekey, http->sock, http->keepalive-5, (psync_cache_free_callback)psync_socket_close_download, PSYNC_MAX_IDLE_HTTP_CONNS);
@@ -1078,6 +1290,7 @@ psync_http_socket *psync_http_connect_multihost(const binresult *hosts, const ch
   hsock->contentlength=-1;
   hsock->readbytes=0;
   hsock->keepalive=0;
+  hsock->pendingrequests=0;
   hsock->readbuffoff=0;
   hsock->readbuffsize=0;
   memcpy(hsock->cachekey, cachekey, cl);
@@ -1110,27 +1323,35 @@ psync_http_socket *psync_http_connect_multihost_from_cache(const binresult *host
   hsock->contentlength=-1;
   hsock->readbytes=0;
   hsock->keepalive=0;
+  hsock->pendingrequests=0;
   hsock->readbuffoff=0;
   hsock->readbuffsize=0;
   memcpy(hsock->cachekey, cachekey, cl);
   return hsock;
 }
 
+/* Requests can be pipelined, i.e. sent before the responses of the previous ones are read. The read buffer may hold
+ * data of responses that are not processed yet, so the request is formatted in a buffer of its own.
+ */
 int psync_http_request(psync_http_socket *sock, const char *host, const char *path, uint64_t from, uint64_t to){
+  char buff[PSYNC_HTTP_RESP_BUFFER];
   int rl;
   if (from || to){
     if (to)
-      rl=snprintf(sock->readbuff, PSYNC_HTTP_RESP_BUFFER, "GET %s HTTP/1.1\015\012Host: %s\015\012Range: bytes=%"P_PRI_U64"-%"P_PRI_U64
+      rl=snprintf(buff, sizeof(buff), "GET %s HTTP/1.1\015\012Host: %s\015\012Range: bytes=%"P_PRI_U64"-%"P_PRI_U64
                   "\015\012Connection: Keep-Alive\015\012\015\012",
                   path, host, from, to);
     else
-      rl=snprintf(sock->readbuff, PSYNC_HTTP_RESP_BUFFER, "GET %s HTTP/1.1\015\012Host: %s\015\012Range: bytes=%"P_PRI_U64
+      rl=snprintf(buff, sizeof(buff), "GET %s HTTP/1.1\015\012Host: %s\015\012Range: bytes=%"P_PRI_U64
                   "-\015\012Connection: Keep-Alive\015\012\015\012",
                   path, host, from);
   }
   else
-    rl=snprintf(sock->readbuff, PSYNC_HTTP_RESP_BUFFER, "GET %s HTTP/1.1\015\012Host: %s\015\012Connection: Keep-Alive\015\012\015\012", path, host);
-  return psync_socket_writeall(sock->sock, sock->readbuff, rl)==rl?0:-1;
+    rl=snprintf(buff, sizeof(buff), "GET %s HTTP/1.1\015\012Host: %s\015\012Connection: Keep-Alive\015\012\015\012", path, host);
+  if (unlikely_log(rl>=sizeof(buff)) || psync_socket_writeall(sock->sock, buff, rl)!=rl)
+    return -1;
+  sock->pendingrequests++;
+  return 0;
 }
 
 int psync_http_next_request(psync_http_socket *sock){
@@ -1139,8 +1360,22 @@ int psync_http_next_request(psync_http_socket *sock){
   uint32_t keepalive;
   int rl, rb, isval;
   char ch, lch;
-  if (unlikely_log((rb=psync_socket_read(sock->sock, sock->readbuff, PSYNC_HTTP_RESP_BUFFER-1))<=0))
-    goto err0;
+  /* with pipelined requests the buffer may already have the beginning of this response after the previous one */
+  rb=sock->readbuffsize-sock->readbuffoff;
+  if (rb)
+    memmove(sock->readbuff, sock->readbuff+sock->readbuffoff, rb);
+  sock->readbuffoff=0;
+  sock->readbuffsize=0;
+  while (!memchr(sock->readbuff, '\012', rb)){
+    if (unlikely_log(rb>=PSYNC_HTTP_RESP_BUFFER-1))
+      goto err0;
+    rl=psync_socket_read(sock->sock, sock->readbuff+rb, PSYNC_HTTP_RESP_BUFFER-1-rb);
+    if (unlikely_log(rl<=0))
+      goto err0;
+    rb+=rl;
+  }
+  if (sock->pendingrequests)
+    sock->pendingrequests--;
   sock->readbuff[rb]=0;
   ptr=sock->readbuff;
   while (*ptr && !isspace(*ptr))
@@ -1151,6 +1386,8 @@ int psync_http_next_request(psync_http_socket *sock){
     goto err0;
   rl=atoi(ptr);
   if (unlikely_log(rl/10!=20)){
+    /* the body of the response is not read, the connection can not be reused */
+    sock->contentlength=-1;
     if (unlikely_log(rl==0))
       return -1;
     else
@@ -1285,69 +1522,6 @@ char *psync_url_decode(const char *s){
   return ret;
 }
 
-static int psync_net_get_checksums(psync_socket *api, psync_fileid_t fileid, uint64_t hash, psync_file_checksums **checksums){
-  binparam params[]={P_STR("auth", psync_my_auth), P_NUM("fileid", fileid), P_NUM("hash", hash)};
-  binresult *res;
-  const binresult *hosts;
-  const char *requestpath;
-  psync_http_socket *http;
-  psync_file_checksums *cs;
-  psync_block_checksum_header hdr;
-  uint64_t result;
-  uint32_t i;
-  *checksums=NULL; /* gcc is not smart enough to notice that initialization is not needed */
-  if (api)
-    res=send_command(api, "getchecksumlink", params);
-  else {
-    api=psync_apipool_get();
-    if (unlikely(!api))
-      return PSYNC_NET_TEMPFAIL;
-    res=send_command(api, "getchecksumlink", params);
-    if (res)
-      psync_apipool_release(api);
-    else
-      psync_apipool_release_bad(api);
-  }
-  if (unlikely_log(!res)){
-    psync_timer_notify_exception();
-    return PSYNC_NET_TEMPFAIL;
-  }
-  result=psync_find_result(res, "result", PARAM_NUM)->num;
-  if (result){
-    debug(D_ERROR, "getchecksumlink returned error %lu", (unsigned long)result);
-    psync_free(res);
-    return psync_handle_api_result(result);
-  }
-  hosts=psync_find_result(res, "hosts", PARAM_ARRAY);
-  requestpath=psync_find_result(res, "path", PARAM_STR)->str;
-  http=NULL;
-  for (i=0; i<hosts->length; i++)
-    if ((http=psync_http_connect(hosts->array[i]->str, requestpath, 0, 0)))
-      break;
-  psync_free(res);
-  if (unlikely_log(!http))
-    return PSYNC_NET_TEMPFAIL;
-  if (unlikely_log(psync_http_readall(http, &hdr, sizeof(hdr))!=sizeof(hdr)))
-    goto err0;
-  i=(hdr.filesize+hdr.blocksize-1)/hdr.blocksize;
-  cs=(psync_file_checksums *)psync_malloc(offsetof(psync_file_checksums, blocks)+(sizeof(psync_block_checksum)+sizeof(uint32_t))*i);
-  cs->filesize=hdr.filesize;
-  cs->blocksize=hdr.blocksize;
-  cs->blockcnt=i;
-  cs->next=(uint32_t *)(((char *)cs)+offsetof(psync_file_checksums, blocks)+sizeof(psync_block_checksum)*i);
-  if (unlikely_log(psync_http_readall(http, cs->blocks, sizeof(psync_block_checksum)*i)!=sizeof(psync_block_checksum)*i))
-    goto err1;
-  psync_http_close(http);
-  memset(cs->next, 0, sizeof(uint32_t)*i);
-  *checksums=cs;
-  return PSYNC_NET_OK;
-err1:
-  psync_free(cs);
-err0:
-  psync_http_close(http);
-  return PSYNC_NET_TEMPFAIL;
-}
-
 static int psync_net_get_upload_checksums(psync_socket *api, psync_uploadid_t uploadid, psync_file_checksums **checksums){
   binparam params[]={P_STR("auth", psync_my_auth), P_NUM("uploadid", uploadid)};
   binresult *res;
@@ -1414,16 +1588,28 @@ static int psync_is_prime(psync_uint_t num){
 
 #define MAX_ADLER_COLL 64
 
+/* The hash is preceded by a bit filter with roughly ADLER_FILTER_BITS_PER_BLOCK bits per block, indexed by a multiplicative
+ * hash of the adler. Almost all of the rolled checksums are not in the hash, so rejecting them with a single bit test saves
+ * the modulo and the probe into the (much larger and cache-unfriendly) element and block arrays. Bits are never cleared
+ * on remove, the filter may only give false positives.
+ */
+#define ADLER_FILTER_BITS_PER_BLOCK 16
+#define ADLER_FILTER_MIN_SHIFT      10
+#define ADLER_FILTER_MAX_SHIFT      26
+
+#define adler_filter_pos(hash, adler) (((uint32_t)(adler)*0x9E3779B1U)>>(32-(hash)->filtershift))
+#define adler_filter_test(hash, adler) ((hash)->filter[adler_filter_pos(hash, adler)/32]&(1U<<(adler_filter_pos(hash, adler)%32)))
+
 /* Since it is fairly easy to generate adler32 collisions, a file can be crafted to contain many colliding blocks.
  * Our hash will drop entries if more than MAX_ADLER_COLL collisions are detected (actually we just don't travel more
  * than MAX_ADLER_COLL from our "perfect" position in the hash).
  */
 
-static psync_file_checksum_hash *psync_net_create_hash(const psync_file_checksums *checksums){
+static psync_file_checksum_hash *psync_net_alloc_hash(uint32_t blockcnt){
   psync_file_checksum_hash *h;
-  psync_uint_t cnt, col;
-  uint32_t i, o;
-  cnt=((checksums->blockcnt+1)/2)*6+1;
+  psync_uint_t cnt;
+  uint32_t shift, fwords;
+  cnt=((blockcnt+1)/2)*6+1;
   while (1){
     if (psync_is_prime(cnt))
       break;
@@ -1432,10 +1618,26 @@ static psync_file_checksum_hash *psync_net_create_hash(const psync_file_checksum
       break;
     cnt+=2;
   }
-  h=(psync_file_checksum_hash *)psync_malloc(offsetof(psync_file_checksum_hash, elements)+sizeof(uint32_t)*cnt);
+  shift=ADLER_FILTER_MIN_SHIFT;
+  while (shift<ADLER_FILTER_MAX_SHIFT && ((psync_uint_t)1<<shift)<(psync_uint_t)blockcnt*ADLER_FILTER_BITS_PER_BLOCK)
+    shift++;
+  fwords=((uint32_t)1<<shift)/32;
+  h=(psync_file_checksum_hash *)psync_malloc(offsetof(psync_file_checksum_hash, elements)+sizeof(uint32_t)*(cnt+fwords));
   h->elementcnt=cnt;
-  memset(h->elements, 0, sizeof(uint32_t)*cnt);
-  for (i=0; i<checksums->blockcnt; i++){
+  h->filter=h->elements+cnt;
+  h->filtershift=shift;
+  memset(h->elements, 0, sizeof(uint32_t)*(cnt+fwords));
+  return h;
+}
+
+/* blocks have to be added in order, so that next[] always points to a previous identical block */
+static void psync_net_hash_add_blocks(psync_file_checksum_hash *restrict h, psync_file_checksums *restrict checksums, uint32_t from, uint32_t to){
+  psync_uint_t cnt, col;
+  uint32_t i, o;
+  cnt=h->elementcnt;
+  for (i=from; i<to; i++){
+    o=adler_filter_pos(h, checksums->blocks[i].adler);
+    h->filter[o/32]|=1U<<(o%32);
     o=checksums->blocks[i].adler%cnt;
     if (h->elements[o]){
       col=0;
@@ -1456,9 +1658,271 @@ static psync_file_checksum_hash *psync_net_create_hash(const psync_file_checksum
     }
     h->elements[o]=i+1;
   }
+}
+
+static psync_file_checksum_hash *psync_net_create_hash(psync_file_checksums *checksums){
+  psync_file_checksum_hash *h;
+  h=psync_net_alloc_hash(checksums->blockcnt);
+  psync_net_hash_add_blocks(h, checksums, 0, checksums->blockcnt);
   return h;
 }
 
+/* Checksum lists of file revisions are cached in PSYNC_DEFAULT_CHECKSUMS_DIR, one file per content hash in the same format
+ * as they are served (header followed by the blocks). While a list is being downloaded, records are added to the hash in
+ * batches of PSYNC_CHECKSUMS_STREAM_BATCH as they arrive, instead of after the whole list is in memory.
+ */
+
+typedef struct {
+  char *path;
+  time_t mtime;
+  uint64_t size;
+} psync_checksum_cache_file_t;
+
+typedef struct {
+  psync_checksum_cache_file_t *files;
+  uint32_t filecnt;
+  uint32_t filealloc;
+  uint64_t totalsize;
+} psync_checksum_cache_list_t;
+
+static char *psync_net_checksum_cache_dir(){
+  char *path, *rpath;
+  psync_stat_t st;
+  path=psync_get_pcloud_path();
+  if (!path)
+    return NULL;
+  rpath=psync_strcat(path, PSYNC_DIRECTORY_SEPARATOR, PSYNC_DEFAULT_CHECKSUMS_DIR, NULL);
+  psync_free(path);
+  if (psync_stat(rpath, &st) && psync_mkdir(rpath)){
+    psync_free(rpath);
+    return NULL;
+  }
+  return rpath;
+}
+
+static char *psync_net_checksum_cache_file(uint64_t hash, const char *suffix){
+  char *dir, *ret;
+  char hashhex[sizeof(uint64_t)*2+1];
+  dir=psync_net_checksum_cache_dir();
+  if (!dir)
+    return NULL;
+  psync_binhex(hashhex, &hash, sizeof(uint64_t));
+  hashhex[sizeof(uint64_t)*2]=0;
+  ret=psync_strcat(dir, PSYNC_DIRECTORY_SEPARATOR, hashhex, suffix, NULL);
+  psync_free(dir);
+  return ret;
+}
+
+/* several downloads of the same hash may be writing its checksums at once, each one to a file of its own */
+static char *psync_net_checksum_cache_tmp_file(uint64_t hash){
+  static pthread_mutex_t tmpid_mutex=PTHREAD_MUTEX_INITIALIZER;
+  static uint32_t tmpid=0;
+  char suffix[32];
+  uint32_t id;
+  pthread_mutex_lock(&tmpid_mutex);
+  id=++tmpid;
+  pthread_mutex_unlock(&tmpid_mutex);
+  snprintf(suffix, sizeof(suffix), "-%u" PSYNC_APPEND_PARTIAL_FILES, (unsigned)id);
+  return psync_net_checksum_cache_file(hash, suffix);
+}
+
+static void psync_net_checksum_cache_list(void *ptr, psync_pstat *st){
+  psync_checksum_cache_list_t *l;
+  l=(psync_checksum_cache_list_t *)ptr;
+  if (!psync_stat_isfolder(&st->stat)){
+    if (l->filecnt==l->filealloc){
+      l->filealloc=l->filealloc*2+32;
+      l->files=(psync_checksum_cache_file_t *)psync_realloc(l->files, sizeof(psync_checksum_cache_file_t)*l->filealloc);
+    }
+    l->files[l->filecnt].path=psync_strdup(st->path);
+    l->files[l->filecnt].mtime=psync_stat_mtime(&st->stat);
+    l->files[l->filecnt].size=psync_stat_size(&st->stat);
+    l->totalsize+=psync_stat_size(&st->stat);
+    l->filecnt++;
+  }
+}
+
+static int psync_net_checksum_cache_cmp(const void *f1, const void *f2){
+  time_t t1, t2;
+  t1=((const psync_checksum_cache_file_t *)f1)->mtime;
+  t2=((const psync_checksum_cache_file_t *)f2)->mtime;
+  return t1<t2?-1:(t1>t2?1:0);
+}
+
+static void psync_net_checksum_cache_trim(){
+  psync_checksum_cache_list_t l;
+  char *dir;
+  uint32_t i;
+  dir=psync_net_checksum_cache_dir();
+  if (!dir)
+    return;
+  memset(&l, 0, sizeof(l));
+  psync_list_dir(dir, psync_net_checksum_cache_list, &l);
+  psync_free(dir);
+  if (l.totalsize>PSYNC_CHECKSUMS_CACHE_MAX_SIZE){
+    qsort(l.files, l.filecnt, sizeof(psync_checksum_cache_file_t), psync_net_checksum_cache_cmp);
+    for (i=0; i<l.filecnt && l.totalsize>PSYNC_CHECKSUMS_CACHE_MAX_SIZE; i++){
+      debug(D_NOTICE, "deleting cached checksums %s", l.files[i].path);
+      psync_file_delete(l.files[i].path);
+      l.totalsize-=l.files[i].size;
+    }
+  }
+  for (i=0; i<l.filecnt; i++)
+    psync_free(l.files[i].path);
+  psync_free(l.files);
+}
+
+static psync_file_checksums *psync_net_alloc_checksums(const psync_block_checksum_header *hdr){
+  psync_file_checksums *cs;
+  uint32_t cnt;
+  cnt=(hdr->filesize+hdr->blocksize-1)/hdr->blocksize;
+  cs=(psync_file_checksums *)psync_malloc(offsetof(psync_file_checksums, blocks)+(sizeof(psync_block_checksum)+sizeof(uint32_t))*cnt);
+  cs->filesize=hdr->filesize;
+  cs->blocksize=hdr->blocksize;
+  cs->blockcnt=cnt;
+  cs->next=(uint32_t *)(((char *)cs)+offsetof(psync_file_checksums, blocks)+sizeof(psync_block_checksum)*cnt);
+  memset(cs->next, 0, sizeof(uint32_t)*cnt);
+  return cs;
+}
+
+static psync_file_checksums *psync_net_get_cached_checksums(uint64_t hash){
+  psync_file_checksums *cs;
+  psync_block_checksum_header hdr;
+  char *filename;
+  psync_file_t fd;
+  uint64_t cnt;
+  filename=psync_net_checksum_cache_file(hash, "");
+  if (!filename)
+    return NULL;
+  fd=psync_file_open(filename, P_O_RDONLY, 0);
+  psync_free(filename);
+  if (fd==INVALID_HANDLE_VALUE)
+    return NULL;
+  cs=NULL;
+  if (psync_file_read(fd, &hdr, sizeof(hdr))!=sizeof(hdr) || !hdr.blocksize)
+    goto err;
+  cnt=(hdr.filesize+hdr.blocksize-1)/hdr.blocksize;
+  if (psync_file_size(fd)!=sizeof(hdr)+sizeof(psync_block_checksum)*cnt)
+    goto err;
+  cs=psync_net_alloc_checksums(&hdr);
+  if (psync_file_read(fd, cs->blocks, sizeof(psync_block_checksum)*cnt)!=sizeof(psync_block_checksum)*cnt){
+    psync_free(cs);
+    cs=NULL;
+  }
+err:
+  psync_file_close(fd);
+  return cs;
+}
+
+/* if phash is not NULL, the hash of the checksums is built while they are being received */
+static int psync_net_get_checksums(psync_socket *api, psync_fileid_t fileid, uint64_t hash, psync_file_checksums **checksums,
+                                   psync_file_checksum_hash **phash){
+  binparam params[]={P_STR("auth", psync_my_auth), P_NUM("fileid", fileid), P_NUM("hash", hash)};
+  binresult *res;
+  const binresult *hosts;
+  const char *requestpath;
+  psync_http_socket *http;
+  psync_file_checksums *cs;
+  psync_file_checksum_hash *h;
+  char *cachename, *cachetmp;
+  psync_block_checksum_header hdr;
+  uint64_t result;
+  psync_file_t cfd;
+  uint32_t i, cnt;
+  *checksums=NULL; /* gcc is not smart enough to notice that initialization is not needed */
+  if ((cs=psync_net_get_cached_checksums(hash))){
+    debug(D_NOTICE, "using cached checksums for hash %lu", (unsigned long)hash);
+    if (phash)
+      *phash=psync_net_create_hash(cs);
+    *checksums=cs;
+    return PSYNC_NET_OK;
+  }
+  if (api)
+    res=send_command(api, "getchecksumlink", params);
+  else {
+    api=psync_apipool_get();
+    if (unlikely(!api))
+      return PSYNC_NET_TEMPFAIL;
+    res=send_command(api, "getchecksumlink", params);
+    if (res)
+      psync_apipool_release(api);
+    else
+      psync_apipool_release_bad(api);
+  }
+  if (unlikely_log(!res)){
+    psync_timer_notify_exception();
+    return PSYNC_NET_TEMPFAIL;
+  }
+  result=psync_find_result(res, "result", PARAM_NUM)->num;
+  if (result){
+    debug(D_ERROR, "getchecksumlink returned error %lu", (unsigned long)result);
+    psync_free(res);
+    return psync_handle_api_result(result);
+  }
+  hosts=psync_find_result(res, "hosts", PARAM_ARRAY);
+  requestpath=psync_find_result(res, "path", PARAM_STR)->str;
+  http=NULL;
+  for (i=0; i<hosts->length; i++)
+    if ((http=psync_http_connect(hosts->array[i]->str, requestpath, 0, 0)))
+      break;
+  psync_free(res);
+  if (unlikely_log(!http))
+    return PSYNC_NET_TEMPFAIL;
+  if (unlikely_log(psync_http_readall(http, &hdr, sizeof(hdr))!=sizeof(hdr)) || unlikely_log(!hdr.blocksize))
+    goto err0;
+  cs=psync_net_alloc_checksums(&hdr);
+  h=phash?psync_net_alloc_hash(cs->blockcnt):NULL;
+  cachename=psync_net_checksum_cache_file(hash, "");
+  cachetmp=psync_net_checksum_cache_tmp_file(hash);
+  cfd=INVALID_HANDLE_VALUE;
+  if (cachename && cachetmp){
+    cfd=psync_file_open(cachetmp, P_O_WRONLY, P_O_CREAT|P_O_TRUNC);
+    if (cfd!=INVALID_HANDLE_VALUE && psync_file_write(cfd, &hdr, sizeof(hdr))!=sizeof(hdr)){
+      psync_file_close(cfd);
+      cfd=INVALID_HANDLE_VALUE;
+    }
+  }
+  for (i=0; i<cs->blockcnt; i+=cnt){
+    cnt=cs->blockcnt-i;
+    if (cnt>PSYNC_CHECKSUMS_STREAM_BATCH)
+      cnt=PSYNC_CHECKSUMS_STREAM_BATCH;
+    if (unlikely_log(psync_http_readall(http, cs->blocks+i, sizeof(psync_block_checksum)*cnt)!=sizeof(psync_block_checksum)*cnt))
+      goto err1;
+    if (h)
+      psync_net_hash_add_blocks(h, cs, i, i+cnt);
+    if (cfd!=INVALID_HANDLE_VALUE && psync_file_write(cfd, cs->blocks+i, sizeof(psync_block_checksum)*cnt)!=sizeof(psync_block_checksum)*cnt){
+      psync_file_close(cfd);
+      cfd=INVALID_HANDLE_VALUE;
+      psync_file_delete(cachetmp);
+    }
+  }
+  psync_http_close(http);
+  if (cfd!=INVALID_HANDLE_VALUE){
+    if (psync_file_close(cfd) || psync_file_rename_overwrite(cachetmp, cachename))
+      psync_file_delete(cachetmp);
+    else
+      psync_net_checksum_cache_trim();
+  }
+  psync_free(cachename);
+  psync_free(cachetmp);
+  if (phash)
+    *phash=h;
+  *checksums=cs;
+  return PSYNC_NET_OK;
+err1:
+  if (cfd!=INVALID_HANDLE_VALUE){
+    psync_file_close(cfd);
+    psync_file_delete(cachetmp);
+  }
+  psync_free(cachename);
+  psync_free(cachetmp);
+  psync_free(h);
+  psync_free(cs);
+err0:
+  psync_http_close(http);
+  return PSYNC_NET_TEMPFAIL;
+}
+
 static void psync_net_hash_remove(psync_file_checksum_hash *restrict hash, psync_file_checksums *restrict checksums,
                                   uint32_t adler, const unsigned char *sha1){
   uint32_t idx, zeroidx, o, bp;
@@ -1520,6 +1984,8 @@ static void psync_net_block_match_found(psync_file_checksum_hash *restrict hash,
 
 static int psync_net_hash_has_adler(const psync_file_checksum_hash *hash, const psync_file_checksums *checksums, uint32_t adler){
   uint32_t idx, o;
+  if (likely(!adler_filter_test(hash, adler)))
+    return 0;
   o=adler%hash->elementcnt;
   while (1){
     idx=hash->elements[o];
@@ -1584,15 +2050,33 @@ static uint32_t adler32(uint32_t adler, const unsigned char *buff, size_t len){
   return adler|(sum<<16);
 }
 
-static uint32_t adler32_roll(uint32_t adler, unsigned char byteout, unsigned char bytein, uint32_t len){
-  uint32_t sum;
+/* outtab[b] is (len*b)%ADLER32_BASE, so that adler32_roll can keep both halves reduced with conditional subtractions
+ * instead of two divisions per byte */
+static void adler32_roll_init(uint32_t *outtab, uint32_t len){
+  uint32_t i;
+  len%=ADLER32_BASE;
+  outtab[0]=0;
+  for (i=1; i<256; i++){
+    outtab[i]=outtab[i-1]+len;
+    if (outtab[i]>=ADLER32_BASE)
+      outtab[i]-=ADLER32_BASE;
+  }
+}
+
+static uint32_t adler32_roll(uint32_t adler, unsigned char byteout, unsigned char bytein, const uint32_t *outtab){
+  int32_t a, sum;
   sum=adler>>16;
-  adler&=0xffff;
-  adler+=ADLER32_BASE+bytein-byteout;
-  sum=(ADLER32_BASE*ADLER32_BASE+sum-len*byteout-ADLER32_INITIAL+adler)%ADLER32_BASE;
-  /* dividing after sum calculation gives processor a chance to run the divisions in parallel */
-  adler%=ADLER32_BASE;
-  return adler|(sum<<16);
+  a=(adler&0xffff)+bytein-byteout;
+  if (a<0)
+    a+=ADLER32_BASE;
+  else if (a>=(int32_t)ADLER32_BASE)
+    a-=ADLER32_BASE;
+  sum+=a-(int32_t)outtab[byteout]-(int32_t)ADLER32_INITIAL;
+  if (sum<0)
+    sum+=ADLER32_BASE;
+  else if (sum>=(int32_t)ADLER32_BASE)
+    sum-=ADLER32_BASE;
+  return (uint32_t)a|((uint32_t)sum<<16);
 }
 
 static void psync_net_check_file_for_blocks(const char *name, psync_file_checksums *restrict checksums, 
@@ -1605,6 +2089,7 @@ static void psync_net_check_file_for_blocks(const char *name, psync_file_checksu
   psync_file_t fd;
   uint32_t adler, off;
   psync_sha1_ctx ctx;
+  uint32_t outtab[256];
   unsigned char sha1bin[PSYNC_SHA1_DIGEST_LEN];
   debug(D_NOTICE, "scanning file %s for blocks", name);
   fd=psync_file_open(name, P_O_RDONLY, 0);
@@ -1629,6 +2114,7 @@ static void psync_net_check_file_for_blocks(const char *name, psync_file_checksu
   else
     bufferlen=buffersize;
   adler=adler32(ADLER32_INITIAL, buff, checksums->blocksize);
+  adler32_roll_init(outtab, checksums->blocksize);
   outbyteoff=0;
   buffoff=0;
   inbyteoff=checksums->blocksize;
@@ -1679,46 +2165,173 @@ static void psync_net_check_file_for_blocks(const char *name, psync_file_checksu
         }
       }
     }
-    adler=adler32_roll(adler, buff[outbyteoff++], buff[inbyteoff++], checksums->blocksize);
+    adler=adler32_roll(adler, buff[outbyteoff++], buff[inbyteoff++], outtab);
   }
   psync_free(buff);
   psync_file_close(fd);
 }
 
+/* Block checksums of every file downloaded with checksums are kept in blockchecksum, keyed by block SHA1 and pointing
+ * to an offset in the content with a given hash. Any local file with that hash (localfile.hash) can then be a source of
+ * blocks, regardless of its name or location. The local file may have changed since it was last scanned, so every
+ * block found this way is read and verified before use and stale rows are dropped. Rows of a hash are deleted by triggers
+ * together with the last local file having it, see psync_net_prune_checksums() for the rest.
+ */
+
+typedef struct {
+  psync_fileid_t localfileid;
+  char *path;
+  psync_file_t fd;
+} psync_block_index_file_t;
+
+static void psync_net_index_blocks(const psync_file_checksums *checksums, uint64_t filehash){
+  psync_sql_res *res;
+  uint64_t fullblocks, i;
+  fullblocks=checksums->filesize/checksums->blocksize;
+  if (!fullblocks)
+    return;
+  psync_sql_start_transaction();
+  res=psync_sql_prep_statement("INSERT OR IGNORE INTO blockchecksum (sha1, blocksize, hash, off) VALUES (?, ?, ?, ?)");
+  for (i=0; i<fullblocks; i++){
+    psync_sql_bind_blob(res, 1, (const char *)checksums->blocks[i].sha1, PSYNC_SHA1_DIGEST_LEN);
+    psync_sql_bind_uint(res, 2, checksums->blocksize);
+    psync_sql_bind_uint(res, 3, filehash);
+    psync_sql_bind_uint(res, 4, i*checksums->blocksize);
+    psync_sql_run(res);
+  }
+  psync_sql_free_result(res);
+  psync_sql_commit_transaction();
+}
+
+static psync_block_index_file_t *psync_net_index_get_file(psync_block_index_file_t *ifiles, uint32_t *ifilecnt, psync_fileid_t localfileid){
+  psync_block_index_file_t *f;
+  uint32_t i;
+  for (i=0; i<*ifilecnt; i++)
+    if (ifiles[i].localfileid==localfileid)
+      return &ifiles[i];
+  if (*ifilecnt>=PSYNC_MAX_BLOCK_INDEX_FILES)
+    return NULL;
+  f=&ifiles[(*ifilecnt)++];
+  f->localfileid=localfileid;
+  f->path=psync_local_path_for_local_file(localfileid, NULL);
+  if (f->path)
+    f->fd=psync_file_open(f->path, P_O_RDONLY, 0);
+  else
+    f->fd=INVALID_HANDLE_VALUE;
+  return f;
+}
+
+static void psync_net_check_index_for_blocks(psync_file_checksums *restrict checksums, psync_file_checksum_hash *restrict hash,
+                                             psync_block_action *restrict blockactions, uint32_t fileidx,
+                                             psync_block_index_file_t *ifiles, uint32_t *ifilecnt){
+  psync_sql_res *res;
+  psync_uint_row row;
+  psync_block_index_file_t *f;
+  unsigned char *buff;
+  uint64_t i, off, bhash;
+  psync_fileid_t localfileid;
+  unsigned char sha1bin[PSYNC_SHA1_DIGEST_LEN];
+  buff=psync_malloc(checksums->blocksize);
+  /* going backwards, the last of several identical blocks is the one in the hash, so psync_net_block_match_found marks all of them */
+  i=checksums->filesize/checksums->blocksize;
+  while (i--){
+    if (blockactions[i].type!=PSYNC_RANGE_TRANSFER)
+      continue;
+    res=psync_sql_query("SELECT l.id, b.off, b.hash FROM blockchecksum b, localfile l WHERE b.sha1=? AND b.blocksize=? AND l.hash=b.hash LIMIT 1");
+    psync_sql_bind_blob(res, 1, (const char *)checksums->blocks[i].sha1, PSYNC_SHA1_DIGEST_LEN);
+    psync_sql_bind_uint(res, 2, checksums->blocksize);
+    row=psync_sql_fetch_rowint(res);
+    if (!row){
+      psync_sql_free_result(res);
+      continue;
+    }
+    localfileid=row[0];
+    off=row[1];
+    bhash=row[2];
+    psync_sql_free_result(res);
+    f=psync_net_index_get_file(ifiles, ifilecnt, localfileid);
+    if (!f || f->fd==INVALID_HANDLE_VALUE)
+      continue;
+    if (psync_file_pread(f->fd, buff, checksums->blocksize, off)==checksums->blocksize){
+      psync_sha1(buff, checksums->blocksize, sha1bin);
+      if (!memcmp(sha1bin, checksums->blocks[i].sha1, PSYNC_SHA1_DIGEST_LEN)){
+        psync_net_block_match_found(hash, checksums, blockactions, i+1, fileidx+(f-ifiles), off);
+        continue;
+      }
+    }
+    debug(D_NOTICE, "dropping stale block checksum for hash %lu offset %lu", (unsigned long)bhash, (unsigned long)off);
+    res=psync_sql_prep_statement("DELETE FROM blockchecksum WHERE sha1=? AND blocksize=? AND hash=?");
+    psync_sql_bind_blob(res, 1, (const char *)checksums->blocks[i].sha1, PSYNC_SHA1_DIGEST_LEN);
+    psync_sql_bind_uint(res, 2, checksums->blocksize);
+    psync_sql_bind_uint(res, 3, bhash);
+    psync_sql_run_free(res);
+  }
+  psync_free(buff);
+}
+
+/* ranges that copy from files found in the block index own a copy of the file name, as the caller only knows files[] */
+static psync_range_list_t *psync_net_new_range(psync_list *ranges, const psync_block_action *ba, uint64_t off, uint64_t len,
+                                               char *const *files, uint32_t filecnt, const psync_block_index_file_t *ifiles){
+  psync_range_list_t *range;
+  size_t nlen;
+  if (ba->type==PSYNC_RANGE_COPY && ba->idx>=filecnt){
+    nlen=strlen(ifiles[ba->idx-filecnt].path)+1;
+    range=(psync_range_list_t *)psync_malloc(sizeof(psync_range_list_t)+nlen);
+    memcpy(range+1, ifiles[ba->idx-filecnt].path, nlen);
+    range->filename=(const char *)(range+1);
+  }
+  else{
+    range=psync_new(psync_range_list_t);
+    if (ba->type==PSYNC_RANGE_COPY)
+      range->filename=files[ba->idx];
+  }
+  range->len=len;
+  range->type=ba->type;
+  if (range->type==PSYNC_RANGE_COPY)
+    range->off=ba->off;
+  else
+    range->off=off;
+  psync_list_add_tail(ranges, &range->list);
+  return range;
+}
+
 int psync_net_download_ranges(psync_list *ranges, psync_fileid_t fileid, uint64_t filehash, uint64_t filesize, char *const *files, uint32_t filecnt){
   psync_range_list_t *range;
   psync_file_checksums *checksums;
   psync_file_checksum_hash *hash;
   psync_block_action *blockactions;
-  uint32_t i, bs;
+  psync_block_index_file_t ifiles[PSYNC_MAX_BLOCK_INDEX_FILES];
+  psync_file_t fd;
+  uint32_t i, bs, ifilecnt;
   int rt;
-  if (!filecnt)
+  if (filesize<PSYNC_MIN_SIZE_FOR_CHECKSUMS)
     goto fulldownload;
-  rt=psync_net_get_checksums(NULL, fileid, filehash, &checksums);
+  /* get the local files that are going to be scanned read while the checksums are downloaded */
+  for (i=0; i<filecnt; i++){
+    fd=psync_file_open(files[i], P_O_RDONLY, 0);
+    if (fd!=INVALID_HANDLE_VALUE){
+      psync_file_readahead(fd, 0, PSYNC_CHECKSUMS_PREREAD_SIZE);
+      psync_file_close(fd);
+    }
+  }
+  rt=psync_net_get_checksums(NULL, fileid, filehash, &checksums, &hash);
   if (unlikely_log(rt==PSYNC_NET_PERMFAIL))
     goto fulldownload;
   else if (unlikely_log(rt==PSYNC_NET_TEMPFAIL))
     return PSYNC_NET_TEMPFAIL;
   if (unlikely_log(checksums->filesize!=filesize)){
+    psync_free(hash);
     psync_free(checksums);
     return PSYNC_NET_TEMPFAIL;
   }
-  hash=psync_net_create_hash(checksums);
   blockactions=psync_new_cnt(psync_block_action, checksums->blockcnt);
   memset(blockactions, 0, sizeof(psync_block_action)*checksums->blockcnt);
   for (i=0; i<filecnt; i++)
     psync_net_check_file_for_blocks(files[i], checksums, hash, blockactions, i);
+  ifilecnt=0;
+  psync_net_check_index_for_blocks(checksums, hash, blockactions, filecnt, ifiles, &ifilecnt);
   psync_free(hash);
-  range=psync_new(psync_range_list_t);
-  range->len=checksums->blocksize;
-  range->type=blockactions[0].type;
-  if (range->type==PSYNC_RANGE_COPY){
-    range->off=blockactions[0].off;
-    range->filename=files[blockactions[0].idx];
-  }
-  else
-    range->off=0;
-  psync_list_add_tail(ranges, &range->list);
+  range=psync_net_new_range(ranges, &blockactions[0], 0, checksums->blocksize, files, filecnt, ifiles);
   for (i=1; i<checksums->blockcnt; i++){
     if (i==checksums->blockcnt-1){
       bs=checksums->filesize%checksums->blocksize;
@@ -1728,21 +2341,17 @@ int psync_net_download_ranges(psync_list *ranges, psync_fileid_t fileid, uint64_
     else
       bs=checksums->blocksize;
     if (blockactions[i].type!=range->type || (range->type==PSYNC_RANGE_COPY && 
-         (range->filename!=files[blockactions[i].idx] || range->off+range->len!=blockactions[i].off))){
-      range=psync_new(psync_range_list_t);
-      range->len=bs;
-      range->type=blockactions[i].type;
-      if (range->type==PSYNC_RANGE_COPY){
-        range->off=blockactions[i].off;
-        range->filename=files[blockactions[i].idx];
-      }
-      else
-        range->off=(uint64_t)i*checksums->blocksize;
-      psync_list_add_tail(ranges, &range->list);
-    }
+         (blockactions[i].idx!=blockactions[i-1].idx || range->off+range->len!=blockactions[i].off)))
+      range=psync_net_new_range(ranges, &blockactions[i], (uint64_t)i*checksums->blocksize, bs, files, filecnt, ifiles);
     else
       range->len+=bs;
   }
+  for (i=0; i<ifilecnt; i++){
+    if (ifiles[i].fd!=INVALID_HANDLE_VALUE)
+      psync_file_close(ifiles[i].fd);
+    psync_free(ifiles[i].path);
+  }
+  psync_net_index_blocks(checksums, filehash);
   psync_free(checksums);
   psync_free(blockactions);
   return PSYNC_NET_OK;
@@ -1765,6 +2374,7 @@ static int check_range_for_blocks(psync_file_checksums *checksums, psync_file_ch
   uint32_t adler, blockidx;
   int32_t skipbytes;
   psync_sha1_ctx ctx;
+  uint32_t outtab[256];
   unsigned char sha1bin[PSYNC_SHA1_DIGEST_LEN];
   if (unlikely_log(psync_file_seek(fd, off, P_SEEK_SET)==-1))
     return PSYNC_NET_TEMPFAIL;
@@ -1783,6 +2393,7 @@ static int check_range_for_blocks(psync_file_checksums *checksums, psync_file_ch
   else
     bufferlen=buffersize;
   adler=adler32(ADLER32_INITIAL, buff, checksums->blocksize);
+  adler32_roll_init(outtab, checksums->blocksize);
   outbyteoff=0;
   buffoff=0;
   inbyteoff=checksums->blocksize;
@@ -1869,7 +2480,7 @@ static int check_range_for_blocks(psync_file_checksums *checksums, psync_file_ch
         continue;
       }
     }
-    adler=adler32_roll(adler, buff[outbyteoff++], buff[inbyteoff++], checksums->blocksize);
+    adler=adler32_roll(adler, buff[outbyteoff++], buff[inbyteoff++], outtab);
   }
   psync_free(buff);
   return PSYNC_NET_OK;
@@ -1926,12 +2537,11 @@ int psync_net_scan_file_for_blocks(psync_socket *api, psync_list *rlist, psync_f
   psync_list nr;
   int rt;
   debug(D_NOTICE, "scanning fileid %lu hash %lu for blocks", (unsigned long)fileid, (unsigned long)filehash);
-  rt=psync_net_get_checksums(api, fileid, filehash, &checksums);
+  rt=psync_net_get_checksums(api, fileid, filehash, &checksums, &hash);
   if (unlikely_log(rt==PSYNC_NET_PERMFAIL))
     return PSYNC_NET_OK;
   else if (unlikely_log(rt==PSYNC_NET_TEMPFAIL))
     return PSYNC_NET_TEMPFAIL;
-  hash=psync_net_create_hash(checksums);
   psync_list_for_each_safe(l, lb, rlist){
     ur=psync_list_element(l, psync_upload_range_list_t, list);
     if (ur->len<checksums->blocksize || ur->type!=PSYNC_URANGE_UPLOAD)
@@ -1993,6 +2603,292 @@ int psync_net_scan_upload_for_blocks(psync_socket *api, psync_list *rlist, psync
   return PSYNC_NET_OK;
 }
 
+/* Content defined chunking (FastCDC style): a gear hash over the last 64 bytes decides chunk boundaries, so an insertion
+ * or deletion only changes the chunks around it. Chunk boundaries and SHA1s of every file uploaded in big file mode are
+ * stored in filechunk keyed by the file checksum, next time the file is modified the chunks of the new content are matched
+ * against the ones of the version on the server and identical chunks are copied server side, whatever their offset. This
+ * is a single sequential pass over the new file, unlike the adler32 scan that needs to test every offset. The first
+ * PSYNC_CDC_MIN_CHUNK-64 bytes of each chunk can not contain a boundary and are only hashed. Below the average chunk size
+ * a stricter mask is used, making chunk sizes cluster around the average.
+ */
+
+#define CDC_MASK_S (~(uint64_t)0<<(64-(PSYNC_CDC_AVG_CHUNK_BITS+2)))
+#define CDC_MASK_L (~(uint64_t)0<<(64-(PSYNC_CDC_AVG_CHUNK_BITS-2)))
+
+typedef struct {
+  uint64_t off;
+  uint64_t len;
+  unsigned char sha1[PSYNC_SHA1_DIGEST_LEN];
+} psync_file_chunk_t;
+
+/* random values, must not change between versions or stored chunks will stop matching */
+static const uint64_t cdc_gear[256]={
+  0xf4e613919ea2d7b1ULL, 0x45ea93a2efc866b4ULL, 0x484c1b2cc5930118ULL, 0x5f4eb3f79e158495ULL,
+  0x3def43607298f6b9ULL, 0x34bb6c2fe2e6b915ULL, 0x88ff66e21c58d4e6ULL, 0x9b9133b2d1ec6de8ULL,
+  0x874fd4fecc473013ULL, 0x3cf3589ba8656ee4ULL, 0x306ea5b73afb46f5ULL, 0x932409ac3821fc57ULL,
+  0x806344c93f888887ULL, 0x048d503c5c609ef8ULL, 0x0e73b4f58b28e7b2ULL, 0xe662bcf18195eb64ULL,
+  0x0d2a21cfe1d1dd2dULL, 0xb03f85078f2c19deULL, 0x48feff8f72b0c6e8ULL, 0x976b12dcfc3a8f1dULL,
+  0x99b7b9c2cf93d5ceULL, 0x91bcb9c691416c59ULL, 0x289affbf232fe8c3ULL, 0x3c8a6785306f12c8ULL,
+  0xeb7f6bfa15bb0e5eULL, 0x88163b635a6bfc3aULL, 0xd6251e831da667edULL, 0x32a2bd6f57d1ba67ULL,
+  0xcbacadbdeebd5179ULL, 0x3b24539003325ec3ULL, 0xbe8f423ddf0eee0aULL, 0x9acd3b90a4967371ULL,
+  0xc3673791ba595932ULL, 0xde8fe838da625f4dULL, 0x6644d90f90d05b9bULL, 0x5452559313a127e9ULL,
+  0x090c3fb90ca8dc39ULL, 0x02b2e405964d02a8ULL, 0x6685b79ffdea853eULL, 0x7f127ceb08d4a9daULL,
+  0x9102d6a1e1add34bULL, 0x8b3748f40f5f4c3fULL, 0x119006d393a0727cULL, 0xdb711acf75c545edULL,
+  0x578c992e1f285b9eULL, 0x61e04446784747b6ULL, 0xce1f40d654f186f9ULL, 0x1cc8cab9deb177b0ULL,
+  0xdfc399deb5c11890ULL, 0x8c49a13917ac3ddbULL, 0xb43610864eb66233ULL, 0x78bfb828caacb83aULL,
+  0xdb58ffe369b60d74ULL, 0xc81fee435d30473fULL, 0xaa22e16bf7a92104ULL, 0x34f511e70df0a659ULL,
+  0x1780b6d6a9c6e8bfULL, 0x10ee2176f1e6e58aULL, 0x115e7f58990037dfULL, 0x587dcffbbc8bd033ULL,
+  0x6004a916adc8048cULL, 0x15bbdb2b18c7de09ULL, 0x90cbe0b7cc0a3f87ULL, 0x994ebed6d89a5210ULL,
+  0xc1de57137fd0fe50ULL, 0xc9a5a1e8769d2c7cULL, 0x8f645a38a85f6b3cULL, 0x22598846412b4466ULL,
+  0xa621819eca1ebbf5ULL, 0x6c401c454591d305ULL, 0xd4ac0fe342df0357ULL, 0x34045e785c0f8d89ULL,
+  0xe05d864938611945ULL, 0x3ba0342cd6066528ULL, 0x7cb56310ba95fcc0ULL, 0xe2406aa3155c2d65ULL,
+  0x93864a075a9ffdadULL, 0xff3e248774660fa0ULL, 0x749f779c5dad1caaULL, 0xe46b2fa403bf154bULL,
+  0x691c87fa037b9150ULL, 0xace78c21e37e4226ULL, 0xd56afde9ca27ca6dULL, 0x7db901e6e8f0d1f4ULL,
+  0x4e418f4623327e9fULL, 0xa7a9a5b71b653235ULL, 0x44ecd14aa7e775baULL, 0x05857de727782052ULL,
+  0x33d1128f63f40183ULL, 0x529df896ce1c36bcULL, 0x6cbcbbe8c5d6f719ULL, 0x7a61abecfa0df12bULL,
+  0x058f1b7259aef128ULL, 0x13c00e3c5d76b5cdULL, 0x822fbef8eb074fc2ULL, 0x62f11cbb6c95f147ULL,
+  0xdbec47da4dce7c38ULL, 0xf7f02efdc43d2cf6ULL, 0x380449a88cd5ddddULL, 0x249b032b6309b07aULL,
+  0x7bd027035b2afcb6ULL, 0xd2b5c879976477d1ULL, 0x797ee344ec134f95ULL, 0xfc9724065f2fb0fdULL,
+  0x5362a49ff3ccb16cULL, 0x5785dd70d8db5afaULL, 0x215f2338fa105dd9ULL, 0x1d53c2dd0119585eULL,
+  0x9d30218a24acca58ULL, 0x0c6a63161a18b709ULL, 0x2522f3c4f13e9c12ULL, 0x9ddf5eb078895094ULL,
+  0xabfbfd0a2e29020fULL, 0xa30f96e49f4c20f4ULL, 0xe5fef0018d56cb93ULL, 0x3028d25860aeaf3dULL,
+  0x70afc9f5cca6e905ULL, 0x5a185ff30074f733ULL, 0xcfc08f6f462fec3fULL, 0xb91d6a45a985aabfULL,
+  0x96be304f2a99e95aULL, 0x97637a8463a8284dULL, 0xb808a8b01f89e7e0ULL, 0x2b1d183aac2c2a2aULL,
+  0x162358ea1dccf8d6ULL, 0xce09a039ae919e1cULL, 0x737814d2a4066ac0ULL, 0xe8100b42fc2e8ec4ULL,
+  0xf6495a45a407639dULL, 0x542b5ffc14a197dfULL, 0xcbb198da703d0260ULL, 0x792803e996b1d7eeULL,
+  0xe5896bc61b9c4820ULL, 0x2034af056902ca90ULL, 0xe560a628fb4e9fc4ULL, 0x33d475646176bf53ULL,
+  0x1d483a0208cd157bULL, 0xf60fcc4d1c500945ULL, 0x08d11d8e764b6592ULL, 0xc96a3ec5db362988ULL,
+  0x8f49854cd87fd314ULL, 0x2bc788d729773c09ULL, 0x625b65a170a11b9dULL, 0x067c08aec4cb3e18ULL,
+  0xf2eae4919cbc8ea5ULL, 0x5bfd1f99333f78b7ULL, 0x637bfc094073d792ULL, 0x922b5e338fa3cb74ULL,
+  0xb92c0a1e588f7978ULL, 0xa6ab9e60949dfdc6ULL, 0xfd9a3fee86ad7a2bULL, 0x1131068db96412d9ULL,
+  0xe93a53efdb94c439ULL, 0x7ca42b4c4dde1124ULL, 0x857e33ca564abd40ULL, 0xc4f02c986aafa23fULL,
+  0x090b6c5f26ac3ceeULL, 0x403d21435f9c6391ULL, 0x93bfd99e8e51935aULL, 0x91bb940f8e4dad52ULL,
+  0x675a2984934ecf9fULL, 0x79f6231a9fcaff93ULL, 0xe0723ed860e6afb5ULL, 0xf0271cb53d6ad931ULL,
+  0x601b45ae27948c08ULL, 0x42761516140e9992ULL, 0x6f9594392e26ee30ULL, 0xcd58ddca4e3440cbULL,
+  0x016ebd389ff83342ULL, 0x7325e551e6df383aULL, 0x93cf8c32193cbf49ULL, 0xd7f7c383e5a7ae71ULL,
+  0x6916170081c9b1e0ULL, 0x6716879695b93a37ULL, 0x402cf66e12847f76ULL, 0x12c892762d4fd464ULL,
+  0x880500bb5660cf52ULL, 0xb883aa4ffb449d02ULL, 0x2c8e6867de42ac3fULL, 0x02b66d651b663a61ULL,
+  0xdec524fc4504c47cULL, 0xafc35c837d9c51f5ULL, 0x7dbcc79974cc1553ULL, 0x131d1b21a80288fdULL,
+  0xf6210ad398e0ad97ULL, 0x659b208f5c7b2515ULL, 0x0910c201b6ba0479ULL, 0x8175ec578e512845ULL,
+  0x54ab5bf21bbd528bULL, 0x9d8a7fd48d139861ULL, 0x5ef5fe437c86c74cULL, 0xeeb7128369a45543ULL,
+  0x2da5f9b4e0cf2e9bULL, 0x92193c4f9385a98bULL, 0x890299a0e9f12129ULL, 0xee7018ad338ccabaULL,
+  0x2cd8e4c9419c92ffULL, 0x64473c29f12fa939ULL, 0x820a2cfc69cc3e9bULL, 0x4db10c5c07db7a2dULL,
+  0x4d1cd847c43723e7ULL, 0xd529a1b2bc0da6a3ULL, 0x2107bfd5447dbc1eULL, 0xe06ba5cbae006c87ULL,
+  0x25a0dc7e340ee873ULL, 0xb153ba3da2c0e83fULL, 0x8d050d48f71b58f4ULL, 0xc0ac11884997307fULL,
+  0xb177d9f00cfdeca8ULL, 0x420bb9fa86c0d5c0ULL, 0x7ea8a587efa50194ULL, 0xac2920a25749d5e9ULL,
+  0x544d1355452afba1ULL, 0xb05d803fd0c3fca8ULL, 0x6e5ac702d5510915ULL, 0xadf868dd589de4deULL,
+  0xf60d09be48f9c8aeULL, 0x6148d63f760ce2acULL, 0x22419d8351e01c9dULL, 0x217300c8141d424dULL,
+  0x9fe094971693ebafULL, 0xa1a524341204c7bcULL, 0x1f900ebf782883b2ULL, 0x319d3562a760d76fULL,
+  0xb7dfcc827a8fc954ULL, 0x57293141a7e5b147ULL, 0x493ecd694f28e23bULL, 0x925a1594b2c81a32ULL,
+  0x156ad3d171a13698ULL, 0xd5777d6292264ed6ULL, 0x19a3075ecd060c93ULL, 0x36014489d5e1c051ULL,
+  0x753b82bc5e239886ULL, 0x02e852fcf530131dULL, 0x9704248414628c58ULL, 0xd7bdffc8c0f4eb2fULL,
+  0x7a6687dab7552d29ULL, 0x53a1b7236cd61b0bULL, 0x7714950baa7c8a42ULL, 0xa71993c7c4d49d0fULL,
+  0x148d87b2b3a0d3acULL, 0x1e833dce8686fb00ULL, 0x6c8a6dec294d2296ULL, 0xc17c6e608c3456bdULL,
+  0xe20e7ab5d9f78683ULL, 0x6e8ae4c8bab2fa28ULL, 0x3e9433c9c9b65208ULL, 0x4d7ec014068613d1ULL,
+  0xcc58a90501d40dbdULL, 0xdc73363136d1c349ULL, 0xf8e976eaa8078234ULL, 0x6ebf97b82b80caa9ULL,
+  0x606d5a01ce972439ULL, 0x24df5bac56cc0e58ULL, 0x2bf561e741718856ULL, 0xd8cf6407fbe413ceULL
+};
+
+static psync_file_chunk_t *psync_cdc_add_chunk(psync_file_chunk_t *chunks, uint32_t *cnt, uint32_t *alloced, uint64_t off, uint64_t len,
+                                               psync_sha1_ctx *ctx){
+  if (*cnt==*alloced){
+    *alloced=*alloced*2+64;
+    chunks=(psync_file_chunk_t *)psync_realloc(chunks, sizeof(psync_file_chunk_t)*(*alloced));
+  }
+  chunks[*cnt].off=off;
+  chunks[*cnt].len=len;
+  psync_sha1_final(chunks[*cnt].sha1, ctx);
+  (*cnt)++;
+  return chunks;
+}
+
+static int psync_cdc_chunk_file(psync_file_t fd, psync_file_chunk_t **pchunks, uint32_t *pcnt){
+  psync_file_chunk_t *chunks;
+  unsigned char *buff;
+  psync_sha1_ctx ctx;
+  uint64_t fp, chunkoff, chunklen;
+  size_t p, start, skip;
+  ssize_t rd;
+  uint32_t cnt, alloced;
+  int boundary;
+  if (unlikely_log(psync_file_seek(fd, 0, P_SEEK_SET)==-1))
+    return -1;
+  buff=(unsigned char *)psync_malloc(PSYNC_HASH_BUFFER_SIZE);
+  chunks=NULL;
+  cnt=alloced=0;
+  chunkoff=chunklen=0;
+  fp=0;
+  psync_sha1_init(&ctx);
+  while ((rd=psync_file_read(fd, buff, PSYNC_HASH_BUFFER_SIZE))>0){
+    p=0;
+    while (p<rd){
+      start=p;
+      boundary=0;
+      if (chunklen<PSYNC_CDC_MIN_CHUNK-64){
+        skip=PSYNC_CDC_MIN_CHUNK-64-chunklen;
+        if (skip>rd-p)
+          skip=rd-p;
+        p+=skip;
+        chunklen+=skip;
+      }
+      while (p<rd){
+        fp=(fp<<1)+cdc_gear[buff[p++]];
+        chunklen++;
+        if (chunklen<PSYNC_CDC_MIN_CHUNK)
+          continue;
+        if ((chunklen<((uint64_t)1<<PSYNC_CDC_AVG_CHUNK_BITS) ? !(fp&CDC_MASK_S) : !(fp&CDC_MASK_L)) || chunklen>=PSYNC_CDC_MAX_CHUNK){
+          boundary=1;
+          break;
+        }
+      }
+      psync_sha1_update(&ctx, buff+start, p-start);
+      if (boundary){
+        chunks=psync_cdc_add_chunk(chunks, &cnt, &alloced, chunkoff, chunklen, &ctx);
+        chunkoff+=chunklen;
+        chunklen=0;
+        fp=0;
+        psync_sha1_init(&ctx);
+      }
+    }
+    psync_yield_cpu();
+  }
+  if (chunklen)
+    chunks=psync_cdc_add_chunk(chunks, &cnt, &alloced, chunkoff, chunklen, &ctx);
+  psync_free(buff);
+  if (unlikely_log(rd<0)){
+    psync_free(chunks);
+    return -1;
+  }
+  *pchunks=chunks;
+  *pcnt=cnt;
+  return 0;
+}
+
+static int psync_cdc_chunk_cmp(const void *c1, const void *c2){
+  return memcmp(((const psync_file_chunk_t *)c1)->sha1, ((const psync_file_chunk_t *)c2)->sha1, PSYNC_SHA1_DIGEST_LEN);
+}
+
+static psync_file_chunk_t *psync_cdc_load_chunks(const unsigned char *hexsum, uint32_t *pcnt){
+  psync_sql_res *res;
+  psync_variant_row row;
+  psync_file_chunk_t *chunks;
+  uint32_t cnt, alloced;
+  chunks=NULL;
+  cnt=alloced=0;
+  res=psync_sql_query("SELECT off, len, sha1 FROM filechunk WHERE checksum=?");
+  psync_sql_bind_lstring(res, 1, (const char *)hexsum, PSYNC_HASH_DIGEST_HEXLEN);
+  while ((row=psync_sql_fetch_row(res))){
+    if (unlikely_log(row[2].length!=PSYNC_SHA1_DIGEST_LEN))
+      continue;
+    if (cnt==alloced){
+      alloced=alloced*2+64;
+      chunks=(psync_file_chunk_t *)psync_realloc(chunks, sizeof(psync_file_chunk_t)*alloced);
+    }
+    chunks[cnt].off=psync_get_number(row[0]);
+    chunks[cnt].len=psync_get_number(row[1]);
+    memcpy(chunks[cnt].sha1, row[2].str, PSYNC_SHA1_DIGEST_LEN);
+    cnt++;
+  }
+  psync_sql_free_result(res);
+  if (cnt)
+    qsort(chunks, cnt, sizeof(psync_file_chunk_t), psync_cdc_chunk_cmp);
+  *pcnt=cnt;
+  return chunks;
+}
+
+static void psync_cdc_save_chunks(const unsigned char *hexsum, const psync_file_chunk_t *chunks, uint32_t cnt){
+  psync_sql_res *res;
+  uint32_t i;
+  psync_sql_start_transaction();
+  psync_net_delete_file_chunks(hexsum);
+  res=psync_sql_prep_statement("INSERT INTO filechunk (checksum, off, len, sha1) VALUES (?, ?, ?, ?)");
+  for (i=0; i<cnt; i++){
+    psync_sql_bind_lstring(res, 1, (const char *)hexsum, PSYNC_HASH_DIGEST_HEXLEN);
+    psync_sql_bind_uint(res, 2, chunks[i].off);
+    psync_sql_bind_uint(res, 3, chunks[i].len);
+    psync_sql_bind_blob(res, 4, (const char *)chunks[i].sha1, PSYNC_SHA1_DIGEST_LEN);
+    psync_sql_run(res);
+  }
+  psync_sql_free_result(res);
+  psync_sql_commit_transaction();
+}
+
+void psync_net_delete_file_chunks(const unsigned char *hexsum){
+  psync_sql_res *res;
+  res=psync_sql_prep_statement("DELETE FROM filechunk WHERE checksum=?");
+  psync_sql_bind_lstring(res, 1, (const char *)hexsum, PSYNC_HASH_DIGEST_HEXLEN);
+  psync_sql_run_free(res);
+}
+
+/* chunks the file open as fd and stores its chunks under hexsum. If chunks of the version on the server (fileid, filehash, with
+ * checksum prevhexsum) are known, matching chunks become PSYNC_URANGE_COPY_FILE ranges in rlist. */
+int psync_net_scan_file_for_chunks(psync_list *rlist, psync_fileid_t fileid, uint64_t filehash, const unsigned char *prevhexsum,
+                                   const unsigned char *hexsum, psync_file_t fd){
+  psync_file_chunk_t *chunks, *prevchunks, *pc;
+  psync_upload_range_list_t *ur, *le;
+  psync_list *l, *lb;
+  psync_list nr, matched;
+  uint32_t cnt, prevcnt, i, matches;
+  debug(D_NOTICE, "scanning file for content defined chunks of fileid %lu hash %lu", (unsigned long)fileid, (unsigned long)filehash);
+  if (psync_cdc_chunk_file(fd, &chunks, &cnt))
+    return PSYNC_NET_TEMPFAIL;
+  psync_cdc_save_chunks(hexsum, chunks, cnt);
+  prevcnt=0;
+  prevchunks=NULL;
+  if (prevhexsum && memcmp(prevhexsum, hexsum, PSYNC_HASH_DIGEST_HEXLEN))
+    prevchunks=psync_cdc_load_chunks(prevhexsum, &prevcnt);
+  if (!prevcnt){
+    psync_free(prevchunks);
+    psync_free(chunks);
+    return PSYNC_NET_OK;
+  }
+  psync_list_init(&matched);
+  ur=NULL;
+  matches=0;
+  for (i=0; i<cnt; i++){
+    pc=(psync_file_chunk_t *)bsearch(&chunks[i], prevchunks, prevcnt, sizeof(psync_file_chunk_t), psync_cdc_chunk_cmp);
+    if (!pc || pc->len!=chunks[i].len)
+      continue;
+    matches++;
+    if (ur && ur->uploadoffset+ur->len==chunks[i].off && ur->off+ur->len==pc->off)
+      ur->len+=pc->len;
+    else{
+      ur=psync_new(psync_upload_range_list_t);
+      ur->uploadoffset=chunks[i].off;
+      ur->off=pc->off;
+      ur->len=pc->len;
+      ur->type=PSYNC_URANGE_COPY_FILE;
+      ur->file.fileid=fileid;
+      ur->file.hash=filehash;
+      psync_list_add_tail(&matched, &ur->list);
+    }
+  }
+  debug(D_NOTICE, "%u of %u chunks found in the previous version", (unsigned)matches, (unsigned)cnt);
+  psync_free(prevchunks);
+  psync_free(chunks);
+  /* hand the matched ranges that are fully inside an upload range over to it, they are in increasing order in both lists */
+  psync_list_for_each_safe(l, lb, rlist){
+    le=psync_list_element(l, psync_upload_range_list_t, list);
+    if (le->type!=PSYNC_URANGE_UPLOAD)
+      continue;
+    psync_list_init(&nr);
+    while (!psync_list_isempty(&matched)){
+      ur=psync_list_element(matched.next, psync_upload_range_list_t, list);
+      if (ur->uploadoffset>=le->uploadoffset+le->len)
+        break;
+      psync_list_del(&ur->list);
+      if (ur->uploadoffset>=le->uploadoffset && ur->uploadoffset+ur->len<=le->uploadoffset+le->len)
+        psync_list_add_tail(&nr, &ur->list);
+      else
+        psync_free(ur);
+    }
+    if (!psync_list_isempty(&nr))
+      merge_list_to_element(le, &nr);
+  }
+  psync_list_for_each_element_call(&matched, psync_upload_range_list_t, list, psync_free);
+  return PSYNC_NET_OK;
+}
+
 static int is_revision_local(const unsigned char *localhashhex, uint64_t filesize, psync_fileid_t fileid){
   psync_sql_res *res;
   psync_uint_row row;
@@ -2127,7 +3023,29 @@ static void psync_netlibs_timer(psync_timer_t timer, void *ptr){
   account_uploaded_bytes(0);
 }
 
+/* Triggers on localfile drop the block checksums of a hash and the chunks of a checksum with the last local file having
+ * them. Rows indexed for downloads that never made it to localfile and chunks of versions no local file has or was
+ * uploaded from are only removed here, as are cached checksums of local files not used for a while.
+ */
+static void psync_net_prune_checksums(){
+  psync_sql_res *res;
+  /* blocks are indexed before the local file of a download is written, its task is deleted only after that */
+  psync_sql_statement("DELETE FROM blockchecksum WHERE hash NOT IN (SELECT hash FROM localfile WHERE hash IS NOT NULL) AND "
+                      "hash NOT IN (SELECT f.hash FROM task t, file f WHERE t.type="NTO_STR(PSYNC_DOWNLOAD_FILE)" AND f.id=t.itemid AND f.hash IS NOT NULL)");
+  psync_sql_statement("DELETE FROM filechunk WHERE checksum NOT IN (SELECT checksum FROM localfile WHERE checksum IS NOT NULL) AND "
+                      "checksum NOT IN (SELECT h.checksum FROM localfile l, hashchecksum h WHERE h.hash=l.hash AND h.checksum IS NOT NULL)");
+  res=psync_sql_prep_statement("DELETE FROM localhashcache WHERE lastuse IS NULL OR lastuse<?");
+  psync_sql_bind_uint(res, 1, psync_timer_time()-PSYNC_HASH_CACHE_MAX_UNUSED_SEC);
+  psync_sql_run_free(res);
+}
+
+static void psync_net_prune_checksums_timer(psync_timer_t timer, void *ptr){
+  psync_run_thread("prune checksums", psync_net_prune_checksums);
+}
+
 void psync_netlibs_init(){
   psync_timer_register(psync_netlibs_timer, 1, NULL);
+  psync_timer_register(psync_net_prune_checksums_timer, PSYNC_CHECKSUMS_PRUNE_INTERVAL, NULL);
+  psync_run_thread("prune checksums", psync_net_prune_checksums);
   sem_init(&api_pool_sem, 0, PSYNC_APIPOOL_MAXACTIVE);
 }
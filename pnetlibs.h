@@ -45,6 +45,8 @@ typedef struct {
   int64_t contentlength;
   uint64_t readbytes;
   uint32_t keepalive;
+  /* requests sent on the connection whose response headers are not read yet */
+  uint32_t pendingrequests;
   uint32_t readbuffoff;
   uint32_t readbuffsize;
   char cachekey[];
@@ -65,6 +67,7 @@ typedef struct {
 #define PSYNC_URANGE_COPY_FILE   1
 #define PSYNC_URANGE_COPY_UPLOAD 2
 #define PSYNC_URANGE_LAST        3
+#define PSYNC_URANGE_UPLOADED    4
 
 typedef struct {
   psync_list list;
@@ -100,6 +103,8 @@ int psync_rmdir_recursive(const char *path);
 void psync_set_local_full(int over);
 int psync_handle_api_result(uint64_t result);
 int psync_get_remote_file_checksum(psync_fileid_t fileid, unsigned char *hexsum, uint64_t *fsize, uint64_t *hash);
+int psync_get_cached_remote_file_checksum(psync_fileid_t fileid, unsigned char *hexsum, uint64_t *fsize, uint64_t *hash);
+int psync_remote_file_checksum_result(const binresult *res, unsigned char *hexsum, uint64_t *fsize, uint64_t *hash);
 int psync_get_local_file_checksum(const char *restrict filename, unsigned char *restrict hexsum, uint64_t *restrict fsize);
 int psync_get_local_file_checksum_part(const char *restrict filename, unsigned char *restrict hexsum, uint64_t *restrict fsize,
                                        unsigned char *restrict phexsum, uint64_t pfsize);
@@ -126,6 +131,9 @@ char *psync_url_decode(const char *s);
 int psync_net_download_ranges(psync_list *ranges, psync_fileid_t fileid, uint64_t filehash, uint64_t filesize, char *const *files, uint32_t filecnt);
 int psync_net_scan_file_for_blocks(psync_socket *api, psync_list *rlist, psync_fileid_t fileid, uint64_t filehash, psync_file_t fd);
 int psync_net_scan_upload_for_blocks(psync_socket *api, psync_list *rlist, psync_uploadid_t uploadid, psync_file_t fd);
+int psync_net_scan_file_for_chunks(psync_list *rlist, psync_fileid_t fileid, uint64_t filehash, const unsigned char *prevhexsum,
+                                   const unsigned char *hexsum, psync_file_t fd);
+void psync_net_delete_file_chunks(const unsigned char *hexsum);
 
 int psync_is_revision_of_file(const unsigned char *localhashhex, uint64_t filesize, psync_fileid_t fileid, int *isrev);
 
@@ -32,17 +32,26 @@
 #include "pnetlibs.h"
 #include "pstatus.h"
 #include "pcache.h"
+#include "ptransfer.h"
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
 
-#define CACHE_PAGES (PSYNC_FS_MEMORY_CACHE/PSYNC_FS_PAGE_SIZE)
-#define CACHE_HASH (CACHE_PAGES/2)
+/* cache_hash_size is kept divisible by CACHE_SHARDS, bucket h belongs to shard h%CACHE_SHARDS */
+#define CACHE_SHARDS 16
+#define CACHE_MIN_SHARD_PAGES 4
 
 #define PAGE_WAITER_HASH 1024
 #define PAGE_WAITER_MUTEXES 16
 
-#define DB_CACHE_UPDATE_HASH (32*1024)
+#define PAGE_INDEX_MAGIC 0x3158444945474150ULL
+#define PAGE_INDEX_VERSION 1
+
+#define PAGE_TIERS 5
+#define PAGE_EVICT_BATCH 256
+#define PAGE_EVICT_PER_RUN (16*1024)
+
+#define READAHEAD_CANCEL_CHECK_BYTES (1024*1024)
 
 #define PAGE_TYPE_FREE 0
 #define PAGE_TYPE_READ 1
@@ -50,15 +59,20 @@
 #define PAGE_TASK_TYPE_CREAT  0
 #define PAGE_TASK_TYPE_MODIFY 1
 
-#define pagehash_by_hash_and_pageid(hash, pageid) (((hash)+(pageid))%CACHE_HASH)
+#define pagehash_by_hash_and_pageid(hash, pageid) (((hash)+(pageid))%cache_hash_size)
+#define shard_by_pagehash(h) (&cache_shards[(h)%CACHE_SHARDS])
+#define ghost_key_by_hash_and_pageid(hash, pageid) (((hash)*0x9E3779B97F4A7C15ULL)^(pageid)^0x1ULL)
 #define waiterhash_by_hash_and_pageid(hash, pageid) (((hash)+(pageid))%PAGE_WAITER_HASH)
 #define waiter_mutex_by_hash(hash) (hash%PAGE_WAITER_MUTEXES)
 #define lock_wait(hash) pthread_mutex_lock(&wait_page_mutexes[waiter_mutex_by_hash(hash)])
 #define unlock_wait(hash) pthread_mutex_unlock(&wait_page_mutexes[waiter_mutex_by_hash(hash)])
 
 typedef struct {
+  /* list is either element of hash bucket or of the free list of a shard */
   psync_list list;
   psync_list flushlist;
+  /* clock is an element of the clock ring of the shard the page is resident in */
+  psync_list clock;
   char *page;
   uint64_t hash;
   uint64_t pageid;
@@ -67,13 +81,71 @@ typedef struct {
   uint32_t usecnt;
   uint32_t flushpageid;
   uint8_t type;
+  /* dirty pages are not yet written to the cache file and can not be evicted */
+  uint8_t dirty;
+  uint8_t hot;
+  uint8_t referenced;
 } psync_cache_page_t;
 
+/* Every shard protects the hash buckets that map to it, a free list and a CLOCK-Pro like
+ * replacement ring of the pages resident in these buckets. Resident pages are either hot
+ * or cold, new pages enter cold and are only promoted if referenced again while still
+ * resident or if they are found in the non-resident (ghost) table, so a sequential read
+ * passes through the cold pages without pushing out the hot ones.
+ */
 typedef struct {
-  uint64_t pagecacheid;
-  time_t lastuse;
+  pthread_mutex_t mutex;
+  psync_list clock;
+  psync_list *hand;
+  psync_list free_pages;
+  uint32_t pages_free;
+  uint32_t pages_resident;
+  uint32_t pages_dirty;
+  uint32_t pages_hot;
+  uint32_t hot_target;
+  uint64_t *ghosts;
+} psync_cache_shard_t;
+
+/* The index of the pages in the cache file is an open addressing (linear probing) hash table keyed by hash and pageid
+ * and stored in the file next to the cache. It is mapped in memory and replaces the old pagecache table, so disk cache
+ * lookups do not touch the database. Entries are only added after the page data is synced to the cache file and slots
+ * of evicted pages are only reused after the index is synced, so the index never points to a slot holding other data.
+ */
+typedef struct {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t pagesize;
+  uint64_t buckets;
+  uint64_t slots;
+} psync_page_index_header_t;
+
+typedef struct {
+  uint64_t hash;
+  uint64_t pageid;
+  /* number of the page in the cache file, 0 for an empty bucket */
+  uint32_t id;
+  uint32_t lastuse;
   uint32_t usecnt;
-} psync_cachepage_to_update;
+  uint32_t size;
+} psync_page_index_entry_t;
+
+typedef struct {
+  uint64_t hash;
+  uint64_t pageid;
+  uint32_t prev;
+  uint32_t next;
+  uint32_t tier;
+  /* number of reads returned as ranges of the cache file that are not finished yet, freed is set if the slot
+   * was released while pinned and it goes back to free_slots when the last pin is dropped */
+  uint32_t pins;
+  uint32_t freed;
+} psync_page_slot_t;
+
+typedef struct {
+  uint32_t *ids;
+  uint32_t cnt;
+  uint32_t alloc;
+} psync_slot_pins_t;
 
 typedef struct {
   /* list is an element of hash table for pages */
@@ -112,6 +184,10 @@ typedef struct {
   psync_openfile_t *of;
   psync_fileid_t fileid;
   uint64_t hash;
+  /* readahead stream of the file the request was made for, streamid is -1 if none */
+  uint64_t streamstart;
+  psync_int_t streamid;
+  unsigned char streamtype;
 } psync_request_t;
 
 typedef struct {
@@ -122,21 +198,48 @@ typedef struct {
   uint32_t status;
 } psync_urls_t;
 
-static psync_list cache_hash[CACHE_HASH];
-static uint32_t cache_pages_in_hash=0;
-static uint32_t cache_pages_free;
-static psync_list free_pages;
+/* page size and number of pages are read from settings in psync_pagecache_init and do not change afterwards */
+static uint32_t cache_page_size;
+static uint32_t cache_pages;
+static uint32_t cache_hash_size;
+static uint32_t cache_shard_pages;
+/* power of 2 */
+static uint32_t cache_ghosts_per_shard;
+
+static psync_list *cache_hash;
+static psync_cache_shard_t cache_shards[CACHE_SHARDS];
 static psync_list wait_page_hash[PAGE_WAITER_HASH];
+static psync_fs_readahead_stats_t readahead_stats;
 static char *pages_base;
-
-static psync_cachepage_to_update cachepages_to_update[DB_CACHE_UPDATE_HASH];
-static uint32_t cachepages_to_update_cnt=0;
+static psync_cache_page_t *pages_structs;
+
+static char *index_map;
+static uint64_t index_map_size;
+static psync_page_index_entry_t *index_entries;
+static uint64_t index_mask;
+/* stack of free slots of the cache file, the lowest ones are on top */
+static uint32_t *free_slots;
 static uint32_t free_db_pages;
-
-static pthread_mutex_t cache_mutex=PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t clean_cache_mutex=PTHREAD_MUTEX_INITIALIZER;
+static int index_dirty=0;
+static int evictrun=0;
+
+/* per slot of the cache file, the LRU lists are linked by slot number, 0 ends a list */
+static psync_page_slot_t *cache_slots;
+static uint32_t lru_head[PAGE_TIERS];
+static uint32_t lru_tail[PAGE_TIERS];
+static uint32_t lru_cnt[PAGE_TIERS];
+static uint32_t lru_used;
+static uint32_t evict_low_watermark;
+static uint32_t evict_high_watermark;
+
+/* slots pinned by the last read of each thread, see psync_pagecache_unpin_ranges() */
+static pthread_key_t slot_pins_key;
+
+static pthread_mutex_t index_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flush_run_mutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t flush_cache_mutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t url_cache_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t readahead_stats_mutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t url_cache_cond=PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t wait_page_mutexes[PAGE_WAITER_MUTEXES];
 
@@ -145,9 +248,9 @@ static int flushchacherun=0;
 static int upload_to_cache_thread_run=0;
 
 static uint64_t db_cache_in_pages;
-static uint64_t db_cache_max_page;
 
 static psync_file_t readcache;
+static psync_file_t readcacheindex;
 
 static psync_tree *url_cache_tree=PSYNC_TREE_EMPTY;
 
@@ -157,31 +260,155 @@ static void flush_pages_noret(){
   flush_pages(0);
 }
 
-static psync_cache_page_t *psync_pagecache_get_free_page(){
+static uint32_t cache_pages_dirty(){
+  uint32_t i, cnt;
+  cnt=0;
+  for (i=0; i<CACHE_SHARDS; i++)
+    cnt+=cache_shards[i].pages_dirty;
+  return cnt;
+}
+
+static uint32_t cache_pages_reclaimable(){
+  uint32_t i, cnt;
+  cnt=0;
+  for (i=0; i<CACHE_SHARDS; i++)
+    cnt+=cache_shards[i].pages_free+cache_shards[i].pages_resident-cache_shards[i].pages_dirty;
+  return cnt;
+}
+
+static psync_cache_shard_t *psync_pagecache_page_home_shard(psync_cache_page_t *page){
+  return &cache_shards[(page-pages_structs)%CACHE_SHARDS];
+}
+
+static int ghost_check_and_remove_locked(psync_cache_shard_t *shard, uint64_t key){
+  psync_uint_t h;
+  h=key&(cache_ghosts_per_shard-1);
+  if (shard->ghosts[h]==key){
+    shard->ghosts[h]=0;
+    return 1;
+  }
+  else
+    return 0;
+}
+
+static void ghost_add_locked(psync_cache_shard_t *shard, uint64_t key){
+  shard->ghosts[key&(cache_ghosts_per_shard-1)]=key;
+}
+
+static void psync_pagecache_add_page_locked(psync_cache_shard_t *shard, psync_uint_t h, psync_cache_page_t *page){
+  psync_list_add_tail(&cache_hash[h], &page->list);
+  psync_list_add_before(shard->hand, &page->clock);
+  page->dirty=1;
+  page->referenced=0;
+  if (ghost_check_and_remove_locked(shard, ghost_key_by_hash_and_pageid(page->hash, page->pageid))){
+    /* page was evicted while cold and is needed again, cold pages need more space */
+    page->hot=1;
+    shard->pages_hot++;
+    if (shard->hot_target>cache_shard_pages/10)
+      shard->hot_target--;
+  }
+  else
+    page->hot=0;
+  shard->pages_resident++;
+  shard->pages_dirty++;
+}
+
+static void psync_pagecache_add_page(psync_cache_page_t *page){
+  psync_cache_shard_t *shard;
+  psync_uint_t h;
+  h=pagehash_by_hash_and_pageid(page->hash, page->pageid);
+  shard=shard_by_pagehash(h);
+  pthread_mutex_lock(&shard->mutex);
+  psync_pagecache_add_page_locked(shard, h, page);
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+/* runs the clock hand of the shard until it finds a clean cold unreferenced page or does two full turns */
+static psync_cache_page_t *psync_pagecache_evict_page_locked(psync_cache_shard_t *shard){
   psync_cache_page_t *page;
-  pthread_mutex_lock(&cache_mutex);
-  if (cache_pages_free<=CACHE_PAGES*10/100 && !flushchacherun){
-    psync_run_thread("flush pages get free page", flush_pages_noret);
-    flushchacherun=1;
+  psync_uint_t cnt;
+  cnt=shard->pages_resident*2+2;
+  while (shard->pages_resident>shard->pages_dirty && cnt--){
+    if (shard->hand==&shard->clock){
+      shard->hand=shard->hand->next;
+      continue;
+    }
+    page=psync_list_element(shard->hand, psync_cache_page_t, clock);
+    shard->hand=shard->hand->next;
+    if (page->dirty)
+      continue;
+    if (page->hot){
+      if (!page->referenced || shard->pages_hot>shard->hot_target){
+        page->hot=0;
+        shard->pages_hot--;
+      }
+      page->referenced=0;
+    }
+    else if (page->referenced){
+      /* cold page that got re-referenced during its test period */
+      page->referenced=0;
+      page->hot=1;
+      shard->pages_hot++;
+    }
+    else{
+      /* cold page passed its test period without being used, hot pages can have more space */
+      psync_list_del(&page->clock);
+      psync_list_del(&page->list);
+      ghost_add_locked(shard, ghost_key_by_hash_and_pageid(page->hash, page->pageid));
+      shard->pages_resident--;
+      if (shard->hot_target<cache_shard_pages*9/10)
+        shard->hot_target++;
+      return page;
+    }
   }
-  if (likely(!psync_list_isempty(&free_pages)))
-    page=psync_list_remove_head_element(&free_pages, psync_cache_page_t, list);
-  else{
+  return NULL;
+}
+
+static psync_cache_page_t *psync_pagecache_get_free_page_from_shard(psync_cache_shard_t *shard){
+  psync_cache_page_t *page;
+  pthread_mutex_lock(&shard->mutex);
+  if (likely(!psync_list_isempty(&shard->free_pages))){
+    page=psync_list_remove_head_element(&shard->free_pages, psync_cache_page_t, list);
+    shard->pages_free--;
+  }
+  else
+    page=psync_pagecache_evict_page_locked(shard);
+  pthread_mutex_unlock(&shard->mutex);
+  return page;
+}
+
+static psync_cache_page_t *psync_pagecache_try_get_free_page(psync_uint_t shardid){
+  psync_cache_page_t *page;
+  psync_uint_t i;
+  for (i=0; i<CACHE_SHARDS; i++)
+    if ((page=psync_pagecache_get_free_page_from_shard(&cache_shards[(shardid+i)%CACHE_SHARDS])))
+      return page;
+  return NULL;
+}
+
+/* hash and pageid are only a hint which shard to take the page from first */
+static psync_cache_page_t *psync_pagecache_get_free_page(uint64_t hash, uint64_t pageid){
+  psync_cache_page_t *page;
+  psync_uint_t shardid;
+  if (cache_pages_reclaimable()<=cache_pages*10/100){
+    pthread_mutex_lock(&flush_run_mutex);
+    if (!flushchacherun){
+      psync_run_thread("flush pages get free page", flush_pages_noret);
+      flushchacherun=1;
+    }
+    pthread_mutex_unlock(&flush_run_mutex);
+  }
+  shardid=pagehash_by_hash_and_pageid(hash, pageid)%CACHE_SHARDS;
+  page=psync_pagecache_try_get_free_page(shardid);
+  if (unlikely(!page)){
     debug(D_NOTICE, "no free pages, flushing cache");
-    pthread_mutex_unlock(&cache_mutex);
     flush_pages(1);
-    pthread_mutex_lock(&cache_mutex);
-    while (unlikely(psync_list_isempty(&free_pages))){
-      pthread_mutex_unlock(&cache_mutex);
+    while (unlikely(!(page=psync_pagecache_try_get_free_page(shardid)))){
       debug(D_NOTICE, "no free pages after flush, sleeping");
       psync_milisleep(200);
       flush_pages(1);
-      pthread_mutex_lock(&cache_mutex);
     }
-    page=psync_list_remove_head_element(&free_pages, psync_cache_page_t, list);
   }
-  cache_pages_free--;
-  pthread_mutex_unlock(&cache_mutex);
   return page;
 }
 
@@ -217,15 +444,13 @@ static void psync_pagecache_send_page_wait_page(psync_page_wait_t *pw, psync_cac
   psync_free(pw);
 }
 
-static void psync_pagecache_return_free_page_locked(psync_cache_page_t *page){
-  psync_list_add_head(&free_pages, &page->list);
-  cache_pages_free++;
-}
-
 static void psync_pagecache_return_free_page(psync_cache_page_t *page){
-  pthread_mutex_lock(&cache_mutex);
-  psync_pagecache_return_free_page_locked(page);
-  pthread_mutex_unlock(&cache_mutex);
+  psync_cache_shard_t *shard;
+  shard=psync_pagecache_page_home_shard(page);
+  pthread_mutex_lock(&shard->mutex);
+  psync_list_add_head(&shard->free_pages, &page->list);
+  shard->pages_free++;
+  pthread_mutex_unlock(&shard->mutex);
 }
 
 static int psync_pagecache_read_range_from_api(psync_request_t *request, psync_request_range_t *range, psync_socket *api){
@@ -235,8 +460,8 @@ static int psync_pagecache_read_range_from_api(psync_request_t *request, psync_r
   binresult *res;
   psync_uint_t len, i, h;
   int rb;
-  first_page_id=range->offset/PSYNC_FS_PAGE_SIZE;
-  len=range->length/PSYNC_FS_PAGE_SIZE;
+  first_page_id=range->offset/cache_page_size;
+  len=range->length/cache_page_size;
   res=get_result_thread(api);
   if (unlikely_log(!res))
     return -2;
@@ -249,8 +474,8 @@ static int psync_pagecache_read_range_from_api(psync_request_t *request, psync_r
   dlen=psync_find_result(res, "data", PARAM_DATA)->num;
   psync_free(res);
   for (i=0; i<len; i++){
-    page=psync_pagecache_get_free_page();
-    rb=psync_socket_readall_download_thread(api, page->page, dlen<PSYNC_FS_PAGE_SIZE?dlen:PSYNC_FS_PAGE_SIZE);
+    page=psync_pagecache_get_free_page(request->of->hash, first_page_id+i);
+    rb=psync_socket_readall_download_thread(api, page->page, dlen<cache_page_size?dlen:cache_page_size);
     if (unlikely_log(rb<=0)){
       psync_pagecache_return_free_page(page);
       psync_timer_notify_exception();
@@ -271,10 +496,7 @@ static int psync_pagecache_read_range_from_api(psync_request_t *request, psync_r
         break;
       }
     unlock_wait(page->hash);
-    pthread_mutex_lock(&cache_mutex);
-    psync_list_add_tail(&cache_hash[pagehash_by_hash_and_pageid(page->hash, page->pageid)], &page->list);
-    cache_pages_in_hash++;
-    pthread_mutex_unlock(&cache_mutex);
+    psync_pagecache_add_page(page);
   }
   return 0;
 }
@@ -438,8 +660,12 @@ static int get_urls(psync_request_t *request, psync_urls_t *urls){
     debug(D_NOTICE, "got file URLs of fileid %lu, hash %lu", (unsigned long)request->fileid, (unsigned long)request->hash);
     if (likely_log(hosts->length && hosts->array[0]->type==PARAM_STR))
       psync_http_connect_and_cache_host(hosts->array[0]->str);
-    /*if (of->initialsize>=PSYNC_FS_FILESIZE_FOR_2CONN && hosts->length>1 && hosts->array[1]->type==PARAM_STR)
-      psync_http_connect_and_cache_host(hosts->array[1]->str);*/
+    if (request->of->initialsize>=PSYNC_FS_FILESIZE_FOR_2CONN){
+      uint32_t i;
+      for (i=1; i<hosts->length && i<PSYNC_FS_MAX_READ_CONNECTIONS; i++)
+        if (hosts->array[i]->type==PARAM_STR)
+          psync_http_connect_and_cache_host(hosts->array[i]->str);
+    }
     set_urls(urls, ret);
     psync_list_for_each_safe(l1, l2, &request->ranges){
       range=psync_list_element(l1, psync_request_range_t, list);
@@ -564,77 +790,226 @@ static void release_bad_urls(psync_urls_t *urls){
 }
 
 static uint64_t offset_round_down_to_page(uint64_t offset){
-  return offset&~(((uint64_t)PSYNC_FS_PAGE_SIZE)-1);
+  return offset&~(((uint64_t)cache_page_size)-1);
 }
 
 static uint64_t size_round_up_to_page(uint64_t size){
-  return ((size-1)|(((uint64_t)PSYNC_FS_PAGE_SIZE)-1))+1;
+  return ((size-1)|(((uint64_t)cache_page_size)-1))+1;
 }
 
 static int has_page_in_cache_by_hash(uint64_t hash, uint64_t pageid){
   psync_cache_page_t *page;
+  psync_cache_shard_t *shard;
   psync_uint_t h;
   h=pagehash_by_hash_and_pageid(hash, pageid);
-  pthread_mutex_lock(&cache_mutex);
+  shard=shard_by_pagehash(h);
+  pthread_mutex_lock(&shard->mutex);
   psync_list_for_each_element(page, &cache_hash[h], psync_cache_page_t, list)
     if (page->type==PAGE_TYPE_READ && page->hash==hash && page->pageid==pageid){
-      pthread_mutex_unlock(&cache_mutex);
+      pthread_mutex_unlock(&shard->mutex);
       return 1;
     }
-  pthread_mutex_unlock(&cache_mutex);
+  pthread_mutex_unlock(&shard->mutex);
   return 0;
 }
 
+static uint64_t index_bucket(uint64_t hash, uint64_t pageid){
+  uint64_t h;
+  h=hash*0x9E3779B97F4A7C15ULL+pageid*0xC2B2AE3D27D4EB4FULL;
+  return (h^(h>>31))&index_mask;
+}
+
+static psync_page_index_entry_t *index_find_locked(uint64_t hash, uint64_t pageid){
+  psync_page_index_entry_t *e;
+  uint64_t b;
+  b=index_bucket(hash, pageid);
+  while (1){
+    e=&index_entries[b];
+    if (!e->id)
+      return NULL;
+    if (e->hash==hash && e->pageid==pageid)
+      return e;
+    b=(b+1)&index_mask;
+  }
+}
+
+/* returns either the existing entry for hash and pageid or an empty bucket where it should be put, the table is
+ * never more than 3/4 full so there is always one */
+static psync_page_index_entry_t *index_find_or_empty_locked(uint64_t hash, uint64_t pageid){
+  psync_page_index_entry_t *e;
+  uint64_t b;
+  b=index_bucket(hash, pageid);
+  while (1){
+    e=&index_entries[b];
+    if (!e->id || (e->hash==hash && e->pageid==pageid))
+      return e;
+    b=(b+1)&index_mask;
+  }
+}
+
+/* backward shift deletion, no tombstones are needed with linear probing */
+static void index_del_locked(psync_page_index_entry_t *e){
+  uint64_t i, j, k;
+  i=e-index_entries;
+  j=i;
+  while (1){
+    j=(j+1)&index_mask;
+    if (!index_entries[j].id)
+      break;
+    k=index_bucket(index_entries[j].hash, index_entries[j].pageid);
+    if (i<=j?(i<k && k<=j):(i<k || k<=j))
+      continue;
+    index_entries[i]=index_entries[j];
+    i=j;
+  }
+  memset(&index_entries[i], 0, sizeof(psync_page_index_entry_t));
+  index_dirty=1;
+}
+
+static uint64_t index_buckets_for_slots(uint64_t slots){
+  uint64_t buckets;
+  buckets=1024;
+  while (buckets<slots+slots/3)
+    buckets*=2;
+  return buckets;
+}
+
+static int index_sync(){
+  int ret;
+  pthread_mutex_lock(&index_mutex);
+  index_dirty=0;
+  pthread_mutex_unlock(&index_mutex);
+  if (!index_map_size)
+    return 0;
+  ret=psync_mmap_file_sync(index_map, index_map_size);
+  if (unlikely(ret))
+    debug(D_ERROR, "failed to sync cache index");
+  return ret;
+}
+
+/* slots can be reused only after the removal of their entries is on the disk and no read is using them */
+static void index_free_slots(uint32_t *ids, uint32_t cnt){
+  uint32_t i;
+  if (!cnt)
+    return;
+  index_sync();
+  pthread_mutex_lock(&index_mutex);
+  for (i=0; i<cnt; i++)
+    if (cache_slots[ids[i]].pins)
+      cache_slots[ids[i]].freed=1;
+    else
+      free_slots[free_db_pages++]=ids[i];
+  pthread_mutex_unlock(&index_mutex);
+}
+
+static void slot_unpin_locked(uint32_t id){
+  if (!--cache_slots[id].pins && cache_slots[id].freed){
+    cache_slots[id].freed=0;
+    free_slots[free_db_pages++]=id;
+  }
+}
+
+static void slot_pins_release(psync_slot_pins_t *pins){
+  uint32_t i;
+  if (!pins->cnt)
+    return;
+  pthread_mutex_lock(&index_mutex);
+  for (i=0; i<pins->cnt; i++)
+    slot_unpin_locked(pins->ids[i]);
+  pthread_mutex_unlock(&index_mutex);
+  pins->cnt=0;
+}
+
+static void slot_pins_destroy(void *ptr){
+  psync_slot_pins_t *pins;
+  pins=(psync_slot_pins_t *)ptr;
+  slot_pins_release(pins);
+  if (pins->ids)
+    psync_free(pins->ids);
+  psync_free(pins);
+}
+
+static psync_slot_pins_t *slot_pins_get(uint32_t cnt){
+  psync_slot_pins_t *pins;
+  pins=(psync_slot_pins_t *)pthread_getspecific(slot_pins_key);
+  if (!pins){
+    pins=psync_new(psync_slot_pins_t);
+    pins->ids=NULL;
+    pins->cnt=0;
+    pins->alloc=0;
+    pthread_setspecific(slot_pins_key, pins);
+  }
+  if (pins->cnt+cnt>pins->alloc){
+    pins->alloc=pins->cnt+cnt;
+    pins->ids=(uint32_t *)psync_realloc(pins->ids, sizeof(uint32_t)*pins->alloc);
+  }
+  return pins;
+}
+
+/* fuse replies to a read returned as ranges of the cache file before the thread that made it serves another
+ * request, so the pins of the previous read of the thread are released when it starts a new one (or exits)
+ */
+void psync_pagecache_unpin_ranges(){
+  psync_slot_pins_t *pins;
+  pins=(psync_slot_pins_t *)pthread_getspecific(slot_pins_key);
+  if (pins)
+    slot_pins_release(pins);
+}
+
 static unsigned char *has_pages_in_db(uint64_t hash, uint64_t pageid, uint32_t pagecnt){
-  psync_sql_res *res;
-  psync_uint_row row;
+  psync_page_index_entry_t *e;
   unsigned char *ret;
+  uint32_t *ids;
   uint64_t fromid;
-  uint32_t fcnt;
+  uint32_t fcnt, i;
   ret=psync_new_cnt(unsigned char, pagecnt);
+  ids=psync_new_cnt(uint32_t, pagecnt);
   memset(ret, 0, pagecnt);
+  pthread_mutex_lock(&index_mutex);
+  for (i=0; i<pagecnt; i++)
+    if ((e=index_find_locked(hash, pageid+i))){
+      ret[i]=1;
+      ids[i]=e->id;
+    }
+  pthread_mutex_unlock(&index_mutex);
   fromid=0;
   fcnt=0;
-  res=psync_sql_query("SELECT pageid, id FROM pagecache WHERE type=+"NTO_STR(PAGE_TYPE_READ)" AND hash=? AND pageid>=? AND pageid<? ORDER BY pageid");
-  psync_sql_bind_uint(res, 1, hash);
-  psync_sql_bind_uint(res, 2, pageid);
-  psync_sql_bind_uint(res, 3, pageid+pagecnt);
-  while ((row=psync_sql_fetch_rowint(res))){
-    ret[row[0]-pageid]=1;
-    if (row[1]==fromid+fcnt)
+  for (i=0; i<pagecnt; i++){
+    if (!ret[i])
+      continue;
+    if (ids[i]==fromid+fcnt)
       fcnt++;
     else{
       if (fcnt)
-        psync_file_readahead(readcache, fromid*PSYNC_FS_PAGE_SIZE, fcnt*PSYNC_FS_PAGE_SIZE);
-      fromid=row[1];
+        psync_file_readahead(readcache, fromid*cache_page_size, fcnt*cache_page_size);
+      fromid=ids[i];
       fcnt=1;
     }
   }
-  psync_sql_free_result(res);
   if (fcnt)
-    psync_file_readahead(readcache, fromid*PSYNC_FS_PAGE_SIZE, fcnt*PSYNC_FS_PAGE_SIZE);
+    psync_file_readahead(readcache, fromid*cache_page_size, fcnt*cache_page_size);
+  psync_free(ids);
   return ret;
 }
 
 static int has_page_in_db(uint64_t hash, uint64_t pageid){
-  psync_sql_res *res;
-  psync_uint_row row;
-  res=psync_sql_query("SELECT pageid FROM pagecache WHERE type=+"NTO_STR(PAGE_TYPE_READ)" AND hash=? AND pageid=?");
-  psync_sql_bind_uint(res, 1, hash);
-  psync_sql_bind_uint(res, 2, pageid);
-  row=psync_sql_fetch_rowint(res);
-  psync_sql_free_result(res);
-  return row!=NULL;
+  int ret;
+  pthread_mutex_lock(&index_mutex);
+  ret=index_find_locked(hash, pageid)!=NULL;
+  pthread_mutex_unlock(&index_mutex);
+  return ret;
 }
 
 static psync_int_t check_page_in_memory_by_hash(uint64_t hash, uint64_t pageid, char *buff, psync_uint_t size, psync_uint_t off){
   psync_cache_page_t *page;
+  psync_cache_shard_t *shard;
   psync_uint_t h;
   psync_int_t ret;
   time_t tm;
   ret=-1;
   h=pagehash_by_hash_and_pageid(hash, pageid);
-  pthread_mutex_lock(&cache_mutex);
+  shard=shard_by_pagehash(h);
+  pthread_mutex_lock(&shard->mutex);
   psync_list_for_each_element(page, &cache_hash[h], psync_cache_page_t, list)
     if (page->type==PAGE_TYPE_READ && page->hash==hash && page->pageid==pageid){
       tm=psync_timer_time();
@@ -642,6 +1017,7 @@ static psync_int_t check_page_in_memory_by_hash(uint64_t hash, uint64_t pageid,
         page->usecnt++;
         page->lastuse=tm;
       }
+      page->referenced=1;
       if (size+off>page->size){
         if (off>page->size)
           size=0;
@@ -650,146 +1026,131 @@ static psync_int_t check_page_in_memory_by_hash(uint64_t hash, uint64_t pageid,
       }
       memcpy(buff, page->page+off, size);
       ret=size;
+      break;
     }
-  pthread_mutex_unlock(&cache_mutex);
+  pthread_mutex_unlock(&shard->mutex);
   return ret;
 }
 
-typedef struct {
-  time_t lastuse;
-  uint32_t id;
-  uint32_t usecnt;
-} pagecache_entry;
+/* Pages in the cache file are kept in LRU lists by tier of their use count, the limits of the tiers being 2, 4, 8 and 16
+ * uses. A tier that holds more than its percent of the pages gives its least recently used page when a page needs to be
+ * evicted, so the order is maintained on every access and eviction never needs to look at the whole cache.
+ * Sum should be around 90-95 percent.
+ */
+#define PSYNC_FS_CACHE_LRU_PERCENT 40
+#define PSYNC_FS_CACHE_LRU2_PERCENT 25
+#define PSYNC_FS_CACHE_LRU4_PERCENT 15
+#define PSYNC_FS_CACHE_LRU8_PERCENT 10
+#define PSYNC_FS_CACHE_LRU16_PERCENT 5
 
-static int pagecache_entry_cmp_lastuse(const void *p1, const void *p2){
-  const pagecache_entry *e1, *e2;
-  e1=(const pagecache_entry *)p1;
-  e2=(const pagecache_entry *)p2;
-  return (int)((int64_t)e1->lastuse-(int64_t)e2->lastuse);
-}
+static const uint32_t tier_percent[PAGE_TIERS]={PSYNC_FS_CACHE_LRU_PERCENT, PSYNC_FS_CACHE_LRU2_PERCENT, PSYNC_FS_CACHE_LRU4_PERCENT,
+                                                PSYNC_FS_CACHE_LRU8_PERCENT, PSYNC_FS_CACHE_LRU16_PERCENT};
 
-static int pagecache_entry_cmp_usecnt_lastuse2(const void *p1, const void *p2){
-  const pagecache_entry *e1, *e2;
-  e1=(const pagecache_entry *)p1;
-  e2=(const pagecache_entry *)p2;
-  if (e1->usecnt>=2 && e2->usecnt<2)
+static uint32_t page_tier(uint32_t usecnt){
+  if (usecnt<2)
+    return 0;
+  else if (usecnt<4)
     return 1;
-  else if (e2->usecnt>=2 && e1->usecnt<2)
-    return -1;
+  else if (usecnt<8)
+    return 2;
+  else if (usecnt<16)
+    return 3;
   else
-    return (int)((int64_t)e1->lastuse-(int64_t)e2->lastuse);
+    return 4;
 }
 
-static int pagecache_entry_cmp_usecnt_lastuse4(const void *p1, const void *p2){
-  const pagecache_entry *e1, *e2;
-  e1=(const pagecache_entry *)p1;
-  e2=(const pagecache_entry *)p2;
-  if (e1->usecnt>=4 && e2->usecnt<4)
-    return 1;
-  else if (e2->usecnt>=4 && e1->usecnt<4)
-    return -1;
+static void lru_add_locked(uint32_t id, uint64_t hash, uint64_t pageid, uint32_t usecnt){
+  psync_page_slot_t *slot;
+  uint32_t tier;
+  tier=page_tier(usecnt);
+  slot=&cache_slots[id];
+  slot->hash=hash;
+  slot->pageid=pageid;
+  slot->tier=tier;
+  slot->next=0;
+  slot->prev=lru_tail[tier];
+  if (lru_tail[tier])
+    cache_slots[lru_tail[tier]].next=id;
   else
-    return (int)((int64_t)e1->lastuse-(int64_t)e2->lastuse);
+    lru_head[tier]=id;
+  lru_tail[tier]=id;
+  lru_cnt[tier]++;
+  lru_used++;
 }
 
-static int pagecache_entry_cmp_usecnt_lastuse8(const void *p1, const void *p2){
-  const pagecache_entry *e1, *e2;
-  e1=(const pagecache_entry *)p1;
-  e2=(const pagecache_entry *)p2;
-  if (e1->usecnt>=8 && e2->usecnt<8)
-    return 1;
-  else if (e2->usecnt>=8 && e1->usecnt<8)
-    return -1;
+static void lru_del_locked(uint32_t id){
+  psync_page_slot_t *slot;
+  slot=&cache_slots[id];
+  if (slot->prev)
+    cache_slots[slot->prev].next=slot->next;
+  else
+    lru_head[slot->tier]=slot->next;
+  if (slot->next)
+    cache_slots[slot->next].prev=slot->prev;
   else
-    return (int)((int64_t)e1->lastuse-(int64_t)e2->lastuse);
+    lru_tail[slot->tier]=slot->prev;
+  lru_cnt[slot->tier]--;
+  lru_used--;
 }
 
-static int pagecache_entry_cmp_usecnt_lastuse16(const void *p1, const void *p2){
-  const pagecache_entry *e1, *e2;
-  e1=(const pagecache_entry *)p1;
-  e2=(const pagecache_entry *)p2;
-  if (e1->usecnt>=16 && e2->usecnt<16)
-    return 1;
-  else if (e2->usecnt>=16 && e1->usecnt<16)
-    return -1;
-  else
-    return (int)((int64_t)e1->lastuse-(int64_t)e2->lastuse);
+static void lru_touch_locked(uint32_t id, uint32_t usecnt){
+  lru_del_locked(id);
+  lru_add_locked(id, cache_slots[id].hash, cache_slots[id].pageid, usecnt);
 }
 
-/* sum should be around 90-95 percent, so after a run cache get smaller */
-#define PSYNC_FS_CACHE_LRU_PERCENT 40
-#define PSYNC_FS_CACHE_LRU2_PERCENT 25
-#define PSYNC_FS_CACHE_LRU4_PERCENT 15
-#define PSYNC_FS_CACHE_LRU8_PERCENT 10
-#define PSYNC_FS_CACHE_LRU16_PERCENT 5
+static uint32_t lru_victim_locked(){
+  uint32_t i;
+  for (i=0; i<PAGE_TIERS; i++)
+    if (lru_cnt[i] && (uint64_t)lru_cnt[i]*100>(uint64_t)lru_used*tier_percent[i])
+      return lru_head[i];
+  for (i=0; i<PAGE_TIERS; i++)
+    if (lru_cnt[i])
+      return lru_head[i];
+  return 0;
+}
 
-static void clean_cache(){
-  psync_sql_res *res;
-  uint64_t ocnt, cnt, i, j, e;
-  psync_uint_row row;
-  pagecache_entry *entries;
-  debug(D_NOTICE, "cleaning cache, free cache pages %u", (unsigned)free_db_pages);
-  if (pthread_mutex_trylock(&clean_cache_mutex)){
-    debug(D_NOTICE, "cache clean already in progress, skipping");
-    return;
-  }
-  cnt=psync_sql_cellint("SELECT COUNT(*) FROM pagecache", 0);
-  entries=(pagecache_entry *)psync_malloc(cnt*sizeof(pagecache_entry));
-  i=0;
-  while (i<cnt){
-    res=psync_sql_query("SELECT id, lastuse, usecnt, type FROM pagecache WHERE id>? ORDER BY id LIMIT 10000");
-    psync_sql_bind_uint(res, 1, i);
-    while ((row=psync_sql_fetch_rowint(res))){
-      if (i>=cnt)
+static void evict_cache_pages(){
+  psync_page_index_entry_t *e;
+  uint32_t *ids;
+  uint32_t cnt, id, i;
+  debug(D_NOTICE, "evicting cache pages, free cache pages %u", (unsigned)free_db_pages);
+  ids=psync_new_cnt(uint32_t, PAGE_EVICT_PER_RUN);
+  cnt=0;
+  while (cnt<PAGE_EVICT_PER_RUN){
+    pthread_mutex_lock(&index_mutex);
+    for (i=0; i<PAGE_EVICT_BATCH && cnt<PAGE_EVICT_PER_RUN && free_db_pages+cnt<evict_high_watermark; i++){
+      if (!(id=lru_victim_locked()))
         break;
-      if (row[3]!=PAGE_TYPE_READ)
-        continue;
-      entries[i].lastuse=row[1];
-      entries[i].id=row[0];
-      entries[i].usecnt=row[2];
-      i++;
-    }
-    psync_sql_free_result(res);
-    psync_milisleep(1);
-  }
-  ocnt=cnt=i;
-  debug(D_NOTICE, "read %lu entries", (unsigned long)cnt);
-  qsort(entries, cnt, sizeof(pagecache_entry), pagecache_entry_cmp_lastuse);
-  cnt-=PSYNC_FS_CACHE_LRU_PERCENT*ocnt/100;
-  debug(D_NOTICE, "sorted entries by lastuse, continuing with %lu oldest entries", (unsigned long)cnt);
-  qsort(entries, cnt, sizeof(pagecache_entry), pagecache_entry_cmp_usecnt_lastuse2);
-  cnt-=PSYNC_FS_CACHE_LRU2_PERCENT*ocnt/100;
-  debug(D_NOTICE, "sorted entries by more than 2 uses and lastuse, continuing with %lu entries", (unsigned long)cnt);
-  qsort(entries, cnt, sizeof(pagecache_entry), pagecache_entry_cmp_usecnt_lastuse4);
-  cnt-=PSYNC_FS_CACHE_LRU4_PERCENT*ocnt/100;
-  debug(D_NOTICE, "sorted entries by more than 4 uses and lastuse, continuing with %lu entries", (unsigned long)cnt);
-  qsort(entries, cnt, sizeof(pagecache_entry), pagecache_entry_cmp_usecnt_lastuse8);
-  cnt-=PSYNC_FS_CACHE_LRU8_PERCENT*ocnt/100;
-  debug(D_NOTICE, "sorted entries by more than 8 uses and lastuse, continuing with %lu entries", (unsigned long)cnt);
-  qsort(entries, cnt, sizeof(pagecache_entry), pagecache_entry_cmp_usecnt_lastuse16);
-  cnt-=PSYNC_FS_CACHE_LRU16_PERCENT*ocnt/100;
-  debug(D_NOTICE, "sorted entries by more than 16 uses and lastuse, deleting %lu entries", (unsigned long)cnt);
-  ocnt=(cnt+255)/256;
-  for (j=0; j<ocnt; j++){
-    i=j*256;
-    e=i+256;
-    if (e>cnt)
-      e=cnt;
-    psync_sql_start_transaction();
-    res=psync_sql_prep_statement("UPDATE pagecache SET type="NTO_STR(PAGE_TYPE_FREE)" WHERE id=?");
-    for (; i<e; i++){
-      psync_sql_bind_uint(res, 1, entries[i].id);
-      psync_sql_run(res);
-      free_db_pages++;
+      if ((e=index_find_locked(cache_slots[id].hash, cache_slots[id].pageid)) && e->id==id)
+        index_del_locked(e);
+      lru_del_locked(id);
+      ids[cnt++]=id;
     }
-    psync_sql_free_result(res);
-    psync_sql_commit_transaction();
-    psync_milisleep(5);
+    pthread_mutex_unlock(&index_mutex);
+    if (i<PAGE_EVICT_BATCH)
+      break;
   }
-  pthread_mutex_unlock(&clean_cache_mutex);
-  psync_free(entries);
-  psync_sql_sync();
-  debug(D_NOTICE, "finished cleaning cache, free cache pages %u", (unsigned)free_db_pages);
+  index_free_slots(ids, cnt);
+  psync_free(ids);
+  pthread_mutex_lock(&index_mutex);
+  evictrun=0;
+  pthread_mutex_unlock(&index_mutex);
+  debug(D_NOTICE, "evicted %u pages, free cache pages %u", (unsigned)cnt, (unsigned)free_db_pages);
+}
+
+static void check_evict_cache_pages(){
+  pthread_mutex_lock(&index_mutex);
+  if (free_db_pages<evict_low_watermark && !evictrun && lru_used){
+    evictrun=1;
+    pthread_mutex_unlock(&index_mutex);
+    psync_run_thread("evict cache pages", evict_cache_pages);
+  }
+  else
+    pthread_mutex_unlock(&index_mutex);
+}
+
+static void psync_pagecache_evict_timer(psync_timer_t timer, void *ptr){
+  check_evict_cache_pages();
 }
 
 static int cmp_flush_pages(const psync_list *p1, const psync_list *p2){
@@ -808,38 +1169,51 @@ static int cmp_flush_pages(const psync_list *p1, const psync_list *p2){
     return 0;
 }
 
+static void psync_pagecache_mark_page_clean(psync_cache_page_t *page){
+  psync_cache_shard_t *shard;
+  shard=shard_by_pagehash(pagehash_by_hash_and_pageid(page->hash, page->pageid));
+  pthread_mutex_lock(&shard->mutex);
+  page->dirty=0;
+  shard->pages_dirty--;
+  pthread_mutex_unlock(&shard->mutex);
+}
+
 static int flush_pages(int nosleep){
   static time_t lastflush=0;
-  psync_sql_res *res;
-  psync_uint_row row;
+  psync_page_index_entry_t *e;
   psync_cache_page_t *page;
+  psync_cache_shard_t *shard;
   psync_list pages_to_flush;
-  psync_uint_t i, updates, pagecnt;
+  psync_uint_t i, pagecnt;
   time_t ctime;
-  uint32_t cpih;
+  uint32_t *oldids;
+  uint32_t cpih, oldcnt;
   int ret;
   flushedbetweentimers=1;
   pthread_mutex_lock(&flush_cache_mutex);
-  updates=0;
   pagecnt=0;
+  ret=0;
   ctime=psync_timer_time();
   psync_list_init(&pages_to_flush);
-  pthread_mutex_lock(&cache_mutex);
-  if (cache_pages_in_hash){
+  cpih=cache_pages_dirty();
+  if (cpih){
     debug(D_NOTICE, "flushing cache");
-    for (i=0; i<CACHE_HASH; i++)
-      psync_list_for_each_element(page, &cache_hash[i], psync_cache_page_t, list)
-        if (page->type==PAGE_TYPE_READ){
+    for (i=0; i<CACHE_SHARDS; i++){
+      shard=&cache_shards[i];
+      pthread_mutex_lock(&shard->mutex);
+      psync_list_for_each_element(page, &shard->clock, psync_cache_page_t, clock)
+        if (page->dirty && page->type==PAGE_TYPE_READ){
           psync_list_add_tail(&pages_to_flush, &page->flushlist);
           pagecnt++;
         }
-    pthread_mutex_unlock(&cache_mutex);
+      pthread_mutex_unlock(&shard->mutex);
+    }
     psync_list_sort(&pages_to_flush, cmp_flush_pages);
-    res=psync_sql_query("SELECT id FROM pagecache WHERE type="NTO_STR(PAGE_TYPE_FREE)" ORDER BY id LIMIT ?");
-    psync_sql_bind_uint(res, 1, pagecnt);
-    pagecnt=0;
+    pthread_mutex_lock(&index_mutex);
     psync_list_for_each_element(page, &pages_to_flush, psync_cache_page_t, flushlist){
-      if (unlikely(!(row=psync_sql_fetch_rowint(res)))){
+      if (likely(free_db_pages))
+        page->flushpageid=free_slots[--free_db_pages];
+      else{
         psync_list *l1, *l2;
         l1=&page->flushlist;
         do{
@@ -849,23 +1223,10 @@ static int flush_pages(int nosleep){
         } while (l1!=&pages_to_flush);
         break;
       }
-      page->flushpageid=row[0];
     }
-    psync_sql_free_result(res);
-/*    res=psync_sql_query("SELECT id FROM pagecache WHERE type="NTO_STR(PAGE_TYPE_FREE)" ORDER BY id");
-    for (i=0; i<CACHE_HASH; i++)
-      psync_list_for_each_element(page, &cache_hash[i], psync_cache_page_t, list)
-        if (page->type==PAGE_TYPE_READ){
-          if (!(row=psync_sql_fetch_rowint(res)))
-            goto break2;
-          page->flushpageid=row[0];
-          psync_list_add_tail(&pages_to_flush, &page->flushlist);
-        }
-break2:
-    psync_sql_free_result(res);
-    pthread_mutex_unlock(&cache_mutex);*/
+    pthread_mutex_unlock(&index_mutex);
     psync_list_for_each_element(page, &pages_to_flush, psync_cache_page_t, flushlist){
-      if (psync_file_pwrite(readcache, page->page, PSYNC_FS_PAGE_SIZE, (uint64_t)page->flushpageid*PSYNC_FS_PAGE_SIZE)!=PSYNC_FS_PAGE_SIZE){
+      if (psync_file_pwrite(readcache, page->page, cache_page_size, (uint64_t)page->flushpageid*cache_page_size)!=cache_page_size){
         debug(D_ERROR, "write to cache file failed");
         pthread_mutex_unlock(&flush_cache_mutex);
         return -1;
@@ -874,109 +1235,56 @@ break2:
     i=0;
     debug(D_NOTICE, "cache data written");
     /* if we can afford it, wait a while before calling fsync() as at least on Linux this blocks reads from the same file until it returns */
-    if (!nosleep){
-      pthread_mutex_lock(&cache_mutex);
-      while (cache_pages_free>=CACHE_PAGES*5/100 && i++<200){
-        pthread_mutex_unlock(&cache_mutex);
+    if (!nosleep)
+      while (cache_pages_reclaimable()>=cache_pages*5/100 && i++<200)
         psync_milisleep(10);
-        pthread_mutex_lock(&cache_mutex);
-      }
-      pthread_mutex_unlock(&cache_mutex);
-    }
     if (psync_file_sync(readcache)){
       debug(D_ERROR, "flush of cache file failed");
       pthread_mutex_unlock(&flush_cache_mutex);
       return -1;
     }
     debug(D_NOTICE, "cache data synced");
-    pthread_mutex_lock(&cache_mutex);
-  }  
-  psync_sql_start_transaction();
-  if (db_cache_max_page<db_cache_in_pages && cache_pages_in_hash){
-    i=0;
-    res=psync_sql_prep_statement("INSERT INTO pagecache (type) VALUES ("NTO_STR(PAGE_TYPE_FREE)")");
-    while (db_cache_max_page+i<db_cache_in_pages && i<CACHE_PAGES && i<cache_pages_in_hash){
-      psync_sql_run(res);
-      i++;
-    }
-    psync_sql_free_result(res);
-    free_db_pages+=i;
-    db_cache_max_page+=i;
-    debug(D_NOTICE, "inserted %lu new free pages to database, db_cache_in_pages=%lu, db_cache_max_page=%lu", 
-                    (unsigned long)i, (unsigned long)db_cache_in_pages, (unsigned long)db_cache_max_page);
   }
-  cpih=cache_pages_in_hash;
   if (!psync_list_isempty(&pages_to_flush)){
-    res=psync_sql_prep_statement("UPDATE pagecache SET hash=?, pageid=?, type="NTO_STR(PAGE_TYPE_READ)", lastuse=?, usecnt=?, size=? WHERE id=?");
+    oldids=psync_new_cnt(uint32_t, pagecnt);
+    oldcnt=0;
+    pagecnt=0;
+    pthread_mutex_lock(&index_mutex);
     psync_list_for_each_element(page, &pages_to_flush, psync_cache_page_t, flushlist){
-      psync_list_del(&page->list);
-      psync_sql_bind_uint(res, 1, page->hash);
-      psync_sql_bind_uint(res, 2, page->pageid);
-      psync_sql_bind_uint(res, 3, page->lastuse);
-      psync_sql_bind_uint(res, 4, page->usecnt);
-      psync_sql_bind_uint(res, 5, page->size);
-      psync_sql_bind_uint(res, 6, page->flushpageid);
-      psync_sql_run(res);
-      updates++;
-      pagecnt++;
-      cache_pages_free++;
-      free_db_pages--;
-      psync_list_add_head(&free_pages, &page->list);
-      if (updates%64==0){
-        psync_sql_free_result(res);
-        psync_sql_commit_transaction();
-        pthread_mutex_unlock(&cache_mutex);
-        psync_milisleep(1);
-        pthread_mutex_lock(&cache_mutex);
-        psync_sql_start_transaction();
-        res=psync_sql_prep_statement("UPDATE pagecache SET hash=?, pageid=?, type="NTO_STR(PAGE_TYPE_READ)", lastuse=?, usecnt=?, size=? WHERE id=?");
+      e=index_find_or_empty_locked(page->hash, page->pageid);
+      /* the page was already on the disk (e.g. also added by upload to cache), the old copy is released */
+      if (e->id){
+        oldids[oldcnt++]=e->id;
+        lru_del_locked(e->id);
       }
+      e->hash=page->hash;
+      e->pageid=page->pageid;
+      e->id=page->flushpageid;
+      e->lastuse=page->lastuse;
+      e->usecnt=page->usecnt;
+      e->size=page->size;
+      lru_add_locked(e->id, e->hash, e->pageid, e->usecnt);
+      pagecnt++;
+      /* the page stays in memory, but from now on it can be evicted */
+      psync_pagecache_mark_page_clean(page);
     }
-    psync_sql_free_result(res);
-    debug(D_NOTICE, "flushed %u pages to cache file, free db pages %u, cache_pages_in_hash=%u", (unsigned)pagecnt,
-          (unsigned)free_db_pages, (unsigned)cache_pages_in_hash);
-    cache_pages_in_hash-=pagecnt;
-  }
-  if (cachepages_to_update_cnt && (cpih || cachepages_to_update_cnt>=DB_CACHE_UPDATE_HASH/4 || lastflush+300<ctime)){
-    res=psync_sql_prep_statement("UPDATE pagecache SET lastuse=?, usecnt=usecnt+? WHERE id=?");
-    for (i=0; i<DB_CACHE_UPDATE_HASH; i++)
-      if (cachepages_to_update[i].pagecacheid){
-        psync_sql_bind_uint(res, 1, cachepages_to_update[i].lastuse);
-        psync_sql_bind_uint(res, 2, cachepages_to_update[i].usecnt);
-        psync_sql_bind_uint(res, 3, cachepages_to_update[i].pagecacheid);
-        psync_sql_run(res);
-        memset(&cachepages_to_update[i], 0, sizeof(psync_cachepage_to_update));
-        updates++;
-        if (updates%128==0){
-          psync_sql_free_result(res);
-          psync_sql_commit_transaction();
-          pthread_mutex_unlock(&cache_mutex);
-          psync_milisleep(1);
-          pthread_mutex_lock(&cache_mutex);
-          psync_sql_start_transaction();
-          res=psync_sql_prep_statement("UPDATE pagecache SET lastuse=?, usecnt=usecnt+? WHERE id=?");
-        }
-      }
-    psync_sql_free_result(res);
-    debug(D_NOTICE, "flushed %u access records to database", (unsigned)cachepages_to_update_cnt);
-    cachepages_to_update_cnt=0;
-    lastflush=ctime;
-  }
+    index_dirty=1;
+    pthread_mutex_unlock(&index_mutex);
+    index_free_slots(oldids, oldcnt);
+    psync_free(oldids);
+    debug(D_NOTICE, "flushed %u pages to cache file, free db pages %u, dirty pages left %u", (unsigned)pagecnt,
+          (unsigned)free_db_pages, (unsigned)cache_pages_dirty());
+  }
+  pthread_mutex_lock(&flush_run_mutex);
   flushchacherun=0;
-  if (updates){
-    ret=psync_sql_commit_transaction();
-    pthread_mutex_unlock(&cache_mutex);
-    pthread_mutex_unlock(&flush_cache_mutex);
-    if (free_db_pages<=CACHE_PAGES*2)
-      psync_run_thread("clean cache", clean_cache);
-    return ret;
-  }
-  else{
-    psync_sql_rollback_transaction();
-    pthread_mutex_unlock(&cache_mutex);
-    pthread_mutex_unlock(&flush_cache_mutex);
-    return 0;
+  pthread_mutex_unlock(&flush_run_mutex);
+  if (index_dirty && (cpih || lastflush+300<ctime)){
+    ret=index_sync();
+    lastflush=ctime;
   }
+  pthread_mutex_unlock(&flush_cache_mutex);
+  check_evict_cache_pages();
+  return ret;
 }
 
 int psync_pagecache_flush(){
@@ -987,53 +1295,32 @@ int psync_pagecache_flush(){
 }
 
 static void psync_pagecache_flush_timer(psync_timer_t timer, void *ptr){
-  if (!flushedbetweentimers && (cache_pages_in_hash || cachepages_to_update_cnt))
+  if (!flushedbetweentimers && (cache_pages_dirty() || index_dirty))
     psync_run_thread("flush pages timer", flush_pages_noret);
   flushedbetweentimers=0;
 }
 
-static void mark_pagecache_used(uint64_t pagecacheid){
-  uint64_t h;
+static void index_mark_used_locked(psync_page_index_entry_t *e){
   time_t tm;
-  h=pagecacheid%DB_CACHE_UPDATE_HASH;
   tm=psync_timer_time();
-  if (cachepages_to_update_cnt>DB_CACHE_UPDATE_HASH/2)
-    flush_pages(1);
-  pthread_mutex_lock(&cache_mutex);
-  while (1){
-    if (cachepages_to_update[h].pagecacheid==0){
-      cachepages_to_update[h].pagecacheid=pagecacheid;
-      cachepages_to_update[h].lastuse=tm;
-      cachepages_to_update[h].usecnt=1;
-      cachepages_to_update_cnt++;
-      break;
-    }
-    else if (cachepages_to_update[h].pagecacheid==pagecacheid){
-      if (tm>cachepages_to_update[h].lastuse+5){
-        cachepages_to_update[h].lastuse=tm;
-        cachepages_to_update[h].usecnt++;
-      }
-      break;
-    }
-    if (++h>=DB_CACHE_UPDATE_HASH)
-      h=0;
+  if (tm>e->lastuse+5){
+    e->lastuse=tm;
+    e->usecnt++;
+    lru_touch_locked(e->id, e->usecnt);
+    index_dirty=1;
   }
-  pthread_mutex_unlock(&cache_mutex);
 }
 
 static psync_int_t check_page_in_database_by_hash(uint64_t hash, uint64_t pageid, char *buff, psync_uint_t size, psync_uint_t off){
-  psync_sql_res *res;
-  psync_variant_row row;
+  psync_page_index_entry_t *e;
   size_t dsize;
   psync_int_t ret;
-  uint64_t pagecacheid;
+  uint32_t pagecacheid;
   ret=-1;
-  res=psync_sql_query("SELECT id, size FROM pagecache WHERE type="NTO_STR(PAGE_TYPE_READ)" AND hash=? AND pageid=?");
-  psync_sql_bind_uint(res, 1, hash);
-  psync_sql_bind_uint(res, 2, pageid);
-  if ((row=psync_sql_fetch_row(res))){
-    pagecacheid=psync_get_number(row[0]);
-    dsize=psync_get_number(row[1]);
+  pthread_mutex_lock(&index_mutex);
+  if ((e=index_find_locked(hash, pageid))){
+    pagecacheid=e->id;
+    dsize=e->size;
     if (size+off>dsize){
       if (off>dsize)
         size=0;
@@ -1041,18 +1328,22 @@ static psync_int_t check_page_in_database_by_hash(uint64_t hash, uint64_t pageid
         size=dsize-off;
     }
     ret=size;
-  }
-  psync_sql_free_result(res);
-  if (ret!=-1){
-    if (psync_file_pread(readcache, buff, size, pagecacheid*PSYNC_FS_PAGE_SIZE+off)!=size){
-      debug(D_ERROR, "failed to read %lu bytes from cache file at offset %lu", (unsigned long)size, (unsigned long)(pagecacheid*PSYNC_FS_PAGE_SIZE+off));
-      res=psync_sql_prep_statement("UPDATE pagecache SET type="NTO_STR(PAGE_TYPE_READ)" WHERE id=?");
-      psync_sql_bind_uint(res, 1, pagecacheid);
-      psync_sql_run_free(res);
-      ret=-1;
+    index_mark_used_locked(e);
+  }
+  pthread_mutex_unlock(&index_mutex);
+  if (ret!=-1 && psync_file_pread(readcache, buff, size, (uint64_t)pagecacheid*cache_page_size+off)!=size){
+    debug(D_ERROR, "failed to read %lu bytes from cache file at offset %lu", (unsigned long)size, (unsigned long)((uint64_t)pagecacheid*cache_page_size+off));
+    pthread_mutex_lock(&index_mutex);
+    if ((e=index_find_locked(hash, pageid)) && e->id==pagecacheid){
+      index_del_locked(e);
+      lru_del_locked(pagecacheid);
     }
     else
-      mark_pagecache_used(pagecacheid);
+      pagecacheid=0;
+    pthread_mutex_unlock(&index_mutex);
+    if (pagecacheid)
+      index_free_slots(&pagecacheid, 1);
+    ret=-1;
   }
   return ret;
 }
@@ -1155,8 +1446,8 @@ static void psync_pagecache_send_range_error(psync_request_range_t *range, psync
   uint64_t first_page_id;
   psync_page_wait_t *pw;
   psync_uint_t len, i, h;
-  first_page_id=range->offset/PSYNC_FS_PAGE_SIZE;
-  len=range->length/PSYNC_FS_PAGE_SIZE;
+  first_page_id=range->offset/cache_page_size;
+  len=range->length/cache_page_size;
   debug(D_NOTICE, "sending error %d to request for offset %lu, length %lu of fileid %lu hash %lu",
                   err, (unsigned long)range->offset, (unsigned long)range->length, (unsigned long)request->fileid, (unsigned long)request->hash);
   for (i=0; i<len; i++){
@@ -1179,15 +1470,96 @@ static void psync_pagecache_send_error(psync_request_t *request, int err){
   psync_pagecache_free_request(request);
 }
 
-static int psync_pagecache_read_range_from_sock(psync_request_t *request, psync_request_range_t *range, psync_http_socket *sock){
+static psync_page_wait_t *psync_pagecache_find_page_wait_locked(uint64_t hash, uint64_t pageid){
+  psync_page_wait_t *pw;
+  psync_list_for_each_element(pw, &wait_page_hash[waiterhash_by_hash_and_pageid(hash, pageid)], psync_page_wait_t, list)
+    if (pw->hash==hash && pw->pageid==pageid)
+      return pw;
+  return NULL;
+}
+
+static void psync_pagecache_account_readahead(unsigned char type, uint64_t reads, uint64_t hits, uint64_t readaheadbytes, uint64_t wastedbytes){
+  pthread_mutex_lock(&readahead_stats_mutex);
+  readahead_stats.streams[type].reads+=reads;
+  readahead_stats.streams[type].hits+=hits;
+  readahead_stats.streams[type].readaheadbytes+=readaheadbytes;
+  readahead_stats.streams[type].wastedbytes+=wastedbytes;
+  pthread_mutex_unlock(&readahead_stats_mutex);
+}
+
+void psync_pagecache_get_readahead_stats(psync_fs_readahead_stats_t *stats){
+  pthread_mutex_lock(&readahead_stats_mutex);
+  memcpy(stats, &readahead_stats, sizeof(psync_fs_readahead_stats_t));
+  pthread_mutex_unlock(&readahead_stats_mutex);
+}
+
+static int psync_pagecache_request_abandoned(psync_request_t *request){
+  psync_file_stream_t *st;
+  int ret;
+  if (request->streamid==-1)
+    return 0;
+  pthread_mutex_lock(&request->of->mutex);
+  st=&request->of->streams[request->streamid];
+  ret=st->startid!=request->streamstart || st->lastuse<psync_timer_time()-PSYNC_FS_STREAM_ABANDON_SEC;
+  pthread_mutex_unlock(&request->of->mutex);
+  return ret;
+}
+
+/* Cancels the pages of the request starting from pageid in range, unless a reader waits for any of them. The pages
+ * nobody waits for are only wanted by the readahead of the stream that made the request. */
+static int psync_pagecache_cancel_request(psync_request_t *request, psync_request_range_t *range, uint64_t pageid){
+  psync_request_range_t *r;
+  psync_page_wait_t *pw;
+  uint64_t pid, cancelled;
+  int pass;
+  cancelled=0;
+  lock_wait(request->hash);
+  for (pass=0; pass<2; pass++){
+    r=range;
+    pid=pageid;
+    while (1){
+      for (; pid<(r->offset+r->length)/cache_page_size; pid++){
+        pw=psync_pagecache_find_page_wait_locked(request->hash, pid);
+        if (!pw)
+          continue;
+        if (!pass){
+          if (!psync_list_isempty(&pw->waiters)){
+            unlock_wait(request->hash);
+            return 0;
+          }
+        }
+        else{
+          psync_pagecache_send_error_page_wait(pw, -EINTR);
+          cancelled+=cache_page_size;
+        }
+      }
+      if (r->list.next==&request->ranges)
+        break;
+      r=psync_list_element(r->list.next, psync_request_range_t, list);
+      pid=r->offset/cache_page_size;
+    }
+  }
+  unlock_wait(request->hash);
+  debug(D_NOTICE, "cancelled %lu bytes of readahead of abandoned stream", (unsigned long)cancelled);
+  psync_pagecache_account_readahead(request->streamtype, 0, 0, 0, cancelled);
+  return 1;
+}
+
+static int psync_pagecache_read_range_from_sock(psync_request_t *request, psync_request_range_t *range, psync_http_socket *sock,
+                                                struct timespec *firstresp){
   uint64_t first_page_id;
   psync_page_wait_t *pw;
   psync_cache_page_t *page;
-  psync_uint_t len, i, h;
+  psync_uint_t len, i, h, checkpages;
   int rb;
-  first_page_id=range->offset/PSYNC_FS_PAGE_SIZE;
-  len=range->length/PSYNC_FS_PAGE_SIZE;
+  first_page_id=range->offset/cache_page_size;
+  len=range->length/cache_page_size;
+  checkpages=READAHEAD_CANCEL_CHECK_BYTES/cache_page_size;
+  if (!checkpages)
+    checkpages=1;
   rb=psync_http_next_request(sock);
+  if (!rb && !firstresp->tv_sec)
+    psync_nanotime(firstresp);
   if (unlikely(rb)){
     if (rb==410 || rb==404){
       debug(D_WARNING, "got %d from psync_http_next_request, freeing URLs and requesting retry", rb);
@@ -1199,8 +1571,10 @@ static int psync_pagecache_read_range_from_sock(psync_request_t *request, psync_
     }
   }
   for (i=0; i<len; i++){
-    page=psync_pagecache_get_free_page();
-    rb=psync_http_request_readall(sock, page->page, PSYNC_FS_PAGE_SIZE);
+    if (i && i%checkpages==0 && psync_pagecache_request_abandoned(request) && psync_pagecache_cancel_request(request, range, first_page_id+i))
+      return 2;
+    page=psync_pagecache_get_free_page(request->of->hash, first_page_id+i);
+    rb=psync_http_request_readall(sock, page->page, cache_page_size);
     if (unlikely_log(rb<=0)){
       psync_pagecache_return_free_page(page);
       psync_timer_notify_exception();
@@ -1220,23 +1594,52 @@ static int psync_pagecache_read_range_from_sock(psync_request_t *request, psync_
         break;
       }
     unlock_wait(page->hash);
-    pthread_mutex_lock(&cache_mutex);
-    psync_list_add_tail(&cache_hash[pagehash_by_hash_and_pageid(page->hash, page->pageid)], &page->list);
-    cache_pages_in_hash++;
-    pthread_mutex_unlock(&cache_mutex);
+    psync_pagecache_add_page(page);
   }
   return 0;
 }
 
+static uint64_t psync_pagecache_elapsed_ms(const struct timespec *start, const struct timespec *end){
+  return (end->tv_sec-start->tv_sec)*1000+end->tv_nsec/1000000-start->tv_nsec/1000000;
+}
+
+static void psync_pagecache_account_connection(psync_openfile_t *of, uint64_t bytes, const struct timespec *start, const struct timespec *firstresp){
+  struct timespec end;
+  uint64_t ms;
+  uint32_t speed, latency;
+  if (bytes<PSYNC_FS_MIN_READ_PER_CONNECTION || !firstresp->tv_sec)
+    return;
+  psync_nanotime(&end);
+  ms=psync_pagecache_elapsed_ms(start, &end);
+  if (!ms)
+    ms=1;
+  speed=bytes*1000/ms;
+  latency=psync_pagecache_elapsed_ms(start, firstresp);
+  pthread_mutex_lock(&of->mutex);
+  if (of->connspeed){
+    of->connspeed=(of->connspeed*3+speed)/4;
+    of->connlatency=(of->connlatency*3+latency)/4;
+  }
+  else{
+    of->connspeed=speed;
+    of->connlatency=latency;
+  }
+  pthread_mutex_unlock(&of->mutex);
+}
+
 static void psync_pagecache_read_unmodified_thread(void *ptr){
   psync_request_t *request;
   psync_http_socket *sock;
   psync_socket *api;
   const char *host;
   const char *path;
-  psync_request_range_t *range;
+  psync_request_range_t *range, *sendrange;
   const binresult *hosts;
   psync_urls_t *urls;
+  psync_transfer_t transfer;
+  struct timespec start, firstresp;
+  uint64_t total;
+  uint32_t inflight;
   int err, tries;
   request=(psync_request_t *)ptr;
   if (psync_status_get(PSTATUS_TYPE_ONLINE)==PSTATUS_ONLINE_OFFLINE){
@@ -1245,13 +1648,20 @@ static void psync_pagecache_read_unmodified_thread(void *ptr){
   }
   range=psync_list_element(request->ranges.next, psync_request_range_t, list);
   debug(D_NOTICE, "thread run, first offset %lu, size %lu", (unsigned long)range->offset, (unsigned long)range->length);
+  /* pagecache reads never wait for the scheduler, they are accounted so that background downloads back off */
+  total=0;
+  psync_list_for_each_element(range, &request->ranges, psync_request_range_t, list)
+    total+=range->length;
+  psync_transfer_start(&transfer, PSYNC_TRANSFER_PAGECACHE, total, NULL);
   tries=0;
 retry:
   if (!(urls=get_urls_for_request(request))){
+    psync_transfer_end(&transfer);
     psync_pagecache_send_error(request, -EIO);
     return;
   }
   if (psync_list_isempty(&request->ranges)){
+    psync_transfer_end(&transfer);
     release_urls(urls);
     psync_fs_dec_of_refcnt_and_readers(request->of);
     psync_pagecache_free_request(request);
@@ -1323,14 +1733,28 @@ err_api0:
     goto err0;
 //  debug(D_NOTICE, "connected to %s", host);
   path=psync_find_result(urls->urls, "path", PARAM_STR)->str;
+  psync_nanotime(&start);
+  firstresp.tv_sec=0;
+  total=0;
+  inflight=0;
+  sendrange=psync_list_element(request->ranges.next, psync_request_range_t, list);
   psync_list_for_each_element(range, &request->ranges, psync_request_range_t, list){
-    debug(D_NOTICE, "sending request for offset %lu, size %lu", (unsigned long)range->offset, (unsigned long)range->length);
-    if (psync_http_request(sock, host, path, range->offset, range->offset+range->length-1))
-      goto err1;
-  }
-  psync_list_for_each_element(range, &request->ranges, psync_request_range_t, list)
-    if ((err=psync_pagecache_read_range_from_sock(request, range, sock))){
-      if (err==1 && tries++<5){
+    /* requests are pipelined on the connection, but only a few at a time, so that the ones not sent yet can still be
+     * cancelled and the server is never blocked writing responses to us while we are blocked writing requests */
+    while (&sendrange->list!=&request->ranges && inflight<PSYNC_HTTP_MAX_PIPELINED_REQUESTS){
+      debug(D_NOTICE, "sending request for offset %lu, size %lu", (unsigned long)sendrange->offset, (unsigned long)sendrange->length);
+      if (psync_http_request(sock, host, path, sendrange->offset, sendrange->offset+sendrange->length-1))
+        goto err1;
+      total+=sendrange->length;
+      inflight++;
+      sendrange=psync_list_element(sendrange->list.next, psync_request_range_t, list);
+    }
+    if ((err=psync_pagecache_read_range_from_sock(request, range, sock, &firstresp))){
+      if (err==2){
+        total=0;
+        break;
+      }
+      else if (err==1 && tries++<5){
         psync_http_close(sock);
         release_bad_urls(urls);
         goto retry;
@@ -1338,9 +1762,13 @@ err_api0:
       else
         goto err1;
     }
+    inflight--;
+  }
   psync_http_close(sock);
+  psync_pagecache_account_connection(request->of, total, &start, &firstresp);
   debug(D_NOTICE, "request from %s finished", host);
 ok1:
+  psync_transfer_end(&transfer);
   psync_fs_dec_of_refcnt_and_readers(request->of);
   psync_pagecache_free_request(request);
   release_urls(urls);
@@ -1348,40 +1776,106 @@ ok1:
 err1:
   psync_http_close(sock);
 err0:
+  psync_transfer_end(&transfer);
   psync_pagecache_send_error(request, -EIO);
   release_urls(urls);
   return;
 }
 
-static void psync_pagecache_read_unmodified_readahead(psync_openfile_t *of, uint64_t offset, uint64_t size, psync_list *ranges, psync_request_range_t *range,
-                                                      psync_fileid_t fileid, uint64_t hash, uint64_t initialsize){
-  uint64_t readahead, frompageoff, topageoff, first_page_id, rto;
-  psync_int_t i, pagecnt, h, streamid;
+static psync_int_t psync_pagecache_readahead_pages(psync_request_t *rq, psync_request_range_t **prange, uint64_t first_page_id, psync_int_t pagecnt,
+                                                  psync_fileid_t fileid, uint64_t hash){
+  psync_request_range_t *range;
   psync_page_wait_t *pw;
-  time_t ctime;
   unsigned char *pages_in_db;
+  psync_int_t i, added;
+  if (pagecnt<=0)
+    return 0;
+  range=*prange;
+  added=0;
+  pages_in_db=has_pages_in_db(hash, first_page_id, pagecnt);
+  for (i=0; i<pagecnt; i++){
+    if (pages_in_db[i])
+      continue;
+    if (has_page_in_cache_by_hash(hash, first_page_id+i))
+      continue;
+    if (psync_pagecache_find_page_wait_locked(hash, first_page_id+i))
+      continue;
+//    debug(D_NOTICE, "read-aheading page %lu", first_page_id+i);
+    pw=psync_new(psync_page_wait_t);
+    psync_list_add_tail(&wait_page_hash[waiterhash_by_hash_and_pageid(hash, first_page_id+i)], &pw->list);
+    psync_list_init(&pw->waiters);
+    pw->hash=hash;
+    pw->pageid=first_page_id+i;
+    pw->fileid=fileid;
+    if (range && range->offset+range->length==(first_page_id+i)*cache_page_size)
+      range->length+=cache_page_size;
+    else{
+      range=psync_new(psync_request_range_t);
+      psync_list_add_tail(&rq->ranges, &range->list);
+      range->offset=(first_page_id+i)*cache_page_size;
+      range->length=cache_page_size;
+    }
+    added++;
+  }
+  psync_free(pages_in_db);
+  *prange=range;
+  return added;
+}
+
+/* Every read is matched to a stream of reads of the file and the stream is classified as sequential, strided (reads of
+ * the same size at a constant distance), backward or random. The window of sequential streams grows with the length of
+ * the stream, is at least the bandwidth-delay product of a connection so that the link is kept busy and is capped to a
+ * number of seconds of the rate the file is consumed at. Strided streams read ahead the next few strides and backward
+ * streams the data before the read.
+ */
+static void psync_pagecache_read_unmodified_readahead(psync_openfile_t *of, uint64_t offset, uint64_t size, psync_request_t *rq, psync_request_range_t *range,
+                                                      psync_fileid_t fileid, uint64_t hash, uint64_t initialsize){
+  uint64_t readahead, frompageoff, topageoff, first_page_id, rto, bdp, min;
+  psync_file_stream_t *st;
+  psync_int_t i, pagecnt, streamid, recent, added;
+  time_t ctime;
   int found;
+  unsigned char type;
   if (offset+size>=initialsize)
     return;
   readahead=0;
-  frompageoff=offset/PSYNC_FS_PAGE_SIZE;
-  topageoff=((offset+size+PSYNC_FS_PAGE_SIZE-1)/PSYNC_FS_PAGE_SIZE)-1;
+  frompageoff=offset/cache_page_size;
+  topageoff=((offset+size+cache_page_size-1)/cache_page_size)-1;
   ctime=psync_timer_time();
+  bdp=(uint64_t)of->connspeed*of->connlatency/1000;
+  if (bdp>PSYNC_FS_MAX_READAHEAD)
+    bdp=PSYNC_FS_MAX_READAHEAD;
   found=0;
-  for (streamid=0; streamid<PSYNC_FS_FILESTREAMS_CNT; streamid++)
-    if (of->streams[streamid].frompage<=frompageoff && of->streams[streamid].topage+2>=frompageoff){
-      of->streams[streamid].id=++of->laststreamid;
-      readahead=of->streams[streamid].length;
-      of->streams[streamid].frompage=frompageoff;
-      of->streams[streamid].topage=topageoff;
-      of->streams[streamid].length+=size;
-      of->streams[streamid].lastuse=ctime;
-      break;
+  recent=-1;
+  type=PSYNC_FS_STREAM_RANDOM;
+  for (streamid=0; streamid<PSYNC_FS_FILESTREAMS_CNT; streamid++){
+    st=&of->streams[streamid];
+    if (st->frompage<=frompageoff && st->topage+2>=frompageoff)
+      type=PSYNC_FS_STREAM_SEQUENTIAL;
+    else if (st->stride && st->lastuse>=ctime-PSYNC_FS_STREAM_ABANDON_SEC && (int64_t)(frompageoff-st->frompage)==st->stride)
+      type=PSYNC_FS_STREAM_STRIDED;
+    else if (st->lastuse>=ctime-PSYNC_FS_STREAM_ABANDON_SEC && frompageoff<st->frompage && topageoff+2>=st->frompage)
+      type=PSYNC_FS_STREAM_BACKWARD;
+    else{
+      if (st->lastuse>=ctime-2){
+        found++;
+        if (recent==-1 || st->id>of->streams[recent].id)
+          recent=streamid;
+      }
+      continue;
     }
-    else if (of->streams[streamid].lastuse>=ctime-2)
-      found++;
+    st->id=++of->laststreamid;
+    readahead=st->length;
+    if (type==PSYNC_FS_STREAM_BACKWARD)
+      st->stride=0;
+    st->frompage=frompageoff;
+    st->topage=topageoff;
+    st->length+=size;
+    st->lastuse=ctime;
+    st->type=type;
+    break;
+  }
   if (streamid==PSYNC_FS_FILESTREAMS_CNT){
-    uint64_t min;
     debug(D_NOTICE, "ran out of readahead streams");
     min=~(uint64_t)0;
     streamid=0;
@@ -1390,31 +1884,79 @@ static void psync_pagecache_read_unmodified_readahead(psync_openfile_t *of, uint
         min=of->streams[i].id;
         streamid=i;
       }
-    of->streams[streamid].id=++of->laststreamid;
-    of->streams[streamid].frompage=frompageoff;
-    of->streams[streamid].topage=topageoff;
-    of->streams[streamid].length=size;
-    of->streams[streamid].requestedto=0;
-    of->streams[streamid].lastuse=ctime;
+    st=&of->streams[streamid];
+    /* a read close to the last one of another stream may be the second one of a strided stream */
+    if (recent!=-1 && recent!=streamid && frompageoff>of->streams[recent].frompage &&
+        (frompageoff-of->streams[recent].frompage)*cache_page_size<=PSYNC_FS_MAX_READAHEAD)
+      st->stride=frompageoff-of->streams[recent].frompage;
+    else
+      st->stride=0;
+    st->id=++of->laststreamid;
+    st->startid=st->id;
+    st->frompage=frompageoff;
+    st->topage=topageoff;
+    st->length=size;
+    st->requestedto=0;
+    st->lastuse=ctime;
+    st->type=type;
     if (found==1 && of->currentspeed*4>readahead && range){
       debug(D_NOTICE, "found just one freshly used stream, increasing readahead to four times current speed %u", (unsigned int)of->currentspeed*4);
       readahead=size_round_up_to_page(of->currentspeed*4);
     }
   }
+  rq->streamid=streamid;
+  rq->streamstart=st->startid;
+  rq->streamtype=type;
   if (of->runningreads>=3 && !range)
     return;
+  if (type==PSYNC_FS_STREAM_STRIDED){
+    pagecnt=topageoff-frompageoff+1;
+    added=0;
+    for (i=1; i<=PSYNC_FS_MAX_STRIDES_AHEAD; i++){
+      first_page_id=frompageoff+st->stride*i;
+      if (first_page_id*cache_page_size>=initialsize)
+        break;
+      if ((first_page_id+pagecnt)*cache_page_size>initialsize)
+        pagecnt=(initialsize+cache_page_size-1)/cache_page_size-first_page_id;
+      added+=psync_pagecache_readahead_pages(rq, &range, first_page_id, pagecnt, fileid, hash);
+      if (i*size>=bdp && i*size>=PSYNC_FS_MIN_READAHEAD_RAND)
+        break;
+    }
+    psync_pagecache_account_readahead(type, 0, 0, (uint64_t)added*cache_page_size, 0);
+    return;
+  }
+  if (type==PSYNC_FS_STREAM_BACKWARD){
+    readahead=st->length;
+    if (readahead>PSYNC_FS_MAX_READAHEAD/4)
+      readahead=PSYNC_FS_MAX_READAHEAD/4;
+    if (readahead<bdp)
+      readahead=bdp;
+    if (readahead<PSYNC_FS_MIN_READAHEAD_RAND)
+      readahead=PSYNC_FS_MIN_READAHEAD_RAND;
+    pagecnt=size_round_up_to_page(readahead)/cache_page_size;
+    if (pagecnt>frompageoff)
+      pagecnt=frompageoff;
+    added=psync_pagecache_readahead_pages(rq, &range, frompageoff-pagecnt, pagecnt, fileid, hash);
+    psync_pagecache_account_readahead(type, 0, 0, (uint64_t)added*cache_page_size, 0);
+    return;
+  }
   if (offset==0 && (size<PSYNC_FS_MIN_READAHEAD_START) && readahead<PSYNC_FS_MIN_READAHEAD_START-size)
     readahead=PSYNC_FS_MIN_READAHEAD_START-size;
   else if (offset==PSYNC_FS_MIN_READAHEAD_START/2 && readahead==PSYNC_FS_MIN_READAHEAD_START/2){
-    of->streams[streamid].length+=offset;
+    st->length+=offset;
     readahead=(PSYNC_FS_MIN_READAHEAD_START/2)*3;
   }
   else if (offset!=0 && (size<PSYNC_FS_MIN_READAHEAD_RAND) && readahead<PSYNC_FS_MIN_READAHEAD_RAND-size)
     readahead=PSYNC_FS_MIN_READAHEAD_RAND-size;
+  if (type==PSYNC_FS_STREAM_SEQUENTIAL && readahead<bdp)
+    readahead=size_round_up_to_page(bdp);
   if (readahead>PSYNC_FS_MAX_READAHEAD)
     readahead=PSYNC_FS_MAX_READAHEAD;
-  if (of->currentspeed*PSYNC_FS_MAX_READAHEAD_SEC>PSYNC_FS_MIN_READAHEAD_START && readahead>of->currentspeed*PSYNC_FS_MAX_READAHEAD_SEC)
+  if (of->currentspeed*PSYNC_FS_MAX_READAHEAD_SEC>PSYNC_FS_MIN_READAHEAD_START && readahead>of->currentspeed*PSYNC_FS_MAX_READAHEAD_SEC){
     readahead=size_round_up_to_page(of->currentspeed*PSYNC_FS_MAX_READAHEAD_SEC);
+    if (type==PSYNC_FS_STREAM_SEQUENTIAL && readahead<bdp)
+      readahead=size_round_up_to_page(bdp);
+  }
   if (!range){
     if (readahead>=8192*1024)
       readahead=(readahead+offset+size)/(4*1024*1024)*(4*1024*1024)-offset-size;
@@ -1427,53 +1969,92 @@ static void psync_pagecache_read_unmodified_readahead(psync_openfile_t *of, uint
   }
   if (offset+size+readahead>initialsize)
     readahead=size_round_up_to_page(initialsize-offset-size);
-  rto=of->streams[streamid].requestedto;
+  rto=st->requestedto;
   if (rto<offset+size+readahead)
-    of->streams[streamid].requestedto=offset+size+readahead;
+    st->requestedto=offset+size+readahead;
 //  debug(D_NOTICE, "rto=%lu", rto);
   if (rto>offset+size){
     if (rto>offset+size+readahead)
       return;
-    first_page_id=rto/PSYNC_FS_PAGE_SIZE;
-    pagecnt=(offset+size+readahead-rto)/PSYNC_FS_PAGE_SIZE;
+    first_page_id=rto/cache_page_size;
+    pagecnt=(offset+size+readahead-rto)/cache_page_size;
   }
   else{
-    first_page_id=(offset+size)/PSYNC_FS_PAGE_SIZE;
-    pagecnt=readahead/PSYNC_FS_PAGE_SIZE;
-  }
-  pages_in_db=has_pages_in_db(hash, first_page_id, pagecnt);
-  for (i=0; i<pagecnt; i++){
-    if (pages_in_db[i])
-      continue;
-    if (has_page_in_cache_by_hash(hash, first_page_id+i))
-      continue;
-    h=waiterhash_by_hash_and_pageid(hash, first_page_id+i);
-    found=0;
-    psync_list_for_each_element(pw, &wait_page_hash[h], psync_page_wait_t, list)
-      if (pw->hash==hash && pw->pageid==first_page_id+i)        
-        found=1;
-    if (found)
-      continue; 
-//    debug(D_NOTICE, "read-aheading page %lu", first_page_id+i);
-    pw=psync_new(psync_page_wait_t);
-    psync_list_add_tail(&wait_page_hash[h], &pw->list);
-    psync_list_init(&pw->waiters);
-    pw->hash=hash;
-    pw->pageid=first_page_id+i;
-    pw->fileid=fileid;
-    if (range && range->offset+range->length==(first_page_id+i)*PSYNC_FS_PAGE_SIZE)
-      range->length+=PSYNC_FS_PAGE_SIZE;
-    else{
-      range=psync_new(psync_request_range_t);
-      psync_list_add_tail(ranges, &range->list);
-      range->offset=(first_page_id+i)*PSYNC_FS_PAGE_SIZE;
-      range->length=PSYNC_FS_PAGE_SIZE;
+    first_page_id=(offset+size)/cache_page_size;
+    pagecnt=readahead/cache_page_size;
+  }
+  added=psync_pagecache_readahead_pages(rq, &range, first_page_id, pagecnt, fileid, hash);
+  psync_pagecache_account_readahead(type, 0, 0, (uint64_t)added*cache_page_size, 0);
+  if (!psync_list_isempty(&rq->ranges))
+    debug(D_NOTICE, "readahead=%lu, rto=%lu, offset=%lu, size=%lu, currentspeed=%u, type=%u",
+          (long unsigned)readahead, (unsigned long)rto, (unsigned long)offset, (unsigned long)size, (unsigned)of->currentspeed, (unsigned)type);
+}
+
+/* A single TCP stream can not saturate high latency links, so large requests for big files are split between several
+ * connections. One more connection than the file is read faster than a single one can deliver is used, so the number
+ * of connections grows for as long as adding one makes reading faster.
+ */
+static uint32_t psync_pagecache_read_connections(psync_openfile_t *of, uint64_t total){
+  uint32_t conns;
+  if (of->initialsize<PSYNC_FS_FILESIZE_FOR_2CONN || total<PSYNC_FS_MIN_READ_PER_CONNECTION*2)
+    return 1;
+  if (of->connspeed)
+    conns=of->currentspeed/of->connspeed+1;
+  else
+    conns=2;
+  if (conns>PSYNC_FS_MAX_READ_CONNECTIONS)
+    conns=PSYNC_FS_MAX_READ_CONNECTIONS;
+  if (conns>total/PSYNC_FS_MIN_READ_PER_CONNECTION)
+    conns=total/PSYNC_FS_MIN_READ_PER_CONNECTION;
+  return conns;
+}
+
+/* The request keeps the beginning of the ranges, as that is what readers are most likely waiting for, and the rest is
+ * moved to new requests, each served by its own thread.
+ */
+static void psync_pagecache_run_request(psync_request_t *rq){
+  psync_request_t *nrq;
+  psync_request_range_t *range, *nrange;
+  uint64_t total, part, taken;
+  uint32_t conns;
+  total=0;
+  psync_list_for_each_element(range, &rq->ranges, psync_request_range_t, list)
+    total+=range->length;
+  conns=psync_pagecache_read_connections(rq->of, total);
+  if (conns>1)
+    debug(D_NOTICE, "splitting request of %lu bytes between %u connections", (unsigned long)total, (unsigned)conns);
+  part=total/conns/cache_page_size*cache_page_size;
+  while (--conns){
+    nrq=psync_new(psync_request_t);
+    psync_list_init(&nrq->ranges);
+    nrq->of=rq->of;
+    nrq->fileid=rq->fileid;
+    nrq->hash=rq->hash;
+    nrq->streamstart=rq->streamstart;
+    nrq->streamid=rq->streamid;
+    nrq->streamtype=rq->streamtype;
+    taken=0;
+    while (taken<part){
+      range=psync_list_element(rq->ranges.prev, psync_request_range_t, list);
+      if (range->length<=part-taken){
+        psync_list_del(&range->list);
+        psync_list_add_head(&nrq->ranges, &range->list);
+        taken+=range->length;
+      }
+      else{
+        nrange=psync_new(psync_request_range_t);
+        nrange->length=part-taken;
+        nrange->offset=range->offset+range->length-nrange->length;
+        range->length-=nrange->length;
+        psync_list_add_head(&nrq->ranges, &nrange->list);
+        taken=part;
+      }
     }
+    psync_fs_inc_of_refcnt_and_readers(nrq->of);
+    psync_run_thread1("read unmodified", psync_pagecache_read_unmodified_thread, nrq);
   }
-  psync_free(pages_in_db);
-  if (!psync_list_isempty(ranges))
-    debug(D_NOTICE, "readahead=%lu, rto=%lu, offset=%lu, size=%lu, currentspeed=%u", 
-          (long unsigned)readahead, (unsigned long)rto, (unsigned long)offset, (unsigned long)size, (unsigned)of->currentspeed);
+  psync_fs_inc_of_refcnt_and_readers(rq->of);
+  psync_run_thread1("read unmodified", psync_pagecache_read_unmodified_thread, rq);
 }
 
 static void psync_free_page_waiter(psync_page_waiter_t *pwt){
@@ -1504,33 +2085,35 @@ int psync_pagecache_read_unmodified_locked(psync_openfile_t *of, char *buf, uint
   poffset=offset_round_down_to_page(offset);
   pageoff=offset-poffset;
   psize=size_round_up_to_page(size+pageoff);
-  pagecnt=psize/PSYNC_FS_PAGE_SIZE;
-  first_page_id=poffset/PSYNC_FS_PAGE_SIZE;
+  pagecnt=psize/cache_page_size;
+  first_page_id=poffset/cache_page_size;
   psync_list_init(&waiting);
   rq=psync_new(psync_request_t);
   psync_list_init(&rq->ranges);
+  rq->streamid=-1;
+  rq->streamtype=PSYNC_FS_STREAM_RANDOM;
   range=NULL;
   lock_wait(hash);
   for (i=0; i<pagecnt; i++){
     if (i==0){
       copyoff=pageoff;
-      if (size>PSYNC_FS_PAGE_SIZE-copyoff)
-        copysize=PSYNC_FS_PAGE_SIZE-copyoff;
+      if (size>cache_page_size-copyoff)
+        copysize=cache_page_size-copyoff;
       else
         copysize=size;
       pbuff=buf;
     }
     else if (i==pagecnt-1){
       copyoff=0;
-      copysize=(size+pageoff)&(PSYNC_FS_PAGE_SIZE-1);
+      copysize=(size+pageoff)&(cache_page_size-1);
       if (!copysize)
-        copysize=PSYNC_FS_PAGE_SIZE;
-      pbuff=buf+i*PSYNC_FS_PAGE_SIZE-pageoff;
+        copysize=cache_page_size;
+      pbuff=buf+i*cache_page_size-pageoff;
     }
     else{
       copyoff=0;
-      copysize=PSYNC_FS_PAGE_SIZE;
-      pbuff=buf+i*PSYNC_FS_PAGE_SIZE-pageoff;
+      copysize=cache_page_size;
+      pbuff=buf+i*cache_page_size-pageoff;
     }
     rb=check_page_in_memory_by_hash(hash, first_page_id+i, pbuff, copysize, copyoff);
     if (rb==-1)
@@ -1540,7 +2123,7 @@ int psync_pagecache_read_unmodified_locked(psync_openfile_t *of, char *buf, uint
         continue;
       else{
         if (i)
-          size=i*PSYNC_FS_PAGE_SIZE+rb-pageoff;
+          size=i*cache_page_size+rb-pageoff;
         else
           size=rb;
         break;
@@ -1566,26 +2149,26 @@ int psync_pagecache_read_unmodified_locked(psync_openfile_t *of, char *buf, uint
     pw->hash=hash;
     pw->pageid=first_page_id+i;
     pw->fileid=fileid;
-    if (range && range->offset+range->length==(first_page_id+i)*PSYNC_FS_PAGE_SIZE)
-      range->length+=PSYNC_FS_PAGE_SIZE;
+    if (range && range->offset+range->length==(first_page_id+i)*cache_page_size)
+      range->length+=cache_page_size;
     else{
       range=psync_new(psync_request_range_t);
       psync_list_add_tail(&rq->ranges, &range->list);
-      range->offset=(first_page_id+i)*PSYNC_FS_PAGE_SIZE;
-      range->length=PSYNC_FS_PAGE_SIZE;
+      range->offset=(first_page_id+i)*cache_page_size;
+      range->length=cache_page_size;
     }
 found:
     psync_list_add_tail(&pw->waiters, &pwt->listpage);
     pwt->waiting_for=pw;
   }
-  psync_pagecache_read_unmodified_readahead(of, poffset, psize, &rq->ranges, range, fileid, hash, initialsize);
+  psync_pagecache_read_unmodified_readahead(of, poffset, psize, rq, range, fileid, hash, initialsize);
+  psync_pagecache_account_readahead(rq->streamtype, 1, psync_list_isempty(&waiting), 0, 0);
   if (!psync_list_isempty(&rq->ranges)){
     unlock_wait(hash);
     rq->of=of;
     rq->fileid=fileid;
     rq->hash=hash;
-    psync_fs_inc_of_refcnt_and_readers(of);
-    psync_run_thread1("read unmodified", psync_pagecache_read_unmodified_thread, rq);
+    psync_pagecache_run_request(rq);
     if (psync_list_isempty(&waiting))
       return size;
     lock_wait(hash);
@@ -1605,14 +2188,14 @@ found:
       else if (pwt->rsize<pwt->size && ret>=0){
         if (pwt->rsize){
           if (pwt->pageidx)
-            ret=pwt->pageidx*PSYNC_FS_PAGE_SIZE+pwt->rsize-pageoff;
+            ret=pwt->pageidx*cache_page_size+pwt->rsize-pageoff;
           else
             ret=pwt->rsize;
         }
         else{
           if (pwt->pageidx){
-            if (pwt->pageidx*PSYNC_FS_PAGE_SIZE+pwt->rsize-pageoff<ret)
-              ret=pwt->pageidx*PSYNC_FS_PAGE_SIZE+pwt->rsize-pageoff;
+            if (pwt->pageidx*cache_page_size+pwt->rsize-pageoff<ret)
+              ret=pwt->pageidx*cache_page_size+pwt->rsize-pageoff;
           }
           else
             ret=pwt->rsize;
@@ -1625,16 +2208,109 @@ found:
   return ret;
 }
 
+/* If all the requested data is in the disk cache, returns the number of ranges of the cache file (*fd) holding it in
+ * *pranges that the caller should free and releases of->mutex. Otherwise returns -1 and of->mutex stays locked.
+ */
+int psync_pagecache_read_unmodified_ranges_locked(psync_openfile_t *of, uint64_t size, uint64_t offset, psync_pagecache_range_t **pranges, psync_file_t *fd){
+  psync_page_index_entry_t *e;
+  psync_pagecache_range_t *ranges;
+  psync_slot_pins_t *pins;
+  psync_request_t *rq;
+  uint64_t poffset, psize, first_page_id, initialsize, hash, foff;
+  psync_uint_t pageoff, pagecnt, i, copysize, copyoff;
+  psync_fileid_t fileid;
+  uint32_t pinstart;
+  int cnt;
+  initialsize=of->initialsize;
+  hash=of->hash;
+  fileid=of->remotefileid;
+  *pranges=NULL;
+  *fd=readcache;
+  if (offset>=initialsize){
+    pthread_mutex_unlock(&of->mutex);
+    return 0;
+  }
+  if (offset+size>initialsize)
+    size=initialsize-offset;
+  poffset=offset_round_down_to_page(offset);
+  pageoff=offset-poffset;
+  psize=size_round_up_to_page(size+pageoff);
+  pagecnt=psize/cache_page_size;
+  first_page_id=poffset/cache_page_size;
+  ranges=psync_new_cnt(psync_pagecache_range_t, pagecnt);
+  /* the slots stay pinned until fuse is done reading them, otherwise they could be overwritten by other pages */
+  pins=slot_pins_get(pagecnt);
+  pinstart=pins->cnt;
+  cnt=0;
+  pthread_mutex_lock(&index_mutex);
+  for (i=0; i<pagecnt; i++){
+    if (unlikely(!(e=index_find_locked(hash, first_page_id+i)))){
+      while (pins->cnt>pinstart)
+        slot_unpin_locked(pins->ids[--pins->cnt]);
+      pthread_mutex_unlock(&index_mutex);
+      psync_free(ranges);
+      return -1;
+    }
+    copyoff=i?0:pageoff;
+    copysize=cache_page_size-copyoff;
+    if (copysize>size)
+      copysize=size;
+    size-=copysize;
+    if (e->size<copyoff+copysize){
+      copysize=e->size>copyoff?e->size-copyoff:0;
+      size=0;
+    }
+    index_mark_used_locked(e);
+    foff=(uint64_t)e->id*cache_page_size+copyoff;
+    if (!copysize)
+      break;
+    cache_slots[e->id].pins++;
+    pins->ids[pins->cnt++]=e->id;
+    if (cnt && ranges[cnt-1].offset+ranges[cnt-1].size==foff)
+      ranges[cnt-1].size+=copysize;
+    else{
+      ranges[cnt].offset=foff;
+      ranges[cnt].size=copysize;
+      cnt++;
+    }
+    if (!size)
+      break;
+  }
+  pthread_mutex_unlock(&index_mutex);
+  pthread_mutex_unlock(&of->mutex);
+  /* keep the readahead going as if the pages were read */
+  rq=psync_new(psync_request_t);
+  psync_list_init(&rq->ranges);
+  rq->streamid=-1;
+  rq->streamtype=PSYNC_FS_STREAM_RANDOM;
+  lock_wait(hash);
+  psync_pagecache_read_unmodified_readahead(of, poffset, psize, rq, NULL, fileid, hash, initialsize);
+  unlock_wait(hash);
+  psync_pagecache_account_readahead(rq->streamtype, 1, 1, 0, 0);
+  if (!psync_list_isempty(&rq->ranges)){
+    rq->of=of;
+    rq->fileid=fileid;
+    rq->hash=hash;
+    psync_pagecache_run_request(rq);
+  }
+  else
+    psync_free(rq);
+  *pranges=ranges;
+  return cnt;
+}
+
 static void psync_pagecache_add_page_if_not_exists(psync_cache_page_t *page, uint64_t hash, uint64_t pageid){
   psync_cache_page_t *pg;
+  psync_cache_shard_t *shard;
   psync_page_wait_t *pw;
   psync_uint_t h1, h2;
   int hasit;
   hasit=0;
   h1=pagehash_by_hash_and_pageid(hash, pageid);
   h2=waiterhash_by_hash_and_pageid(hash, pageid);
+  shard=shard_by_pagehash(h1);
   lock_wait(hash);
-  pthread_mutex_lock(&cache_mutex);
+  pthread_mutex_lock(&shard->mutex);
   psync_list_for_each_element(pg, &cache_hash[h1], psync_cache_page_t, list)
     if (pg->type==PAGE_TYPE_READ && pg->hash==hash && pg->pageid==pageid){
       hasit=1;
@@ -1648,14 +2324,12 @@ static void psync_pagecache_add_page_if_not_exists(psync_cache_page_t *page, uin
       }
   if (!hasit && has_page_in_db(hash, pageid))
     hasit=1;
-  if (hasit)
-    psync_pagecache_return_free_page_locked(page);
-  else{
-    psync_list_add_tail(&cache_hash[h1], &page->list);
-    cache_pages_in_hash++;
-  }
-  pthread_mutex_unlock(&cache_mutex);
+  if (!hasit)
+    psync_pagecache_add_page_locked(shard, h1, page);
+  pthread_mutex_unlock(&shard->mutex);
   unlock_wait(hash);
+  if (hasit)
+    psync_pagecache_return_free_page(page);
 }
 
 static void psync_pagecache_new_upload_to_cache(uint64_t taskid, uint64_t hash){
@@ -1680,8 +2354,8 @@ static void psync_pagecache_new_upload_to_cache(uint64_t taskid, uint64_t hash){
   }
   pageid=0;
   while (1){
-    page=psync_pagecache_get_free_page();
-    rd=psync_file_read(fd, page->page, PSYNC_FS_PAGE_SIZE);
+    page=psync_pagecache_get_free_page(hash, pageid);
+    rd=psync_file_read(fd, page->page, cache_page_size);
     if (rd<=0){
       psync_pagecache_return_free_page(page);
       break;
@@ -1693,7 +2367,7 @@ static void psync_pagecache_new_upload_to_cache(uint64_t taskid, uint64_t hash){
     page->usecnt=1;
     page->type=PAGE_TYPE_READ;
     psync_pagecache_add_page_if_not_exists(page, hash, pageid);
-    if (rd<PSYNC_FS_PAGE_SIZE)
+    if (rd<cache_page_size)
       break;
     pageid++;
   }
@@ -1742,16 +2416,16 @@ static void psync_pagecache_modify_to_cache(uint64_t taskid, uint64_t hash){
   pageid=0;
   interval=psync_interval_tree_get_first(tree);
   while (interval){
-    off=((interval->from-1)|(PSYNC_FS_PAGE_SIZE-1))+1;
-    to=interval->to-(interval->to&(PSYNC_FS_PAGE_SIZE-1));
+    off=((interval->from-1)|(cache_page_size-1))+1;
+    to=interval->to-(interval->to&(cache_page_size-1));
     interval=psync_interval_tree_get_next(interval);
     if (off>=to || psync_file_seek(fd, off, P_SEEK_SET)==-1)
       continue;
-    pageid=off/PSYNC_FS_PAGE_SIZE;
-    for (; off<to; off+=PSYNC_FS_PAGE_SIZE){
-      page=psync_pagecache_get_free_page();
-      rd=psync_file_read(fd, page->page, PSYNC_FS_PAGE_SIZE);
-      if (rd<PSYNC_FS_PAGE_SIZE){
+    pageid=off/cache_page_size;
+    for (; off<to; off+=cache_page_size){
+      page=psync_pagecache_get_free_page(hash, pageid);
+      rd=psync_file_read(fd, page->page, cache_page_size);
+      if (rd<cache_page_size){
         psync_pagecache_return_free_page(page);
         break;
       }
@@ -1824,79 +2498,272 @@ void psync_pagecache_modify_to_pagecache(uint64_t taskid, uint64_t hash){
 }
 
 static void delete_extra_pages(){
-  pthread_mutex_lock(&flush_cache_mutex);
-  if (db_cache_max_page>db_cache_in_pages){
-    psync_sql_res *res;
-    psync_stat_t st;
-    res=psync_sql_prep_statement("DELETE FROM pagecache ORDER BY id DESC LIMIT ?");
-    psync_sql_bind_uint(res, 1, db_cache_in_pages-db_cache_max_page);
-    psync_sql_run_free(res);
-    db_cache_max_page=db_cache_in_pages;
-    if (!psync_fstat(readcache, &st) && psync_stat_size(&st)>db_cache_in_pages*PSYNC_FS_PAGE_SIZE){
-      if (likely_log(psync_file_seek(readcache, db_cache_in_pages*PSYNC_FS_PAGE_SIZE, P_SEEK_SET)!=-1))
-        assertw(psync_file_truncate(readcache)==0);
+  psync_stat_t st;
+  if (!psync_fstat(readcache, &st) && psync_stat_size(&st)>(db_cache_in_pages+1)*cache_page_size){
+    if (likely_log(psync_file_seek(readcache, (db_cache_in_pages+1)*cache_page_size, P_SEEK_SET)!=-1))
+      assertw(psync_file_truncate(readcache)==0);
+  }
+}
+
+static int index_entry_usable(const psync_page_index_entry_t *e, uint64_t maxid, unsigned char *used){
+  if (!e->id || e->id>db_cache_in_pages || e->id>=maxid || used[e->id])
+    return 0;
+  used[e->id]=1;
+  return 1;
+}
+
+/* collects the usable entries of the currently mapped index, maxid is the first page not (fully) present in the cache file */
+static psync_page_index_entry_t *index_collect_entries(uint64_t maxid, uint64_t *cnt){
+  psync_page_index_entry_t *entries;
+  unsigned char *used;
+  uint64_t i, c;
+  used=psync_new_cnt(unsigned char, db_cache_in_pages+1);
+  memset(used, 0, db_cache_in_pages+1);
+  entries=psync_new_cnt(psync_page_index_entry_t, db_cache_in_pages+1);
+  c=0;
+  for (i=0; i<=index_mask; i++)
+    if (index_entry_usable(&index_entries[i], maxid, used) && c<db_cache_in_pages)
+      entries[c++]=index_entries[i];
+  psync_free(used);
+  *cnt=c;
+  return entries;
+}
+
+/* imports the pagecache table that was used as index before */
+static psync_page_index_entry_t *index_import_from_db(uint64_t maxid, uint64_t *cnt){
+  psync_page_index_entry_t *entries;
+  unsigned char *used;
+  psync_sql_res *res;
+  psync_uint_row row;
+  uint64_t c;
+  used=psync_new_cnt(unsigned char, db_cache_in_pages+1);
+  memset(used, 0, db_cache_in_pages+1);
+  entries=psync_new_cnt(psync_page_index_entry_t, db_cache_in_pages+1);
+  c=0;
+  res=psync_sql_query("SELECT id, hash, pageid, lastuse, usecnt, size FROM pagecache WHERE type="NTO_STR(PAGE_TYPE_READ));
+  while ((row=psync_sql_fetch_rowint(res)) && c<db_cache_in_pages){
+    entries[c].id=row[0]<=db_cache_in_pages?row[0]:0;
+    entries[c].hash=row[1];
+    entries[c].pageid=row[2];
+    entries[c].lastuse=row[3];
+    entries[c].usecnt=row[4];
+    entries[c].size=row[5];
+    if (index_entry_usable(&entries[c], maxid, used))
+      c++;
+  }
+  psync_sql_free_result(res);
+  psync_sql_statement("DELETE FROM pagecache");
+  psync_free(used);
+  debug(D_NOTICE, "imported %lu pages from database to cache index", (unsigned long)c);
+  *cnt=c;
+  return entries;
+}
+
+/* if the index file can not be mapped the index is kept only in memory and the disk cache is lost on restart */
+static void index_create(uint64_t buckets, psync_page_index_entry_t *entries, uint64_t cnt){
+  psync_page_index_header_t *hdr;
+  psync_page_index_entry_t *e;
+  uint64_t size, i;
+  size=sizeof(psync_page_index_header_t)+buckets*sizeof(psync_page_index_entry_t);
+  if (readcacheindex!=INVALID_HANDLE_VALUE && psync_file_seek(readcacheindex, 0, P_SEEK_SET)!=-1 && !psync_file_truncate(readcacheindex) &&
+      psync_file_seek(readcacheindex, size, P_SEEK_SET)!=-1 && !psync_file_truncate(readcacheindex) &&
+      (index_map=(char *)psync_mmap_file(readcacheindex, size)))
+    index_map_size=size;
+  else{
+    debug(D_ERROR, "could not create cache index file, keeping the index only in memory");
+    index_map=(char *)psync_malloc(size);
+    memset(index_map, 0, size);
+    index_map_size=0;
+  }
+  hdr=(psync_page_index_header_t *)index_map;
+  hdr->magic=PAGE_INDEX_MAGIC;
+  hdr->version=PAGE_INDEX_VERSION;
+  hdr->pagesize=cache_page_size;
+  hdr->buckets=buckets;
+  hdr->slots=db_cache_in_pages;
+  index_entries=(psync_page_index_entry_t *)(index_map+sizeof(psync_page_index_header_t));
+  index_mask=buckets-1;
+  for (i=0; i<cnt; i++){
+    e=index_find_or_empty_locked(entries[i].hash, entries[i].pageid);
+    *e=entries[i];
+  }
+  if (index_map_size)
+    psync_mmap_file_sync(index_map, index_map_size);
+}
+
+static void index_init(const char *cache_dir, uint64_t cachefilesize){
+  psync_page_index_header_t *hdr;
+  psync_page_index_entry_t *entries;
+  unsigned char *used;
+  char *index_file;
+  uint64_t buckets, maxid, cnt, used_cnt, i;
+  int64_t fsize;
+  int rebuild;
+  index_file=psync_strcat(cache_dir, PSYNC_DIRECTORY_SEPARATOR, PSYNC_DEFAULT_READ_CACHE_INDEX_FILE, NULL);
+  readcacheindex=psync_file_open(index_file, P_O_RDWR, P_O_CREAT);
+  if (unlikely(readcacheindex==INVALID_HANDLE_VALUE))
+    debug(D_ERROR, "could not open cache index %s", index_file);
+  psync_free(index_file);
+  buckets=index_buckets_for_slots(db_cache_in_pages);
+  maxid=cachefilesize/cache_page_size;
+  entries=NULL;
+  cnt=0;
+  rebuild=1;
+  if (readcacheindex!=INVALID_HANDLE_VALUE && (fsize=psync_file_size(readcacheindex))>=(int64_t)sizeof(psync_page_index_header_t) &&
+      (hdr=(psync_page_index_header_t *)psync_mmap_file(readcacheindex, fsize))){
+    if (hdr->magic==PAGE_INDEX_MAGIC && hdr->version==PAGE_INDEX_VERSION && hdr->pagesize==cache_page_size &&
+        fsize==sizeof(psync_page_index_header_t)+hdr->buckets*sizeof(psync_page_index_entry_t)){
+      index_map=(char *)hdr;
+      index_map_size=fsize;
+      index_entries=(psync_page_index_entry_t *)(index_map+sizeof(psync_page_index_header_t));
+      index_mask=hdr->buckets-1;
+      entries=index_collect_entries(maxid, &cnt);
+      used_cnt=0;
+      for (i=0; i<=index_mask; i++)
+        if (index_entries[i].id)
+          used_cnt++;
+      /* a rebuild also drops entries pointing to pages that are not in the cache file or duplicate ones */
+      rebuild=hdr->buckets!=buckets || hdr->slots!=db_cache_in_pages || cnt!=used_cnt;
+      if (rebuild)
+        psync_munmap_file(index_map, index_map_size);
+    }
+    else{
+      debug(D_NOTICE, "cache index is invalid, rebuilding");
+      psync_munmap_file(hdr, fsize);
     }
   }
-  pthread_mutex_unlock(&flush_cache_mutex);
+  else if (psync_sql_cellint("SELECT COUNT(*) FROM pagecache", 0))
+    entries=index_import_from_db(maxid, &cnt);
+  if (rebuild){
+    debug(D_NOTICE, "creating cache index with %lu buckets and %lu entries", (unsigned long)buckets, (unsigned long)cnt);
+    index_create(buckets, entries, cnt);
+  }
+  psync_free(entries);
+  used=psync_new_cnt(unsigned char, db_cache_in_pages+1);
+  memset(used, 0, db_cache_in_pages+1);
+  for (i=0; i<=index_mask; i++)
+    used[index_entries[i].id]=1;
+  free_slots=psync_new_cnt(uint32_t, db_cache_in_pages+1);
+  free_db_pages=0;
+  for (i=db_cache_in_pages; i>=1; i--)
+    if (!used[i])
+      free_slots[free_db_pages++]=i;
+  psync_free(used);
+}
+
+static int index_entry_cmp_lastuse(const void *p1, const void *p2){
+  const psync_page_index_entry_t *e1, *e2;
+  e1=(const psync_page_index_entry_t *)p1;
+  e2=(const psync_page_index_entry_t *)p2;
+  if (e1->lastuse<e2->lastuse)
+    return -1;
+  else if (e1->lastuse>e2->lastuse)
+    return 1;
+  else
+    return 0;
+}
+
+static void lru_init(){
+  psync_page_index_entry_t *entries;
+  uint64_t i, cnt;
+  cache_slots=psync_new_cnt(psync_page_slot_t, db_cache_in_pages+1);
+  memset(cache_slots, 0, sizeof(psync_page_slot_t)*(db_cache_in_pages+1));
+  entries=psync_new_cnt(psync_page_index_entry_t, db_cache_in_pages-free_db_pages+1);
+  cnt=0;
+  for (i=0; i<=index_mask; i++)
+    if (index_entries[i].id)
+      entries[cnt++]=index_entries[i];
+  qsort(entries, cnt, sizeof(psync_page_index_entry_t), index_entry_cmp_lastuse);
+  for (i=0; i<cnt; i++)
+    lru_add_locked(entries[i].id, entries[i].hash, entries[i].pageid, entries[i].usecnt);
+  psync_free(entries);
+  /* keep enough free slots to flush the memory cache a few times over */
+  evict_low_watermark=cache_pages*2;
+  if (evict_low_watermark>db_cache_in_pages/4)
+    evict_low_watermark=db_cache_in_pages/4;
+  evict_high_watermark=cache_pages*4;
+  if (evict_high_watermark>db_cache_in_pages/2)
+    evict_high_watermark=db_cache_in_pages/2;
+  debug(D_NOTICE, "%u pages in disk cache, %u free", (unsigned)lru_used, (unsigned)free_db_pages);
+}
+
+static void psync_pagecache_read_settings(){
+  uint64_t pages;
+  cache_page_size=psync_setting_get_uint(_PS(fspagesize));
+  pages=psync_setting_get_uint(_PS(fsmemorycache))/cache_page_size;
+  if (pages<CACHE_SHARDS*CACHE_MIN_SHARD_PAGES){
+    debug(D_NOTICE, "memory cache too small for page size %u, using %u pages", (unsigned)cache_page_size, (unsigned)(CACHE_SHARDS*CACHE_MIN_SHARD_PAGES));
+    pages=CACHE_SHARDS*CACHE_MIN_SHARD_PAGES;
+  }
+  cache_pages=pages;
+  cache_shard_pages=cache_pages/CACHE_SHARDS;
+  cache_hash_size=cache_pages/2/CACHE_SHARDS*CACHE_SHARDS;
+  cache_ghosts_per_shard=1;
+  while (cache_ghosts_per_shard<cache_shard_pages*2)
+    cache_ghosts_per_shard*=2;
+  debug(D_NOTICE, "page size %u, %u pages in memory cache", (unsigned)cache_page_size, (unsigned)cache_pages);
 }
 
 void psync_pagecache_init(){
   uint64_t i;
   char *page_data, *cache_file;
   const char *cache_dir;
-  psync_sql_res *res;
+  uint64_t *ghosts;
   psync_cache_page_t *page;
   psync_stat_t st;
-  for (i=0; i<CACHE_HASH; i++)
+  int64_t fs;
+  psync_pagecache_read_settings();
+  pthread_key_create(&slot_pins_key, slot_pins_destroy);
+  cache_hash=psync_new_cnt(psync_list, cache_hash_size);
+  for (i=0; i<cache_hash_size; i++)
     psync_list_init(&cache_hash[i]);
   for (i=0; i<PAGE_WAITER_HASH; i++)
     psync_list_init(&wait_page_hash[i]);
   for (i=0; i<PAGE_WAITER_MUTEXES; i++)
     pthread_mutex_init(&wait_page_mutexes[i], NULL);
-  psync_list_init(&free_pages);
-  memset(cachepages_to_update, 0, sizeof(cachepages_to_update));
-  pages_base=(char *)psync_malloc(CACHE_PAGES*(PSYNC_FS_PAGE_SIZE+sizeof(psync_cache_page_t)));
+  memset(cache_shards, 0, sizeof(cache_shards));
+  ghosts=psync_new_cnt(uint64_t, CACHE_SHARDS*cache_ghosts_per_shard);
+  memset(ghosts, 0, sizeof(uint64_t)*CACHE_SHARDS*cache_ghosts_per_shard);
+  for (i=0; i<CACHE_SHARDS; i++){
+    pthread_mutex_init(&cache_shards[i].mutex, NULL);
+    psync_list_init(&cache_shards[i].clock);
+    psync_list_init(&cache_shards[i].free_pages);
+    cache_shards[i].hand=&cache_shards[i].clock;
+    cache_shards[i].hot_target=cache_shard_pages/2;
+    cache_shards[i].ghosts=ghosts+i*cache_ghosts_per_shard;
+  }
+  pages_base=(char *)psync_malloc((size_t)cache_pages*(cache_page_size+sizeof(psync_cache_page_t)));
   page_data=pages_base;
-  page=(psync_cache_page_t *)(page_data+CACHE_PAGES*PSYNC_FS_PAGE_SIZE);
-  cache_pages_free=CACHE_PAGES;
-  for (i=0; i<CACHE_PAGES; i++){
+  page=pages_structs=(psync_cache_page_t *)(page_data+(size_t)cache_pages*cache_page_size);
+  for (i=0; i<cache_pages; i++){
     page->page=page_data;
-    psync_list_add_tail(&free_pages, &page->list);
-    page_data+=PSYNC_FS_PAGE_SIZE;
+    psync_list_add_tail(&cache_shards[i%CACHE_SHARDS].free_pages, &page->list);
+    cache_shards[i%CACHE_SHARDS].pages_free++;
+    page_data+=cache_page_size;
     page++;
   }
   cache_dir=psync_setting_get_string(_PS(fscachepath));
   if (psync_stat(cache_dir, &st))
     psync_mkdir(cache_dir);
   cache_file=psync_strcat(cache_dir, PSYNC_DIRECTORY_SEPARATOR, PSYNC_DEFAULT_READ_CACHE_FILE, NULL);
-  if (psync_stat(cache_file, &st))
+  /* pages are stored at id*cache_page_size in the cache file, so a file written with different page size is useless */
+  if (psync_sql_cellint("SELECT value FROM setting WHERE id='fscachefilepagesize'", PSYNC_FS_PAGE_SIZE)!=cache_page_size){
+    debug(D_NOTICE, "page size changed to %u, dropping disk cache", (unsigned)cache_page_size);
     psync_sql_statement("DELETE FROM pagecache");
-  else{
-    res=psync_sql_prep_statement("DELETE FROM pagecache WHERE id>? AND type!="NTO_STR(PAGE_TYPE_FREE));
-    psync_sql_bind_uint(res, 1, psync_stat_size(&st)/PSYNC_FS_PAGE_SIZE);
-    psync_sql_run_free(res);
-  }
-  db_cache_in_pages=psync_setting_get_uint(_PS(fscachesize))/PSYNC_FS_PAGE_SIZE;
-  db_cache_max_page=psync_sql_cellint("SELECT MAX(id) FROM pagecache", 0);
-  if (db_cache_max_page<db_cache_in_pages){
-    i=0;
-    psync_sql_start_transaction();
-    res=psync_sql_prep_statement("INSERT INTO pagecache (type) VALUES ("NTO_STR(PAGE_TYPE_FREE)")");
-    while (db_cache_max_page+i<db_cache_in_pages && i<CACHE_PAGES*4){
-      psync_sql_run(res);
-      i++;
-    }
-    psync_sql_free_result(res);
-    psync_sql_commit_transaction();
-    free_db_pages+=i;
-    db_cache_max_page+=i;
-    debug(D_NOTICE, "inserted %lu new free pages to database, db_cache_in_pages=%lu, db_cache_max_page=%lu", 
-                    (unsigned long)i, (unsigned long)db_cache_in_pages, (unsigned long)db_cache_max_page);
+    if (!psync_stat(cache_file, &st))
+      psync_file_delete(cache_file);
+    psync_set_uint_value("fscachefilepagesize", cache_page_size);
   }
+  db_cache_in_pages=psync_setting_get_uint(_PS(fscachesize))/cache_page_size;
+  if (db_cache_in_pages>=UINT32_MAX)
+    db_cache_in_pages=UINT32_MAX-1;
   readcache=psync_file_open(cache_file, P_O_RDWR, P_O_CREAT);
-  if (db_cache_max_page>db_cache_in_pages)
-    delete_extra_pages();
-  free_db_pages=psync_sql_cellint("SELECT COUNT(*) FROM pagecache WHERE type="NTO_STR(PAGE_TYPE_FREE), 0);
+  psync_free(cache_file);
+  fs=psync_file_size(readcache);
+  index_init(cache_dir, fs>0?fs:0);
+  lru_init();
+  delete_extra_pages();
   psync_timer_register(psync_pagecache_flush_timer, PSYNC_FS_DISK_FLUSH_SEC, NULL);
+  psync_timer_register(psync_pagecache_evict_timer, 1, NULL);
 }
 
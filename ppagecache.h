@@ -30,11 +30,19 @@
 
 #include "pfs.h"
 
+typedef struct {
+  uint64_t offset;
+  uint64_t size;
+} psync_pagecache_range_t;
+
 void psync_pagecache_init();
 int psync_pagecache_flush();
 int psync_pagecache_read_modified_locked(psync_openfile_t *of, char *buf, uint64_t size, uint64_t offset);
 int psync_pagecache_read_unmodified_locked(psync_openfile_t *of, char *buf, uint64_t size, uint64_t offset);
+int psync_pagecache_read_unmodified_ranges_locked(psync_openfile_t *of, uint64_t size, uint64_t offset, psync_pagecache_range_t **pranges, psync_file_t *fd);
+void psync_pagecache_unpin_ranges();
 void psync_pagecache_creat_to_pagecache(uint64_t taskid, uint64_t hash);
 void psync_pagecache_modify_to_pagecache(uint64_t taskid, uint64_t hash);
+void psync_pagecache_get_readahead_stats(psync_fs_readahead_stats_t *stats);
 
 #endif
\ No newline at end of file
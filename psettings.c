@@ -50,6 +50,7 @@ typedef struct {
 } psync_setting_t;
 
 static void lower_patterns(void *ptr);
+static void fix_page_size(void *ptr);
 
 static void fsroot_change(){
   psync_fs_remount();
@@ -66,7 +67,9 @@ static psync_setting_t settings[]={
   {"fsroot", fsroot_change, NULL, {0}, PSYNC_TSTRING},
   {"autostartfs", NULL, NULL, {PSYNC_AUTOSTARTFS_DEFAULT}, PSYNC_TBOOL},
   {"fscachesize", fsroot_change, NULL, {PSYNC_FS_DEFAULT_CACHE_SIZE}, PSYNC_TNUMBER},
-  {"fscachepath", NULL, NULL, {0}, PSYNC_TSTRING}
+  {"fscachepath", NULL, NULL, {0}, PSYNC_TSTRING},
+  {"fsmemorycache", NULL, NULL, {PSYNC_FS_MEMORY_CACHE}, PSYNC_TNUMBER},
+  {"fspagesize", NULL, fix_page_size, {PSYNC_FS_PAGE_SIZE}, PSYNC_TNUMBER}
 };
 
 void psync_settings_reset(){
@@ -282,3 +285,12 @@ static void lower_patterns(void *ptr){
     str++;
   }
 }
+
+static void fix_page_size(void *ptr){
+  uint64_t size, psize;
+  size=*((uint64_t *)ptr);
+  psize=PSYNC_FS_MIN_PAGE_SIZE;
+  while (psize<size && psize<PSYNC_FS_MAX_PAGE_SIZE)
+    psize*=2;
+  *((uint64_t *)ptr)=psize;
+}
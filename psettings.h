@@ -48,7 +48,8 @@
 
 #define PSYNC_P2P_RSA_SIZE 2048
 
-#define PSYNC_DIFF_LIMIT   50000
+#define PSYNC_DIFF_LIMIT       50000
+#define PSYNC_DIFF_FETCH_AHEAD 2
 
 #define PSYNC_SOCK_CONNECT_TIMEOUT 20
 #define PSYNC_SOCK_READ_TIMEOUT    60
@@ -58,18 +59,45 @@
 
 #define PSYNC_STACK_SIZE 64*1024
 
-#define PSYNC_QUERY_CACHE_SEC 600
-#define PSYNC_QUERY_MAX_CNT 4
+#define PSYNC_SQL_STMT_CACHE_SIZE 256
+#define PSYNC_SQL_STMT_CACHE_WAYS 4
+#define PSYNC_SQL_PROFILE_STATEMENTS 512
+#define PSYNC_SQL_PROFILE_SITES 256
+#define PSYNC_SQL_PROFILE_PROBES 16
 
 #define PSYNC_MAX_PARALLEL_DOWNLOADS 32
 #define PSYNC_MAX_PARALLEL_UPLOADS 32
 #define PSYNC_FSUPLOAD_NUM_TASKS_PER_RUN 128
-#define PSYNC_START_NEW_DOWNLOADS_TRESHOLD (512*1024)
-#define PSYNC_START_NEW_UPLOADS_TRESHOLD (256*1024)
+#define PSYNC_TRANSFER_SMALL_FILE_SIZE (256*1024)
+#define PSYNC_TRANSFER_DOWNLOAD_INFLIGHT (2*1024*1024)
+#define PSYNC_TRANSFER_UPLOAD_INFLIGHT (1024*1024)
+#define PSYNC_TASK_QUEUE_SIZE 256
+#define PSYNC_UPLOAD_PARALLEL_MIN_SIZE (64*1024*1024)
+#define PSYNC_UPLOAD_PART_SIZE (16*1024*1024)
+#define PSYNC_UPLOAD_PARALLEL_CONNECTIONS 4
+#define PSYNC_UPLOAD_BATCH_MAX_FILE_SIZE (64*1024)
+#define PSYNC_UPLOAD_BATCH_MIN_FILES 4
+#define PSYNC_UPLOAD_BATCH_MAX_FILES 128
+#define PSYNC_UPLOAD_BATCH_WINDOW 32
 #define PSYNC_MIN_SIZE_FOR_CHECKSUMS (64*1024)
 #define PSYNC_MIN_SIZE_FOR_P2P (32*1024)
+#define PSYNC_MAX_BLOCK_INDEX_FILES 16
+#define PSYNC_CHECKSUMS_PRUNE_INTERVAL (24*3600)
+#define PSYNC_CHECKSUMS_STREAM_BATCH 4096
+#define PSYNC_CHECKSUMS_CACHE_MAX_SIZE (256*1024*1024)
+#define PSYNC_CHECKSUMS_PREREAD_SIZE (32*1024*1024)
+
+/* content defined chunking of uploaded files, average chunk size is 1<<PSYNC_CDC_AVG_CHUNK_BITS */
+#define PSYNC_CDC_MIN_CHUNK (16*1024)
+#define PSYNC_CDC_AVG_CHUNK_BITS 16
+#define PSYNC_CDC_MAX_CHUNK (256*1024)
 
 #define PSYNC_COPY_BUFFER_SIZE 64*1024
+#define PSYNC_HASH_BUFFER_SIZE (1024*1024)
+#define PSYNC_HASH_PIPELINE_MIN_SIZE (4*1024*1024)
+#define PSYNC_HASH_MAX_PIPELINES 4
+#define PSYNC_HASH_CACHE_MIN_AGE_SEC 2
+#define PSYNC_HASH_CACHE_MAX_UNUSED_SEC (30*24*3600)
 #define PSYNC_RECV_BUFFER_SHAPED 128*1024
 #define PSYNC_MAX_SPEED_RECV_BUFFER 1024*1024
 
@@ -104,11 +132,15 @@
 #define PSYNC_DEFAULT_WINDOWS_DIR "pCloud"
 
 #define PSYNC_DEFAULT_TMP_DIR "temp"
+#define PSYNC_DEFAULT_CHECKSUMS_DIR "checksums"
 
 #define PSYNC_DB_CHECKPOINT_AT_PAGES 2000
+#define PSYNC_DB_READERS 4
+#define PSYNC_DB_READER_BUSY_TIMEOUT 1000
 
 #define PSYNC_DEFAULT_CACHE_FOLDER "Cache"
 #define PSYNC_DEFAULT_READ_CACHE_FILE "cached"
+#define PSYNC_DEFAULT_READ_CACHE_INDEX_FILE "cached.idx"
 #define PSYNC_DEFAULT_WRITE_CACHE_FOLDER "ToUpload"
 
 #define PSYNC_DEFAULT_FS_FOLDER "pCloudDrive"
@@ -133,6 +165,7 @@
 #define PSYNC_CRYPTO_PASS_TO_KEY_ITERATIONS 20000
 
 #define PSYNC_HTTP_RESP_BUFFER 4000
+#define PSYNC_HTTP_MAX_PIPELINED_REQUESTS 8
 
 #define PSYNC_CHECKSUM "sha1"
 
@@ -164,6 +197,8 @@
 #define PSYNC_DEFAULT_SEND_BUFF (4*1024*1024)
 
 #define PSYNC_FS_PAGE_SIZE 4096
+#define PSYNC_FS_MIN_PAGE_SIZE 4096
+#define PSYNC_FS_MAX_PAGE_SIZE (1024*1024)
 #define PSYNC_FS_MEMORY_CACHE (16*1024*1024)
 #define PSYNC_FS_DISK_FLUSH_SEC 15
 #define PSYNC_FS_FILESTREAMS_CNT 12
@@ -174,6 +209,10 @@
 #define PSYNC_FS_DEFAULT_CACHE_SIZE ((uint64_t)5*1024*1024*1024)
 #define PSYNC_FS_DIRECT_UPLOAD_LIMIT (256*1024)
 #define PSYNC_FS_FILESIZE_FOR_2CONN (4*1024*1024)
+#define PSYNC_FS_MAX_READ_CONNECTIONS 4
+#define PSYNC_FS_MIN_READ_PER_CONNECTION (512*1024)
+#define PSYNC_FS_MAX_STRIDES_AHEAD 8
+#define PSYNC_FS_STREAM_ABANDON_SEC 3
 
 /* defaults for database settings */
 #define PSYNC_USE_SSL_DEFAULT 1
@@ -213,6 +252,8 @@ $RECYCLE.BIN;\
 #define PSYNC_SETTING_autostartfs       8
 #define PSYNC_SETTING_fscachesize       9
 #define PSYNC_SETTING_fscachepath      10
+#define PSYNC_SETTING_fsmemorycache    11
+#define PSYNC_SETTING_fspagesize       12
 
 typedef int psync_settingid_t;
 
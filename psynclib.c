@@ -1241,3 +1241,11 @@ void psync_run_new_version(psync_new_version_t *ver){
   exit(0);
 }
 
+
+psync_sql_profile_t *psync_get_sql_profile(){
+  return psync_sql_get_profile();
+}
+
+int psync_dump_sql_profile(const char *path){
+  return psync_sql_dump_profile(path);
+}
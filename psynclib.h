@@ -556,6 +556,9 @@ const char *psync_get_auth_string();
  * p2psync (bool) - use or not peer to peer downloads
  * 
  * fscachesize (uint) - size of filesystem cache, in bytes, sane minimum of few tens of Mb or even hundreds is advised
+ * fsmemorycache (uint) - size of the in-memory part of filesystem cache, in bytes, takes effect on next start
+ * fspagesize (uint) - page size of filesystem cache, in bytes, rounded up to a power of 2 between 4Kb and 1Mb, takes effect
+ *                     on next start, changing it drops the contents of the disk cache
  * fsroot (string) - where to mount the filesystem
  * autostartfs (bool) - if set starts the fs on app startup
  * 
@@ -725,12 +728,80 @@ void psync_run_new_version(psync_new_version_t *ver);
  * psync_fs_start() - starts the filesystem
  * psync_fs_isstarted() - returns 1 if the filesystem is started and 0 otherwise
  * psync_fs_stop() - stops the filesystem
+ * psync_fs_get_readahead_stats() - fills stats with counters of the readahead of the filesystem, one entry for each
+ *                                  of the PSYNC_FS_STREAM_ access patterns that reads of open files are classified as
  * 
  */
 
+#define PSYNC_FS_STREAM_RANDOM     0
+#define PSYNC_FS_STREAM_SEQUENTIAL 1
+#define PSYNC_FS_STREAM_STRIDED    2
+#define PSYNC_FS_STREAM_BACKWARD   3
+#define PSYNC_FS_STREAM_TYPES      4
+
+typedef struct {
+  uint64_t reads; /* number of reads classified with the pattern */
+  uint64_t hits; /* reads that did not have to wait for data from the network */
+  uint64_t readaheadbytes; /* bytes requested from the network ahead of the reads */
+  uint64_t wastedbytes; /* readahead bytes that were cancelled as the stream was abandoned */
+} psync_fs_stream_stats_t;
+
+typedef struct {
+  psync_fs_stream_stats_t streams[PSYNC_FS_STREAM_TYPES];
+} psync_fs_readahead_stats_t;
+
 int psync_fs_start();
 int psync_fs_isstarted();
 void psync_fs_stop();
+void psync_fs_get_readahead_stats(psync_fs_readahead_stats_t *stats);
+
+/* Database profiling functions.
+ * 
+ * psync_get_sql_profile() - returns execution counts, rows and latencies of the sql statements run by the library and histograms
+ *                           of waiting for and holding the database lock for each place in the code that takes it. Statements
+ *                           are sorted by total time and lock sites by total hold time. Returned value is to be freed with a
+ *                           single free().
+ * psync_dump_sql_profile() - writes the same as text to the file at path, returns 0 on success and -1 on failure.
+ * 
+ * Bucket i of a histogram counts times from 2^i to 2^(i+1)-1 microseconds, bucket 0 times under 2 microseconds and the last one
+ * all longer times. Percentiles are the upper bounds of the buckets they fall in.
+ * 
+ */
+
+#define PSYNC_SQL_PROFILE_BUCKETS 24
+
+typedef struct {
+  const char *sql;
+  uint64_t executions;
+  uint64_t rows; /* rows returned */
+  uint64_t totalusec; /* time spent stepping the statement */
+  uint64_t p99usec; /* 99th percentile of the time of one execution */
+} psync_sql_stmt_profile_t;
+
+typedef struct {
+  const char *site; /* file:line (function) of the outermost lock, or the sql of a statement that took the lock itself */
+  uint64_t waits; /* times the lock had to be waited for */
+  uint64_t waitusec;
+  uint64_t holds;
+  uint64_t holdusec;
+  uint64_t p99waitusec;
+  uint64_t p99holdusec;
+  uint32_t waithist[PSYNC_SQL_PROFILE_BUCKETS];
+  uint32_t holdhist[PSYNC_SQL_PROFILE_BUCKETS];
+} psync_sql_lock_profile_t;
+
+typedef struct {
+  uint64_t prepared; /* statements prepared */
+  uint64_t reused; /* statements reused from the statement cache */
+  uint64_t dropped; /* samples not accounted as the tables of statements or lock sites had no room for them */
+  size_t stmtcnt;
+  size_t lockcnt;
+  psync_sql_stmt_profile_t *stmts;
+  psync_sql_lock_profile_t *locks;
+} psync_sql_profile_t;
+
+psync_sql_profile_t *psync_get_sql_profile();
+int psync_dump_sql_profile(const char *path);
 
 #ifdef __cplusplus
 }
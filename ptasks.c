@@ -25,6 +25,7 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <string.h>
 #include "ptasks.h"
 #include "plibs.h"
 #include "pdownload.h"
@@ -191,3 +192,144 @@ void psync_task_delete_remote_file(psync_syncid_t syncid, psync_fileid_t fileid)
 void psync_task_delete_remote_folder(psync_syncid_t syncid, psync_folderid_t folderid){
   create_task5(PSYNC_DELREC_REMOTE_FOLDER, syncid, folderid);
 }
+
+static void task_queue_release(psync_task_queue_t *q){
+  psync_sql_res *res;
+  uint32_t i;
+  psync_sql_start_transaction();
+  res=psync_sql_prep_statement("UPDATE task SET inprogress=0 WHERE id=?");
+  for (i=0; i<q->cnt; i++){
+    if (!q->tasks[i]->started){
+      psync_sql_bind_uint(res, 1, q->tasks[i]->id);
+      psync_sql_run(res);
+    }
+    psync_free(q->tasks[i]);
+  }
+  psync_sql_free_result(res);
+  psync_sql_commit_transaction();
+  q->cnt=0;
+}
+
+static void task_queue_fill(psync_task_queue_t *q){
+  psync_sql_res *res;
+  psync_variant_row row;
+  psync_task_t *task;
+  const char *name;
+  size_t len;
+  uint32_t i;
+  psync_sql_start_transaction();
+  res=psync_sql_query(q->sql);
+  while (q->cnt<PSYNC_TASK_QUEUE_SIZE && (row=psync_sql_fetch_row(res))){
+    name=psync_get_lstring_or_null(row[6], &len);
+    if (name){
+      task=(psync_task_t *)psync_malloc(sizeof(psync_task_t)+len+1);
+      memcpy(task+1, name, len+1);
+      task->name=(char *)(task+1);
+    }
+    else{
+      task=psync_new(psync_task_t);
+      task->name=NULL;
+    }
+    task->id=psync_get_number(row[0]);
+    task->type=psync_get_number(row[1]);
+    task->syncid=psync_get_number(row[2]);
+    task->itemid=psync_get_number(row[3]);
+    task->localitemid=psync_get_number(row[4]);
+    task->newitemid=psync_get_number_or_null(row[5]);
+    task->newsyncid=psync_get_number_or_null(row[7]);
+    task->size=psync_get_number(row[8]);
+    task->started=0;
+    q->tasks[q->cnt++]=task;
+  }
+  psync_sql_free_result(res);
+  res=psync_sql_prep_statement("UPDATE task SET inprogress=1 WHERE id=?");
+  for (i=0; i<q->cnt; i++){
+    psync_sql_bind_uint(res, 1, q->tasks[i]->id);
+    psync_sql_run(res);
+  }
+  psync_sql_free_result(res);
+  psync_sql_commit_transaction();
+}
+
+/* File tasks that come before the first task of another type are independent of each other and are picked by size class instead
+ * of by id - a large file if preferlarge is set, a small one otherwise. */
+static psync_task_t *task_queue_pick(psync_task_queue_t *q, int preferlarge){
+  psync_task_t *task, *first;
+  uint32_t i;
+  first=NULL;
+  for (i=0; i<q->cnt; i++){
+    task=q->tasks[i];
+    if (task->started)
+      continue;
+    if (task->type!=q->filetype)
+      return first?first:task;
+    if (!first)
+      first=task;
+    if ((task->size>PSYNC_TRANSFER_SMALL_FILE_SIZE)==preferlarge)
+      return task;
+  }
+  return first;
+}
+
+psync_task_t *psync_task_queue_get(psync_task_queue_t *q, int preferlarge){
+  psync_task_t *task;
+  int changed;
+  pthread_mutex_lock(&q->mutex);
+  changed=q->changed;
+  q->changed=0;
+  pthread_mutex_unlock(&q->mutex);
+  if (changed && q->cnt)
+    task_queue_release(q);
+  task=task_queue_pick(q, !!preferlarge);
+  if (!task){
+    if (q->cnt)
+      task_queue_release(q);
+    task_queue_fill(q);
+    task=task_queue_pick(q, !!preferlarge);
+  }
+  if (task)
+    task->started=1;
+  return task;
+}
+
+/* takes from the queue up to max file tasks of at most maxsize bytes that can be run along with an already started file task,
+ * if there are less than min of them none are taken */
+uint32_t psync_task_queue_take_files(psync_task_queue_t *q, psync_task_t **tasks, uint32_t min, uint32_t max, uint64_t maxsize){
+  psync_task_t *task;
+  uint32_t i, cnt;
+  cnt=0;
+  for (i=0; i<q->cnt && cnt<max; i++){
+    task=q->tasks[i];
+    if (task->started)
+      continue;
+    if (task->type!=q->filetype)
+      break;
+    if (task->size<=maxsize)
+      tasks[cnt++]=task;
+  }
+  if (cnt<min)
+    return 0;
+  for (i=0; i<cnt; i++)
+    tasks[i]->started=1;
+  return cnt;
+}
+
+void psync_task_queue_done(psync_task_queue_t *q, psync_task_t *task){
+  psync_sql_res *res;
+  res=psync_sql_prep_statement("DELETE FROM task WHERE id=?");
+  psync_sql_bind_uint(res, 1, task->id);
+  psync_sql_run_free(res);
+}
+
+/* the task is to be run again before any of the tasks after it, so it is released along with all that are not started */
+void psync_task_queue_retry(psync_task_queue_t *q, psync_task_t *task){
+  task->started=0;
+  task_queue_release(q);
+}
+
+/* to be called after tasks are deleted or modified by other threads, the queue is reloaded before running the next task */
+void psync_task_queue_changed(psync_task_queue_t *q){
+  pthread_mutex_lock(&q->mutex);
+  q->changed=1;
+  pthread_mutex_unlock(&q->mutex);
+}
@@ -29,7 +29,9 @@
 #define _PSYNC_TASKS_H
 
 #include "pcompiler.h"
+#include "pcompat.h"
 #include "psynclib.h"
+#include "psettings.h"
 
 #define PSYNC_TASK_DOWNLOAD 0
 #define PSYNC_TASK_UPLOAD   1
@@ -90,4 +92,39 @@ void psync_task_rename_remote_folder(psync_syncid_t oldsyncid, psync_syncid_t ne
 void psync_task_delete_remote_file(psync_syncid_t syncid, psync_fileid_t fileid);
 void psync_task_delete_remote_folder(psync_syncid_t syncid, psync_folderid_t folderid);
 
+typedef struct {
+  uint64_t id;
+  uint64_t itemid;
+  uint64_t localitemid;
+  uint64_t newitemid;
+  uint64_t size;
+  const char *name;
+  uint32_t type;
+  psync_syncid_t syncid;
+  psync_syncid_t newsyncid;
+  int started;
+} psync_task_t;
+
+/* The queue keeps up to PSYNC_TASK_QUEUE_SIZE pending tasks in memory, claimed in the database by setting inprogress=1, and
+ * deletes each task as soon as it completes, so that a restart does not run finished tasks again. The sql is to select id, type, syncid, itemid, localitemid, newitemid, name, newsyncid and
+ * size of the first PSYNC_TASK_QUEUE_SIZE tasks with inprogress=0 ordered by id. Only the thread running the tasks may use the
+ * queue, except for psync_task_queue_changed(). Returned tasks are valid until the next call to psync_task_queue_get().
+ */
+typedef struct {
+  pthread_mutex_t mutex;
+  const char *sql;
+  uint32_t filetype;
+  uint32_t cnt;
+  int changed;
+  psync_task_t *tasks[PSYNC_TASK_QUEUE_SIZE];
+} psync_task_queue_t;
+
+#define PSYNC_TASK_QUEUE_STATIC_INIT(sql, filetype) {PTHREAD_MUTEX_INITIALIZER, sql, filetype, 0, 0, {NULL}}
+
+psync_task_t *psync_task_queue_get(psync_task_queue_t *q, int preferlarge);
+uint32_t psync_task_queue_take_files(psync_task_queue_t *q, psync_task_t **tasks, uint32_t min, uint32_t max, uint64_t maxsize);
+void psync_task_queue_done(psync_task_queue_t *q, psync_task_t *task);
+void psync_task_queue_retry(psync_task_queue_t *q, psync_task_t *task);
+void psync_task_queue_changed(psync_task_queue_t *q);
+
 #endif
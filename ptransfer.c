@@ -0,0 +1,158 @@
+/* Copyright (c) 2014 Anton Titov.
+ * Copyright (c) 2014 pCloud Ltd.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ptransfer.h"
+#include "plibs.h"
+#include "psettings.h"
+
+typedef struct {
+  uint64_t inflight;
+  uint64_t largeinflight;
+  uint64_t budget;
+  uint32_t active;
+  uint32_t maxactive;
+} transfer_class_t;
+
+static transfer_class_t transfer_classes[PSYNC_TRANSFER_TYPES]={
+  {0, 0, PSYNC_TRANSFER_DOWNLOAD_INFLIGHT, 0, PSYNC_MAX_PARALLEL_DOWNLOADS},
+  {0, 0, PSYNC_TRANSFER_UPLOAD_INFLIGHT, 0, PSYNC_MAX_PARALLEL_UPLOADS},
+  {0, 0, 0, 0, 0}
+};
+
+static psync_uint_t transfer_waiters=0;
+static pthread_mutex_t transfer_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t transfer_cond=PTHREAD_COND_INITIALIZER;
+
+/* Uploads and downloads use different directions of the link, so each of them has its own budget of bytes in flight. Pagecache
+ * reads share the downlink with downloads, but someone is waiting for them, so they never wait and downloads give them up to half
+ * of their budget and connections instead. */
+static uint64_t transfer_budget(uint32_t type, uint32_t *maxactive){
+  uint64_t budget, pc;
+  budget=transfer_classes[type].budget;
+  *maxactive=transfer_classes[type].maxactive;
+  if (type==PSYNC_TRANSFER_DOWNLOAD && (pc=transfer_classes[PSYNC_TRANSFER_PAGECACHE].inflight)){
+    if (pc>budget/2)
+      pc=budget/2;
+    budget-=pc;
+    *maxactive/=2;
+  }
+  return budget;
+}
+
+static int transfer_can_start(uint32_t type, uint64_t size){
+  uint64_t budget;
+  uint32_t maxactive;
+  if (type==PSYNC_TRANSFER_PAGECACHE)
+    return 1;
+  budget=transfer_budget(type, &maxactive);
+  if (transfer_classes[type].active>=maxactive)
+    return 0;
+  /* small files are bound by round trips, not by bandwidth, they only need a free connection */
+  if (size<=PSYNC_TRANSFER_SMALL_FILE_SIZE)
+    return 1;
+  return transfer_classes[type].largeinflight<budget;
+}
+
+int psync_transfer_start(psync_transfer_t *tr, uint32_t type, uint64_t size, const int *stop){
+  tr->size=size;
+  tr->done=0;
+  tr->type=type;
+  tr->large=size>PSYNC_TRANSFER_SMALL_FILE_SIZE;
+  pthread_mutex_lock(&transfer_mutex);
+  while (1){
+    if (stop && *stop){
+      pthread_mutex_unlock(&transfer_mutex);
+      return -1;
+    }
+    if (transfer_can_start(type, size))
+      break;
+    transfer_waiters++;
+    pthread_cond_wait(&transfer_cond, &transfer_mutex);
+    transfer_waiters--;
+  }
+  transfer_classes[type].active++;
+  transfer_classes[type].inflight+=size;
+  if (tr->large)
+    transfer_classes[type].largeinflight+=size;
+  pthread_mutex_unlock(&transfer_mutex);
+  return 0;
+}
+
+void psync_transfer_progress(psync_transfer_t *tr, uint64_t bytes){
+  uint64_t budget;
+  uint32_t maxactive;
+  pthread_mutex_lock(&transfer_mutex);
+  if (bytes>tr->size-tr->done)
+    bytes=tr->size-tr->done;
+  if (!bytes){
+    pthread_mutex_unlock(&transfer_mutex);
+    return;
+  }
+  tr->done+=bytes;
+  transfer_classes[tr->type].inflight-=bytes;
+  if (tr->large){
+    transfer_classes[tr->type].largeinflight-=bytes;
+    budget=transfer_budget(tr->type, &maxactive);
+    if (transfer_waiters && transfer_classes[tr->type].largeinflight<budget && transfer_classes[tr->type].largeinflight+bytes>=budget)
+      pthread_cond_broadcast(&transfer_cond);
+  }
+  else if (transfer_waiters && tr->type==PSYNC_TRANSFER_PAGECACHE)
+    pthread_cond_broadcast(&transfer_cond);
+  pthread_mutex_unlock(&transfer_mutex);
+}
+
+void psync_transfer_end(psync_transfer_t *tr){
+  uint64_t left;
+  pthread_mutex_lock(&transfer_mutex);
+  left=tr->size-tr->done;
+  tr->done=tr->size;
+  transfer_classes[tr->type].active--;
+  transfer_classes[tr->type].inflight-=left;
+  if (tr->large)
+    transfer_classes[tr->type].largeinflight-=left;
+  if (transfer_waiters)
+    pthread_cond_broadcast(&transfer_cond);
+  pthread_mutex_unlock(&transfer_mutex);
+}
+
+/* to be called after setting the stop flag of a transfer that may be waiting in psync_transfer_start */
+void psync_transfer_wake(){
+  pthread_mutex_lock(&transfer_mutex);
+  if (transfer_waiters)
+    pthread_cond_broadcast(&transfer_cond);
+  pthread_mutex_unlock(&transfer_mutex);
+}
+
+/* used to order pending tasks - when there is room for a large transfer it goes first to fill the bandwidth, otherwise small
+ * files are preferred as they can still be started */
+int psync_transfer_large_can_start(uint32_t type){
+  int ret;
+  pthread_mutex_lock(&transfer_mutex);
+  ret=transfer_can_start(type, PSYNC_TRANSFER_SMALL_FILE_SIZE+1);
+  pthread_mutex_unlock(&transfer_mutex);
+  return ret;
+}
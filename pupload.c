@@ -38,6 +38,7 @@
 #include "pcallbacks.h"
 #include "pdiff.h"
 #include "plist.h"
+#include "ptransfer.h"
 
 typedef struct {
   psync_list list;
@@ -47,6 +48,9 @@ typedef struct {
   uint64_t taskid;
   psync_syncid_t syncid;
   int stop;
+  /* stop flag of the batch the file is part of, NULL for files uploaded on their own */
+  int *batchstop;
+  psync_transfer_t transfer;
   unsigned char hash[PSYNC_HASH_DIGEST_HEXLEN];
 } upload_list_t;
 
@@ -65,6 +69,11 @@ static pthread_cond_t current_uploads_cond=PTHREAD_COND_INITIALIZER;
 
 static psync_list uploads=PSYNC_LIST_STATIC_INIT(uploads);
 
+static psync_task_queue_t upload_queue=PSYNC_TASK_QUEUE_STATIC_INIT(
+  "SELECT t.id, t.type, t.syncid, t.itemid, t.localitemid, t.newitemid, t.name, t.newsyncid, IFNULL(f.size, 0) FROM task t LEFT JOIN localfile f ON "
+  "t.type="NTO_STR(PSYNC_UPLOAD_FILE)" AND f.id=t.localitemid WHERE t.inprogress=0 AND t.type&"NTO_STR(PSYNC_TASK_DWLUPL_MASK)"="
+  NTO_STR(PSYNC_TASK_UPLOAD)" ORDER BY t.id LIMIT "NTO_STR(PSYNC_TASK_QUEUE_SIZE), PSYNC_UPLOAD_FILE);
+
 static const uint32_t requiredstatuses[]={
   PSTATUS_COMBINE(PSTATUS_TYPE_RUN, PSTATUS_RUN_RUN),
   PSTATUS_COMBINE(PSTATUS_TYPE_ONLINE, PSTATUS_ONLINE_ONLINE),
@@ -302,12 +311,27 @@ static void set_local_file_conflicted(psync_fileid_t localfileid, psync_fileid_t
   psync_free(newpath);
 }
 
+/* processes and frees the result of copyfile, called with the diff lock held */
+static int copy_file_result(binresult *res, psync_fileid_t localfileid){
+  const binresult *meta;
+  uint64_t result;
+  result=psync_find_result(res, "result", PARAM_NUM)->num;
+  if (unlikely(result)){
+    psync_free(res);
+    debug(D_WARNING, "command copyfile returned code %u", (unsigned)result);
+    return 0;
+  }
+  meta=psync_find_result(res, "metadata", PARAM_HASH);
+  set_local_file_remote_id(localfileid, psync_find_result(meta, "fileid", PARAM_NUM)->num, psync_find_result(meta, "hash", PARAM_NUM)->num);
+  psync_free(res);
+  return 1;
+}
+
 static int copy_file(psync_fileid_t fileid, uint64_t hash, psync_folderid_t folderid, const char *name, psync_fileid_t localfileid){
   binparam params[]={P_STR("auth", psync_my_auth), P_NUM("fileid", fileid), P_NUM("hash", hash), P_NUM("tofolderid", folderid), P_STR("toname", name)};
   psync_socket *api;
   binresult *res;
-  const binresult *meta;
-  uint64_t result;
+  int ret;
   api=psync_apipool_get();
   if (unlikely(!api))
     return -1;
@@ -320,59 +344,77 @@ static int copy_file(psync_fileid_t fileid, uint64_t hash, psync_folderid_t fold
     psync_apipool_release_bad(api);
     return -1;
   }
-  result=psync_find_result(res, "result", PARAM_NUM)->num;
-  if (unlikely(result)){
-    psync_diff_unlock();
-    psync_free(res);
-    debug(D_WARNING, "command copyfile returned code %u", (unsigned)result);
-    return 0;
-  }
-  meta=psync_find_result(res, "metadata", PARAM_HASH);
-  set_local_file_remote_id(localfileid, psync_find_result(meta, "fileid", PARAM_NUM)->num, psync_find_result(meta, "hash", PARAM_NUM)->num);
+  ret=copy_file_result(res, localfileid);
   psync_diff_unlock();
-  psync_free(res);
-  return 1;
+  return ret;
 }
 
-static int check_file_if_exists(const unsigned char *hashhex, uint64_t fsize, psync_folderid_t folderid, const char *name, psync_fileid_t localfileid){
+/* returns the id of the remote file with the same name and size as the one being uploaded or 0 */
+static psync_fileid_t same_size_remote_file(uint64_t fsize, psync_folderid_t folderid, const char *name){
   psync_sql_res *res;
   psync_uint_row row;
   psync_fileid_t fileid;
-  uint64_t filesize, hash;
-  unsigned char shashhex[PSYNC_HASH_DIGEST_HEXLEN];
-  int ret;
   res=psync_sql_query("SELECT id, size FROM file WHERE parentfolderid=? AND name=?");
   psync_sql_bind_uint(res, 1, folderid);
   psync_sql_bind_string(res, 2, name);
   row=psync_sql_fetch_rowint(res);
-  if (row && row[1]==fsize){
+  if (row && row[1]==fsize)
     fileid=row[0];
-    psync_sql_free_result(res);
-    ret=psync_get_remote_file_checksum(fileid, shashhex, &filesize, &hash);
-    if (ret==PSYNC_NET_OK){
-      if (filesize==fsize && !memcmp(hashhex, shashhex, PSYNC_HASH_DIGEST_HEXLEN)){
-        debug(D_NOTICE, "file %lu/%s already exists and matches local checksum, not doing anything", (unsigned long)folderid, name);
-        set_local_file_remote_id(localfileid, fileid, hash);
-        return 1;
-      }
-      else
-        return 0;
-    }
-    else if (ret==PSYNC_NET_TEMPFAIL)
-      return -1;
-    else if (ret==PSYNC_NET_PERMFAIL)
-      return 0;
-  }
+  else
+    fileid=0;
   psync_sql_free_result(res);
-  return 0;
+  return fileid;
+}
+
+static int remote_file_matches(const unsigned char *hashhex, uint64_t fsize, psync_folderid_t folderid, const char *name, psync_fileid_t localfileid,
+                               psync_fileid_t fileid, const unsigned char *shashhex, uint64_t filesize, uint64_t hash){
+  if (filesize==fsize && !memcmp(hashhex, shashhex, PSYNC_HASH_DIGEST_HEXLEN)){
+    debug(D_NOTICE, "file %lu/%s already exists and matches local checksum, not doing anything", (unsigned long)folderid, name);
+    set_local_file_remote_id(localfileid, fileid, hash);
+    return 1;
+  }
+  else
+    return 0;
+}
+
+static int check_file_if_exists(const unsigned char *hashhex, uint64_t fsize, psync_folderid_t folderid, const char *name, psync_fileid_t localfileid){
+  psync_fileid_t fileid;
+  uint64_t filesize, hash;
+  unsigned char shashhex[PSYNC_HASH_DIGEST_HEXLEN];
+  int ret;
+  fileid=same_size_remote_file(fsize, folderid, name);
+  if (!fileid)
+    return 0;
+  ret=psync_get_remote_file_checksum(fileid, shashhex, &filesize, &hash);
+  if (ret==PSYNC_NET_OK)
+    return remote_file_matches(hashhex, fsize, folderid, name, localfileid, fileid, shashhex, filesize, hash);
+  else if (ret==PSYNC_NET_TEMPFAIL)
+    return -1;
+  else
+    return 0;
+}
+
+/* returns the metadata of the first file in the result of getfilesbychecksum or NULL if there are none */
+static const binresult *first_file_by_checksum(const binresult *res){
+  const binresult *metas;
+  uint64_t result;
+  result=psync_find_result(res, "result", PARAM_NUM)->num;
+  if (unlikely(result)){
+    debug(D_WARNING, "command getfilesbychecksum returned code %u", (unsigned)result);
+    return NULL;
+  }
+  metas=psync_find_result(res, "metadata", PARAM_ARRAY);
+  if (!metas->length)
+    return NULL;
+  else
+    return metas->array[0];
 }
 
 static int copy_file_if_exists(const unsigned char *hashhex, uint64_t fsize, psync_folderid_t folderid, const char *name, psync_fileid_t localfileid){
   binparam params[]={P_STR("auth", psync_my_auth), P_NUM("size", fsize), P_LSTR(PSYNC_CHECKSUM, hashhex, PSYNC_HASH_DIGEST_HEXLEN)};
   psync_socket *api;
   binresult *res;
-  const binresult *metas, *meta;
-  uint64_t result;
+  const binresult *meta;
   int ret;
   api=psync_apipool_get();
   if (unlikely(!api))
@@ -384,18 +426,11 @@ static int copy_file_if_exists(const unsigned char *hashhex, uint64_t fsize, psy
     psync_apipool_release_bad(api);
     return -1;
   }
-  result=psync_find_result(res, "result", PARAM_NUM)->num;
-  if (unlikely(result)){
+  meta=first_file_by_checksum(res);
+  if (!meta){
     psync_free(res);
-    debug(D_WARNING, "command getfilesbychecksum returned code %u", (unsigned)result);
     return 0;
   }
-  metas=psync_find_result(res, "metadata", PARAM_ARRAY);
-  if (!metas->length){
-    psync_free(res);
-    return 0;
-  }
-  meta=metas->array[0];
   ret=copy_file(psync_find_result(meta, "fileid", PARAM_NUM)->num, psync_find_result(meta, "hash", PARAM_NUM)->num, folderid, name, localfileid);
   if (ret==1)
     debug(D_NOTICE, "file %lu/%s copied to %lu/%s instead of uploading due to matching checksum", 
@@ -406,19 +441,61 @@ static int copy_file_if_exists(const unsigned char *hashhex, uint64_t fsize, psy
 }
 
 static void wake_upload_when_ready(){
-  if (current_uploads_waiters && psync_status.filesuploading<PSYNC_MAX_PARALLEL_UPLOADS && 
-      psync_status.bytestouploadcurrent-psync_status.bytesuploaded<=PSYNC_START_NEW_UPLOADS_TRESHOLD)
+  if (current_uploads_waiters && !psync_status.filesuploading)
     pthread_cond_signal(&current_uploads_cond);
 }
 
-static void add_bytes_uploaded(uint64_t bytes){
+/* upload->uploaded is updated under current_uploads_mutex, as parts of a file can be uploaded by several threads */
+static void add_bytes_uploaded(upload_list_t *upload, uint64_t bytes){
   pthread_mutex_lock(&current_uploads_mutex);
+  upload->uploaded+=bytes;
   psync_status.bytesuploaded+=bytes;
-  wake_upload_when_ready();
   pthread_mutex_unlock(&current_uploads_mutex);
+  psync_transfer_progress(&upload->transfer, bytes);
   psync_send_status_update();
 }
 
+/* processes and frees the result of uploadfile, called with the diff lock held */
+static int upload_file_result(binresult *res, const char *localpath, const unsigned char *hashhex, uint64_t fsize, psync_folderid_t folderid,
+                              const char *name, psync_fileid_t localfileid, uint64_t taskid){
+  const binresult *meta;
+  const char *hashhexsrv;
+  psync_sql_res *sres;
+  uint64_t result, fileid, rsize, hash;
+  result=psync_find_result(res, "result", PARAM_NUM)->num;
+  if (unlikely(result)){
+    psync_free(res);
+    debug(D_WARNING, "command uploadfile returned code %u", (unsigned)result);
+    if (psync_handle_api_result(result)==PSYNC_NET_TEMPFAIL)
+      return -1;
+    else
+      return 0;
+  }
+  meta=psync_find_result(res, "metadata", PARAM_ARRAY)->array[0];
+  fileid=psync_find_result(meta, "fileid", PARAM_NUM)->num;
+  hash=psync_find_result(meta, "hash", PARAM_NUM)->num;
+  rsize=psync_find_result(meta, "size", PARAM_NUM)->num;
+  hashhexsrv=psync_find_result(psync_find_result(res, "checksums", PARAM_ARRAY)->array[0], PSYNC_CHECKSUM, PARAM_STR)->str;
+  psync_sql_start_transaction();
+  sres=psync_sql_prep_statement("REPLACE INTO hashchecksum (hash, size, checksum) VALUES (?, ?, ?)");
+  psync_sql_bind_uint(sres, 1, hash);
+  psync_sql_bind_uint(sres, 2, rsize);
+  psync_sql_bind_lstring(sres, 3, hashhexsrv, PSYNC_HASH_DIGEST_HEXLEN);
+  psync_sql_run_free(sres);
+  if (psync_check_result(meta, "conflicted", PARAM_BOOL))
+    set_local_file_conflicted(localfileid, fileid, hash, localpath, psync_find_result(meta, "name", PARAM_STR)->str, taskid);
+  else
+    set_local_file_remote_id(localfileid, fileid, hash);
+  psync_sql_commit_transaction();
+  if (unlikely_log(rsize!=fsize) || unlikely_log(memcmp(hashhexsrv, hashhex, PSYNC_HASH_DIGEST_HEXLEN))){
+    psync_free(res);
+    return -1;
+  }
+  psync_free(res);
+  debug(D_NOTICE, "file %s uploaded to %lu/%s", localpath, (long unsigned)folderid, name);
+  return 0;
+}
+
 static int upload_file(const char *localpath, const unsigned char *hashhex, uint64_t fsize, psync_folderid_t folderid, const char *name, 
                        psync_fileid_t localfileid, psync_syncid_t syncid, upload_list_t *upload, binparam pr){
   binparam params[]={P_STR("auth", psync_my_auth), P_NUM("folderid", folderid), P_STR("filename", name), P_BOOL("nopartial", 1), 
@@ -426,13 +503,11 @@ static int upload_file(const char *localpath, const unsigned char *hashhex, uint
   psync_socket *api;
   void *buff;
   binresult *res;
-  const binresult *meta;
-  const char *hashhexsrv;
-  psync_sql_res *sres;
-  uint64_t bw, result, fileid, rsize, hash;
+  uint64_t bw;
   size_t rd;
   ssize_t rrd;
   psync_file_t fd;
+  int ret;
   fd=psync_file_open(localpath, P_O_RDONLY, 0);
   if (fd==INVALID_HANDLE_VALUE){
     debug(D_WARNING, "could not open local file %s", localpath);
@@ -465,8 +540,7 @@ static int upload_file(const char *localpath, const unsigned char *hashhex, uint
       debug(D_WARNING, "file %s has grown while uploading, retrying", localpath);
       goto err2;
     }
-    upload->uploaded+=rrd;
-    add_bytes_uploaded(rrd);
+    add_bytes_uploaded(upload, rrd);
   }
   psync_free(buff);
   psync_file_close(fd);
@@ -479,39 +553,9 @@ static int upload_file(const char *localpath, const unsigned char *hashhex, uint
     psync_apipool_release_bad(api);
     goto err00;
   }
-  result=psync_find_result(res, "result", PARAM_NUM)->num;
-  if (unlikely(result)){
-    psync_free(res);
-    debug(D_WARNING, "command uploadfile returned code %u", (unsigned)result);
-    if (psync_handle_api_result(result)==PSYNC_NET_TEMPFAIL)
-      goto err00;
-    else{
-      psync_diff_unlock();
-      return 0;
-    }
-  }
-  meta=psync_find_result(res, "metadata", PARAM_ARRAY)->array[0];
-  fileid=psync_find_result(meta, "fileid", PARAM_NUM)->num;
-  hash=psync_find_result(meta, "hash", PARAM_NUM)->num;
-  rsize=psync_find_result(meta, "size", PARAM_NUM)->num;
-  hashhexsrv=psync_find_result(psync_find_result(res, "checksums", PARAM_ARRAY)->array[0], PSYNC_CHECKSUM, PARAM_STR)->str;
-  psync_sql_start_transaction();
-  sres=psync_sql_prep_statement("REPLACE INTO hashchecksum (hash, size, checksum) VALUES (?, ?, ?)");
-  psync_sql_bind_uint(sres, 1, hash);
-  psync_sql_bind_uint(sres, 2, rsize);
-  psync_sql_bind_lstring(sres, 3, hashhexsrv, PSYNC_HASH_DIGEST_HEXLEN);
-  psync_sql_run_free(sres);
-  if (psync_check_result(meta, "conflicted", PARAM_BOOL))
-    set_local_file_conflicted(localfileid, fileid, hash, localpath, psync_find_result(meta, "name", PARAM_STR)->str, upload->taskid);
-  else
-    set_local_file_remote_id(localfileid, fileid, hash);
-  psync_sql_commit_transaction();
+  ret=upload_file_result(res, localpath, hashhex, fsize, folderid, name, localfileid, upload->taskid);
   psync_diff_unlock();
-  psync_free(res);
-  if (unlikely_log(rsize!=fsize) || unlikely_log(memcmp(hashhexsrv, hashhex, PSYNC_HASH_DIGEST_HEXLEN)))
-    return -1;
-  debug(D_NOTICE, "file %s uploaded to %lu/%s", localpath, (long unsigned)folderid, name);
-  return 0;
+  return ret;
 err2:
   psync_free(buff);
 err1:
@@ -551,8 +595,7 @@ static int upload_range(psync_socket *api, psync_upload_range_list_t *r, upload_
     bw+=rrd;
     if (unlikely_log(psync_socket_writeall_upload(api, buff, rrd)!=rrd))
       goto err0;
-    upload->uploaded+=rrd;
-    add_bytes_uploaded(rrd);
+    add_bytes_uploaded(upload, rrd);
   }
   psync_free(buff);
   return PSYNC_NET_OK;
@@ -567,8 +610,7 @@ static int upload_from_file(psync_socket *api, psync_upload_range_list_t *r, psy
   if (unlikely_log(!send_command_no_res(api, "upload_writefromfile", params)))
     return PSYNC_NET_TEMPFAIL;
   else{
-    upload->uploaded+=r->len;
-    add_bytes_uploaded(r->len);
+    add_bytes_uploaded(upload, r->len);
     return PSYNC_NET_OK;
   }
 }
@@ -579,8 +621,7 @@ static int upload_from_upload(psync_socket *api, psync_upload_range_list_t *r, p
   if (unlikely_log(!send_command_no_res(api, "upload_writefromupload", params)))
     return PSYNC_NET_TEMPFAIL;
   else{
-    upload->uploaded+=r->len;
-    add_bytes_uploaded(r->len);
+    add_bytes_uploaded(upload, r->len);
     return PSYNC_NET_OK;
   }
 }
@@ -636,6 +677,224 @@ static int upload_save(psync_socket *api, psync_fileid_t localfileid, const char
   return ret;
 }
 
+/* Large upload ranges are split in parts of PSYNC_UPLOAD_PART_SIZE that are uploaded concurrently over up to
+ * PSYNC_UPLOAD_PARALLEL_CONNECTIONS API connections, one of which is the connection of the upload itself. Each completed part
+ * is recorded in localfileuploadpart, so a resumed upload only sends the missing parts. Uploaded parts stay in the range list
+ * as PSYNC_URANGE_UPLOADED, so that offsets of the following ranges are unchanged.
+ */
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  psync_upload_range_list_t **parts;
+  const char *localpath;
+  upload_list_t *upload;
+  psync_uploadid_t uploadid;
+  uint32_t partcnt;
+  uint32_t nextpart;
+  uint32_t running;
+  int error;
+} upload_parts_t;
+
+static int upload_parts_run(psync_socket *api, psync_file_t fd, upload_parts_t *up){
+  psync_upload_range_list_t *le;
+  psync_sql_res *sql;
+  binresult *res;
+  uint64_t result;
+  while (1){
+    pthread_mutex_lock(&up->mutex);
+    if (up->error || up->nextpart==up->partcnt){
+      pthread_mutex_unlock(&up->mutex);
+      return 0;
+    }
+    le=up->parts[up->nextpart++];
+    pthread_mutex_unlock(&up->mutex);
+    debug(D_NOTICE, "uploading part of %lu bytes at offset %lu", (unsigned long)le->len, (unsigned long)le->uploadoffset);
+    if (upload_range(api, le, up->upload, up->uploadid, fd)!=PSYNC_NET_OK)
+      goto err;
+    res=get_result(api);
+    if (unlikely_log(!res))
+      goto err;
+    result=psync_find_result(res, "result", PARAM_NUM)->num;
+    psync_free(res);
+    if (unlikely(result)){
+      debug(D_WARNING, "upload_write of part at offset %lu returned %lu", (unsigned long)le->uploadoffset, (unsigned long)result);
+      goto err;
+    }
+    le->type=PSYNC_URANGE_UPLOADED;
+    sql=psync_sql_prep_statement("REPLACE INTO localfileuploadpart (uploadid, off, len) VALUES (?, ?, ?)");
+    psync_sql_bind_uint(sql, 1, up->uploadid);
+    psync_sql_bind_uint(sql, 2, le->uploadoffset);
+    psync_sql_bind_uint(sql, 3, le->len);
+    psync_sql_run_free(sql);
+  }
+err:
+  pthread_mutex_lock(&up->mutex);
+  up->error=1;
+  pthread_mutex_unlock(&up->mutex);
+  return -1;
+}
+
+static void upload_parts_thread(void *ptr){
+  upload_parts_t *up;
+  psync_socket *api;
+  psync_file_t fd;
+  up=(upload_parts_t *)ptr;
+  api=psync_apipool_get();
+  if (likely(api)){
+    fd=psync_file_open(up->localpath, P_O_RDONLY, 0);
+    if (likely_log(fd!=INVALID_HANDLE_VALUE)){
+      if (upload_parts_run(api, fd, up))
+        psync_apipool_release_bad(api);
+      else
+        psync_apipool_release(api);
+      psync_file_close(fd);
+    }
+    else
+      psync_apipool_release(api);
+  }
+  pthread_mutex_lock(&up->mutex);
+  if (--up->running==0)
+    pthread_cond_signal(&up->cond);
+  pthread_mutex_unlock(&up->mutex);
+}
+
+static int upload_parts_parallel(psync_socket *api, psync_file_t fd, psync_list *rlist, const char *localpath, upload_list_t *upload,
+                                 psync_uploadid_t uploadid){
+  upload_parts_t up;
+  psync_upload_range_list_t *le, *n;
+  uint32_t i, threads;
+  int ret;
+  up.partcnt=0;
+  psync_list_for_each_element(le, rlist, psync_upload_range_list_t, list)
+    if (le->type==PSYNC_URANGE_UPLOAD && le->len>=PSYNC_UPLOAD_PART_SIZE*2)
+      up.partcnt+=(le->len+PSYNC_UPLOAD_PART_SIZE-1)/PSYNC_UPLOAD_PART_SIZE;
+  if (up.partcnt<2)
+    return 0;
+  up.parts=psync_new_cnt(psync_upload_range_list_t *, up.partcnt);
+  i=0;
+  psync_list_for_each_element(le, rlist, psync_upload_range_list_t, list)
+    if (le->type==PSYNC_URANGE_UPLOAD && le->len>=PSYNC_UPLOAD_PART_SIZE*2){
+      while (le->len>PSYNC_UPLOAD_PART_SIZE){
+        n=psync_new(psync_upload_range_list_t);
+        n->uploadoffset=le->uploadoffset+PSYNC_UPLOAD_PART_SIZE;
+        n->off=le->off+PSYNC_UPLOAD_PART_SIZE;
+        n->len=le->len-PSYNC_UPLOAD_PART_SIZE;
+        n->type=PSYNC_URANGE_UPLOAD;
+        n->id=0;
+        le->len=PSYNC_UPLOAD_PART_SIZE;
+        psync_list_add_after(&le->list, &n->list);
+        up.parts[i++]=le;
+        le=n;
+      }
+      up.parts[i++]=le;
+    }
+  assertw(i==up.partcnt);
+  pthread_mutex_init(&up.mutex, NULL);
+  pthread_cond_init(&up.cond, NULL);
+  up.localpath=localpath;
+  up.upload=upload;
+  up.uploadid=uploadid;
+  up.nextpart=0;
+  up.error=0;
+  threads=PSYNC_UPLOAD_PARALLEL_CONNECTIONS-1;
+  if (threads>up.partcnt-1)
+    threads=up.partcnt-1;
+  debug(D_NOTICE, "uploading %u parts over %u connections", (unsigned)up.partcnt, (unsigned)threads+1);
+  up.running=threads;
+  for (i=0; i<threads; i++)
+    psync_run_thread1("upload part", upload_parts_thread, &up);
+  ret=upload_parts_run(api, fd, &up);
+  pthread_mutex_lock(&up.mutex);
+  while (up.running)
+    pthread_cond_wait(&up.cond, &up.mutex);
+  if (up.error)
+    ret=-1;
+  pthread_mutex_unlock(&up.mutex);
+  pthread_cond_destroy(&up.cond);
+  pthread_mutex_destroy(&up.mutex);
+  psync_free(up.parts);
+  return ret;
+}
+
+/* builds the ranges from uploadoffset to fsize, skipping parts already uploaded to uploadid */
+static uint64_t upload_init_ranges(psync_list *rlist, psync_uploadid_t uploadid, uint64_t uploadoffset, uint64_t fsize){
+  psync_sql_res *sql;
+  psync_uint_row row;
+  psync_upload_range_list_t *le;
+  uint64_t off, uploaded;
+  off=uploadoffset;
+  uploaded=0;
+  if (uploadid){
+    sql=psync_sql_query("SELECT off, len FROM localfileuploadpart WHERE uploadid=? AND off>=? ORDER BY off");
+    psync_sql_bind_uint(sql, 1, uploadid);
+    psync_sql_bind_uint(sql, 2, uploadoffset);
+    while ((row=psync_sql_fetch_rowint(sql))){
+      if (row[0]<off || row[0]+row[1]>fsize)
+        continue;
+      if (row[0]>off){
+        le=psync_new(psync_upload_range_list_t);
+        le->uploadoffset=le->off=off;
+        le->len=row[0]-off;
+        le->type=PSYNC_URANGE_UPLOAD;
+        le->id=0;
+        psync_list_add_tail(rlist, &le->list);
+      }
+      le=psync_new(psync_upload_range_list_t);
+      le->uploadoffset=le->off=row[0];
+      le->len=row[1];
+      le->type=PSYNC_URANGE_UPLOADED;
+      le->id=0;
+      psync_list_add_tail(rlist, &le->list);
+      off=row[0]+row[1];
+      uploaded+=row[1];
+    }
+    psync_sql_free_result(sql);
+  }
+  if (off<fsize){
+    le=psync_new(psync_upload_range_list_t);
+    le->uploadoffset=le->off=off;
+    le->len=fsize-off;
+    le->type=PSYNC_URANGE_UPLOAD;
+    le->id=0;
+    psync_list_add_tail(rlist, &le->list);
+  }
+  return uploaded;
+}
+
+static int upload_has_parts(psync_uploadid_t uploadid){
+  psync_sql_res *sql;
+  int ret;
+  sql=psync_sql_query("SELECT uploadid FROM localfileuploadpart WHERE uploadid=? LIMIT 1");
+  psync_sql_bind_uint(sql, 1, uploadid);
+  ret=psync_sql_fetch_rowint(sql)!=NULL;
+  psync_sql_free_result(sql);
+  return ret;
+}
+
+static void upload_delete_parts(psync_uploadid_t uploadid){
+  psync_sql_res *sql;
+  sql=psync_sql_prep_statement("DELETE FROM localfileuploadpart WHERE uploadid=?");
+  psync_sql_bind_uint(sql, 1, uploadid);
+  psync_sql_run_free(sql);
+}
+
+static int get_checksum_for_hash(uint64_t hash, unsigned char *hashhex){
+  psync_sql_res *res;
+  psync_variant_row row;
+  int ret;
+  res=psync_sql_query("SELECT checksum FROM hashchecksum WHERE hash=? LIMIT 1");
+  psync_sql_bind_uint(res, 1, hash);
+  if ((row=psync_sql_fetch_row(res)) && row[0].length==PSYNC_HASH_DIGEST_HEXLEN){
+    memcpy(hashhex, psync_get_string(row[0]), PSYNC_HASH_DIGEST_HEXLEN);
+    ret=1;
+  }
+  else
+    ret=0;
+  psync_sql_free_result(res);
+  return ret;
+}
+
 static int upload_big_file(const char *localpath, const unsigned char *hashhex, uint64_t fsize, psync_folderid_t folderid, const char *name, 
                        psync_fileid_t localfileid, psync_syncid_t syncid, upload_list_t *upload, psync_uploadid_t uploadid, uint64_t uploadoffset, binparam pr){
   psync_socket *api;
@@ -648,12 +907,12 @@ static int upload_big_file(const char *localpath, const unsigned char *hashhex,
   uint64_t result;
   uint32_t rid, respwait, id;
   psync_file_t fd;
-  int ret;
+  int ret, hasprev;
+  unsigned char prevhashhex[PSYNC_HASH_DIGEST_HEXLEN];
   debug(D_NOTICE, "uploading file %s with repeating block inspection", localpath);
   if (uploadoffset){
     debug(D_NOTICE, "resuming from position %lu", (unsigned long)uploadoffset);
-    upload->uploaded+=uploadoffset;
-    add_bytes_uploaded(uploadoffset);
+    add_bytes_uploaded(upload, uploadoffset);
   }
   api=psync_apipool_get();
   if (unlikely(!api))
@@ -682,12 +941,11 @@ static int upload_big_file(const char *localpath, const unsigned char *hashhex,
   }
   psync_list_init(&rlist);
   if (likely(uploadoffset<fsize)){
-    le=psync_new(psync_upload_range_list_t);
-    le->uploadoffset=uploadoffset;
-    le->off=uploadoffset;
-    le->len=fsize-uploadoffset;
-    le->type=PSYNC_URANGE_UPLOAD;
-    psync_list_add_tail(&rlist, &le->list);
+    result=upload_init_ranges(&rlist, uploadid, uploadoffset, fsize);
+    if (result){
+      debug(D_NOTICE, "%lu bytes already uploaded in parts", (unsigned long)result);
+      add_bytes_uploaded(upload, result);
+    }
   }
   fd=psync_file_open(localpath, P_O_RDONLY, 0);
   if (unlikely(fd==INVALID_HANDLE_VALUE)){
@@ -696,6 +954,7 @@ static int upload_big_file(const char *localpath, const unsigned char *hashhex,
     psync_list_for_each_element_call(&rlist, psync_upload_range_list_t, list, psync_free);
     return -1;
   }
+  hasprev=0;
   if (likely(uploadoffset<fsize)){
     sql=psync_sql_query("SELECT fileid, hash FROM localfile WHERE id=?");
     psync_sql_bind_uint(sql, 1, localfileid);
@@ -704,7 +963,13 @@ static int upload_big_file(const char *localpath, const unsigned char *hashhex,
       fileid=row[0];
       hash=row[1];
       psync_sql_free_result(sql);
-      if (fileid && psync_net_scan_file_for_blocks(api, &rlist, fileid, hash, fd)==PSYNC_NET_TEMPFAIL)
+      if (fileid){
+        hasprev=get_checksum_for_hash(hash, prevhashhex);
+        if (psync_net_scan_file_for_chunks(&rlist, fileid, hash, hasprev?prevhashhex:NULL, hashhex, fd)==PSYNC_NET_TEMPFAIL ||
+            psync_net_scan_file_for_blocks(api, &rlist, fileid, hash, fd)==PSYNC_NET_TEMPFAIL)
+          goto err1;
+      }
+      else if (psync_net_scan_file_for_chunks(&rlist, 0, 0, NULL, hashhex, fd)==PSYNC_NET_TEMPFAIL)
         goto err1;
     }
     else
@@ -718,6 +983,8 @@ static int upload_big_file(const char *localpath, const unsigned char *hashhex,
         goto err1;
       }
     psync_free(fr);
+    if (fsize>=PSYNC_UPLOAD_PARALLEL_MIN_SIZE && upload_parts_parallel(api, fd, &rlist, localpath, upload, uploadid))
+      goto err1;
   }
   rid=0;
   respwait=0;
@@ -728,6 +995,10 @@ static int upload_big_file(const char *localpath, const unsigned char *hashhex,
     if (upload->stop)
       goto err1;
     le->uploadoffset=uploadoffset;
+    if (le->type==PSYNC_URANGE_UPLOADED){
+      uploadoffset+=le->len;
+      continue;
+    }
     le->id=++rid;
     if (le->type==PSYNC_URANGE_LAST){
       if (upload_get_checksum(api, uploadid, le->id))
@@ -783,6 +1054,7 @@ static int upload_big_file(const char *localpath, const unsigned char *hashhex,
                            "s, got: %."NTO_STR(PSYNC_HASH_DIGEST_HEXLEN)"s", hashhex, 
                            psync_find_result(res, PSYNC_CHECKSUM, PARAM_STR)->str);
           psync_free(res);
+          upload_delete_parts(uploadid);
           goto err1;
         }
         else
@@ -829,6 +1101,8 @@ restart:
   psync_file_close(fd);
   if (ret==PSYNC_NET_OK)
     ret=upload_save(api, localfileid, localpath, hashhex, fsize, uploadid, folderid, name, upload->taskid, pr);
+  if (ret==PSYNC_NET_OK && hasprev && memcmp(prevhashhex, hashhex, PSYNC_HASH_DIGEST_HEXLEN))
+    psync_net_delete_file_chunks(prevhashhex);
   psync_apipool_release(api);
   if (ret==PSYNC_NET_TEMPFAIL)
     return -1;
@@ -847,6 +1121,27 @@ errp:
   return 0;
 }
 
+static void get_ifhash_param(psync_fileid_t localfileid, binparam *pr){
+  psync_sql_res *res;
+  psync_uint_row row;
+  res=psync_sql_query("SELECT hash FROM localfile WHERE hash IS NOT NULL AND id=?");
+  psync_sql_bind_uint(res, 1, localfileid);
+  if ((row=psync_sql_fetch_rowint(res))){
+    pr->paramtype=PARAM_NUM;
+    pr->paramnamelen=6;
+    pr->paramname="ifhash";
+    pr->num=row[0];
+  }
+  else{
+    pr->paramtype=PARAM_STR;
+    pr->paramnamelen=6;
+    pr->paramname="ifhash";
+    pr->opts=3;
+    pr->str="new";
+  }
+  psync_sql_free_result(res);
+}
+
 static void delete_uploadid(psync_uploadid_t uploadid){
   binparam params[]={P_STR("auth", psync_my_auth), P_NUM("uploadid", uploadid)};
   psync_socket *api;
@@ -867,8 +1162,10 @@ static void delete_uploadids(psync_fileid_t localfileid){
   psync_sql_bind_uint(res, 1, localfileid);
   rows=psync_sql_fetchall_int(res);
   if (rows->rows){
-    for (i=0; i<rows->rows; i++)
+    for (i=0; i<rows->rows; i++){
       delete_uploadid(psync_get_result_cell(rows, i, 0));
+      upload_delete_parts(psync_get_result_cell(rows, i, 0));
+    }
     res=psync_sql_prep_statement("DELETE FROM localfileupload WHERE localfileid=?");
     psync_sql_bind_uint(res, 1, localfileid);
     psync_sql_run_free(res);
@@ -971,27 +1268,14 @@ static int task_uploadfile(psync_syncid_t syncid, psync_folderid_t localfileid,
     return ret==1?0:-1;
   }
   memcpy(upload->hash, hashhex, PSYNC_HASH_DIGEST_HEXLEN);
-  res=psync_sql_query("SELECT hash FROM localfile WHERE hash IS NOT NULL AND id=?");
-  psync_sql_bind_uint(res, 1, localfileid);
-  if ((row=psync_sql_fetch_rowint(res))){
-    pr.paramtype=PARAM_NUM;
-    pr.paramnamelen=6;
-    pr.paramname="ifhash";
-    pr.num=row[0];
-  }
-  else{
-    pr.paramtype=PARAM_STR;
-    pr.paramnamelen=6;
-    pr.paramname="ifhash";
-    pr.opts=3;
-    pr.str="new";
-  }
-  psync_sql_free_result(res);
+  get_ifhash_param(localfileid, &pr);
   debug(D_NOTICE, "uploading file %s", localpath);
   if (fsize<=PSYNC_MIN_SIZE_FOR_CHECKSUMS)
     ret=upload_file(localpath, hashhex, fsize, folderid, nname, localfileid, syncid, upload, pr);
   else{
-    if (uploadid && !memcmp(phashhex, uhashhex, PSYNC_HASH_DIGEST_HEXLEN))
+    if (uploadid && upload_has_parts(uploadid))
+      ret=upload_big_file(localpath, hashhex, fsize, folderid, nname, localfileid, syncid, upload, uploadid, 0, pr);
+    else if (uploadid && !memcmp(phashhex, uhashhex, PSYNC_HASH_DIGEST_HEXLEN))
       ret=upload_big_file(localpath, hashhex, fsize, folderid, nname, localfileid, syncid, upload, uploadid, ufsize, pr);
     else{
       if (uploadid && memcmp(phashhex, uhashhex, PSYNC_HASH_DIGEST_HEXLEN))
@@ -1024,6 +1308,7 @@ static void task_run_upload_file_thread(void *ptr){
     psync_sql_bind_uint(res, 1, ut->upllist.taskid);
     psync_sql_run_free(res);
   }
+  psync_transfer_end(&ut->upllist.transfer);
   pthread_mutex_lock(&current_uploads_mutex);
   psync_status.bytestouploadcurrent-=ut->upllist.filesize;
   psync_status.bytesuploaded-=ut->upllist.uploaded;
@@ -1059,9 +1344,6 @@ static int task_run_uploadfile(uint64_t taskid, psync_syncid_t syncid, psync_fol
     debug(D_WARNING, "could not get size for local file %s (localfileid %lu)", filename, (unsigned long)localfileid);
     return 0;
   }
-  res=psync_sql_prep_statement("UPDATE task SET inprogress=1 WHERE id=?");
-  psync_sql_bind_uint(res, 1, taskid);
-  psync_sql_run_free(res);
   len=strlen(filename);
   ut=(upload_task_t *)psync_malloc(offsetof(upload_task_t, filename)+len+1);
   ut->upllist.taskid=taskid;
@@ -1070,18 +1352,15 @@ static int task_run_uploadfile(uint64_t taskid, psync_syncid_t syncid, psync_fol
   ut->upllist.uploaded=0;
   ut->upllist.syncid=syncid;
   ut->upllist.stop=0;
+  ut->upllist.batchstop=NULL;
   ut->upllist.hash[0]=0;
   memcpy(ut->filename, filename, len+1);
-  stop=0;
   pthread_mutex_lock(&current_uploads_mutex);
   psync_list_add_tail(&uploads, &ut->upllist.list);
-  while (!ut->upllist.stop && (psync_status.filesuploading>=PSYNC_MAX_PARALLEL_UPLOADS || 
-         psync_status.bytestouploadcurrent-psync_status.bytesuploaded>PSYNC_START_NEW_UPLOADS_TRESHOLD)){
-    current_uploads_waiters++;
-    pthread_cond_wait(&current_uploads_cond, &current_uploads_mutex);
-    current_uploads_waiters--;
-  }
-  if (unlikely(ut->upllist.stop)){
+  pthread_mutex_unlock(&current_uploads_mutex);
+  stop=psync_transfer_start(&ut->upllist.transfer, PSYNC_TRANSFER_UPLOAD, filesize, &ut->upllist.stop);
+  pthread_mutex_lock(&current_uploads_mutex);
+  if (unlikely(stop)){
     psync_list_del(&ut->upllist.list);
     stop=1;
   }
@@ -1155,33 +1434,424 @@ static int upload_task(uint64_t taskid, uint32_t type, psync_syncid_t syncid, ui
   return res;
 }
 
-static void upload_thread(){
+/* Small files are uploaded in batches - the existence checks, copies and uploads of all the files in a batch are pipelined on
+ * a single connection, so syncing many small files is limited by bandwidth rather than by the round trip time. That includes
+ * the checksums of same named and sized remote files that are not known locally. */
+typedef struct {
+  upload_list_t upllist;
+  psync_file_lock_t *lock;
+  char *localpath;
+  char *nname;
+  binresult *res;
+  psync_folderid_t folderid;
+  psync_fileid_t existingfileid;
+  binparam ifhash;
+  int copy;
+  int ret;
+  char filename[];
+} upload_batch_file_t;
+
+typedef struct {
+  psync_transfer_t transfer;
+  uint32_t cnt;
+  /* set when any of the files is stopped, so that the batch does not wait to start */
+  int stop;
+  upload_batch_file_t *files[];
+} upload_batch_t;
+
+typedef int (*upload_batch_send_ptr)(psync_socket *, upload_batch_t *, upload_batch_file_t *);
+typedef int (*upload_batch_recv_ptr)(psync_socket *, upload_batch_file_t *);
+
+/* does the local part of task_uploadfile, returns 1 if the file is to be sent, 0 if the task is done and -1 if it is to be retried */
+static int upload_batch_prepare(upload_batch_file_t *bf){
   psync_sql_res *res;
-  psync_variant *row;
-  uint64_t taskid;
-  uint32_t type;
+  psync_uint_row row;
+  psync_fileid_t fileid;
+  uint64_t fsize, filesize, hash;
+  unsigned char shashhex[PSYNC_HASH_DIGEST_HEXLEN];
+  if (bf->upllist.stop)
+    return -1;
+  bf->localpath=psync_local_path_for_local_file(bf->upllist.localfileid, NULL);
+  if (unlikely(!bf->localpath)){
+    debug(D_WARNING, "could not find local file %s (id %lu)", bf->filename, (unsigned long)bf->upllist.localfileid);
+    return 0;
+  }
+  bf->lock=psync_lock_file(bf->localpath);
+  if (!bf->lock){
+    debug(D_NOTICE, "file %s is currently locked, skipping for now", bf->localpath);
+    return -1;
+  }
+  if (psync_get_local_file_checksum(bf->localpath, bf->upllist.hash, &fsize)){
+    debug(D_WARNING, "could not open local file %s, deleting it from localfile", bf->localpath);
+    res=psync_sql_prep_statement("DELETE FROM localfile WHERE id=?");
+    psync_sql_bind_uint(res, 1, bf->upllist.localfileid);
+    psync_sql_run_free(res);
+    return 0;
+  }
+  if (fsize!=bf->upllist.filesize){
+    pthread_mutex_lock(&current_uploads_mutex);
+    psync_status.bytestouploadcurrent-=bf->upllist.filesize;
+    psync_status.bytestouploadcurrent+=fsize;
+    pthread_mutex_unlock(&current_uploads_mutex);
+    bf->upllist.filesize=fsize;
+  }
+  res=psync_sql_prep_statement("UPDATE localfile SET size=?, checksum=? WHERE id=?");
+  psync_sql_bind_uint(res, 1, fsize);
+  psync_sql_bind_lstring(res, 2, (char *)bf->upllist.hash, PSYNC_HASH_DIGEST_HEXLEN);
+  psync_sql_bind_uint(res, 3, bf->upllist.localfileid);
+  psync_sql_run_free(res);
+  if (fsize>PSYNC_UPLOAD_BATCH_MAX_FILE_SIZE){
+    debug(D_NOTICE, "file %s has grown to %lu bytes, leaving it for a separate upload", bf->localpath, (unsigned long)fsize);
+    return -1;
+  }
+  res=psync_sql_query("SELECT s.folderid FROM localfile f, syncedfolder s WHERE f.id=? AND f.localparentfolderid=s.localfolderid AND s.syncid=?");
+  psync_sql_bind_uint(res, 1, bf->upllist.localfileid);
+  psync_sql_bind_uint(res, 2, bf->upllist.syncid);
+  if (likely_log(row=psync_sql_fetch_rowint(res)))
+    bf->folderid=row[0];
+  else{
+    debug(D_WARNING, "could not get remote folderid for local file %lu", (unsigned long)bf->upllist.localfileid);
+    psync_sql_free_result(res);
+    return 0;
+  }
+  psync_sql_free_result(res);
+  bf->nname=psync_strnormalize_filename(bf->filename);
+  fileid=same_size_remote_file(fsize, bf->folderid, bf->nname);
+  if (fileid){
+    if (!psync_get_cached_remote_file_checksum(fileid, shashhex, &filesize, &hash))
+      bf->existingfileid=fileid;
+    else if (remote_file_matches(bf->upllist.hash, fsize, bf->folderid, bf->nname, bf->upllist.localfileid, fileid, shashhex, filesize, hash))
+      return 0;
+  }
+  get_ifhash_param(bf->upllist.localfileid, &bf->ifhash);
+  return 1;
+}
+
+static int upload_batch_send_exists(psync_socket *api, upload_batch_t *b, upload_batch_file_t *bf){
+  binparam params[]={P_STR("auth", psync_my_auth), P_NUM("fileid", bf->existingfileid)};
+  if (!bf->existingfileid)
+    return 0;
+  if (unlikely_log(!send_command_no_res(api, "checksumfile", params)))
+    return -1;
+  else
+    return 1;
+}
+
+static int upload_batch_recv_exists(psync_socket *api, upload_batch_file_t *bf){
+  binresult *res;
+  uint64_t filesize, hash;
+  unsigned char shashhex[PSYNC_HASH_DIGEST_HEXLEN];
+  int ret;
+  res=get_result(api);
+  if (unlikely_log(!res))
+    return -1;
+  ret=psync_remote_file_checksum_result(res, shashhex, &filesize, &hash);
+  psync_free(res);
+  if (ret==PSYNC_NET_OK){
+    if (remote_file_matches(bf->upllist.hash, bf->upllist.filesize, bf->folderid, bf->nname, bf->upllist.localfileid, bf->existingfileid,
+                            shashhex, filesize, hash))
+      bf->ret=0;
+  }
+  else if (ret==PSYNC_NET_TEMPFAIL)
+    bf->ret=-1;
+  return 0;
+}
+
+static int upload_batch_send_checksum(psync_socket *api, upload_batch_t *b, upload_batch_file_t *bf){
+  binparam params[]={P_STR("auth", psync_my_auth), P_NUM("size", bf->upllist.filesize), P_LSTR(PSYNC_CHECKSUM, bf->upllist.hash, PSYNC_HASH_DIGEST_HEXLEN)};
+  if (unlikely_log(!send_command_no_res(api, "getfilesbychecksum", params)))
+    return -1;
+  else
+    return 1;
+}
+
+static int upload_batch_recv_checksum(psync_socket *api, upload_batch_file_t *bf){
+  bf->res=get_result(api);
+  if (unlikely_log(!bf->res))
+    return -1;
+  else
+    return 0;
+}
+
+static int upload_batch_send_file(psync_socket *api, upload_batch_t *b, upload_batch_file_t *bf){
+  const binresult *meta;
+  void *buff;
+  uint64_t fsize;
+  ssize_t rd;
+  psync_file_t fd;
+  if (unlikely(bf->upllist.stop)){
+    debug(D_NOTICE, "upload of %s stopped", bf->localpath);
+    bf->ret=-1;
+    return 0;
+  }
+  if (bf->res && (meta=first_file_by_checksum(bf->res))){
+    binparam params[]={P_STR("auth", psync_my_auth), P_NUM("fileid", psync_find_result(meta, "fileid", PARAM_NUM)->num),
+                       P_NUM("hash", psync_find_result(meta, "hash", PARAM_NUM)->num), P_NUM("tofolderid", bf->folderid), P_STR("toname", bf->nname)};
+    bf->copy=1;
+    if (unlikely_log(!send_command_no_res(api, "copyfile", params)))
+      return -1;
+    else
+      return 1;
+  }
+  else{
+    binparam params[]={P_STR("auth", psync_my_auth), P_NUM("folderid", bf->folderid), P_STR("filename", bf->nname), P_BOOL("nopartial", 1), bf->ifhash};
+    fsize=bf->upllist.filesize;
+    fd=psync_file_open(bf->localpath, P_O_RDONLY, 0);
+    if (fd==INVALID_HANDLE_VALUE){
+      debug(D_WARNING, "could not open local file %s", bf->localpath);
+      bf->ret=-1;
+      return 0;
+    }
+    /* one byte more is read to find out if the file has grown */
+    buff=psync_malloc(fsize+1);
+    rd=psync_file_read(fd, buff, fsize+1);
+    psync_file_close(fd);
+    if (rd!=(ssize_t)fsize){
+      debug(D_WARNING, "file %s has changed while uploading, retrying", bf->localpath);
+      psync_free(buff);
+      bf->ret=-1;
+      return 0;
+    }
+    if (unlikely_log(!do_send_command(api, "uploadfile", strlen("uploadfile"), params, ARRAY_SIZE(params), fsize, 0)) ||
+        unlikely_log(fsize && psync_socket_writeall_upload(api, buff, fsize)!=fsize)){
+      psync_free(buff);
+      return -1;
+    }
+    psync_free(buff);
+    pthread_mutex_lock(&current_uploads_mutex);
+    bf->upllist.uploaded+=fsize;
+    psync_status.bytesuploaded+=fsize;
+    pthread_mutex_unlock(&current_uploads_mutex);
+    psync_transfer_progress(&b->transfer, fsize);
+    psync_send_status_update();
+    return 1;
+  }
+}
+
+static int upload_batch_recv_file(psync_socket *api, upload_batch_file_t *bf){
+  binresult *res;
+  psync_diff_lock();
+  res=get_result(api);
+  if (unlikely_log(!res)){
+    psync_diff_unlock();
+    return -1;
+  }
+  if (bf->copy){
+    if (copy_file_result(res, bf->upllist.localfileid)){
+      debug(D_NOTICE, "file %s copied to %lu/%s instead of uploading due to matching checksum", bf->localpath, 
+            (unsigned long)bf->folderid, bf->nname);
+      bf->ret=0;
+    }
+    else{
+      /* the file will be uploaded in the next round */
+      psync_free(bf->res);
+      bf->res=NULL;
+      bf->copy=0;
+    }
+  }
+  else
+    bf->ret=upload_file_result(res, bf->localpath, bf->upllist.hash, bf->upllist.filesize, bf->folderid, bf->nname, 
+                               bf->upllist.localfileid, bf->upllist.taskid);
+  psync_diff_unlock();
+  return 0;
+}
+
+/* Sends a command for each file of the batch that still waits for the network, keeping up to PSYNC_UPLOAD_BATCH_WINDOW commands
+ * in flight and reading the results as soon as they are available, the same way psync_fsupload_run_tasks() does. */
+static int upload_batch_pipeline(psync_socket *api, upload_batch_t *b, upload_batch_send_ptr send, upload_batch_recv_ptr recv){
+  uint32_t *sent;
+  uint32_t i, ns, nr;
+  int ret;
+  sent=psync_new_cnt(uint32_t, b->cnt);
+  ns=nr=0;
+  for (i=0; i<b->cnt; i++){
+    if (b->files[i]->ret!=1)
+      continue;
+    ret=send(api, b, b->files[i]);
+    if (ret==-1)
+      goto err;
+    else if (ret==0)
+      continue;
+    sent[ns++]=i;
+    while (ns-nr>=PSYNC_UPLOAD_BATCH_WINDOW || (nr<ns && psync_select_in(&api->sock, 1, 0)==0))
+      if (recv(api, b->files[sent[nr++]]))
+        goto err;
+  }
+  while (nr<ns)
+    if (recv(api, b->files[sent[nr++]]))
+      goto err;
+  psync_free(sent);
+  return 0;
+err:
+  psync_free(sent);
+  return -1;
+}
+
+static void task_run_upload_batch_thread(void *ptr){
+  upload_batch_t *b;
+  upload_batch_file_t *bf;
+  psync_socket *api;
+  psync_sql_res *del, *upd;
+  uint32_t i, pending, failed;
+  b=(upload_batch_t *)ptr;
+  psync_wait_statuses_array(requiredstatuses, ARRAY_SIZE(requiredstatuses));
+  pending=0;
+  for (i=0; i<b->cnt; i++){
+    b->files[i]->ret=upload_batch_prepare(b->files[i]);
+    if (b->files[i]->ret==1)
+      pending++;
+  }
+  if (pending && likely(api=psync_apipool_get())){
+    /* the fourth round uploads the files that could not be copied in the third */
+    if (upload_batch_pipeline(api, b, upload_batch_send_exists, upload_batch_recv_exists) ||
+        upload_batch_pipeline(api, b, upload_batch_send_checksum, upload_batch_recv_checksum) ||
+        upload_batch_pipeline(api, b, upload_batch_send_file, upload_batch_recv_file) ||
+        upload_batch_pipeline(api, b, upload_batch_send_file, upload_batch_recv_file))
+      psync_apipool_release_bad(api);
+    else{
+      psync_set_default_sendbuf(api);
+      psync_apipool_release(api);
+    }
+  }
+  psync_transfer_end(&b->transfer);
+  failed=0;
+  for (i=0; i<b->cnt; i++)
+    if (b->files[i]->ret)
+      failed++;
+  if (failed){
+    debug(D_NOTICE, "%u of %u files of the batch failed to upload", (unsigned)failed, (unsigned)b->cnt);
+    psync_milisleep(PSYNC_SLEEP_ON_FAILED_UPLOAD);
+  }
+  psync_sql_start_transaction();
+  del=psync_sql_prep_statement("DELETE FROM task WHERE id=?");
+  upd=psync_sql_prep_statement("UPDATE task SET inprogress=0 WHERE id=?");
+  for (i=0; i<b->cnt; i++)
+    if (b->files[i]->ret){
+      psync_sql_bind_uint(upd, 1, b->files[i]->upllist.taskid);
+      psync_sql_run(upd);
+    }
+    else{
+      psync_sql_bind_uint(del, 1, b->files[i]->upllist.taskid);
+      psync_sql_run(del);
+    }
+  psync_sql_free_result(upd);
+  psync_sql_free_result(del);
+  psync_sql_commit_transaction();
+  for (i=0; i<b->cnt; i++)
+    if (!b->files[i]->ret)
+      delete_uploadids(b->files[i]->upllist.localfileid);
+  pthread_mutex_lock(&current_uploads_mutex);
+  for (i=0; i<b->cnt; i++){
+    bf=b->files[i];
+    psync_status.bytestouploadcurrent-=bf->upllist.filesize;
+    psync_status.bytesuploaded-=bf->upllist.uploaded;
+    psync_status.filesuploading--;
+    psync_list_del(&bf->upllist.list);
+  }
+  if (!psync_status.filesuploading){
+    psync_status.bytesuploaded=0;
+    psync_status.bytestouploadcurrent=0;
+  }
+  wake_upload_when_ready();
+  pthread_mutex_unlock(&current_uploads_mutex);
+  for (i=0; i<b->cnt; i++){
+    bf=b->files[i];
+    if (bf->lock)
+      psync_unlock_file(bf->lock);
+    psync_free(bf->res);
+    psync_free(bf->nname);
+    psync_free(bf->localpath);
+    psync_free(bf);
+  }
+  psync_free(b);
+  if (failed)
+    psync_wake_upload();
+  psync_status_recalc_to_upload();
+  psync_status_send_update();
+}
+
+/* first is an already started small file task, the batch is made of it and the small file tasks following it in the queue */
+static int task_run_upload_batch(psync_task_t *first){
+  psync_task_t *tasks[PSYNC_UPLOAD_BATCH_MAX_FILES];
+  psync_sql_res *res;
+  upload_batch_t *b;
+  upload_batch_file_t *bf;
+  size_t len;
+  uint64_t total;
+  uint32_t i, cnt;
+  tasks[0]=first;
+  cnt=psync_task_queue_take_files(&upload_queue, tasks+1, PSYNC_UPLOAD_BATCH_MIN_FILES-1, PSYNC_UPLOAD_BATCH_MAX_FILES-1,
+                                  PSYNC_UPLOAD_BATCH_MAX_FILE_SIZE);
+  if (!cnt)
+    return 0;
+  cnt++;
+  b=(upload_batch_t *)psync_malloc(offsetof(upload_batch_t, files)+sizeof(upload_batch_file_t *)*cnt);
+  b->cnt=cnt;
+  b->stop=0;
+  total=0;
+  for (i=0; i<cnt; i++){
+    len=strlen(tasks[i]->name);
+    bf=(upload_batch_file_t *)psync_malloc(offsetof(upload_batch_file_t, filename)+len+1);
+    memset(bf, 0, offsetof(upload_batch_file_t, filename));
+    bf->upllist.taskid=tasks[i]->id;
+    bf->upllist.syncid=tasks[i]->syncid;
+    bf->upllist.localfileid=tasks[i]->localitemid;
+    bf->upllist.filesize=tasks[i]->size;
+    bf->upllist.batchstop=&b->stop;
+    bf->ret=1;
+    memcpy(bf->filename, tasks[i]->name, len+1);
+    total+=bf->upllist.filesize;
+    b->files[i]=bf;
+  }
+  pthread_mutex_lock(&current_uploads_mutex);
+  for (i=0; i<b->cnt; i++)
+    psync_list_add_tail(&uploads, &b->files[i]->upllist.list);
+  pthread_mutex_unlock(&current_uploads_mutex);
+  if (unlikely(psync_transfer_start(&b->transfer, PSYNC_TRANSFER_UPLOAD, total, &b->stop))){
+    debug(D_NOTICE, "batch of %u small files stopped before starting", (unsigned)b->cnt);
+    pthread_mutex_lock(&current_uploads_mutex);
+    for (i=0; i<b->cnt; i++)
+      psync_list_del(&b->files[i]->upllist.list);
+    pthread_mutex_unlock(&current_uploads_mutex);
+    psync_sql_start_transaction();
+    res=psync_sql_prep_statement("UPDATE task SET inprogress=0 WHERE id=?");
+    for (i=0; i<b->cnt; i++){
+      psync_sql_bind_uint(res, 1, b->files[i]->upllist.taskid);
+      psync_sql_run(res);
+      psync_free(b->files[i]);
+    }
+    psync_sql_free_result(res);
+    psync_sql_commit_transaction();
+    psync_free(b);
+    return 1;
+  }
+  pthread_mutex_lock(&current_uploads_mutex);
+  psync_status.bytestouploadcurrent+=total;
+  psync_status.filesuploading+=b->cnt;
+  pthread_mutex_unlock(&current_uploads_mutex);
+  psync_status_send_update();
+  debug(D_NOTICE, "uploading a batch of %u small files", (unsigned)b->cnt);
+  psync_run_thread1("upload batch", task_run_upload_batch_thread, b);
+  return 1;
+}
+
+static void upload_thread(){
+  psync_task_t *task;
   while (psync_do_run){
     psync_wait_statuses_array(requiredstatuses, ARRAY_SIZE(requiredstatuses));
     
-    row=psync_sql_row("SELECT id, type, syncid, itemid, localitemid, newitemid, name, newsyncid FROM task WHERE type&"
-                       NTO_STR(PSYNC_TASK_DWLUPL_MASK)"="NTO_STR(PSYNC_TASK_UPLOAD)" AND inprogress=0 ORDER BY id LIMIT 1");
-    if (row){
-      taskid=psync_get_number(row[0]);
-      type=psync_get_number(row[1]);
-      if (!upload_task(taskid, type, 
-                         psync_get_number(row[2]), 
-                         psync_get_number(row[3]), 
-                         psync_get_number(row[4]),
-                         psync_get_number_or_null(row[5]),                          
-                         psync_get_string_or_null(row[6]),
-                         psync_get_number_or_null(row[7]))){
-        res=psync_sql_prep_statement("DELETE FROM task WHERE id=?");
-        psync_sql_bind_uint(res, 1, taskid);
-        psync_sql_run_free(res);
-      }
-      else if (type!=PSYNC_UPLOAD_FILE)
+    /* same ordering as in pdownload.c - large files first if there is room for one more of them */
+    task=psync_task_queue_get(&upload_queue, psync_transfer_large_can_start(PSYNC_TRANSFER_UPLOAD));
+    if (task){
+      if (task->type==PSYNC_UPLOAD_FILE && task->size<=PSYNC_UPLOAD_BATCH_MAX_FILE_SIZE && task_run_upload_batch(task))
+        continue;
+      if (!upload_task(task->id, task->type, task->syncid, task->itemid, task->localitemid, task->newitemid, task->name, 
+                       task->newsyncid))
+        psync_task_queue_done(&upload_queue, task);
+      else if (task->type!=PSYNC_UPLOAD_FILE){
         psync_milisleep(PSYNC_SLEEP_ON_FAILED_UPLOAD);
-      psync_free(row);
+        psync_task_queue_retry(&upload_queue, task);
+      }
       continue;
     }
     
@@ -1205,6 +1875,12 @@ void psync_upload_init(){
   psync_run_thread("upload main", upload_thread);
 }
 
+static void upload_stop_locked(upload_list_t *upl){
+  upl->stop=1;
+  if (upl->batchstop)
+    *upl->batchstop=1;
+}
+
 void psync_delete_upload_tasks_for_file(psync_fileid_t localfileid){
   psync_sql_res *res;
   upload_list_t *upl;
@@ -1213,6 +1889,7 @@ void psync_delete_upload_tasks_for_file(psync_fileid_t localfileid){
   psync_sql_bind_uint(res, 2, localfileid);
   psync_sql_run(res);
   if (psync_sql_affected_rows()){
+    psync_task_queue_changed(&upload_queue);
     psync_status_recalc_to_upload();
     psync_send_status_update();
   }
@@ -1220,8 +1897,9 @@ void psync_delete_upload_tasks_for_file(psync_fileid_t localfileid){
   pthread_mutex_lock(&current_uploads_mutex);
   psync_list_for_each_element(upl, &uploads, upload_list_t, list)
     if (upl->localfileid==localfileid)
-      upl->stop=1;
+      upload_stop_locked(upl);
   pthread_mutex_unlock(&current_uploads_mutex);
+  psync_transfer_wake();
 }
 
 void psync_stop_sync_upload(psync_syncid_t syncid){
@@ -1230,19 +1908,22 @@ void psync_stop_sync_upload(psync_syncid_t syncid){
   res=psync_sql_prep_statement("DELETE FROM task WHERE syncid=? AND type&"NTO_STR(PSYNC_TASK_DWLUPL_MASK)"="NTO_STR(PSYNC_TASK_UPLOAD));
   psync_sql_bind_uint(res, 1, syncid);
   psync_sql_run_free(res);
+  psync_task_queue_changed(&upload_queue);
   psync_status_recalc_to_upload();
   psync_send_status_update();
   pthread_mutex_lock(&current_uploads_mutex);
   psync_list_for_each_element(upl, &uploads, upload_list_t, list)
     if (upl->syncid==syncid)
-      upl->stop=1;
+      upload_stop_locked(upl);
   pthread_mutex_unlock(&current_uploads_mutex);
+  psync_transfer_wake();
 }
 
 void psync_stop_all_upload(){
   upload_list_t *upl;
   pthread_mutex_lock(&current_uploads_mutex);
   psync_list_for_each_element(upl, &uploads, upload_list_t, list)
-    upl->stop=1;
+    upload_stop_locked(upl);
   pthread_mutex_unlock(&current_uploads_mutex);
+  psync_transfer_wake();
 }